@@ -0,0 +1,44 @@
+#ifndef BOT_H
+#define BOT_H
+
+/*
+ * Bots are players built into the server, for anyone who wants a game
+ * and has nobody to play, and for generating load: each is a CLIENT that
+ * is logged in like any other, shows up in USERS and can be INVITEd, but
+ * has no connection behind it.  A bot accepts every invitation it gets
+ * and answers every move straight away, so a bot costs no thread, no
+ * socket and no more time than it takes the server to handle the
+ * opponent's move.
+ *
+ * Bots play perfectly.  When bots are started, every position that can
+ * come up in a game (5478 of them) is solved by minimax, and the moves
+ * that keep the best result for the side to move are kept in a table
+ * indexed by position.  After that, a bot's move is a table lookup; when
+ * several moves are equally good, one is picked at random, so that bots
+ * don't play the same game over and over.
+ *
+ * The packets a bot is sent are handed to it (see client_set_receiver())
+ * and its replies are made from the event loop (see ev_loop_post()), just
+ * after the request that prompted them has been dealt with.
+ *
+ * Games with bots are not carried over by a hot restart (see handoff.h).
+ */
+
+#define BOT_NAME_FORMAT "bot%d"
+
+/*
+ * Start bots, named BOT_NAME_FORMAT with numbers from 1 on, and log them
+ * in.
+ *
+ * @param count  The number of bots.
+ * @return the number of bots started, or -1 on error.
+ */
+int bot_start(int count);
+
+/*
+ * Log out and unregister all of the bots, and free them.  This is done
+ * once the games of the other clients are over.
+ */
+void bot_stop(void);
+
+#endif
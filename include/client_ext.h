@@ -0,0 +1,311 @@
+#ifndef CLIENT_EXT_H
+#define CLIENT_EXT_H
+
+#include <stdint.h>
+
+#include "client_registry.h"
+#include "game.h"
+#include "invitation_ext.h"
+#include "rate_limit.h"
+
+/*
+ * Operations on a CLIENT beyond those in client.h, which is not to be
+ * modified.
+ */
+
+/*
+ * End every game in progress in which a CLIENT is a participant, without
+ * a winner: both players are sent ENDED with a role of NULL_ROLE, the
+ * invitations are removed from both players' lists and no result is
+ * posted.  This is used when the server shuts down, so that players are
+ * told their games are over instead of just losing the connection.
+ *
+ * @param client  The CLIENT whose games are to be ended.
+ * @return the number of games that were ended, or -1 on error.
+ */
+int client_end_games(CLIENT *client);
+
+/*
+ * End one game in progress, on behalf of something other than the
+ * players: either as if one of them had run out of time (the game is
+ * theirs to lose and the result is posted), or without a winner, as
+ * client_end_games() does.
+ *
+ * @param client  One of the players.
+ * @param id  That player's ID for the game.
+ * @param loser  The role of the player who loses, or NULL_ROLE for no
+ * winner.
+ * @return 0 if the game was ended, -1 if there is no such game in
+ * progress.
+ */
+int client_end_game(CLIENT *client, int id, GAME_ROLE loser);
+
+/*
+ * Get the invitations in a CLIENT's list, together with the CLIENT's ids
+ * for them.  Each INVITATION in the list has its reference count
+ * incremented, so that it can be used without holding on to the CLIENT;
+ * the caller must unref each of them and free both arrays.
+ *
+ * @param client  The CLIENT.
+ * @param idsp  A malloc'ed array of the ids is stored here.
+ * @param invsp  A malloc'ed array of the INVITATIONs is stored here.
+ * @return the number of invitations, or -1 if the arrays could not be
+ * allocated (in which case nothing is stored).
+ */
+int client_list_invitations(CLIENT *client, int **idsp, INVITATION ***invsp);
+
+/*
+ * Look up an INVITATION by the ID a CLIENT has assigned to it.
+ *
+ * @param client  The CLIENT.
+ * @param id  The ID.
+ * @return the INVITATION, with its reference count incremented, or NULL
+ * if the CLIENT has no invitation with that ID.
+ */
+INVITATION *client_get_invitation(CLIENT *client, int id);
+
+/*
+ * Get the ID a CLIENT has assigned to an INVITATION.
+ *
+ * @param client  The CLIENT.
+ * @param inv  The INVITATION.
+ * @return the ID, or -1 if the INVITATION is not in the CLIENT's list.
+ */
+int client_invitation_id(CLIENT *client, INVITATION *inv);
+
+/*
+ * Add an INVITATION to a CLIENT's list under a particular ID, rather
+ * than the next free one as client_add_invitation() does.  This is for
+ * reconstructing a list saved elsewhere, whose ids the client already
+ * knows.  Nothing is sent to anyone.
+ *
+ * @param client  The CLIENT to which the invitation is to be added.
+ * @param inv  The INVITATION, whose reference count is incremented.
+ * @param id  The ID the invitation is to have.
+ * @return 0 if successful, -1 if the ID is out of range or in use.
+ */
+int client_restore_invitation(CLIENT *client, INVITATION *inv, int id);
+
+/*
+ * Start a game between two CLIENTs who have been paired by matchmaking
+ * rather than by an invitation: an INVITATION is created and accepted on
+ * the spot, and each player is sent INVITED (with their ID for it, their
+ * role and the opponent's name) and then ACCEPTED (with the initial game
+ * state for the first player).
+ *
+ * @param first  The CLIENT who is to play first.
+ * @param second  The CLIENT who is to play second.
+ * @return 0 if the game was started, otherwise -1.
+ */
+int client_make_match(CLIENT *first, CLIENT *second);
+
+/*
+ * Start a game between two CLIENTs on behalf of something that wants to
+ * know how it comes out, such as a tournament: as client_make_match(),
+ * but func is called with the result when the game is over (see
+ * inv_set_result_func()), whether it was played out, resigned, lost on
+ * time or aborted.
+ *
+ * @param first  The CLIENT who is to play first.
+ * @param second  The CLIENT who is to play second.
+ * @param func  The function to be told the result, or NULL.
+ * @param arg  Passed to func along with the result.
+ * @return 0 if the game was started, otherwise -1.
+ */
+int client_make_game(CLIENT *first, CLIENT *second, INV_RESULT_FUNC *func, void *arg);
+
+/*
+ * Send a notification to a CLIENT, with the header filled in the way the
+ * server's own notifications (INVITED, MOVED, ...) are.
+ *
+ * @param client  The CLIENT.
+ * @param type  The packet type.
+ * @param id  The id field of the header.
+ * @param role  The role field of the header.
+ * @param payload  A string to send as the payload, or NULL.
+ * @return 0 if successful, otherwise -1.
+ */
+int client_send_notification(CLIENT *client, JEUX_PACKET_TYPE type, int id, int role,
+                             char *payload);
+
+/*
+ * Set the time control for games accepted from now on: each player starts
+ * with base_ms on their clock and gets increment_ms added back for every
+ * move they make.  A player who runs out of time loses, exactly as if
+ * they had resigned (but the opponent just gets ENDED).  The default is
+ * no time control.
+ *
+ * @param base_ms  The time each player starts with, or 0 for untimed games.
+ * @param increment_ms  The time added per move.
+ */
+void client_set_time_control(uint64_t base_ms, uint64_t increment_ms);
+
+/*
+ * Set how long invitations made from now on stay open.  One that has been
+ * neither accepted, declined nor revoked by then is withdrawn: the target
+ * gets REVOKED and the source gets DECLINED, as if each had been turned
+ * down by the other.  The default is for invitations to stay open until
+ * one side or the other closes them or logs out.
+ *
+ * @param ms  How long an invitation stays open, or 0 for no limit.
+ */
+void client_set_invitation_ttl(uint64_t ms);
+
+/*
+ * Have an OPEN INVITATION expire once it has been open as long as
+ * invitations may be (see client_set_invitation_ttl()), counting from
+ * now.  This is done for every invitation client_make_invitation() makes;
+ * it is for invitations put together some other way, such as those
+ * restored by a hot restart.
+ *
+ * @param inv  The INVITATION.
+ * @return 0 if successful (or invitations do not expire), -1 if the
+ * INVITATION is not OPEN.
+ */
+int client_start_expiry(INVITATION *inv);
+
+/*
+ * Start a clock for the game of an accepted INVITATION, whatever the
+ * time control.  This is for games carried over from elsewhere;
+ * client_accept_invitation() starts the clock of a new game itself.
+ *
+ * @param inv  The INVITATION, which must not have a clock already.
+ * @param first_ms  The time left to the first player.
+ * @param second_ms  The time left to the second player.
+ * @param increment_ms  The time added per move.
+ * @param to_move  The player whose clock is to run.
+ * @return 0 if successful, otherwise -1.
+ */
+int client_start_clock(INVITATION *inv, uint64_t first_ms, uint64_t second_ms,
+                       uint64_t increment_ms, GAME_ROLE to_move);
+
+/*
+ * Start watching the game a player has in progress: from now until the
+ * game is over (or client_unwatch_game()), the spectator is sent MOVED,
+ * with its own ID for the game and the role of the player who moved,
+ * after every move, and then ENDED.  If the player has more than one
+ * game in progress, the one with the lowest ID is watched.
+ *
+ * @param client  The spectator, who must not be playing in the game.
+ * @param player  The player whose game is to be watched.
+ * @param strp  If successful, a malloc'ed string showing the state of the
+ * game is stored here.
+ * @return the spectator's ID for the game, or -1 if there is no game to
+ * watch (or the spectator is already watching it).
+ */
+int client_watch_game(CLIENT *client, CLIENT *player, char **strp);
+
+/*
+ * Stop watching a game.
+ *
+ * @param client  The spectator.
+ * @param id  The spectator's ID for the game.
+ * @return 0 if successful, -1 if it was not watching a game with that ID.
+ */
+int client_unwatch_game(CLIENT *client, int id);
+
+/*
+ * Get the games a CLIENT is watching, together with its ids for them, as
+ * for client_list_invitations().
+ *
+ * @return the number of games, or -1 if the arrays could not be allocated.
+ */
+int client_list_watches(CLIENT *client, int **idsp, INVITATION ***invsp);
+
+/*
+ * Start watching a game under a particular ID, for reconstructing a watch
+ * list saved elsewhere.  Nothing is sent to anyone.
+ *
+ * @param client  The spectator.
+ * @param inv  The INVITATION whose game is to be watched.
+ * @param id  The ID the game is to have.
+ * @return 0 if successful, -1 if the ID is out of range or in use, or the
+ * game is not in progress.
+ */
+int client_restore_watch(CLIENT *client, INVITATION *inv, int id);
+
+/*
+ * A function that takes the packets sent to a CLIENT that has no
+ * connection behind it, such as a bot (see bot.h).  It is called from
+ * client_send_packet() (or whatever else is sending to the CLIENT), so it
+ * must not block, and must not act on the packet then and there either,
+ * since the sender is in the middle of something: anything it has to do
+ * in reply has to wait (see ev_loop_post()).
+ *
+ * @param client  The CLIENT the packet was sent to.
+ * @param hdr  The header, exactly as it would have gone on the wire.
+ * @param data  The payload, or NULL if there is none.  It is not
+ * NUL-terminated, and is only valid for the duration of the call.
+ * @param arg  The argument given to client_set_receiver().
+ */
+typedef void CLIENT_RECEIVER(CLIENT *client, JEUX_PACKET_HEADER *hdr, void *data, void *arg);
+
+/*
+ * Have the packets sent to a CLIENT handed to a function instead of
+ * being written to its file descriptor, which need not be open.  This is
+ * done once, before the CLIENT logs in.
+ *
+ * @param client  The CLIENT.
+ * @param func  The function.
+ * @param arg  Passed to func along with each packet.
+ */
+void client_set_receiver(CLIENT *client, CLIENT_RECEIVER *func, void *arg);
+
+/*
+ * What is known about the timing of a CLIENT's connection.
+ */
+typedef struct client_timing {
+    long rtt_us;            // round trip time, as TCP has it; -1 if unknown
+    long delay_us;          // smoothed one-way delay of requests
+    long skew_us;           // how far the client's clock is ahead of ours
+    long stamped;           // requests with a timestamp; if none, the
+                            // delay and skew are unknown (and 0)
+} CLIENT_TIMING;
+
+/*
+ * Choose how the headers of the packets sent to clients are stamped: by
+ * default with the time the event loop last woke up (see
+ * ev_loop_wall_time()), which is read once for all the packets sent in
+ * one pass of the loop, or, if precise, by reading the clock for each
+ * packet, for when the timestamps are wanted for measuring latencies.
+ *
+ * @param precise  Nonzero to read the clock for each packet.
+ */
+void client_set_precise_stamps(int precise);
+
+/*
+ * Take note of the arrival of a request from a CLIENT, as soon as its
+ * header has been received.  Every second or so the kernel is asked for
+ * the round trip time of the connection.  If the client stamped the
+ * header with the time it sent it (see protocol_ext.h), the lag from
+ * then to now is the one-way delay plus the offset between its clock and
+ * ours.  The least lag over the last minute or two is taken to be half a
+ * round trip, which gives the offset and so the delay of each request.
+ * The round trip times and delays are counted in the stats, too.
+ *
+ * @param client  The CLIENT.
+ * @param hdr  The header, as received.
+ */
+void client_note_request(CLIENT *client, JEUX_PACKET_HEADER *hdr);
+
+/*
+ * Get what is known about the timing of a CLIENT's connection.
+ *
+ * @param client  The CLIENT.
+ * @param timing  Filled in with the figures.
+ * @return 0 if anything is known, -1 if nothing is.
+ */
+int client_get_timing(CLIENT *client, CLIENT_TIMING *timing);
+
+/*
+ * Charge a request against a CLIENT's rate limits (see rate_limit.h).
+ * Only whatever is servicing the client may do this.
+ *
+ * @param client  The CLIENT.
+ * @param type  The packet type of the request.
+ * @return RL_OK if the request may go ahead, RL_REFUSED if it is to be
+ * NACKed, or RL_CUT_OFF if the client is to be disconnected as well.
+ */
+RL_VERDICT client_check_rate(CLIENT *client, int type);
+
+#endif
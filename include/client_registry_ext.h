@@ -0,0 +1,23 @@
+#ifndef CLIENT_REGISTRY_EXT_H
+#define CLIENT_REGISTRY_EXT_H
+
+#include "client_registry.h"
+
+/*
+ * Operations on a CLIENT_REGISTRY beyond those in client_registry.h,
+ * which is not to be modified.
+ */
+
+/*
+ * Return a list of the clients that are logged in, as creg_all_players()
+ * does their players.  The result is a malloc'ed, NULL-terminated array
+ * of CLIENT pointers, each with its reference count incremented; it is
+ * the caller's responsibility to unref each of the entries and to free
+ * the array when it is no longer needed.
+ *
+ * @param cr  The registry.
+ * @return the list of clients, or NULL if it could not be allocated.
+ */
+CLIENT **creg_all_clients(CLIENT_REGISTRY *cr);
+
+#endif
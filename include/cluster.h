@@ -0,0 +1,116 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "client_registry.h"
+
+/*
+ * Cluster mode: several Jeux servers (nodes) sharing their players, so
+ * that a player logged in to one node can play one logged in to another,
+ * and adding nodes adds capacity.
+ *
+ * Each node is told the addresses of all of the nodes, itself included,
+ * in the same order, and is known to the others by its place in that
+ * list.  The nodes talk to one another over TCP on those addresses: a
+ * node connects to each other node as it first needs to send it
+ * something, and sends only on the connections it made.  Everything for
+ * one node, from however many games, goes over the one connection in the
+ * order it was queued, so each game's messages arrive in order; what is
+ * queued during a pass of the event loop is written out at the end of it
+ * in as few writes as the connection will take, without blocking.
+ *
+ * The player directory, which says which node each player is logged in
+ * to, is spread over the nodes by consistent hashing: every node has
+ * CL_VNODES points on a ring of 64-bit hashes, and a username belongs to
+ * the node owning the first point at or after the hash of the name (its
+ * home).  Logging in registers the name with its home, which refuses it
+ * if the name is logged in elsewhere; the LOGIN is answered only once the
+ * home has answered.  Logging out unregisters it.
+ *
+ * A player on another node is stood in for by a proxy: a CLIENT with no
+ * connection behind it (see client_set_receiver()), logged in under the
+ * remote player's name but not registered in the client registry, so it
+ * is not in USERS.  An INVITE naming a player who isn't logged in locally
+ * goes to a proxy, and the invitation is then mirrored on the remote
+ * player's node, where a proxy for the inviter invites the player for
+ * real.  From then on, what the server sends a proxy is what the remote
+ * player has to be told about, and it is forwarded to the node where that
+ * player is to be repeated there by the proxy standing in for the other
+ * side: a move made against a proxy is made by the proxy on the other
+ * node, and likewise acceptances, declines, revocations, resignations and
+ * games ended by the clock or by a shutdown.  Both nodes therefore have
+ * the game, each validating the moves (the players' own node first), and
+ * a game can be watched from either node.  Only the inviter's node puts
+ * the game in the journal; each node posts the result to its own ratings.
+ *
+ * INVITEs go by way of the invitee's home, which passes them on to the
+ * node the invitee is on.  An INVITE naming someone who isn't logged in
+ * anywhere is ACKed all the same, and then DECLINED.
+ *
+ * Matchmaking, tournaments and WATCH deal with the players on the node
+ * itself.  When a node goes away, the others end its players' games with
+ * theirs, without a result, and forget its players.  A node that comes
+ * back (or is hot-restarted) says so, and its players are registered
+ * again; games between nodes are not carried over by a hot restart.
+ */
+
+#define CL_VNODES    64      // points per node on the hash ring
+#define CL_MAX_NODES 32
+
+typedef struct cluster CLUSTER;
+
+/*
+ * The server's cluster, or NULL if it is not part of one.
+ */
+extern CLUSTER *cluster;
+
+/*
+ * Join a cluster: start listening for the other nodes, tell them this
+ * node has (re)started, and register the players already logged in.
+ *
+ * @param spec  "<self>:<host>:<port>,<host>:<port>,...": this node's
+ * place in the list of nodes, and then the list.
+ * @return the cluster, or NULL if spec is bad or the node's address could
+ * not be listened on.
+ */
+CLUSTER *cluster_init(char *spec);
+
+/*
+ * Leave the cluster: send what is still to be sent, log the proxies out
+ * and close the connections to the other nodes.  This is done once the
+ * games of the local players are over.
+ */
+void cluster_fini(CLUSTER *cl);
+
+/*
+ * Register a CLIENT that has just logged in with the player directory.
+ *
+ * @param cl  The cluster.
+ * @param client  The CLIENT.
+ * @return 0 if the name is now registered, 1 if the answer has to come
+ * from another node (the CLIENT is then sent the ACK, or is logged out and
+ * sent the NACK, once it does), or -1 if the name is taken.
+ */
+int cluster_register(CLUSTER *cl, CLIENT *client);
+
+/*
+ * Take a logged-in CLIENT that is about to log out out of the player
+ * directory, along with any registration still waiting for an answer.
+ */
+void cluster_unregister(CLUSTER *cl, CLIENT *client);
+
+/*
+ * Get the proxy for a player who is not logged in to this node.
+ *
+ * @param cl  The cluster.
+ * @param name  The player's name.
+ * @return the proxy, with its reference count incremented, or NULL if the
+ * player is known not to be logged in anywhere.
+ */
+CLIENT *cluster_lookup(CLUSTER *cl, char *name);
+
+/*
+ * @return nonzero if a CLIENT is a proxy for a player on another node.
+ */
+int cluster_is_proxy(CLUSTER *cl, CLIENT *client);
+
+#endif
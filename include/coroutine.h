@@ -0,0 +1,67 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+/*
+ * Stackless coroutines, in the style of protothreads.
+ *
+ * A coroutine is an ordinary function whose body is wrapped in
+ * CO_BEGIN()/CO_END().  When it has to wait for something (usually I/O
+ * on a non-blocking socket) it returns CO_WAITING to its caller, after
+ * recording in a CO_STATE the point at which it should resume.  The next
+ * call to the function jumps straight back to that point.  This lets a
+ * request handler be written as a straight-line loop while the only
+ * state that has to be kept between calls is a few bytes, instead of a
+ * whole thread stack.
+ *
+ * The price is that local variables do NOT survive across a suspension
+ * point.  Anything that must be remembered has to live in the object
+ * that owns the CO_STATE.  Also, a suspension point cannot appear inside
+ * a switch statement of the coroutine body itself, because the resume
+ * points are implemented as case labels.
+ */
+
+/*
+ * Values returned by a coroutine body.
+ */
+#define CO_WAITING 0   // suspended, call again when there is progress to be made
+#define CO_DONE    1   // finished, must not be called again
+
+typedef struct co_state {
+    unsigned int line;      // resume point (0 means "start from the top")
+    int rc;                 // result of the last CO_AWAIT expression
+} CO_STATE;
+
+#define CO_INIT(co) do { (co)->line = 0; (co)->rc = 0; } while(0)
+
+#define CO_BEGIN(co) switch((co)->line) { case 0:
+
+#define CO_END(co) } (co)->line = 0; return CO_DONE
+
+/*
+ * Evaluate expr, suspending the coroutine for as long as it yields 0.
+ * Once it yields a nonzero value that value is left in (co)->rc and
+ * execution continues with the next statement.
+ */
+#define CO_AWAIT(co, expr)                                      \
+    do {                                                        \
+        (co)->line = __LINE__; case __LINE__:                   \
+        if(((co)->rc = (expr)) == 0)                            \
+            return CO_WAITING;                                  \
+    } while(0)
+
+/*
+ * Give up the processor unconditionally; execution resumes with the next
+ * statement on the following call.
+ */
+#define CO_YIELD(co)                                            \
+    do {                                                        \
+        (co)->line = __LINE__;                                  \
+        return CO_WAITING; case __LINE__:;                      \
+    } while(0)
+
+/*
+ * Terminate the coroutine from anywhere in its body.
+ */
+#define CO_EXIT(co) do { (co)->line = 0; return CO_DONE; } while(0)
+
+#endif
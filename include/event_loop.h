@@ -0,0 +1,310 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stddef.h>
+#include <signal.h>
+#include <time.h>
+
+#include "session.h"
+#include "timer_wheel.h"
+
+/*
+ * Resolution of the loop's timers, in milliseconds.
+ */
+#define EV_TICK_MS 10
+
+/*
+ * The event loop multiplexes the listening socket and all client
+ * connections onto a single thread.  Each connection is served by a
+ * SESSION (see session.h), whose coroutine is resumed whenever there is
+ * input for it.
+ *
+ * There are two backends.  The default one uses epoll(7) readiness
+ * notification and lets each session read(2) its own socket; packets
+ * are written as soon as they are sent, and whatever the socket can't
+ * take right away is queued until it becomes writable.  The
+ * io_uring(7) backend instead keeps a multishot accept and a multishot
+ * receive per connection outstanding, with the kernel picking receive
+ * buffers from a shared ring, and queues outbound packets so that all of
+ * the writes produced by one pass of the loop (as linked writes from
+ * registered buffers) are submitted together with the wait for the next
+ * batch of completions: a handful of system calls per pass regardless of
+ * how many clients were serviced.
+ *
+ * Timeouts (per-connection login and idle timeouts, and any other timers
+ * the server needs) are kept on a timer wheel that the loop advances each
+ * time it wakes up, and the loop never sleeps past the next one that can
+ * be due, so no thread or timerfd is needed for them.
+ *
+ * The loop is a singleton: there is one per server process.
+ */
+
+/*
+ * A function called by the loop when a watched file descriptor (see
+ * ev_loop_watch()) becomes readable, or writable (see
+ * ev_loop_watch_writable()).
+ */
+typedef void EV_WATCH_FUNC(int fd, void *arg);
+
+/*
+ * A function call that the loop is to make as soon as it is done with
+ * what it is doing (see ev_loop_post()).  Like a TIMER, it is embedded in
+ * whatever needs the call made, so that posting one never allocates.  Its
+ * fields are private to the loop.
+ */
+typedef struct ev_call EV_CALL;
+typedef void EV_CALL_FUNC(EV_CALL *call, void *arg);
+
+struct ev_call {
+    struct ev_call *next;
+    int posted;
+    EV_CALL_FUNC *func;
+    void *arg;
+};
+
+/*
+ * Initialize the event loop for a given listening socket.
+ *
+ * @param listenfd  The listening socket on which to accept connections.
+ * @param want_uring  Nonzero to use the io_uring backend.  If io_uring is
+ * not available (old kernel, disabled by the administrator, ...) the
+ * epoll backend is used instead.
+ * @return 0 if successful, otherwise -1.
+ */
+int ev_loop_init(int listenfd, int want_uring);
+
+/*
+ * Set how long a connection may go without sending anything before it is
+ * closed: login_ms while it is not logged in, idle_ms while it is.
+ * Closing the connection has the same effect as the client disconnecting
+ * (it is logged out, its games are resigned, and so on).  The timeouts
+ * are checked lazily, so a change of login state takes effect by the time
+ * the previous deadline comes round.
+ *
+ * @param login_ms  The timeout for connections not logged in, or 0 for none.
+ * @param idle_ms  The timeout for logged-in connections, or 0 for none.
+ */
+void ev_loop_set_timeouts(unsigned int login_ms, unsigned int idle_ms);
+
+/*
+ * Start (or restart) a timer on the loop's timer wheel (see
+ * timer_wheel.h).  The timer's function is called from the loop thread
+ * once the time is up.  The resolution is EV_TICK_MS.
+ *
+ * @param timer  The timer, initialized with timer_init().
+ * @param ms  How long from now until it expires.
+ */
+void ev_loop_start_timer(TIMER *timer, uint64_t ms);
+
+/*
+ * Cancel a timer started with ev_loop_start_timer(), if it is pending.
+ */
+void ev_loop_cancel_timer(TIMER *timer);
+
+/*
+ * Initialize a call before its first use.
+ *
+ * @param call  The call.
+ * @param func  The function to call.
+ * @param arg  Passed to func along with the call.
+ */
+void ev_call_init(EV_CALL *call, EV_CALL_FUNC *func, void *arg);
+
+/*
+ * Have the loop make a call at the start of its next pass, before it
+ * writes anything out or waits for events, in order of posting.  This is
+ * for work that has to follow on from a request without being done in
+ * the middle of it, with no timer's worth of delay.  Posting a call that
+ * is already pending does nothing.
+ *
+ * @param call  The call, initialized with ev_call_init().
+ */
+void ev_loop_post(EV_CALL *call);
+
+/*
+ * Take back a call posted with ev_loop_post(), if it is pending.
+ */
+void ev_loop_cancel_post(EV_CALL *call);
+
+/*
+ * @return the loop's idea of the current time in milliseconds (on the
+ * CLOCK_MONOTONIC scale), as of the last time it woke up.
+ */
+uint64_t ev_loop_now(void);
+
+/*
+ * Get the wall-clock time (CLOCK_REALTIME) as of the last time the loop
+ * woke up, which is read once per pass of the loop, for stamping what
+ * goes out without reading the clock for every packet.  It is behind by
+ * however long the loop has been busy since.
+ *
+ * @param ts  The time is stored here.
+ * @return 0 if successful, -1 if the caller is not the loop's thread, or
+ * the loop has not woken up yet.
+ */
+int ev_loop_wall_time(struct timespec *ts);
+
+/*
+ * @return the name of the backend in use, "epoll" or "io_uring".
+ */
+const char *ev_loop_backend(void);
+
+/*
+ * Run the event loop, accepting connections and servicing sessions,
+ * until ev_loop_stop() is called.
+ *
+ * @param sigmask  Signal mask to install while blocked waiting for events
+ * (see epoll_pwait(2)), or NULL to leave the mask alone.  Signals that
+ * should be able to stop the loop are normally blocked everywhere else
+ * and unblocked only here, so that they cannot be lost between a check
+ * of the stop flag and the wait.
+ * @return 0 if the loop was stopped, -1 if it failed.
+ */
+int ev_loop_run(const sigset_t *sigmask);
+
+/*
+ * Make one pass of the loop without waiting: the posted calls are made,
+ * the timers that are due go off, and whatever events are already there
+ * are handled.  This is for driving the server from something other than
+ * ev_loop_run(), such as the fuzzing harness (tools/jeux_fuzz.c).
+ *
+ * @return 0 if successful, -1 if the loop failed.
+ */
+int ev_loop_poll(void);
+
+/*
+ * Ask the event loop to return from ev_loop_run() at the next opportunity.
+ * This function is async-signal-safe.
+ */
+void ev_loop_stop(void);
+
+/*
+ * Stop accepting new connections.  Connections that are still in the
+ * listen backlog are left there, to be refused when the listening socket
+ * is closed.
+ */
+void ev_loop_stop_accepting(void);
+
+/*
+ * Call a function on every session.  The function may send packets to
+ * any client, but must not finish sessions.
+ *
+ * @param func  The function to call.
+ * @param arg  Passed to func along with each session.
+ */
+void ev_loop_for_each_session(void (*func)(SESSION *, void *), void *arg);
+
+/*
+ * Keep servicing the existing sessions, without accepting new
+ * connections, until all of them have finished and their queued output
+ * has been written, or until a deadline passes.  This is used during
+ * shutdown, after the client connections have been shut down for
+ * reading, to let each session handle the requests it has already
+ * received, see its EOF and clean up after itself.
+ *
+ * @param timeout_ms  How long to keep going, or -1 for as long as it takes.
+ * @return 0 once no sessions remain, 1 if some remain when the time is
+ * up, -1 if the loop failed.
+ */
+int ev_loop_drain(int timeout_ms);
+
+/*
+ * Close every remaining session, whatever it is doing, and discard
+ * whatever output it still has queued.
+ *
+ * @param unsentp  If not NULL, the number of bytes of queued output that
+ * were discarded is stored here.
+ * @return the number of sessions that were closed.
+ */
+int ev_loop_close_all(size_t *unsentp);
+
+/*
+ * Have the loop call a function whenever a file descriptor (other than a
+ * client connection) becomes readable.  The function is called from the
+ * loop thread and must not block.
+ *
+ * @param fd  The file descriptor to watch.
+ * @param func  The function to call.
+ * @param arg  Passed to func along with the file descriptor.
+ * @return 0 if successful, otherwise -1.
+ */
+int ev_loop_watch(int fd, EV_WATCH_FUNC *func, void *arg);
+
+/*
+ * Have the loop call a function once, the next time a file descriptor
+ * (other than a client connection, and not otherwise watched) becomes
+ * writable: for output that a non-blocking write could not take all of,
+ * or a non-blocking connect(2) in progress.  After the call the file
+ * descriptor is no longer watched.
+ *
+ * @param fd  The file descriptor to watch.
+ * @param func  The function to call.
+ * @param arg  Passed to func along with the file descriptor.
+ * @return 0 if successful, otherwise -1.
+ */
+int ev_loop_watch_writable(int fd, EV_WATCH_FUNC *func, void *arg);
+
+/*
+ * Stop watching a file descriptor.  This must be done before it is closed.
+ */
+void ev_loop_unwatch(int fd);
+
+/*
+ * Bring the loop to a standstill in which the state of every session can
+ * be saved and carried on elsewhere: no connections are accepted, no
+ * further requests are read or handled, and the kernel has no reads or
+ * writes in progress on behalf of any session.  Queued output keeps being
+ * written until it is all gone or the timeout passes; whatever is left
+ * is then available from ev_loop_unsent().  ev_loop_run() must not be
+ * called again without ev_loop_resume().
+ *
+ * @param timeout_ms  How long to spend writing out queued output.
+ * @return 0 if the loop has come to a standstill, otherwise -1.
+ */
+int ev_loop_quiesce(int timeout_ms);
+
+/*
+ * Undo ev_loop_quiesce() and ev_loop_stop(): start accepting and reading
+ * again.  ev_loop_run() can then be called to carry on where it left off.
+ */
+void ev_loop_resume(void);
+
+/*
+ * Get the output that is queued for a session but has not been written.
+ *
+ * @param s  The SESSION.
+ * @param bufp  A malloc'ed copy of the bytes is stored here, or NULL if
+ * there are none (or they could not be copied).
+ * @return the number of bytes.
+ */
+size_t ev_loop_unsent(SESSION *s, char **bufp);
+
+/*
+ * Create a session for a connection that another process was serving,
+ * and add it to the loop.  The session starts out with the given input
+ * already received (see session_unconsumed()) and the given output
+ * already queued (see ev_loop_unsent()).  Input that makes up complete
+ * requests is handled once ev_loop_run() is called.
+ *
+ * @param fd  The connection.
+ * @param in  Input already received, or NULL.
+ * @param inlen  The length of the input.
+ * @param out  Output to be written before anything else, or NULL.
+ * @param outlen  The length of the output.
+ * @return the new SESSION, or NULL if it could not be created.
+ */
+SESSION *ev_loop_adopt(int fd, const void *in, size_t inlen,
+                       const void *out, size_t outlen);
+
+/*
+ * @return the number of sessions currently being serviced.
+ */
+int ev_loop_session_count(void);
+
+/*
+ * Release the resources of the event loop.  The listening socket is not
+ * closed.
+ */
+void ev_loop_fini(void);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef GAME_CLOCK_H
+#define GAME_CLOCK_H
+
+#include <stdint.h>
+
+#include "game.h"
+#include "timer_wheel.h"
+
+/*
+ * A GAME_CLOCK is a chess clock for the two players of a game: each side
+ * has a budget of time that runs down only while it is that side's turn,
+ * and an increment that is added back each time the side completes a
+ * move.  When the running side's time runs out its flag falls, and a
+ * function supplied by the owner of the clock is called to end the game.
+ *
+ * The clock runs on the event loop's timers (see event_loop.h), so it
+ * must only be used from the loop thread, and the flag function is called
+ * from there.
+ */
+
+typedef struct game_clock GAME_CLOCK;
+
+/*
+ * A function called when a side's flag falls.  The clock has stopped by
+ * then.  The function may free the clock.
+ */
+typedef void GAME_CLOCK_FUNC(GAME_CLOCK *clock, GAME_ROLE role, void *arg);
+
+/*
+ * Create a stopped GAME_CLOCK.
+ *
+ * @param first_ms  The time the first player has left.
+ * @param second_ms  The time the second player has left.
+ * @param increment_ms  The time added to a player's clock for each move.
+ * @param flag  The function to call when a flag falls.
+ * @param arg  Passed to flag along with the clock and the role.
+ * @return the new clock, or NULL if memory could not be allocated.
+ */
+GAME_CLOCK *gclock_create(uint64_t first_ms, uint64_t second_ms, uint64_t increment_ms,
+                          GAME_CLOCK_FUNC *flag, void *arg);
+
+/*
+ * Stop a GAME_CLOCK and free it.
+ */
+void gclock_free(GAME_CLOCK *clock);
+
+/*
+ * Start the clock of one side, which must have time left.  The clock must
+ * be stopped.
+ *
+ * @return 0 if successful, -1 if the clock was already running.
+ */
+int gclock_start(GAME_CLOCK *clock, GAME_ROLE role);
+
+/*
+ * Complete a move: stop the clock of the side that moved, add the
+ * increment to it, and start the other side's clock.
+ *
+ * @param clock  The clock.
+ * @param role  The side that moved.
+ * @return 0 if successful, -1 if it is not that side's clock that is
+ * running, or its time is already up (in which case its flag is about
+ * to fall and the move should not be made).
+ */
+int gclock_press(GAME_CLOCK *clock, GAME_ROLE role);
+
+/*
+ * Stop the clock, without calling anything.  The time used by the side
+ * whose clock was running is deducted.
+ */
+void gclock_stop(GAME_CLOCK *clock);
+
+/*
+ * @return the time a side has left, in milliseconds.
+ */
+uint64_t gclock_remaining(GAME_CLOCK *clock, GAME_ROLE role);
+
+/*
+ * @return the increment per move, in milliseconds.
+ */
+uint64_t gclock_increment(GAME_CLOCK *clock);
+
+/*
+ * @return the side whose clock is running, or NULL_ROLE if stopped.
+ */
+GAME_ROLE gclock_running(GAME_CLOCK *clock);
+
+#endif
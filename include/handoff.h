@@ -0,0 +1,87 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+/*
+ * Hot restart: a new server process takes over from a running one
+ * without dropping any connections.
+ *
+ * A server started with a control socket path listens on that Unix
+ * socket.  A new server started with the same path first connects to it,
+ * which makes the old server bring its event loop to a standstill and
+ * send over:
+ *   - a snapshot of its state: every player and rating, every session
+ *     with the player it is logged in as, whether it is waiting for a
+ *     match, the input it has received but not handled and the output it
+ *     has not yet written, and every open
+ *     or accepted invitation with the ids both clients know it by, the
+ *     moves made in its game so far and the time left on its clock, and
+ *     the games each spectator is watching;
+ *   - the listening socket and every client connection, as SCM_RIGHTS
+ *     control messages.
+ * Once the new server acknowledges the lot, the old one exits without
+ * touching the connections, and the new one carries on serving them and
+ * takes over the control socket for the next upgrade.  Clients see
+ * nothing but a pause.
+ *
+ * Bots (see bot.h) have no connections to hand over; the new server
+ * starts its own, and games against the old server's bots are dropped.
+ *
+ * Both processes must be running the same protocol: the snapshot is an
+ * in-memory format, not something meant to be kept around.
+ */
+
+typedef struct handoff HANDOFF;
+
+/*
+ * Listen on the control socket at path, replacing any stale socket file.
+ *
+ * @return the listening socket, or -1 on error.
+ */
+int handoff_listen(const char *path);
+
+/*
+ * Take over from the server listening on the control socket at path, if
+ * there is one.  Everything is received and acknowledged, but nothing is
+ * applied to this process until handoff_restore().
+ *
+ * @param path  The control socket path.
+ * @param hp  The received state is stored here, or NULL if there was no
+ * server to take over from.
+ * @return 0 if successful (including when there was no server), -1 if
+ * the handoff failed.
+ */
+int handoff_receive(const char *path, HANDOFF **hp);
+
+/*
+ * @return the listening socket received in a handoff.
+ */
+int handoff_listen_fd(HANDOFF *h);
+
+/*
+ * Rebuild the received state in this process: players and ratings,
+ * sessions (which must be done after ev_loop_init()) with their logins,
+ * and invitations with their games.
+ *
+ * @return the number of sessions that were taken over.
+ */
+int handoff_restore(HANDOFF *h);
+
+/*
+ * Free what handoff_receive() returned.  The file descriptors are not
+ * closed; they belong to the event loop by now.
+ */
+void handoff_free(HANDOFF *h);
+
+/*
+ * Hand everything over to the new server that connected on the control
+ * socket.  The event loop must have been quiesced (ev_loop_quiesce()).
+ *
+ * @param conn  The connection from the new server.
+ * @param listenfd  The listening socket for client connections.
+ * @return 0 if the new server has acknowledged the handoff, in which case
+ * this process should exit without touching any connection, otherwise -1,
+ * in which case it should resume serving.
+ */
+int handoff_send(int conn, int listenfd);
+
+#endif
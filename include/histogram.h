@@ -0,0 +1,56 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Fixed-size log-linear histograms of latencies (or any other counts of
+ * nanoseconds), as in HdrHistogram: values below 2^(HIST_SUB_BITS + 1)
+ * each have a bucket of their own, and every power of two above that is
+ * split into 2^HIST_SUB_BITS equal buckets, so that any value is known to
+ * within about 1.6% from its bucket.  Values from 2^HIST_MAX_BITS up are
+ * counted as the largest value below it.
+ *
+ * A histogram is meant to be written by one thread only.  Its buckets are
+ * updated with relaxed atomic loads and stores rather than atomic
+ * increments, which keeps recording cheap, and lets other threads read
+ * (or merge) it at any time without seeing a torn count.
+ */
+
+#define HIST_SUB_BITS 5               // 32 buckets per power of two
+#define HIST_MAX_BITS 36              // about 69s in nanoseconds
+#define HIST_BUCKETS  ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct histogram {
+    long buckets[HIST_BUCKETS];
+} HISTOGRAM;
+
+/*
+ * Count a value.  Only the histogram's own thread may do this.
+ */
+void hist_record(HISTOGRAM *h, uint64_t value);
+
+/*
+ * Add the counts of one histogram to another, which must not be written
+ * by anyone else meanwhile.
+ */
+void hist_merge(HISTOGRAM *into, HISTOGRAM *from);
+
+/*
+ * @return the number of values counted.
+ */
+long hist_count(HISTOGRAM *h);
+
+/*
+ * @return the value at or below which a fraction q of the values counted
+ * lie (the middle of its bucket), or 0 if nothing has been counted.
+ */
+double hist_percentile(HISTOGRAM *h, double q);
+
+/*
+ * @return the largest value counted (the middle of its bucket), or 0 if
+ * nothing has been counted.
+ */
+double hist_max(HISTOGRAM *h);
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef INVITATION_EXT_H
+#define INVITATION_EXT_H
+
+#include "invitation.h"
+#include "game_clock.h"
+
+/*
+ * Operations on an INVITATION beyond those in invitation.h, which is not
+ * to be modified.
+ */
+
+/*
+ * A spectator of the game of an INVITATION (see inv_add_watcher()),
+ * together with the spectator's id for the game.
+ */
+typedef struct inv_watcher {
+    CLIENT *client;
+    int id;
+} INV_WATCHER;
+
+/*
+ * Close an ACCEPTED INVITATION whose GAME is still in progress, without
+ * anyone resigning, so that the game is left with no winner.  Unlike
+ * inv_close(), this is only for games that cannot be finished (the server
+ * is going away) rather than ones that a player has given up.
+ *
+ * @param inv  The INVITATION to be closed.
+ * @return 0 if the INVITATION was closed, otherwise -1 (it was not in the
+ * ACCEPTED state or its game was already over).
+ */
+int inv_abort(INVITATION *inv);
+
+/*
+ * Append a move to the record of the moves made in the game of an
+ * INVITATION, so that the game can be reconstructed by replaying them.
+ *
+ * @param inv  The INVITATION.
+ * @param move  The move, in the form produced by game_unparse_move(),
+ * which is copied.
+ * @return 0 if successful, otherwise -1.
+ */
+int inv_record_move(INVITATION *inv, const char *move);
+
+/*
+ * Get the moves recorded for the game of an INVITATION, oldest first.
+ * The array and strings belong to the INVITATION and are only valid
+ * until the next move is recorded or the INVITATION is freed.
+ *
+ * @param inv  The INVITATION.
+ * @param countp  The number of moves is stored here.
+ * @return the moves.
+ */
+char **inv_get_moves(INVITATION *inv, int *countp);
+
+/*
+ * A function called when an INVITATION expires (see inv_set_expiry()).
+ * It is called from the event loop, with no reference to the INVITATION
+ * taken for it, so it must take one before doing anything that might
+ * drop the last of the others.
+ *
+ * @param inv  The INVITATION, which is still OPEN.
+ * @param arg  The argument given to inv_set_expiry().
+ */
+typedef void INV_EXPIRY_FUNC(INVITATION *inv, void *arg);
+
+/*
+ * Have an OPEN INVITATION expire after a while: if it is neither accepted
+ * nor closed by then, a function is called to get rid of it.  Accepting or
+ * closing the INVITATION, or freeing it, stops the timer; setting the
+ * expiry again restarts it.
+ *
+ * @param inv  The INVITATION.
+ * @param ms  How long from now it expires.
+ * @param func  The function to call if it is still open then.
+ * @param arg  Passed to func along with the INVITATION.
+ * @return 0 if successful, -1 if the INVITATION is not OPEN.
+ */
+int inv_set_expiry(INVITATION *inv, uint64_t ms, INV_EXPIRY_FUNC *func, void *arg);
+
+/*
+ * Give an INVITATION a clock for its game.  The clock is stopped when the
+ * INVITATION is closed and freed along with it.
+ *
+ * @param inv  The INVITATION.
+ * @param clock  The clock, which now belongs to the INVITATION.
+ * @return 0 if successful, -1 if it already has a clock.
+ */
+int inv_set_clock(INVITATION *inv, GAME_CLOCK *clock);
+
+/*
+ * Get the clock of the game of an INVITATION.  The clock belongs to the
+ * INVITATION and is only valid as long as the INVITATION has not been
+ * freed.
+ *
+ * @param inv  The INVITATION.
+ * @return the clock, or NULL if the game is untimed.
+ */
+GAME_CLOCK *inv_get_clock(INVITATION *inv);
+
+/*
+ * A function told how the game of an INVITATION came out (see
+ * inv_set_result_func()).
+ *
+ * @param inv  The INVITATION, which is closed by then.
+ * @param winner  The role of the winner, or NULL_ROLE for a draw.
+ * @param aborted  Nonzero if the game was cut short without a result.
+ * @param arg  The argument given to inv_set_result_func().
+ */
+typedef void INV_RESULT_FUNC(INVITATION *inv, GAME_ROLE winner, int aborted, void *arg);
+
+/*
+ * Have a function told how the game of an INVITATION came out, once it is
+ * over (and the result has been posted to the players' ratings), for
+ * whoever arranged the game.
+ *
+ * @param inv  The INVITATION.
+ * @param func  The function.
+ * @param arg  Passed to func along with the result.
+ */
+void inv_set_result_func(INVITATION *inv, INV_RESULT_FUNC *func, void *arg);
+
+/*
+ * Call the result function of an INVITATION, if it has one.  It is called
+ * at most once, however many times this is.
+ *
+ * @param inv  The INVITATION.
+ * @param winner  The role of the winner, or NULL_ROLE.
+ * @param aborted  Nonzero if the game was cut short without a result.
+ */
+void inv_report_result(INVITATION *inv, GAME_ROLE winner, int aborted);
+
+/*
+ * Add a spectator to the game of an INVITATION, to be told about the
+ * game's moves and its end.  The INVITATION holds a reference to the
+ * spectator until it is removed or the game is over.
+ *
+ * @param inv  The INVITATION.
+ * @param client  The spectator.
+ * @param id  The spectator's id for the game.
+ * @return 0 if successful, -1 if there is no game in progress (or memory
+ * could not be allocated).
+ */
+int inv_add_watcher(INVITATION *inv, CLIENT *client, int id);
+
+/*
+ * Remove a spectator from the game of an INVITATION.
+ *
+ * @param inv  The INVITATION.
+ * @param client  The spectator.
+ * @return 0 if successful, -1 if it was not watching.
+ */
+int inv_remove_watcher(INVITATION *inv, CLIENT *client);
+
+/*
+ * Call a function for each spectator of the game of an INVITATION, with
+ * the spectator and its id for the game.  The INVITATION is locked while
+ * this goes on, so the function must not call back into it.
+ *
+ * @param inv  The INVITATION.
+ * @param func  The function to call.
+ * @param arg  Passed to func along with each spectator.
+ * @return the number of spectators.
+ */
+int inv_for_each_watcher(INVITATION *inv, void (*func)(CLIENT *, int, void *), void *arg);
+
+/*
+ * Take all the spectators away from the game of an INVITATION, which is
+ * left with none.  The caller gets the INVITATION's references to them,
+ * and must unref each one and free the array.
+ *
+ * @param inv  The INVITATION.
+ * @param countp  The number of spectators is stored here.
+ * @return the spectators, or NULL if there are none.
+ */
+INV_WATCHER *inv_take_watchers(INVITATION *inv, int *countp);
+
+#endif
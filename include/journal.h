@@ -0,0 +1,146 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#include "game.h"
+
+/*
+ * The game journal keeps a permanent record of every game that is
+ * finished, so that any of them can be replayed later, move by move.
+ *
+ * Each game gets an ID, one more than the last game journaled, and its
+ * record (the players, the winner and the moves, in the form produced by
+ * game_unparse_move()) is appended to the current segment of the
+ * journal: a file in the journal directory, named after the ID of the
+ * first game in it.  A server starts a new segment each time it starts,
+ * and whenever the current one grows past JOURNAL_SEGMENT_BYTES, so that
+ * a game can be found by looking at the names of the segments and then
+ * reading through one of them.
+ *
+ * Records are not written by the thread that finishes the game, which
+ * can't afford to wait for the disk, but by a writer thread of the
+ * journal's own.  Records that come in while the writer is busy pile up,
+ * and the writer takes them all at once: one write(2) and one
+ * fdatasync(2) per batch, however many games are in it (group commit).
+ *
+ * On disk, all integers are little-endian, and every record has a
+ * CRC-32 of its contents.  A record that was torn by a crash (the last
+ * one in its segment) fails the check and is skipped by readers.
+ */
+
+#define JOURNAL_SEGMENT_BYTES (16 * 1024 * 1024)
+
+typedef struct journal JOURNAL;
+
+/*
+ * The server's journal, or NULL if games are not being journaled.
+ */
+extern JOURNAL *journal;
+
+/*
+ * Open the journal in a directory, which must exist, and start its
+ * writer thread.  The IDs of new games carry on from the last game in
+ * the journal.
+ *
+ * @param dir  The directory.
+ * @return the journal, or NULL if it could not be opened.
+ */
+JOURNAL *journal_open(const char *dir);
+
+/*
+ * Record a finished game.  The record is only queued; it is written by
+ * the writer thread soon afterwards.
+ *
+ * @param j  The journal.
+ * @param first  The user name of the player who moved first.
+ * @param second  The user name of the other player.
+ * @param winner  The role of the winner, or NULL_ROLE for a draw (or an
+ * aborted game).
+ * @param aborted  Nonzero if the game was cut short without a result.
+ * @param moves  The moves made in the game, oldest first.
+ * @param nmoves  The number of moves.
+ * @return the game's ID, or 0 if it could not be recorded.
+ */
+uint64_t journal_record(JOURNAL *j, const char *first, const char *second,
+                        GAME_ROLE winner, int aborted, char **moves, int nmoves);
+
+/*
+ * Wait until the writer has been through every game recorded so far.
+ *
+ * @param j  The journal.
+ * @return 0 if they were all written and synced, -1 if any game recorded
+ * since the last flush could not be (they're lost, and the journal has
+ * carried on in a new segment).
+ */
+int journal_flush(JOURNAL *j);
+
+/*
+ * Flush the journal, stop its writer thread and free it.
+ */
+void journal_close(JOURNAL *j);
+
+/*
+ * A game read back from the journal.  The strings belong to the reader
+ * and are only valid until the next journal_read().
+ */
+typedef struct journal_game {
+    uint64_t id;
+    uint64_t time_ms;            // when it finished, ms since the Epoch
+    char *first, *second;        // the players, in the order they moved
+    GAME_ROLE winner;
+    int aborted;
+    int nmoves;
+    char **moves;
+} JOURNAL_GAME;
+
+typedef struct journal_reader JOURNAL_READER;
+
+/*
+ * Start reading the journal in a directory.  Games are read in order of
+ * ID, one record at a time, so the whole journal can be streamed through
+ * in constant memory however big it is.
+ *
+ * @param dir  The directory.
+ * @param from_id  The ID of the first game wanted: reading starts in the
+ * segment that holds it, and earlier games are skipped.
+ * @return the reader, or NULL if the directory could not be read.
+ */
+JOURNAL_READER *journal_reader_open(const char *dir, uint64_t from_id);
+
+/*
+ * Read the next game.
+ *
+ * @param r  The reader.
+ * @param g  The game is stored here.
+ * @return 1 if a game was read, 0 at the end of the journal, -1 on error.
+ */
+int journal_read(JOURNAL_READER *r, JOURNAL_GAME *g);
+
+/*
+ * Stop reading the journal and free the reader.
+ */
+void journal_reader_close(JOURNAL_READER *r);
+
+/*
+ * Find a single game in the journal.
+ *
+ * @param r  A reader, opened at or before the game's ID.
+ * @param id  The game's ID.
+ * @param g  The game is stored here.
+ * @return 1 if it was found, 0 if there is no such game, -1 on error.
+ */
+int journal_find(JOURNAL_READER *r, uint64_t id, JOURNAL_GAME *g);
+
+/*
+ * Reconstruct a journaled game by replaying its moves on a new GAME with
+ * game_apply_move().
+ *
+ * @param g  The game.
+ * @param upto  How many of its moves to replay, or -1 for all of them.
+ * @return the GAME, or NULL if it could not be created or one of the
+ * moves was rejected.
+ */
+GAME *journal_replay(JOURNAL_GAME *g, int upto);
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef MATCH_QUEUE_H
+#define MATCH_QUEUE_H
+
+#include "client_registry.h"
+
+/*
+ * The matchmaking queue pairs up players who asked for a game (MATCH)
+ * with opponents of similar rating, so that nobody has to look through
+ * the USERS list to find one.
+ *
+ * Waiting players are kept in rating buckets MQ_BUCKET_WIDTH points
+ * wide, each a FIFO, with a bitmap of the non-empty buckets; finding the
+ * closest opponent is a couple of bit scans whatever the number of
+ * players waiting, plus a walk past anyone too far away in the buckets
+ * where that can happen: the one at the edge of the window, and the end
+ * buckets, which also hold the ratings beyond them.  A player is
+ * acceptable as an opponent if the difference in rating is within the
+ * window of the player who is looking.  The window starts at
+ * MQ_INITIAL_WINDOW and widens by MQ_WIDEN_STEP every MQ_WIDEN_MS (up to
+ * MQ_MAX_WINDOW) for as long as the player waits, and each time it
+ * widens, the player looks again.  So a newcomer is paired on arrival
+ * with anyone close by, and a player who has been waiting a while
+ * settles for a less even game.
+ *
+ * When two players are paired, the one who has waited longer plays
+ * first, and the INVITATION and GAME are created and accepted straight
+ * away (see client_make_match()).
+ *
+ * Widening runs on the event loop's timers (see event_loop.h).
+ */
+
+#define MQ_BUCKET_WIDTH   25
+#define MQ_INITIAL_WINDOW 50
+#define MQ_WIDEN_STEP     50
+#define MQ_WIDEN_MS       2000
+#define MQ_MAX_WINDOW     800
+
+typedef struct match_queue MATCH_QUEUE;
+
+/*
+ * The server's matchmaking queue.
+ */
+extern MATCH_QUEUE *match_queue;
+
+/*
+ * Initialize a new, empty matchmaking queue.
+ *
+ * @return the queue, or NULL if memory could not be allocated.
+ */
+MATCH_QUEUE *mq_init(void);
+
+/*
+ * Finalize a matchmaking queue, dropping everyone still waiting.
+ */
+void mq_fini(MATCH_QUEUE *mq);
+
+/*
+ * Put a logged-in CLIENT in the queue, or pair it with a waiting
+ * opponent right away if there is one close enough.  The queue holds a
+ * reference to the CLIENT while it waits.
+ *
+ * @param mq  The queue.
+ * @param client  The CLIENT.
+ * @return 0 if successful, -1 if the CLIENT is not logged in or already
+ * in the queue.
+ */
+int mq_join(MATCH_QUEUE *mq, CLIENT *client);
+
+/*
+ * Take a CLIENT out of the queue.
+ *
+ * @return 0 if it was in the queue, otherwise -1.
+ */
+int mq_leave(MATCH_QUEUE *mq, CLIENT *client);
+
+/*
+ * @return nonzero if the CLIENT is waiting in the queue.
+ */
+int mq_is_waiting(MATCH_QUEUE *mq, CLIENT *client);
+
+/*
+ * @return the number of players waiting.
+ */
+int mq_count(MATCH_QUEUE *mq);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef PLAYER_EXT_H
+#define PLAYER_EXT_H
+
+#include "player.h"
+
+/*
+ * Operations on a PLAYER beyond those in player.h, which is not to be
+ * modified.
+ */
+
+/*
+ * Set the rating of a player outright, rather than through the result
+ * of a game.  This is for restoring ratings that were saved elsewhere.
+ *
+ * @param player  The PLAYER to be updated.
+ * @param rating  The new rating.
+ */
+void player_set_rating(PLAYER *player, int rating);
+
+#endif
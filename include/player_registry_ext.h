@@ -0,0 +1,22 @@
+#ifndef PLAYER_REGISTRY_EXT_H
+#define PLAYER_REGISTRY_EXT_H
+
+#include "player_registry.h"
+
+/*
+ * Operations on a PLAYER_REGISTRY beyond those in player_registry.h,
+ * which is not to be modified.
+ */
+
+/*
+ * Return a list of all the players that have ever been registered.  The
+ * result is a malloc'ed, NULL-terminated array of PLAYER pointers.  It
+ * is the caller's responsibility to decrement the reference count of
+ * each of the entries and to free the array when it is no longer needed.
+ *
+ * @param preg  The registry.
+ * @return the list of players, or NULL if it could not be allocated.
+ */
+PLAYER **preg_all_players(PLAYER_REGISTRY *preg);
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef PROTO_CODEC_H
+#define PROTO_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+/*
+ * The packet header as it is on the wire, spelled out byte by byte
+ * rather than left to however the compiler lays out JEUX_PACKET_HEADER:
+ *
+ *   offset  size  field
+ *        0     1  type
+ *        1     1  id
+ *        2     1  role
+ *        3     1  (zero)
+ *        4     2  size, big-endian
+ *        6     2  (zero)
+ *        8     4  timestamp_sec, big-endian
+ *       12     4  timestamp_nsec, big-endian
+ *
+ * which is where the fields of the struct happen to fall on the usual
+ * ABIs, so the bytes are the same as ever, but nothing depends on that
+ * any more and the padding is always zero.
+ *
+ * The struct side is as protocol.h has it everywhere else: multi-byte
+ * fields in network byte order.  Encoding and decoding are inline, since
+ * they are done for every packet.
+ */
+
+#define JEUX_WIRE_HEADER_SIZE 16
+
+static inline void proto_put_be16(unsigned char *p, uint16_t v){
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void proto_put_be32(unsigned char *p, uint32_t v){
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline uint16_t proto_get_be16(const unsigned char *p){
+    return (uint16_t)p[0] << 8 | p[1];
+}
+
+static inline uint32_t proto_get_be32(const unsigned char *p){
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/*
+ * Encode a header for the wire.
+ *
+ * @param wire  Where the JEUX_WIRE_HEADER_SIZE bytes go.
+ * @param hdr  The header, with multi-byte fields in network byte order.
+ */
+static inline void proto_encode_header(unsigned char *wire, const JEUX_PACKET_HEADER *hdr){
+    wire[0] = hdr->type;
+    wire[1] = hdr->id;
+    wire[2] = hdr->role;
+    wire[3] = 0;
+    proto_put_be16(wire + 4, ntohs(hdr->size));
+    wire[6] = wire[7] = 0;
+    proto_put_be32(wire + 8, ntohl(hdr->timestamp_sec));
+    proto_put_be32(wire + 12, ntohl(hdr->timestamp_nsec));
+}
+
+/*
+ * Decode a header from the wire.  The padding is ignored.
+ *
+ * @param hdr  Filled in, with multi-byte fields in network byte order.
+ * @param wire  The JEUX_WIRE_HEADER_SIZE bytes.
+ */
+static inline void proto_decode_header(JEUX_PACKET_HEADER *hdr, const unsigned char *wire){
+    hdr->type = wire[0];
+    hdr->id = wire[1];
+    hdr->role = wire[2];
+    hdr->size = htons(proto_get_be16(wire + 4));
+    hdr->timestamp_sec = htonl(proto_get_be32(wire + 8));
+    hdr->timestamp_nsec = htonl(proto_get_be32(wire + 12));
+}
+
+/*
+ * Encode many headers back to back into one buffer, for a batch of
+ * header-only packets (or the headers of packets whose payloads go out
+ * in iovecs of their own) to be sent with a single write.
+ *
+ * @param buf  Where the headers go: n * JEUX_WIRE_HEADER_SIZE bytes.
+ * @param hdrs  The headers, as for proto_encode_header().
+ * @param n  How many there are.
+ * @return the number of bytes encoded.
+ */
+static inline size_t proto_encode_headers(unsigned char *buf, const JEUX_PACKET_HEADER *hdrs,
+                                          int n){
+    for(int i = 0; i < n; i++)
+        proto_encode_header(buf + (size_t)i * JEUX_WIRE_HEADER_SIZE, &hdrs[i]);
+    return (size_t)n * JEUX_WIRE_HEADER_SIZE;
+}
+
+#endif
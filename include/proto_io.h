@@ -0,0 +1,103 @@
+#ifndef PROTO_IO_H
+#define PROTO_IO_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+/*
+ * Hooks that let the event loop take over how packets are put on the
+ * wire, without the modules that send packets (client.c etc.) knowing
+ * anything about it.  By default proto_send_packet() writes directly to
+ * the file descriptor.
+ */
+
+/*
+ * Value returned by a PROTO_SENDER that does not handle the given file
+ * descriptor, in which case proto_send_packet() writes it directly.
+ */
+#define PROTO_SEND_DECLINED 1
+
+/*
+ * A function that queues a packet for transmission.  Both buffers belong
+ * to the caller and are only valid for the duration of the call.
+ *
+ * @param fd  The file descriptor on which the packet is to be sent.
+ * @param hdr  The header, exactly as it is to appear on the wire.
+ * @param hdrlen  The length of the header.
+ * @param data  The payload, or NULL if there is none.
+ * @param datalen  The length of the payload.
+ * @return 0 if the packet was accepted for transmission, -1 on error,
+ * or PROTO_SEND_DECLINED.
+ */
+typedef int PROTO_SENDER(int fd, const void *hdr, size_t hdrlen,
+                         const void *data, size_t datalen);
+
+/*
+ * Install a sender, or remove it by passing NULL.  Not thread-safe: this
+ * is meant to be called once, before any connections exist.
+ */
+void proto_set_sender(PROTO_SENDER *sender);
+
+/*
+ * A reference-counted payload, for a packet that goes out to many
+ * connections (MOVED to the spectators of a game, say): it is built once,
+ * and every connection's output queue refers to the same bytes instead of
+ * having a copy of its own.  Only the headers differ from one connection
+ * to the next.
+ */
+typedef struct proto_buf {
+    int refs;
+    size_t len;
+    char data[];
+} PROTO_BUF;
+
+/*
+ * Create a PROTO_BUF holding a copy of some bytes, with one reference.
+ *
+ * @return the new PROTO_BUF, or NULL if memory could not be allocated.
+ */
+PROTO_BUF *proto_buf_create(const void *data, size_t len);
+
+/*
+ * Add a reference to a PROTO_BUF.  Thread-safe.
+ *
+ * @return the same PROTO_BUF.
+ */
+PROTO_BUF *proto_buf_ref(PROTO_BUF *buf);
+
+/*
+ * Drop a reference to a PROTO_BUF, freeing it when the last one goes.
+ * Thread-safe.
+ */
+void proto_buf_unref(PROTO_BUF *buf);
+
+/*
+ * A function that queues a packet whose payload is a PROTO_BUF.  It takes
+ * a reference to the PROTO_BUF for as long as it needs the bytes.  It
+ * may hold the packet back to be written once the connections it has
+ * more urgent traffic for have been served.
+ *
+ * @return as for PROTO_SENDER.
+ */
+typedef int PROTO_SHARED_SENDER(int fd, const void *hdr, size_t hdrlen, PROTO_BUF *buf);
+
+/*
+ * Install a shared-payload sender, or remove it by passing NULL.  As for
+ * proto_set_sender().
+ */
+void proto_set_shared_sender(PROTO_SHARED_SENDER *sender);
+
+/*
+ * Send a packet whose payload is a PROTO_BUF, as proto_send_packet()
+ * would.  The caller keeps its reference to the PROTO_BUF.
+ *
+ * @param fd  The file descriptor on which the packet is to be sent.
+ * @param hdr  The header, with multi-byte fields in network byte order
+ * and the size field matching the length of buf.
+ * @param buf  The payload.
+ * @return 0 if successful, -1 otherwise.
+ */
+int proto_send_shared(int fd, JEUX_PACKET_HEADER *hdr, PROTO_BUF *buf);
+
+#endif
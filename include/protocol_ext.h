@@ -0,0 +1,96 @@
+#ifndef PROTOCOL_EXT_H
+#define PROTOCOL_EXT_H
+
+#include "protocol.h"
+
+/*
+ * Packet types beyond those in protocol.h, which is not to be modified.
+ * They are numbered on from the last of JEUX_PACKET_TYPE, and use the
+ * same header.
+ *
+ * Client-to-server requests:
+ *   MATCH:    Join the matchmaking queue, to be paired with an opponent of
+ *             similar rating.  ACK means queued (NACK: already queued).
+ *   UNMATCH:  Leave the matchmaking queue
+ *   WATCH:    Watch the game a player has in progress
+ *             Payload: user name of the player
+ *             ACK header: the spectator's ID for the game
+ *             ACK payload: string showing the current game state
+ *   UNWATCH:  Stop watching a game
+ *             Header: the spectator's ID for the game
+ *   TOURNEY:  Organize a tournament, which others can then enter
+ *             Payload: "swiss <rounds>" or "roundrobin"
+ *             ACK header: the tournament's ID
+ *   ENTER:    Enter a tournament that has not started yet
+ *             Header: the tournament's ID
+ *   START:    Start a tournament (organizer only)
+ *             Header: the tournament's ID
+ *   STANDINGS: Get the standings of a tournament
+ *             Header: the tournament's ID
+ *             ACK payload: the standings (see below)
+ *   STATS:    Get the server's runtime statistics
+ *             ACK payload: the report described in stats.h
+ *
+ * When a match is made each of the two players is sent, just as if they
+ * had invited each other and accepted straight away:
+ *   INVITED   Header: invitation ID for the new game, player's role
+ *             Payload: user name of the opponent
+ *   ACCEPTED  Header: the same invitation ID
+ *             Payload: string showing initial game state, for the player
+ *                      who moves first
+ * after which the game proceeds as usual.
+ *
+ * Spectators are sent, with their own ID for the game:
+ *   MOVED     Header: role of the player who moved
+ *             Payload: string showing the game state after the move
+ *   ENDED     Header: role of the winner, as for the players
+ * A spectator's IDs are separate from those of its own invitations.
+ *
+ * The games of a tournament are started for the players just as matches
+ * are, a round at a time.  When a round is over, every player in the
+ * tournament (and the organizer) is sent:
+ *   STANDINGS Header: the tournament's ID, the number of rounds played
+ *             Payload: the first line of the standings and the player's
+ *                      own line (the whole table for the organizer)
+ * The standings start with a line "<format>\t<rounds played>\t<rounds>",
+ * followed by one line per player, best first:
+ * "<place>\t<user name>\t<points>\t<tiebreak>", points being 1 for a
+ * win (or a bye, or a game the opponent did not turn up for) and 1/2 for
+ * a draw, written with one decimal place.  The tournament is over when
+ * the rounds played reach the number of rounds.
+ *
+ * Every packet the server sends has the time it was sent in the timestamp
+ * fields of its header, as seconds and nanoseconds since the Unix epoch
+ * (CLOCK_REALTIME): exactly, if the server was started with -T, and
+ * otherwise as of the start of the work that sent it, which can be a
+ * millisecond or so earlier under load.  A client may do the same for its
+ * requests; the server then estimates from them how far the client's
+ * clock is off and how long each request took to arrive.  A timestamp of
+ * zero means the client does not stamp its requests.  The lines of the
+ * ACK to USERS go on, after the rating, with what is known about the
+ * timing of the player's connection, in microseconds, each after a TAB:
+ *   <round trip time>        as measured by TCP, -1 if unknown
+ *   <one-way delay>          smoothed over recent requests, and
+ *   <clock skew>             how far the client's clock is ahead,
+ * the last two only for clients that stamp their requests, and none of
+ * them for players without a connection of their own.
+ *
+ * Each client may only make requests so fast (see rate_limit.h): about
+ * 100 a second in all, 4 a second of USERS, STANDINGS and STATS, and 10
+ * a second of INVITE, MATCH, WATCH and TOURNEY, with bursts of a few
+ * seconds' worth.  A request over the limit is NACKed without being
+ * looked at, and a client that keeps on regardless is disconnected.
+ */
+enum {
+    JEUX_MATCH_PKT = JEUX_ENDED_PKT + 1,
+    JEUX_UNMATCH_PKT,
+    JEUX_WATCH_PKT,
+    JEUX_UNWATCH_PKT,
+    JEUX_TOURNEY_PKT,
+    JEUX_ENTER_PKT,
+    JEUX_START_PKT,
+    JEUX_STANDINGS_PKT,
+    JEUX_STATS_PKT
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdint.h>
+
+/*
+ * Per-client rate limits, so that one client sending requests in a tight
+ * loop can't keep a thread (or the event loop) and the registries busy on
+ * its behalf.
+ *
+ * Every request a client makes takes a token from a bucket that allows a
+ * generous steady rate with bursts, and the requests that are costly for
+ * the server (the ones that walk a registry, like USERS, or that create
+ * something shared, like INVITE) take one from a much smaller bucket of
+ * their own kind as well.  A request with no token to take is refused,
+ * and takes a token from the client's bucket of patience; once that is
+ * empty too, the client is cut off.
+ *
+ * A bucket is kept as one number: the time by which it would have filled
+ * back up, at its steady rate, from the tokens taken so far (the generic
+ * cell rate algorithm).  Taking a token is a comparison and an addition.
+ *
+ * A client's buckets are only ever touched by whatever is servicing the
+ * client, so they need no locking, and nothing is shared between clients
+ * but the (read-only) limits.  The limiter does not read the clock; the
+ * caller passes in the time.
+ */
+
+/*
+ * The kinds of request with buckets of their own.
+ */
+typedef enum rl_class {
+    RL_REQUESTS,                     // every request
+    RL_LISTINGS,                     // USERS, STANDINGS, STATS
+    RL_OFFERS,                       // INVITE, MATCH, WATCH, TOURNEY
+    RL_PATIENCE,                     // requests refused
+    RL_CLASSES
+} RL_CLASS;
+
+typedef struct rate_limiter {
+    uint64_t full_at[RL_CLASSES];    // in ns, from the caller's origin
+} RATE_LIMITER;
+
+typedef enum rl_verdict {
+    RL_OK,                           // go ahead
+    RL_REFUSED,                      // refuse this request
+    RL_CUT_OFF                       // refuse it and disconnect the client
+} RL_VERDICT;
+
+/*
+ * Set up a client's limiter, with all its buckets full.
+ */
+void rl_init(RATE_LIMITER *rl);
+
+/*
+ * Take the tokens for a request.
+ *
+ * @param rl  The client's limiter.
+ * @param type  The packet type of the request.
+ * @param now_ns  The time, in nanoseconds from an origin that is the same
+ * for every call for the same limiter.
+ * @return what to do with the request.
+ */
+RL_VERDICT rl_check(RATE_LIMITER *rl, int type, uint64_t now_ns);
+
+/*
+ * Scale every client's limits.  The default is 1; a larger factor allows
+ * that many times the rates and bursts, and 0 lifts the limits.
+ *
+ * @param factor  The factor.
+ */
+void rl_set_scale(unsigned int factor);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef REFTRACK_H
+#define REFTRACK_H
+
+#include <stdio.h>
+
+/*
+ * Reference tracking, for finding reference count leaks: in a server
+ * built with REFTRACK defined (make reftrack), every CLIENT, PLAYER,
+ * INVITATION and GAME is kept in a table from the time it is created to
+ * the time its last reference is dropped, along with how many references
+ * were taken and dropped for each reason (the why given to *_ref() and
+ * *_unref()).  Anything left in the table once the server has shut down
+ * has been leaked, and the reasons whose references were not all dropped
+ * say who leaked it.  An unref of an object that is not in the table, or
+ * that has no references left, is counted as an over-release.
+ *
+ * GAMEs belong to the game library, so their references are caught at
+ * link time (see the Makefile), by wrapping game_create(), game_ref()
+ * and game_unref().
+ *
+ * Without REFTRACK, all of this compiles to nothing.
+ */
+
+typedef enum ref_kind {
+    REF_CLIENT,
+    REF_PLAYER,
+    REF_INVITATION,
+    REF_GAME,
+    REF_KINDS
+} REF_KIND;
+
+#ifdef REFTRACK
+
+/*
+ * An object has been created, with one reference.
+ */
+void reftrack_create(REF_KIND kind, void *obj, const char *why);
+
+/*
+ * A reference to an object has been taken.
+ */
+void reftrack_ref(REF_KIND kind, void *obj, const char *why);
+
+/*
+ * A reference to an object has been dropped.  This is to be called
+ * before the object might be freed.
+ */
+void reftrack_unref(REF_KIND kind, void *obj, const char *why);
+
+/*
+ * Write a report: lines beginning "reftrack", giving the number of
+ * objects of each kind there are, the over-releases, and, for every
+ * reason, the references taken for it less those dropped for it, over
+ * the objects there are, and how many objects those are.  A reference is
+ * rarely dropped for the reason it was taken, so the reasons come in
+ * pairs that cancel out; a leak is a reason with more to it than its
+ * pair.  With detail, each object is listed as well (up to a limit),
+ * with its count and its references by reason.
+ *
+ * @param f  Where the report goes.
+ * @param detail  Nonzero to list the objects.
+ * @return the number of objects there are.
+ */
+int reftrack_report(FILE *f, int detail);
+
+#else
+
+#define reftrack_create(kind, obj, why) ((void)0)
+#define reftrack_ref(kind, obj, why) ((void)0)
+#define reftrack_unref(kind, obj, why) ((void)0)
+static inline int reftrack_report(FILE *f, int detail){
+    return 0;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include "protocol.h"
+#include "client_registry.h"
+
+/*
+ * Request handling shared by the thread-per-connection service loop
+ * (jeux_client_service(), see server.h) and the coroutine sessions
+ * driven by the event loop (see session.h).  Whatever drives the
+ * connection is responsible for receiving a complete packet; the
+ * functions here carry out the request and send the ACK/NACK.
+ */
+
+/*
+ * Carry out a single request received from a client.
+ *
+ * @param client  The CLIENT that sent the request.
+ * @param hdr  The header of the request, with the size field already
+ * converted to host byte order.
+ * @param payload  The payload of the request as a null-terminated string,
+ * or NULL if there was none.
+ * @return 0 if the request was honored (an ACK was sent), otherwise -1
+ * (a NACK was sent, or nothing could be sent at all), or -2 if the client
+ * has gone over its rate limits once too often (see rate_limit.h), in
+ * which case it has been sent a NACK and the caller is to treat the
+ * connection as ended.
+ */
+int service_dispatch(CLIENT *client, JEUX_PACKET_HEADER *hdr, char *payload);
+
+/*
+ * Tear down the server-side state for a connection that has seen EOF:
+ * log the client out if it was logged in and remove it from the client
+ * registry.  The file descriptor is NOT closed.
+ *
+ * @param client  The CLIENT whose connection has ended.  The reference
+ * held by the client registry is discarded, so the caller must not use
+ * the CLIENT afterwards unless it holds a reference of its own.
+ */
+void service_disconnect(CLIENT *client);
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "proto_io.h"
+#include "proto_codec.h"
+#include "client_registry.h"
+#include "coroutine.h"
+#include "timer_wheel.h"
+
+/*
+ * A SESSION is the event-loop counterpart of a client service thread.
+ * It owns the (non-blocking) connection to one client and runs the
+ * service loop as a stackless coroutine: whenever the socket has no more
+ * data the coroutine suspends, and the event loop resumes it when the
+ * socket becomes readable again.  All of the state that the service loop
+ * needs between packets lives in the SESSION itself, so a connection costs
+ * a few hundred bytes rather than a thread stack.
+ */
+/*
+ * A packet waiting to be written to the connection, header and payload
+ * in one contiguous buffer, or a payload shared with other connections
+ * (queued right behind its header).  The event loop decides where the
+ * buffer comes from; slot is its own bookkeeping.
+ */
+typedef struct session_out {
+    struct session_out *next;
+    char *buf;
+    size_t len;                  // total length of the packet
+    size_t off;                  // how much of it has been written
+    int slot;                    // fixed buffer slot, or -1 if malloc'ed
+    PROTO_BUF *shared;           // buf is this one's data, or NULL
+} SESSION_OUT;
+
+typedef struct session {
+    CO_STATE co;                 // resume point of the service coroutine
+    int fd;                      // connection to the client
+    CLIENT *client;              // registry's CLIENT for this connection
+    // header of the packet being received, as it came off the wire and
+    // decoded (with the size in host byte order)
+    unsigned char wire[JEUX_WIRE_HEADER_SIZE];
+    JEUX_PACKET_HEADER hdr;
+    char *payload;               // payload of the packet being received
+    size_t have;                 // bytes of the current header/payload so far
+    uint64_t hdr_ns;             // when the header was complete (stats_clock_ns())
+
+    // input the event loop has already received on our behalf; when
+    // buffered is set the session never reads from fd itself
+    int buffered;
+    int in_eof;
+    char *in;
+    size_t in_len, in_off, in_cap;
+
+    // output queued by the event loop, oldest first
+    SESSION_OUT *out_head, *out_tail;
+    size_t out_bytes;            // how much of it is left to write
+    unsigned int out_inflight;   // packets handed to the kernel, not yet done
+    int out_short;               // one of them came up short, so the rest
+                                 // of its chain must have been cancelled
+    struct session *next_dirty;  // on the loop's list of sessions to flush
+    int dirty;
+    int recv_armed;              // a multishot receive is outstanding
+    unsigned int ev_mask;        // events the session is registered for with epoll
+    int closing;                 // coroutine finished, waiting for I/O to drain
+    int shut;                    // shutdown(2) already called
+
+    // login/idle timeout, kept by the event loop
+    TIMER timer;
+    uint64_t active_ms;          // when input last arrived
+} SESSION;
+
+/*
+ * Create a SESSION for a newly accepted connection, registering the
+ * connection with the client registry.
+ *
+ * @param fd  The file descriptor of the accepted connection.
+ * @return the new SESSION, or NULL if the client could not be registered.
+ */
+SESSION *session_create(int fd);
+
+/*
+ * Resume the service coroutine of a SESSION, processing as many requests
+ * as can be completed without blocking.
+ *
+ * @param s  The SESSION to run.
+ * @return CO_WAITING if the session is waiting for more input, or CO_DONE
+ * if the connection has ended and the session should be finalized.
+ */
+int session_run(SESSION *s);
+
+/*
+ * Hand the session bytes that the event loop received from its connection.
+ * Only used for sessions with the buffered flag set.
+ *
+ * @param s  The SESSION.
+ * @param data  The bytes received, or NULL to signal EOF.
+ * @param len  Number of bytes received.
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+int session_feed(SESSION *s, const void *data, size_t len);
+
+/*
+ * @return nonzero if the session holds received input it has not consumed.
+ */
+int session_has_input(SESSION *s);
+
+/*
+ * Get the input a SESSION has received but not yet acted on: the part of
+ * the packet it is in the middle of reading, followed by anything still
+ * buffered.  Feeding these bytes to a fresh SESSION on the same
+ * connection picks up exactly where this one left off.
+ *
+ * @param s  The SESSION.
+ * @param bufp  A malloc'ed copy of the bytes is stored here, or NULL if
+ * there are none (or they could not be copied).
+ * @return the number of bytes.
+ */
+size_t session_unconsumed(SESSION *s, char **bufp);
+
+/*
+ * Finalize a SESSION whose service coroutine has finished: the client is
+ * logged out and unregistered, the connection is closed and the SESSION
+ * is freed.
+ *
+ * @param s  The SESSION to finalize, which must not be referenced again.
+ */
+void session_fini(SESSION *s);
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Runtime statistics: counts of the packets and bytes that go in and out,
+ * by packet type, of the NACKs sent, by reason, of the clients,
+ * invitations and games there are right now, of the invitations
+ * withdrawn for being left open too long, and of the clients cut off for
+ * flooding the server with requests.
+ *
+ * Counting is meant to be cheap enough to do on every packet.  Each
+ * thread that counts anything gets a block of counters of its own, padded
+ * out to whole cache lines and written by that thread alone, with plain
+ * (relaxed atomic) loads and stores: no locks, no read-modify-write
+ * instructions, and no cache lines bouncing between threads.  Nothing is
+ * added up until someone asks, when the blocks of every thread there has
+ * been are summed.  The figures so produced are not a snapshot taken at
+ * one instant, but every count in them is one that was actually reached.
+ *
+ * Gauges (clients and the like) are kept as counts going up and down, so
+ * a thread's own block can well hold a negative number for one; only the
+ * sum means anything.
+ *
+ * How long requests take is kept the same way, in a histogram per
+ * request type: the time from the request's header being received to
+ * its ACK or NACK being sent, and for MOVE also the time to the MOVED
+ * being sent to the opponent, in nanoseconds.  The histograms are the
+ * fixed-size log-linear ones of histogram.h, 8K each.  A thread's
+ * histogram for a type is allocated the first time it records one.
+ * A MOVED only counts if it is sent to a connection on this node, so the
+ * figure for MOVE to MOVED covers games between players on one node.
+ *
+ * Two more histograms describe the connections rather than the server:
+ * the round trip times the kernel has measured for them, and the one-way
+ * delays of requests estimated from the timestamps in their headers (see
+ * client_note_request() in client_ext.h).
+ *
+ * The report (see stats_report()) goes to logged-in clients in reply to
+ * STATS (see protocol_ext.h), and to anything connecting to the stats
+ * socket, if the server was started with one.
+ */
+
+#define STATS_MAX_TYPES 32           // packet types; higher ones count as the last
+
+/*
+ * The things counted, besides packets.
+ */
+typedef enum stat_counter {
+    STAT_BYTES_IN,
+    STAT_BYTES_OUT,
+    STAT_CLIENTS,                    // registered: connections and bots
+    STAT_INVITATIONS,                // open, not yet accepted
+    STAT_GAMES,                      // accepted and not yet closed
+    STAT_INVITATIONS_EXPIRED,        // withdrawn for being open too long
+    STAT_CUT_OFF,                    // clients disconnected for flooding
+    STAT_COUNTERS
+} STAT_COUNTER;
+
+/*
+ * Why a request was NACKed.
+ */
+typedef enum stat_nack {
+    STAT_NACK_NOT_LOGGED_IN,         // anything but LOGIN before logging in
+    STAT_NACK_LOGIN,                 // LOGIN refused: bad or taken name
+    STAT_NACK_UNKNOWN,               // no such packet type
+    STAT_NACK_REFUSED,               // the request could not be carried out
+    STAT_NACK_RATE,                  // over the client's rate limits
+    STAT_NACK_REASONS
+} STAT_NACK;
+
+/*
+ * Add to a counter (which may be a negative amount for a gauge).
+ */
+void stats_add(STAT_COUNTER counter, long delta);
+
+/*
+ * Count a packet received from a client, with size the length of its
+ * payload.
+ */
+void stats_packet_in(int type, size_t size);
+
+/*
+ * Count a packet sent to a client, with size the length of its payload.
+ */
+void stats_packet_out(int type, size_t size);
+
+/*
+ * Count a NACK sent for a reason.
+ */
+void stats_nack(STAT_NACK reason);
+
+/*
+ * @return the time now, in nanoseconds, on the clock latencies are
+ * measured by.
+ */
+uint64_t stats_clock_ns(void);
+
+/*
+ * The calling thread is starting on a request from a client, whose header
+ * arrived at start_ns (see stats_clock_ns()).  The ACK or NACK it sends
+ * for it before stats_request_end() (see stats_packet_out()) is timed,
+ * as is the first MOVED it sends for a MOVE.
+ */
+void stats_request_begin(int type, uint64_t start_ns);
+
+/*
+ * The calling thread is done with its request.
+ */
+void stats_request_end(void);
+
+/*
+ * Count the round trip time of a client's connection, in nanoseconds.
+ */
+void stats_rtt(uint64_t ns);
+
+/*
+ * Count the estimated one-way delay of a request from a client, in
+ * nanoseconds.
+ */
+void stats_delay(uint64_t ns);
+
+/*
+ * Merge every thread's histograms and write, for each request type that
+ * has been timed, a line
+ * "latency <type> count <n> p50 <us> p99 <us> p999 <us> max <us>", with
+ * the times in microseconds.  MOVE to MOVED goes as type "MOVE>MOVED",
+ * and the round trip times and one-way delays as "RTT" and "DELAY".
+ */
+void stats_write_latency(FILE *f);
+
+/*
+ * Add up every thread's counters into a report, one figure to a line:
+ * "<name> <value>" for the counters and gauges, "in <type> <count>" and
+ * "out <type> <count>" for the packet types that have been seen,
+ * "nack <reason> <count>" for the NACKs, and then the latencies, as
+ * written by stats_write_latency(), and in a server built with REFTRACK
+ * the summary of the references there are (see reftrack.h).
+ *
+ * @param lenp  The length of the report is stored here.
+ * @return the report, a malloc'ed string, or NULL if memory could not be
+ * allocated.
+ */
+char *stats_report(size_t *lenp);
+
+/*
+ * Start answering on a Unix socket: whatever connects to it is sent the
+ * report, and the connection closed.  The socket is served by the event
+ * loop, so this is to be called once the loop has been initialized.
+ *
+ * @param path  The path of the socket, which replaces any stale socket
+ * file there.
+ * @return 0 if successful, -1 otherwise.
+ */
+int stats_listen(const char *path);
+
+/*
+ * Stop answering on the stats socket, if there is one, and remove it.
+ */
+void stats_unlisten(void);
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+/*
+ * A hierarchical timing wheel, for keeping track of very many timeouts
+ * (one or more per connection) at constant cost.
+ *
+ * Time is counted in ticks of a fixed number of milliseconds.  The wheel
+ * has TW_LEVELS levels of TW_SLOTS slots each: a timer that expires
+ * within TW_SLOTS ticks sits in the slot for its exact tick on level 0, a
+ * timer further out sits in a coarser slot on a higher level, and each
+ * time the slots of one level have gone round once, the next slot of the
+ * level above is emptied into the level below.  Starting and cancelling a
+ * timer are O(1), and so is each tick; timers never need to be compared
+ * with each other.  A timer that is cancelled before it expires (the
+ * common case for timeouts) costs nothing more than unlinking it.
+ *
+ * The wheel does not read the clock or create threads.  The owner passes
+ * in the current time, and asks how long it may sleep before the next
+ * timer can be due (see tw_next_ms()).
+ *
+ * The wheel is not thread-safe; it belongs to the thread that advances it.
+ */
+
+#define TW_LEVEL_BITS 6
+#define TW_SLOTS      (1 << TW_LEVEL_BITS)
+#define TW_LEVELS     4
+
+typedef struct timer TIMER;
+
+/*
+ * A function called when a timer expires.  It may start or cancel any
+ * timer, including this one.
+ */
+typedef void TIMER_FUNC(TIMER *timer, void *arg);
+
+/*
+ * A timer is embedded in whatever it times out, so that starting one
+ * never allocates.  Its fields are private to the wheel.
+ */
+struct timer {
+    struct timer *next;
+    struct timer **pprev;        // NULL when the timer is not pending
+    uint64_t expires;            // tick at which the timer is due
+    unsigned char level, slot;
+    TIMER_FUNC *func;
+    void *arg;
+};
+
+typedef struct timer_wheel TIMER_WHEEL;
+
+/*
+ * Create an empty timer wheel.
+ *
+ * @param tick_ms  The resolution of the wheel, in milliseconds.
+ * @param now_ms  The current time, in milliseconds from any fixed origin.
+ * @return the new wheel, or NULL if memory could not be allocated.
+ */
+TIMER_WHEEL *tw_create(unsigned int tick_ms, uint64_t now_ms);
+
+/*
+ * Free a timer wheel.  Timers still pending are forgotten, not called.
+ */
+void tw_fini(TIMER_WHEEL *tw);
+
+/*
+ * Initialize a timer before its first use.
+ *
+ * @param timer  The timer.
+ * @param func  The function to call when it expires.
+ * @param arg  Passed to func along with the timer.
+ */
+void timer_init(TIMER *timer, TIMER_FUNC *func, void *arg);
+
+/*
+ * Start a timer, or restart it if it is already pending.
+ *
+ * @param tw  The wheel.
+ * @param timer  The timer.
+ * @param ms  How long from the wheel's current time until the timer
+ * expires.  This is rounded up to a whole number of ticks, and at least
+ * one, so a timer never fires from within the call that started it.
+ */
+void tw_add(TIMER_WHEEL *tw, TIMER *timer, uint64_t ms);
+
+/*
+ * Cancel a timer if it is pending.
+ */
+void tw_cancel(TIMER_WHEEL *tw, TIMER *timer);
+
+/*
+ * @return nonzero if the timer has been started and has neither expired
+ * nor been cancelled.
+ */
+int timer_pending(const TIMER *timer);
+
+/*
+ * Bring the wheel up to the current time, calling every timer that has
+ * come due, in order of expiry (timers due in the same tick are called
+ * in no particular order).
+ *
+ * @param tw  The wheel.
+ * @param now_ms  The current time.
+ * @return the number of timers called.
+ */
+int tw_advance(TIMER_WHEEL *tw, uint64_t now_ms);
+
+/*
+ * @return the wheel's notion of the current time: the time given to the
+ * last call of tw_advance().
+ */
+uint64_t tw_now(TIMER_WHEEL *tw);
+
+/*
+ * How long the owner can wait before calling tw_advance() again.  This is
+ * the time to the next tick with a timer due on it, or, if the next
+ * TW_SLOTS ticks have none, to the next tick at which timers further out
+ * are moved down a level.
+ *
+ * @param tw  The wheel.
+ * @param now_ms  The current time.
+ * @return the number of milliseconds, or -1 if no timer is pending at all.
+ */
+int tw_next_ms(TIMER_WHEEL *tw, uint64_t now_ms);
+
+/*
+ * @return the number of pending timers.
+ */
+unsigned int tw_count(TIMER_WHEEL *tw);
+
+#endif
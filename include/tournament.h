@@ -0,0 +1,115 @@
+#ifndef TOURNAMENT_H
+#define TOURNAMENT_H
+
+#include "client_registry.h"
+
+/*
+ * Tournaments: a player organizes one (TOURNEY), others enter it (ENTER)
+ * and, once the organizer starts it (START), the server plays it out a
+ * round at a time, starting every game of a round at once (see
+ * client_make_game()) and starting the next round as soon as the last
+ * game of the previous one is over.  Players are told the standings
+ * after each round (see protocol_ext.h).
+ *
+ * There are two formats.  In a round robin everyone plays everyone else
+ * once, the rounds laid out in advance by the circle method.  In a Swiss
+ * tournament there are a set number of rounds, and each round pairs
+ * players with the same score (or as close as can be) who have not met
+ * before.  Swiss pairing is kept cheap for very large events: the players
+ * are kept in standings order from one round to the next, ordered at the
+ * start by rating and then re-sorted after each round by a stable
+ * counting sort on score, which is linear; each player is then paired
+ * with the first player below who is not yet paired and has not been
+ * played before, looking no more than TRN_PAIRING_WINDOW places ahead.
+ * Pairing 10,000 players takes a millisecond or two.  With an odd number
+ * of players, the lowest placed one who hasn't yet had a bye gets one.
+ * Each player moves first about as often as second.
+ *
+ * A win, a bye and a game the opponent did not turn up for (because they
+ * left) are worth 2 half-points, a draw 1.  Games aborted by the server
+ * shutting down count for nothing, and end the tournament after that
+ * round.  Ties in the standings are broken by the sum of the opponents'
+ * points (Buchholz), then by rating.
+ *
+ * A player who disconnects from a tournament that has started is out of
+ * the remaining rounds; their game in progress is lost by resignation as
+ * usual.  If the organizer disconnects before starting the tournament, it
+ * is called off.  Tournaments are not carried over by a hot restart (see
+ * handoff.h): their games carry on as ordinary games.
+ */
+
+#define TRN_MAX_TOURNAMENTS 256     // IDs go out in the one-byte id field
+#define TRN_PAIRING_WINDOW  32
+
+typedef enum trn_format {
+    TRN_SWISS,
+    TRN_ROUND_ROBIN
+} TRN_FORMAT;
+
+typedef struct tournament_registry TOURNAMENT_REGISTRY;
+
+/*
+ * The server's tournaments.
+ */
+extern TOURNAMENT_REGISTRY *tournaments;
+
+/*
+ * Initialize a new, empty tournament registry.
+ *
+ * @return the registry, or NULL if memory could not be allocated.
+ */
+TOURNAMENT_REGISTRY *treg_init(void);
+
+/*
+ * Finalize a tournament registry, freeing every tournament.  This must
+ * not be done while tournament games are still in progress.
+ */
+void treg_fini(TOURNAMENT_REGISTRY *treg);
+
+/*
+ * Organize a new tournament.  Finished tournaments are kept, so that
+ * their standings can still be had, until their IDs are needed.
+ *
+ * @param treg  The registry.
+ * @param organizer  The logged-in CLIENT organizing it, who is not
+ * entered in it.
+ * @param format  The format.
+ * @param rounds  The number of rounds of a Swiss tournament; a round robin
+ * has as many as it takes.
+ * @return the tournament's ID, or -1 if it could not be created.
+ */
+int treg_create(TOURNAMENT_REGISTRY *treg, CLIENT *organizer, TRN_FORMAT format, int rounds);
+
+/*
+ * Enter a logged-in CLIENT in a tournament that has not started.
+ *
+ * @return 0 if successful, -1 if there is no such tournament, it has
+ * started, or the CLIENT is already in it.
+ */
+int treg_enter(TOURNAMENT_REGISTRY *treg, int id, CLIENT *client);
+
+/*
+ * Start a tournament, pairing the first round.
+ *
+ * @param client  The CLIENT asking, which must be the organizer.
+ * @return 0 if successful, -1 if there is no such tournament, it has
+ * already started, the CLIENT is not its organizer, or it has fewer than
+ * two players.
+ */
+int treg_start(TOURNAMENT_REGISTRY *treg, int id, CLIENT *client);
+
+/*
+ * Get the standings of a tournament, in the form sent to players (see
+ * protocol_ext.h).
+ *
+ * @return a malloc'ed string, or NULL if there is no such tournament.
+ */
+char *treg_standings(TOURNAMENT_REGISTRY *treg, int id);
+
+/*
+ * A CLIENT is going away: it leaves the tournaments that have not started
+ * (calling off those it organized) and drops out of the rest.
+ */
+void treg_leave(TOURNAMENT_REGISTRY *treg, CLIENT *client);
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Always-on tracing, for finding out after the fact what the server was
+ * doing: each thread keeps the last TRACE_EVENTS things it did (packets
+ * in and out, references taken and dropped, invitations changing state)
+ * in a ring of fixed-size binary records, which are written to a file on
+ * SIGUSR1, or when the server crashes, and turned into text by the
+ * jeux_trace tool.
+ *
+ * Recording an event is a read of the time stamp counter and a few
+ * stores into memory only the recording thread writes: no locks, no
+ * atomic read-modify-writes, no system calls.  The ring just wraps
+ * around, so nothing is ever waited for or thrown away but the oldest
+ * events.  A ring is allocated the first time a thread records
+ * anything, and handed on to another thread when its own exits (so
+ * its older events may be those of the thread before).
+ *
+ * The dump is taken while the threads carry on, so the event a thread is
+ * recording just then may come out garbled; everything else is as it was
+ * recorded.
+ */
+
+#define TRACE_EVENTS 8192            // per thread; a power of two
+
+typedef enum trace_type {
+    TRACE_NONE,
+    TRACE_PKT_IN,                    // obj: fd, arg: payload size, arg2: type
+    TRACE_PKT_OUT,                   // the same
+    TRACE_CLIENT_REF,                // obj: the CLIENT, arg: count after, why
+    TRACE_CLIENT_UNREF,
+    TRACE_PLAYER_REF,                // obj: the PLAYER, as for CLIENT
+    TRACE_PLAYER_UNREF,
+    TRACE_INV_REF,                   // obj: the INVITATION, as for CLIENT
+    TRACE_INV_UNREF,
+    TRACE_INV_STATE,                 // obj: the INVITATION, arg: new state,
+                                     // arg2: old state, why: what did it
+    TRACE_TYPES
+} TRACE_TYPE;
+
+/*
+ * One event, as kept in a ring.  why is a string literal, or NULL.
+ */
+typedef struct trace_event {
+    uint64_t tsc;
+    uint64_t obj;
+    const char *why;
+    uint32_t arg;
+    uint16_t type;
+    uint16_t arg2;
+} TRACE_EVENT;
+
+typedef struct trace_ring {
+    struct trace_ring *next;
+    int in_use;                      // by a thread that is still there
+    uint64_t thread;                 // its id (gettid()), or the last one's
+    uint64_t head;                   // events ever recorded
+    TRACE_EVENT events[TRACE_EVENTS];
+} TRACE_RING;
+
+extern __thread TRACE_RING *trace_ring;
+
+/*
+ * Get a ring for the calling thread.  This is the only part of recording
+ * that takes a lock or allocates memory.
+ *
+ * @return the ring, or NULL if none could be allocated.
+ */
+TRACE_RING *trace_ring_get(void);
+
+// inlined even without optimization, which is how the server is built
+static inline __attribute__((always_inline)) uint64_t trace_clock(void){
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Record an event in the calling thread's ring.
+ */
+static inline __attribute__((always_inline))
+void trace(TRACE_TYPE type, uint64_t obj, uint32_t arg, uint16_t arg2, const char *why){
+    TRACE_RING *r = trace_ring;
+    if(r == NULL && (r = trace_ring_get()) == NULL)
+        return;
+    TRACE_EVENT *e = &r->events[r->head & (TRACE_EVENTS - 1)];
+    e->tsc = trace_clock();
+    e->obj = obj;
+    e->why = why;
+    e->arg = arg;
+    e->type = type;
+    e->arg2 = arg2;
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Note where the trace is to be dumped, and have it dumped on SIGUSR1,
+ * and when the server crashes (SIGSEGV, SIGBUS, SIGFPE, SIGILL or
+ * SIGABRT), before it dies of the signal as it would have anyway.
+ *
+ * @param path  The file to dump to, which is replaced by each dump, or
+ * NULL for /tmp/jeux.<pid>.trace.
+ * @return 0 if successful, -1 otherwise.
+ */
+int trace_init(const char *path);
+
+/*
+ * Write the trace to the file given to trace_init().  This is safe to do
+ * from a signal handler.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int trace_dump(void);
+
+/*
+ * The dump: a TRACE_FILE_HEADER, then for each ring a TRACE_RING_HEADER
+ * followed by its events, oldest first, each a TRACE_RECORD and then the
+ * why_len bytes of its why.  Everything is in the byte order of the
+ * machine that wrote it.  The two readings of the time stamp counter
+ * and the wall clock (in nanoseconds since the epoch) convert the
+ * events' times to wall-clock times.
+ */
+#define TRACE_MAGIC "JEUXTRC1"
+
+typedef struct trace_file_header {
+    char magic[8];
+    uint64_t tsc_start, ns_start;    // when tracing started
+    uint64_t tsc_dump, ns_dump;      // when the dump was taken
+    uint32_t rings;
+    uint32_t pid;
+} TRACE_FILE_HEADER;
+
+typedef struct trace_ring_header {
+    uint64_t thread;
+    uint64_t dropped;                // older events overwritten
+    uint32_t count;                  // events that follow
+    uint32_t pad;
+} TRACE_RING_HEADER;
+
+typedef struct trace_record {
+    uint64_t tsc;
+    uint64_t obj;
+    uint32_t arg;
+    uint16_t type;
+    uint16_t arg2;
+    uint16_t why_len;
+    uint16_t pad[3];
+} TRACE_RECORD;
+
+#endif
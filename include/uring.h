@@ -0,0 +1,146 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <signal.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+/*
+ * A minimal wrapper around the raw io_uring(7) system calls, so that the
+ * server does not depend on liburing.  It only provides what the event
+ * loop needs: getting and submitting SQEs, reaping CQEs, registering a
+ * fixed buffer region for sends and a provided-buffer ring for
+ * multishot receives.
+ *
+ * None of these functions are thread-safe; a URING belongs to the thread
+ * that runs the event loop.
+ */
+
+typedef struct uring {
+    int fd;
+    // submission queue
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned sqe_head;            // SQEs handed out but not yet submitted
+    unsigned sqe_tail;
+    // completion queue
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    // mappings, for uring_fini()
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+} URING;
+
+/*
+ * A ring of receive buffers that the kernel picks from for operations
+ * submitted with IOSQE_BUFFER_SELECT.  Buffer i lives at base + i * size.
+ */
+typedef struct uring_buf_ring {
+    struct io_uring_buf_ring *br;
+    char *base;
+    unsigned nbufs;               // a power of two
+    unsigned size;
+    unsigned short bgid;
+    unsigned short tail;
+} URING_BUF_RING;
+
+/*
+ * Set up an io_uring instance.
+ *
+ * @param r  Storage for the ring.
+ * @param entries  Number of submission queue entries requested.
+ * @return 0 if successful, otherwise -1 with errno set (for example when
+ * the kernel does not support io_uring or it has been disabled).
+ */
+int uring_init(URING *r, unsigned entries);
+
+/*
+ * Check that the kernel supports some operations on a ring, with
+ * IORING_REGISTER_PROBE.  That only says the opcodes are known, not which
+ * of their flags are: see uring_check_multishot() for that.
+ *
+ * @param ops  The opcodes (IORING_OP_*).
+ * @param nops  How many there are.
+ * @return 0 if all of them are supported, otherwise -1 with errno set.
+ */
+int uring_probe(URING *r, const unsigned char *ops, int nops);
+
+/*
+ * Check that the kernel supports multishot receives into a provided-buffer
+ * ring, by trying one on a ring and a socketpair of its own.  The kernels
+ * that do (6.0 on) also have multishot accept and multishot poll.  Older
+ * ones may set up a ring and know the RECV opcode, but fail the receive
+ * with EINVAL.
+ *
+ * @return 0 if they are supported, otherwise -1 with errno set.
+ */
+int uring_check_multishot(void);
+
+/*
+ * Tear down an io_uring instance.  Outstanding operations are cancelled.
+ */
+void uring_fini(URING *r);
+
+/*
+ * Get a zeroed SQE to fill in.  It is submitted by the next call to
+ * uring_submit().
+ *
+ * @return the SQE, or NULL if the submission queue is full.
+ */
+struct io_uring_sqe *uring_get_sqe(URING *r);
+
+/*
+ * Submit all SQEs obtained since the last submission and optionally wait
+ * for completions.
+ *
+ * @param wait_nr  Number of completions to wait for (0 to just submit).
+ * @param sigmask  Signal mask to install while waiting, or NULL.
+ * @param timeout_ms  Give up waiting after this many milliseconds, or -1
+ * to wait indefinitely.
+ * @return the number of SQEs consumed, or -1 with errno set.  EINTR means
+ * a signal arrived while waiting.
+ */
+int uring_submit(URING *r, unsigned wait_nr, const sigset_t *sigmask, int timeout_ms);
+
+/*
+ * @return the next unconsumed CQE, or NULL if there is none.  The CQE
+ * stays valid until uring_cqe_seen() is called.
+ */
+struct io_uring_cqe *uring_peek_cqe(URING *r);
+
+/*
+ * Mark the CQE returned by uring_peek_cqe() as consumed.
+ */
+void uring_cqe_seen(URING *r);
+
+/*
+ * Register a region of memory as fixed buffer 0, for use by
+ * IORING_OP_WRITE_FIXED.
+ *
+ * @return 0 if successful, otherwise -1 with errno set.
+ */
+int uring_register_buffer(URING *r, void *base, size_t len);
+
+/*
+ * Allocate nbufs buffers of size bytes each and register them as provided
+ * buffer group bgid.
+ *
+ * @param nbufs  Number of buffers, which must be a power of two.
+ * @return 0 if successful, otherwise -1 with errno set.
+ */
+int uring_buf_ring_init(URING *r, URING_BUF_RING *brp, unsigned short bgid,
+                        unsigned nbufs, unsigned size);
+
+/*
+ * Hand buffer bid back to the kernel once its contents have been consumed.
+ */
+void uring_buf_ring_recycle(URING_BUF_RING *brp, unsigned short bid);
+
+/*
+ * Unregister and free a provided buffer ring.
+ */
+void uring_buf_ring_fini(URING *r, URING_BUF_RING *brp);
+
+#endif
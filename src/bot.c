@@ -0,0 +1,294 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <semaphore.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "bot.h"
+#include "client_registry.h"
+#include "client_ext.h"
+#include "player_registry.h"
+#include "event_loop.h"
+#include "jeux_globals.h"
+
+#define BOT_CELLS     9
+#define BOT_POSITIONS 19683          // 3^9: each cell empty, X or O
+
+/*
+ * The table.  A position is numbered by its cells, left to right and top
+ * to bottom, each worth 0, 1 or 2 (empty, X, O) times its power of 3.
+ * optimal[p] has bit i set if taking cell i is one of the best moves in
+ * position p; it is 0 if the game is over, or if p can't come up at all.
+ */
+static uint16_t optimal[BOT_POSITIONS];
+static signed char value[BOT_POSITIONS];
+static unsigned char solved[BOT_POSITIONS];
+static int table_ready;
+
+static const int power[BOT_CELLS] = { 1, 3, 9, 27, 81, 243, 729, 2187, 6561 };
+static const int lines[8][3] = {
+    { 0, 1, 2 }, { 3, 4, 5 }, { 6, 7, 8 },
+    { 0, 3, 6 }, { 1, 4, 7 }, { 2, 5, 8 },
+    { 0, 4, 8 }, { 2, 4, 6 }
+};
+
+static int has_line(const char *board, int mark){
+    for(int i = 0; i < 8; i++)
+        if(board[lines[i][0]] == mark && board[lines[i][1]] == mark
+           && board[lines[i][2]] == mark)
+            return 1;
+    return 0;
+}
+
+/*
+ * Solve a position in which mark (1 for X, 2 for O) is to move, filled
+ * cells having been taken so far.  The value is from the point of view
+ * of the side to move: positive for a win, the sooner the bigger, negative
+ * for a loss, the sooner the smaller, 0 for a draw.
+ */
+static int solve(char *board, int code, int mark, int filled, int *count){
+    if(solved[code])
+        return value[code];
+    solved[code] = 1;
+    (*count)++;
+    int v;
+    uint16_t best = 0;
+    if(has_line(board, 3 - mark)){
+        v = -(10 - filled);
+    }
+    else if(filled == BOT_CELLS){
+        v = 0;
+    }
+    else{
+        v = -BOT_POSITIONS;
+        for(int i = 0; i < BOT_CELLS; i++){
+            if(board[i] != 0)
+                continue;
+            board[i] = mark;
+            int c = -solve(board, code + mark * power[i], 3 - mark, filled + 1, count);
+            board[i] = 0;
+            if(c > v){
+                v = c;
+                best = 1 << i;
+            }
+            else if(c == v){
+                best |= 1 << i;
+            }
+        }
+    }
+    value[code] = v;
+    optimal[code] = best;
+    return v;
+}
+
+static void build_table(void){
+    char board[BOT_CELLS] = { 0 };
+    int count = 0;
+    solve(board, 0, 1, 0, &count);
+    table_ready = 1;
+    debug("BOT table: %d positions", count);
+}
+
+/*
+ * The number of the position shown in a game state, as produced by
+ * game_unparse_state(): three rows of cells separated by '|', with lines
+ * of '-' in between, and then a line saying whose move it is.
+ *
+ * @return the position, or -1 if the state could not be made out.
+ */
+static int position(const char *state, size_t len){
+    int code = 0, cell = 0;
+    size_t i = 0;
+    while(i < len && cell < BOT_CELLS){
+        //a row of cells, or a line between rows
+        size_t eol = i;
+        while(eol < len && state[eol] != '\n')
+            eol++;
+        if(state[i] != '-'){
+            for(size_t j = i; j < eol && cell < BOT_CELLS; j += 2){
+                if(state[j] == 'X')
+                    code += power[cell];
+                else if(state[j] == 'O')
+                    code += 2 * power[cell];
+                else if(state[j] != ' ')
+                    return -1;
+                cell++;
+            }
+        }
+        i = eol + 1;
+    }
+    return cell == BOT_CELLS ? code : -1;
+}
+
+/*
+ * Something a bot is to do once the request that prompted it has been
+ * dealt with: accept an invitation, or move in a position, or both.
+ */
+typedef struct bot_reply {
+    int id;
+    int accept;
+    int code;                    // the position to move in, or -1
+} BOT_REPLY;
+
+typedef struct bot {
+    CLIENT *client;
+    EV_CALL call;                // posted while there are replies to make
+    BOT_REPLY *replies;
+    int nreplies, cap;
+    sem_t semaphore_block;
+} BOT;
+
+static BOT **bots;
+static int nbots;
+static unsigned int seed;
+
+/*
+ * Make one of the best moves in a position, picked at random.
+ */
+static void play(BOT *bot, int id, int code){
+    uint16_t moves = optimal[code];
+    if(moves == 0)
+        return;
+    int pick = rand_r(&seed) % __builtin_popcount(moves);
+    int cell = 0;
+    for(;; cell++){
+        if((moves & (1 << cell)) && pick-- == 0)
+            break;
+    }
+    char move[2] = { '1' + cell, '\0' };
+    if(client_make_move(bot->client, id, move) == -1)
+        debug("BOT %p: move %s in game %d refused", bot, move, id);
+}
+
+static void reply(EV_CALL *call, void *arg){
+    BOT *bot = arg;
+    sem_wait(&bot->semaphore_block);
+    BOT_REPLY *replies = bot->replies;
+    int n = bot->nreplies;
+    bot->replies = NULL;
+    bot->nreplies = bot->cap = 0;
+    sem_post(&bot->semaphore_block);
+
+    for(int i = 0; i < n; i++){
+        BOT_REPLY *r = &replies[i];
+        if(r->accept){
+            char *state = NULL;
+            if(client_accept_invitation(bot->client, r->id, &state) == -1)
+                continue;
+            //only the first player gets the state, and it is to move
+            if(state != NULL)
+                r->code = position(state, strlen(state));
+            free(state);
+        }
+        if(r->code >= 0)
+            play(bot, r->id, r->code);
+    }
+    free(replies);
+}
+
+/*
+ * The receiver for a bot's CLIENT: the packets that call for an answer
+ * are queued up, to be answered by reply().
+ */
+static void receive(CLIENT *client, JEUX_PACKET_HEADER *hdr, void *data, void *arg){
+    BOT *bot = arg;
+    BOT_REPLY r = { hdr->id, 0, -1 };
+    switch(hdr->type){
+        case JEUX_INVITED_PKT:
+            r.accept = 1;
+            break;
+        case JEUX_ACCEPTED_PKT:
+        case JEUX_MOVED_PKT:
+            //the state comes with these only when it's our move
+            if(data == NULL)
+                return;
+            r.code = position(data, ntohs(hdr->size));
+            if(r.code < 0 || optimal[r.code] == 0)
+                return;
+            break;
+        default:
+            return;
+    }
+    sem_wait(&bot->semaphore_block);
+    if(bot->nreplies == bot->cap){
+        int cap = bot->cap ? 2 * bot->cap : 8;
+        BOT_REPLY *grown = realloc(bot->replies, cap * sizeof(BOT_REPLY));
+        if(grown == NULL){
+            sem_post(&bot->semaphore_block);
+            debug("BOT %p: reply to packet type %d dropped", bot, hdr->type);
+            return;
+        }
+        bot->replies = grown;
+        bot->cap = cap;
+    }
+    bot->replies[bot->nreplies++] = r;
+    sem_post(&bot->semaphore_block);
+    ev_loop_post(&bot->call);
+}
+
+static BOT *bot_create(char *name){
+    BOT *bot = calloc(1, sizeof(BOT));
+    if(bot == NULL)
+        return NULL;
+    sem_init(&bot->semaphore_block, 0, 1);
+    ev_call_init(&bot->call, reply, bot);
+    bot->client = creg_register(client_registry, -1);
+    if(bot->client == NULL){
+        sem_destroy(&bot->semaphore_block);
+        free(bot);
+        return NULL;
+    }
+    client_set_receiver(bot->client, receive, bot);
+    PLAYER *player = preg_register(player_registry, name);
+    if(player == NULL || client_login(bot->client, player) == -1){
+        if(player != NULL)
+            player_unref(player, "bot not logged in");
+        creg_unregister(client_registry, bot->client);
+        sem_destroy(&bot->semaphore_block);
+        free(bot);
+        return NULL;
+    }
+    player_unref(player, "reference from preg_register discarded after bot login");
+    debug("BOT %p created as %s", bot, name);
+    return bot;
+}
+
+int bot_start(int count){
+    if(!table_ready){
+        build_table();
+        seed = time(NULL);
+    }
+    BOT **grown = realloc(bots, (nbots + count) * sizeof(BOT *));
+    if(grown == NULL)
+        return -1;
+    bots = grown;
+    int started = 0;
+    for(int i = 1; i <= count; i++){
+        char name[32];
+        snprintf(name, sizeof(name), BOT_NAME_FORMAT, i);
+        BOT *bot = bot_create(name);
+        if(bot == NULL)
+            continue;
+        bots[nbots++] = bot;
+        started++;
+    }
+    return started;
+}
+
+void bot_stop(void){
+    for(int i = 0; i < nbots; i++){
+        BOT *bot = bots[i];
+        ev_loop_cancel_post(&bot->call);
+        client_logout(bot->client);
+        creg_unregister(client_registry, bot->client);
+        free(bot->replies);
+        sem_destroy(&bot->semaphore_block);
+        free(bot);
+    }
+    free(bots);
+    bots = NULL;
+    nbots = 0;
+}
@@ -0,0 +1,1020 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <semaphore.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "debug.h"
+#include "client_registry.h"
+#include "client_ext.h"
+#include "invitation_ext.h"
+#include "player.h"
+#include "game.h"
+#include "proto_io.h"
+#include "journal.h"
+#include "cluster.h"
+#include "stats.h"
+#include "event_loop.h"
+#include "trace.h"
+#include "reftrack.h"
+
+//invitation IDs go out in the one-byte id field of the packet header
+#define CLIENT_MAX_INVITATIONS 256
+
+//how often the kernel is asked for a connection's round trip time
+#define CLIENT_RTT_INTERVAL_NS 1000000000LL
+//how long the lowest lag seen is kept as the baseline for the clock offset
+#define CLIENT_LAG_WINDOW_NS   60000000000LL
+
+//time control for new games; no clock if the base time is 0
+static uint64_t clock_base_ms;
+static uint64_t clock_increment_ms;
+
+//how long an invitation stays open before it is withdrawn; 0 for ever
+static uint64_t invitation_ttl_ms;
+
+//read the clock for every packet's timestamp, rather than once per pass
+//of the event loop
+static int precise_stamps;
+
+typedef struct client{
+    CLIENT_REGISTRY *creg;
+    int fd;
+    int ref_count;
+    PLAYER *player;
+    //invitations[id] is the invitation this client knows as id, or NULL
+    INVITATION **invitations;
+    int inv_cap;
+    //watching[id] is the game this client watches as id, or NULL; the ids
+    //are separate from those of the client's own invitations
+    INVITATION **watching;
+    int watch_cap;
+    sem_t semaphore_block;
+    //held for the whole of a send so packets don't interleave on the wire
+    sem_t send_block;
+    //takes the packets instead of the connection, if there is none (a bot)
+    CLIENT_RECEIVER *receiver;
+    void *receiver_arg;
+    //timing of the connection (see client_note_request()): when the kernel
+    //was last asked for the round trip time and what it said (-1 if never);
+    //the lowest lag of a request (arrival less the client's stamp) this
+    //window and last, and the smoothed one-way delay, all in nanoseconds
+    uint64_t rtt_checked;
+    long rtt_ns;
+    uint64_t lag_window;
+    int64_t lag_min, lag_min_prev;
+    int64_t delay_ns;
+    long stamped;
+    //how fast it may make requests; only its servicer touches this
+    RATE_LIMITER limiter;
+}CLIENT;
+
+/*
+ * Fill in a header for a packet originated by the server, with its
+ * multi-byte fields in network byte order as proto_send_packet() expects.
+ * The timestamp is left for stamp().
+ */
+static void init_header(JEUX_PACKET_HEADER *hdr, JEUX_PACKET_TYPE type,
+                        int id, int role, size_t size){
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->type = type;
+    hdr->id = id;
+    hdr->role = role;
+    hdr->size = htons(size);
+}
+
+static uint64_t realtime_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Stamp a header with the time it goes out, on the wall clock so that
+ * clients can compare it with their own (see protocol_ext.h).  Unless
+ * precise stamps were asked for, that is the time the event loop last
+ * woke up, so a MOVED going out to a crowd of spectators costs one read
+ * of the clock rather than one each; threads other than the loop's use
+ * the kernel's coarse clock, which is as cheap but only good to a tick.
+ */
+static void stamp(JEUX_PACKET_HEADER *hdr){
+    struct timespec ts;
+    if(precise_stamps)
+        clock_gettime(CLOCK_REALTIME, &ts);
+    else if(ev_loop_wall_time(&ts) == -1)
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    hdr->timestamp_sec = htonl(ts.tv_sec);
+    hdr->timestamp_nsec = htonl(ts.tv_nsec);
+}
+
+/*
+ * Send a notification (INVITED, MOVED, ENDED, ...) to a client.
+ * payload may be NULL.
+ */
+static int send_notification(CLIENT *client, JEUX_PACKET_TYPE type,
+                             int id, int role, char *payload){
+    JEUX_PACKET_HEADER hdr;
+    init_header(&hdr, type, id, role, payload != NULL ? strlen(payload) : 0);
+    return client_send_packet(client, &hdr, payload);
+}
+
+int client_send_notification(CLIENT *client, JEUX_PACKET_TYPE type, int id, int role,
+                             char *payload){
+    return send_notification(client, type, id, role, payload);
+}
+
+CLIENT *client_create(CLIENT_REGISTRY *creg, int fd){
+    CLIENT *client = calloc(1, sizeof(CLIENT));
+    if(client == NULL)
+        return NULL;
+    client->creg = creg;
+    client->fd = fd;
+    client->ref_count = 1;
+    client->rtt_ns = -1;
+    rl_init(&client->limiter);
+    sem_init(&client->semaphore_block, 0, 1);
+    sem_init(&client->send_block, 0, 1);
+    debug("[%d] CLIENT CREATE %p", fd, client);
+    reftrack_create(REF_CLIENT, client, "client_create");
+    return client;
+}
+
+CLIENT *client_ref(CLIENT *client, char *why){
+    sem_wait(&client->semaphore_block);
+    debug("[%d] (%d->%d) %s", client->fd, client->ref_count, client->ref_count+1, why);
+    client->ref_count++;
+    trace(TRACE_CLIENT_REF, (uintptr_t)client, client->ref_count, 0, why);
+    reftrack_ref(REF_CLIENT, client, why);
+    sem_post(&client->semaphore_block);
+    return client;
+}
+
+void client_unref(CLIENT *client, char *why){
+    sem_wait(&client->semaphore_block);
+    debug("[%d] (%d->%d) %s", client->fd, client->ref_count, client->ref_count-1, why);
+    int left = --client->ref_count;
+    trace(TRACE_CLIENT_UNREF, (uintptr_t)client, left, 0, why);
+    reftrack_unref(REF_CLIENT, client, why);
+    sem_post(&client->semaphore_block);
+    if(left > 0)
+        return;
+    //invitations hold references to their clients, so by now the list is
+    //empty and the player was released at logout
+    if(client->player != NULL)
+        player_unref(client->player, "client freed");
+    free(client->invitations);
+    free(client->watching);
+    sem_destroy(&client->semaphore_block);
+    sem_destroy(&client->send_block);
+    free(client);
+}
+
+int client_login(CLIENT *client, PLAYER *player){
+    //done before taking our own lock, since the lookup visits every client
+    CLIENT *other = creg_lookup(client->creg, player_get_name(player));
+    if(other != NULL){
+        client_unref(other, "login lookup");
+        return -1;
+    }
+    sem_wait(&client->semaphore_block);
+    if(client->player != NULL){
+        sem_post(&client->semaphore_block);
+        return -1;
+    }
+    client->player = player_ref(player, "client login");
+    sem_post(&client->semaphore_block);
+    return 0;
+}
+
+int client_list_invitations(CLIENT *client, int **idsp, INVITATION ***invsp){
+    sem_wait(&client->semaphore_block);
+    int n = 0;
+    for(int i = 0; i < client->inv_cap; i++)
+        if(client->invitations[i] != NULL)
+            n++;
+    int *ids = malloc((n + 1) * sizeof(int));
+    INVITATION **invs = malloc((n + 1) * sizeof(INVITATION *));
+    if(ids == NULL || invs == NULL){
+        sem_post(&client->semaphore_block);
+        free(ids);
+        free(invs);
+        return -1;
+    }
+    n = 0;
+    for(int i = 0; i < client->inv_cap; i++){
+        if(client->invitations[i] == NULL)
+            continue;
+        ids[n] = i;
+        invs[n++] = inv_ref(client->invitations[i], "invitation snapshot");
+    }
+    sem_post(&client->semaphore_block);
+    *idsp = ids;
+    *invsp = invs;
+    return n;
+}
+
+int client_logout(CLIENT *client){
+    sem_wait(&client->semaphore_block);
+    PLAYER *player = client->player;
+    sem_post(&client->semaphore_block);
+    if(player == NULL)
+        return -1;
+
+    int *ids;
+    INVITATION **invs;
+    int n = client_list_invitations(client, &ids, &invs);
+    for(int i = 0; i < n; i++){
+        INVITATION *inv = invs[i];
+        if(inv_get_game(inv) != NULL)
+            client_resign_game(client, ids[i]);
+        else if(inv_get_source(inv) == client)
+            client_revoke_invitation(client, ids[i]);
+        else
+            client_decline_invitation(client, ids[i]);
+        inv_unref(inv, "invitation snapshot");
+    }
+    if(n >= 0){
+        free(ids);
+        free(invs);
+    }
+    n = client_list_watches(client, &ids, &invs);
+    for(int i = 0; i < n; i++){
+        client_unwatch_game(client, ids[i]);
+        inv_unref(invs[i], "watch snapshot");
+    }
+    if(n >= 0){
+        free(ids);
+        free(invs);
+    }
+
+    sem_wait(&client->semaphore_block);
+    client->player = NULL;
+    sem_post(&client->semaphore_block);
+    player_unref(player, "client logout");
+    return 0;
+}
+
+PLAYER *client_get_player(CLIENT *client){
+    return client->player;
+}
+
+int client_get_fd(CLIENT *client){
+    return client->fd;
+}
+
+void client_set_receiver(CLIENT *client, CLIENT_RECEIVER *func, void *arg){
+    client->receiver_arg = arg;
+    client->receiver = func;
+}
+
+int client_send_packet(CLIENT *client, JEUX_PACKET_HEADER *pkt, void *data){
+    if(client->receiver != NULL){
+        client->receiver(client, pkt, data, client->receiver_arg);
+        return 0;
+    }
+    stats_packet_out(pkt->type, data != NULL ? ntohs(pkt->size) : 0);
+    trace(TRACE_PKT_OUT, client->fd, data != NULL ? ntohs(pkt->size) : 0, pkt->type, NULL);
+    sem_wait(&client->send_block);
+    stamp(pkt);
+    int ret = proto_send_packet(client->fd, pkt, data);
+    sem_post(&client->send_block);
+    return ret;
+}
+
+/*
+ * Ask the kernel what it makes the round trip time of a connection, which
+ * TCP measures all the time from the acknowledgements (and timestamp
+ * echoes) of what is sent.
+ */
+static long kernel_rtt_ns(int fd){
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if(fd < 0 || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1
+       || len < offsetof(struct tcp_info, tcpi_rtt) + sizeof(info.tcpi_rtt))
+        return -1;
+    return (long)info.tcpi_rtt * 1000;
+}
+
+void client_set_precise_stamps(int precise){
+    precise_stamps = precise;
+}
+
+RL_VERDICT client_check_rate(CLIENT *client, int type){
+    //the coarse clock is good to a tick, which is plenty for rates per
+    //second, and costs no more than a load from the vDSO
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return rl_check(&client->limiter, type, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+void client_note_request(CLIENT *client, JEUX_PACKET_HEADER *hdr){
+    uint64_t now = realtime_ns();
+    if(client->receiver != NULL)
+        return;
+    long rtt = -1;
+    if(now - client->rtt_checked >= CLIENT_RTT_INTERVAL_NS){
+        if((rtt = kernel_rtt_ns(client->fd)) >= 0)
+            stats_rtt(rtt);
+    }
+    uint64_t sent = (uint64_t)ntohl(hdr->timestamp_sec) * 1000000000 + ntohl(hdr->timestamp_nsec);
+
+    sem_wait(&client->semaphore_block);
+    if(now - client->rtt_checked >= CLIENT_RTT_INTERVAL_NS){
+        client->rtt_checked = now;
+        if(rtt >= 0)
+            client->rtt_ns = rtt;
+    }
+    if(sent == 0){
+        sem_post(&client->semaphore_block);
+        return;
+    }
+    //the lag is the one-way delay plus however far the client's clock is
+    //behind ours; the least lag is taken to be a delay of half the round
+    //trip, which leaves the offset, and then every request's delay follows
+    int64_t lag = (int64_t)(now - sent);
+    if(client->stamped == 0 || now - client->lag_window >= CLIENT_LAG_WINDOW_NS){
+        client->lag_min_prev = client->stamped == 0 ? lag : client->lag_min;
+        client->lag_min = lag;
+        client->lag_window = now;
+    }
+    else if(lag < client->lag_min){
+        client->lag_min = lag;
+    }
+    int64_t base = client->lag_min < client->lag_min_prev ? client->lag_min : client->lag_min_prev;
+    int64_t delay = lag - base + (client->rtt_ns > 0 ? client->rtt_ns / 2 : 0);
+    //smoothed as TCP smooths its round trip time, by 1/8 of each change
+    client->delay_ns = client->stamped++ == 0 ? delay : client->delay_ns + (delay - client->delay_ns) / 8;
+    sem_post(&client->semaphore_block);
+    stats_delay(delay);
+}
+
+int client_get_timing(CLIENT *client, CLIENT_TIMING *timing){
+    sem_wait(&client->semaphore_block);
+    timing->rtt_us = client->rtt_ns >= 0 ? client->rtt_ns / 1000 : -1;
+    timing->stamped = client->stamped;
+    if(client->stamped > 0){
+        int64_t base = client->lag_min < client->lag_min_prev ? client->lag_min : client->lag_min_prev;
+        int64_t half = client->rtt_ns > 0 ? client->rtt_ns / 2 : 0;
+        timing->delay_us = client->delay_ns / 1000;
+        timing->skew_us = (half - base) / 1000;
+    }
+    else{
+        timing->delay_us = timing->skew_us = 0;
+    }
+    sem_post(&client->semaphore_block);
+    return timing->rtt_us >= 0 || timing->stamped > 0 ? 0 : -1;
+}
+
+int client_send_ack(CLIENT *client, void *data, size_t datalen){
+    JEUX_PACKET_HEADER hdr;
+    init_header(&hdr, JEUX_ACK_PKT, 0, 0, datalen);
+    return client_send_packet(client, &hdr, data);
+}
+
+int client_send_nack(CLIENT *client){
+    JEUX_PACKET_HEADER hdr;
+    init_header(&hdr, JEUX_NACK_PKT, 0, 0, 0);
+    return client_send_packet(client, &hdr, NULL);
+}
+
+int client_add_invitation(CLIENT *client, INVITATION *inv){
+    sem_wait(&client->semaphore_block);
+    int id;
+    for(id = 0; id < client->inv_cap; id++)
+        if(client->invitations[id] == NULL)
+            break;
+    if(id == client->inv_cap){
+        int cap = client->inv_cap ? 2 * client->inv_cap : 8;
+        if(cap > CLIENT_MAX_INVITATIONS)
+            cap = CLIENT_MAX_INVITATIONS;
+        INVITATION **grown = id < cap
+            ? realloc(client->invitations, cap * sizeof(INVITATION *)) : NULL;
+        if(grown == NULL){
+            sem_post(&client->semaphore_block);
+            return -1;
+        }
+        memset(grown + client->inv_cap, 0, (cap - client->inv_cap) * sizeof(INVITATION *));
+        client->invitations = grown;
+        client->inv_cap = cap;
+    }
+    client->invitations[id] = inv_ref(inv, "added to client's list");
+    sem_post(&client->semaphore_block);
+    return id;
+}
+
+int client_restore_invitation(CLIENT *client, INVITATION *inv, int id){
+    sem_wait(&client->semaphore_block);
+    if(id < 0 || id >= CLIENT_MAX_INVITATIONS){
+        sem_post(&client->semaphore_block);
+        return -1;
+    }
+    if(id >= client->inv_cap){
+        int cap = client->inv_cap ? client->inv_cap : 8;
+        while(cap <= id)
+            cap *= 2;
+        INVITATION **grown = realloc(client->invitations, cap * sizeof(INVITATION *));
+        if(grown == NULL){
+            sem_post(&client->semaphore_block);
+            return -1;
+        }
+        memset(grown + client->inv_cap, 0, (cap - client->inv_cap) * sizeof(INVITATION *));
+        client->invitations = grown;
+        client->inv_cap = cap;
+    }
+    if(client->invitations[id] != NULL){
+        sem_post(&client->semaphore_block);
+        return -1;
+    }
+    client->invitations[id] = inv_ref(inv, "restored to client's list");
+    sem_post(&client->semaphore_block);
+    return 0;
+}
+
+int client_remove_invitation(CLIENT *client, INVITATION *inv){
+    sem_wait(&client->semaphore_block);
+    int id;
+    for(id = 0; id < client->inv_cap; id++)
+        if(client->invitations[id] == inv)
+            break;
+    if(id == client->inv_cap){
+        sem_post(&client->semaphore_block);
+        return -1;
+    }
+    client->invitations[id] = NULL;
+    sem_post(&client->semaphore_block);
+    inv_unref(inv, "removed from client's list");
+    return id;
+}
+
+INVITATION *client_get_invitation(CLIENT *client, int id){
+    INVITATION *inv = NULL;
+    sem_wait(&client->semaphore_block);
+    if(id >= 0 && id < client->inv_cap && client->invitations[id] != NULL)
+        inv = inv_ref(client->invitations[id], "looked up by id");
+    sem_post(&client->semaphore_block);
+    return inv;
+}
+
+int client_invitation_id(CLIENT *client, INVITATION *inv){
+    int id = -1;
+    sem_wait(&client->semaphore_block);
+    for(int i = 0; i < client->inv_cap; i++){
+        if(client->invitations[i] == inv){
+            id = i;
+            break;
+        }
+    }
+    sem_post(&client->semaphore_block);
+    return id;
+}
+
+static CLIENT *opponent_of(INVITATION *inv, CLIENT *client){
+    return inv_get_source(inv) == client ? inv_get_target(inv) : inv_get_source(inv);
+}
+
+static GAME_ROLE role_of(INVITATION *inv, CLIENT *client){
+    return inv_get_source(inv) == client ? inv_get_source_role(inv)
+                                         : inv_get_target_role(inv);
+}
+
+/*
+ * A packet on its way to every spectator of a game: the header is filled
+ * in with each spectator's own id, the payload is one buffer for all.
+ */
+typedef struct broadcast {
+    JEUX_PACKET_TYPE type;
+    int role;
+    PROTO_BUF *buf;
+} BROADCAST;
+
+static void send_to_watcher(CLIENT *client, int id, void *arg){
+    BROADCAST *b = arg;
+    JEUX_PACKET_HEADER hdr;
+    init_header(&hdr, b->type, id, b->role, b->buf->len);
+    if(client->receiver != NULL){
+        client->receiver(client, &hdr, b->buf->len > 0 ? b->buf->data : NULL, client->receiver_arg);
+        return;
+    }
+    stats_packet_out(hdr.type, b->buf->len);
+    trace(TRACE_PKT_OUT, client->fd, b->buf->len, hdr.type, NULL);
+    sem_wait(&client->send_block);
+    stamp(&hdr);
+    proto_send_shared(client->fd, &hdr, b->buf);
+    sem_post(&client->send_block);
+}
+
+/*
+ * Send a notification to all the spectators of a game.  payload may be
+ * NULL.
+ */
+static void notify_watchers(INVITATION *inv, JEUX_PACKET_TYPE type, int role, char *payload){
+    BROADCAST b = { type, role, NULL };
+    b.buf = proto_buf_create(payload, payload != NULL ? strlen(payload) : 0);
+    if(b.buf == NULL)
+        return;
+    inv_for_each_watcher(inv, send_to_watcher, &b);
+    proto_buf_unref(b.buf);
+}
+
+/*
+ * Take a spectator's id for a game out of its list.
+ */
+static int remove_watch(CLIENT *client, INVITATION *inv){
+    sem_wait(&client->semaphore_block);
+    int id;
+    for(id = 0; id < client->watch_cap; id++)
+        if(client->watching[id] == inv)
+            break;
+    if(id == client->watch_cap){
+        sem_post(&client->semaphore_block);
+        return -1;
+    }
+    client->watching[id] = NULL;
+    sem_post(&client->semaphore_block);
+    inv_unref(inv, "removed from client's watch list");
+    return id;
+}
+
+/*
+ * A game is over: its spectators get ENDED with the winner, and it is no
+ * longer theirs to watch.
+ */
+static void end_watching(INVITATION *inv, GAME_ROLE winner){
+    notify_watchers(inv, JEUX_ENDED_PKT, winner, NULL);
+    int n;
+    INV_WATCHER *watchers = inv_take_watchers(inv, &n);
+    for(int i = 0; i < n; i++){
+        remove_watch(watchers[i].client, inv);
+        client_unref(watchers[i].client, "game over for watcher");
+    }
+    free(watchers);
+}
+
+/*
+ * Put a finished game in the journal, if there is one.  A game between
+ * nodes of a cluster is played on both, and goes in the journal of the
+ * one where the invitation was made.
+ */
+static void journal_game(INVITATION *inv, GAME_ROLE winner, int aborted){
+    if(journal == NULL || (cluster != NULL && cluster_is_proxy(cluster, inv_get_source(inv))))
+        return;
+    PLAYER *sp = client_get_player(inv_get_source(inv));
+    PLAYER *tp = client_get_player(inv_get_target(inv));
+    char *sname = sp != NULL ? player_get_name(sp) : NULL;
+    char *tname = tp != NULL ? player_get_name(tp) : NULL;
+    int source_first = inv_get_source_role(inv) == FIRST_PLAYER_ROLE;
+    int nmoves;
+    char **moves = inv_get_moves(inv, &nmoves);
+    journal_record(journal, source_first ? sname : tname, source_first ? tname : sname,
+                   winner, aborted, moves, nmoves);
+}
+
+/*
+ * Wrap up a game that has just ended (by a move, a resignation or an
+ * abort): the invitation leaves both lists, each player gets ENDED with
+ * the winner, the game goes in the journal, the result is posted if
+ * there was one to post, and whoever arranged the game is told.
+ */
+static void finish_game(INVITATION *inv, int post){
+    CLIENT *source = inv_get_source(inv);
+    CLIENT *target = inv_get_target(inv);
+    GAME *game = inv_get_game(inv);
+    GAME_ROLE winner = post ? game_get_winner(game) : NULL_ROLE;
+    journal_game(inv, winner, !post);
+    int sid = client_remove_invitation(source, inv);
+    int tid = client_remove_invitation(target, inv);
+    if(sid >= 0)
+        send_notification(source, JEUX_ENDED_PKT, sid, winner, NULL);
+    if(tid >= 0)
+        send_notification(target, JEUX_ENDED_PKT, tid, winner, NULL);
+    end_watching(inv, winner);
+
+    PLAYER *sp = client_get_player(source);
+    PLAYER *tp = client_get_player(target);
+    if(post && sp != NULL && tp != NULL){
+        if(inv_get_source_role(inv) == FIRST_PLAYER_ROLE)
+            player_post_result(sp, tp, winner);
+        else
+            player_post_result(tp, sp, winner);
+    }
+    inv_report_result(inv, winner, !post);
+}
+
+void client_set_time_control(uint64_t base_ms, uint64_t increment_ms){
+    clock_base_ms = base_ms;
+    clock_increment_ms = increment_ms;
+}
+
+/*
+ * Called when a player runs out of time: the game is resigned on their
+ * behalf, so it ends just as if they had resigned it, except that the
+ * opponent gets nothing but the ENDED.
+ */
+static void flag_fallen(GAME_CLOCK *clock, GAME_ROLE role, void *arg){
+    INVITATION *inv = inv_ref(arg, "flag fell");
+    debug("out of time: role %d", role);
+    if(inv_close(inv, role) == 0)
+        finish_game(inv, 1);
+    inv_unref(inv, "flag fell");
+}
+
+int client_start_clock(INVITATION *inv, uint64_t first_ms, uint64_t second_ms,
+                       uint64_t increment_ms, GAME_ROLE to_move){
+    GAME_CLOCK *clock = gclock_create(first_ms, second_ms, increment_ms, flag_fallen, inv);
+    if(clock == NULL)
+        return -1;
+    if(inv_set_clock(inv, clock) == -1){
+        gclock_free(clock);
+        return -1;
+    }
+    return gclock_start(clock, to_move);
+}
+
+/*
+ * Start the clock of a game that has just been accepted, if games are
+ * timed.
+ */
+static void start_game_clock(INVITATION *inv){
+    if(clock_base_ms > 0 && client_start_clock(inv, clock_base_ms, clock_base_ms,
+                                                clock_increment_ms, FIRST_PLAYER_ROLE) == -1)
+        debug("no clock for this game");
+}
+
+void client_set_invitation_ttl(uint64_t ms){
+    invitation_ttl_ms = ms;
+}
+
+/*
+ * Called when an invitation has been open too long: it is withdrawn from
+ * both sides, just as if the source had revoked it and the target had
+ * declined it at once, so each gets the notification they would have.
+ */
+static void invitation_expired(INVITATION *inv, void *arg){
+    inv = inv_ref(inv, "invitation expired");
+    CLIENT *source = inv_get_source(inv);
+    CLIENT *target = inv_get_target(inv);
+    if(inv_close(inv, NULL_ROLE) == 0){
+        stats_add(STAT_INVITATIONS_EXPIRED, 1);
+        int sid = client_remove_invitation(source, inv);
+        int tid = client_remove_invitation(target, inv);
+        if(tid >= 0)
+            send_notification(target, JEUX_REVOKED_PKT, tid, 0, NULL);
+        if(sid >= 0)
+            send_notification(source, JEUX_DECLINED_PKT, sid, 0, NULL);
+    }
+    inv_unref(inv, "invitation expired");
+}
+
+int client_start_expiry(INVITATION *inv){
+    if(invitation_ttl_ms == 0)
+        return 0;
+    return inv_set_expiry(inv, invitation_ttl_ms, invitation_expired, NULL);
+}
+
+int client_make_invitation(CLIENT *source, CLIENT *target,
+                           GAME_ROLE source_role, GAME_ROLE target_role){
+    if(source == target || client_get_player(source) == NULL
+       || client_get_player(target) == NULL)
+        return -1;
+    INVITATION *inv = inv_create(source, target, source_role, target_role);
+    if(inv == NULL)
+        return -1;
+    int sid = client_add_invitation(source, inv);
+    int tid = sid >= 0 ? client_add_invitation(target, inv) : -1;
+    if(tid < 0){
+        if(sid >= 0)
+            client_remove_invitation(source, inv);
+        inv_unref(inv, "invitation not made");
+        return -1;
+    }
+    if(client_start_expiry(inv) == -1)
+        debug("invitation will not expire");
+    send_notification(target, JEUX_INVITED_PKT, tid, target_role,
+                      player_get_name(client_get_player(source)));
+    inv_unref(inv, "invitation made");
+    return sid;
+}
+
+int client_revoke_invitation(CLIENT *client, int id){
+    INVITATION *inv = client_get_invitation(client, id);
+    if(inv == NULL)
+        return -1;
+    CLIENT *target = inv_get_target(inv);
+    if(inv_get_source(inv) != client || inv_close(inv, NULL_ROLE) == -1){
+        inv_unref(inv, "revoke failed");
+        return -1;
+    }
+    client_remove_invitation(client, inv);
+    int tid = client_remove_invitation(target, inv);
+    if(tid >= 0)
+        send_notification(target, JEUX_REVOKED_PKT, tid, 0, NULL);
+    inv_unref(inv, "revoked");
+    return 0;
+}
+
+int client_decline_invitation(CLIENT *client, int id){
+    INVITATION *inv = client_get_invitation(client, id);
+    if(inv == NULL)
+        return -1;
+    CLIENT *source = inv_get_source(inv);
+    if(inv_get_target(inv) != client || inv_close(inv, NULL_ROLE) == -1){
+        inv_unref(inv, "decline failed");
+        return -1;
+    }
+    client_remove_invitation(client, inv);
+    int sid = client_remove_invitation(source, inv);
+    if(sid >= 0)
+        send_notification(source, JEUX_DECLINED_PKT, sid, 0, NULL);
+    inv_unref(inv, "declined");
+    return 0;
+}
+
+int client_accept_invitation(CLIENT *client, int id, char **strp){
+    INVITATION *inv = client_get_invitation(client, id);
+    if(inv == NULL)
+        return -1;
+    if(inv_get_target(inv) != client || inv_accept(inv) == -1){
+        inv_unref(inv, "accept failed");
+        return -1;
+    }
+    start_game_clock(inv);
+    CLIENT *source = inv_get_source(inv);
+    char *state = game_unparse_state(inv_get_game(inv));
+    //whoever moves first gets the initial state: the source with ACCEPTED,
+    //the target with the ACK the caller sends
+    int source_first = inv_get_source_role(inv) == FIRST_PLAYER_ROLE;
+    int sid = client_invitation_id(source, inv);
+    if(sid >= 0)
+        send_notification(source, JEUX_ACCEPTED_PKT, sid, 0, source_first ? state : NULL);
+    if(source_first){
+        free(state);
+        state = NULL;
+    }
+    *strp = state;
+    inv_unref(inv, "accepted");
+    return 0;
+}
+
+int client_make_match(CLIENT *first, CLIENT *second){
+    return client_make_game(first, second, NULL, NULL);
+}
+
+int client_make_game(CLIENT *first, CLIENT *second, INV_RESULT_FUNC *func, void *arg){
+    PLAYER *fp = client_get_player(first);
+    PLAYER *sp = client_get_player(second);
+    if(first == second || fp == NULL || sp == NULL)
+        return -1;
+    INVITATION *inv = inv_create(first, second, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE);
+    if(inv == NULL)
+        return -1;
+    int fid = client_add_invitation(first, inv);
+    int sid = fid >= 0 ? client_add_invitation(second, inv) : -1;
+    if(sid < 0 || inv_accept(inv) == -1){
+        if(fid >= 0)
+            client_remove_invitation(first, inv);
+        if(sid >= 0)
+            client_remove_invitation(second, inv);
+        inv_unref(inv, "match not made");
+        return -1;
+    }
+    if(func != NULL)
+        inv_set_result_func(inv, func, arg);
+    start_game_clock(inv);
+    send_notification(first, JEUX_INVITED_PKT, fid, FIRST_PLAYER_ROLE, player_get_name(sp));
+    send_notification(second, JEUX_INVITED_PKT, sid, SECOND_PLAYER_ROLE, player_get_name(fp));
+    char *state = game_unparse_state(inv_get_game(inv));
+    send_notification(first, JEUX_ACCEPTED_PKT, fid, 0, state);
+    send_notification(second, JEUX_ACCEPTED_PKT, sid, 0, NULL);
+    free(state);
+    inv_unref(inv, "match made");
+    return 0;
+}
+
+int client_resign_game(CLIENT *client, int id){
+    INVITATION *inv = client_get_invitation(client, id);
+    if(inv == NULL)
+        return -1;
+    if(inv_get_game(inv) == NULL || inv_close(inv, role_of(inv, client)) == -1){
+        inv_unref(inv, "resign failed");
+        return -1;
+    }
+    CLIENT *opponent = opponent_of(inv, client);
+    int oid = client_invitation_id(opponent, inv);
+    if(oid >= 0)
+        send_notification(opponent, JEUX_RESIGNED_PKT, oid, 0, NULL);
+    finish_game(inv, 1);
+    inv_unref(inv, "resigned");
+    return 0;
+}
+
+int client_make_move(CLIENT *client, int id, char *move){
+    INVITATION *inv = client_get_invitation(client, id);
+    if(inv == NULL)
+        return -1;
+    GAME *game = inv_get_game(inv);
+    GAME_ROLE role = role_of(inv, client);
+    //a player whose time is up can't move, even if the flag hasn't quite
+    //fallen yet
+    GAME_CLOCK *clock = inv_get_clock(inv);
+    if(clock != NULL && (gclock_running(clock) != role || gclock_remaining(clock, role) == 0)){
+        inv_unref(inv, "move out of time");
+        return -1;
+    }
+    GAME_MOVE *gm = game != NULL ? game_parse_move(game, role, move) : NULL;
+    if(gm == NULL || game_apply_move(game, gm) == -1){
+        free(gm);
+        inv_unref(inv, "move failed");
+        return -1;
+    }
+    if(clock != NULL)
+        gclock_press(clock, role);
+    char *played = game_unparse_move(gm);
+    if(played != NULL)
+        inv_record_move(inv, played);
+    free(played);
+    free(gm);
+
+    CLIENT *opponent = opponent_of(inv, client);
+    int oid = client_invitation_id(opponent, inv);
+    char *state = game_unparse_state(game);
+    if(oid >= 0)
+        send_notification(opponent, JEUX_MOVED_PKT, oid, 0, state);
+    notify_watchers(inv, JEUX_MOVED_PKT, role, state);
+    free(state);
+
+    if(game_is_over(game) && inv_close(inv, NULL_ROLE) == 0)
+        finish_game(inv, 1);
+    inv_unref(inv, "moved");
+    return 0;
+}
+
+int client_end_game(CLIENT *client, int id, GAME_ROLE loser){
+    INVITATION *inv = client_get_invitation(client, id);
+    if(inv == NULL)
+        return -1;
+    int ret = -1;
+    if(inv_get_game(inv) != NULL){
+        if(loser == NULL_ROLE && inv_abort(inv) == 0){
+            finish_game(inv, 0);
+            ret = 0;
+        }
+        else if(loser != NULL_ROLE && inv_close(inv, loser) == 0){
+            finish_game(inv, 1);
+            ret = 0;
+        }
+    }
+    inv_unref(inv, "game ended");
+    return ret;
+}
+
+int client_end_games(CLIENT *client){
+    int *ids;
+    INVITATION **invs;
+    int n = client_list_invitations(client, &ids, &invs);
+    if(n < 0)
+        return -1;
+    int ended = 0;
+    for(int i = 0; i < n; i++){
+        //the opponent may have gotten here first
+        if(inv_get_game(invs[i]) != NULL && inv_abort(invs[i]) == 0){
+            finish_game(invs[i], 0);
+            ended++;
+        }
+        inv_unref(invs[i], "invitation snapshot");
+    }
+    free(ids);
+    free(invs);
+    return ended;
+}
+
+/*
+ * Put a game in a spectator's watch list, under the given id or, if id is
+ * -1, the first free one.
+ */
+static int add_watch(CLIENT *client, INVITATION *inv, int id){
+    sem_wait(&client->semaphore_block);
+    int free_id = -1;
+    for(int i = 0; i < client->watch_cap; i++){
+        if(client->watching[i] == inv){
+            sem_post(&client->semaphore_block);
+            return -1;
+        }
+        if(client->watching[i] == NULL && free_id == -1)
+            free_id = i;
+    }
+    if(id == -1)
+        id = free_id != -1 ? free_id : client->watch_cap;
+    if(id < 0 || id >= CLIENT_MAX_INVITATIONS){
+        sem_post(&client->semaphore_block);
+        return -1;
+    }
+    if(id >= client->watch_cap){
+        int cap = client->watch_cap ? client->watch_cap : 8;
+        while(cap <= id)
+            cap *= 2;
+        if(cap > CLIENT_MAX_INVITATIONS)
+            cap = CLIENT_MAX_INVITATIONS;
+        INVITATION **grown = realloc(client->watching, cap * sizeof(INVITATION *));
+        if(grown == NULL){
+            sem_post(&client->semaphore_block);
+            return -1;
+        }
+        memset(grown + client->watch_cap, 0, (cap - client->watch_cap) * sizeof(INVITATION *));
+        client->watching = grown;
+        client->watch_cap = cap;
+    }
+    if(client->watching[id] != NULL){
+        sem_post(&client->semaphore_block);
+        return -1;
+    }
+    client->watching[id] = inv_ref(inv, "added to client's watch list");
+    sem_post(&client->semaphore_block);
+    return id;
+}
+
+/*
+ * Start watching a game under a given id (or the first free one if id is
+ * -1), as long as it is in progress.
+ */
+static int watch(CLIENT *client, INVITATION *inv, int id){
+    if(inv_get_source(inv) == client || inv_get_target(inv) == client)
+        return -1;
+    id = add_watch(client, inv, id);
+    if(id < 0)
+        return -1;
+    if(inv_add_watcher(inv, client, id) == -1){
+        remove_watch(client, inv);
+        return -1;
+    }
+    return id;
+}
+
+int client_watch_game(CLIENT *client, CLIENT *player, char **strp){
+    int *ids;
+    INVITATION **invs;
+    int n = client_list_invitations(player, &ids, &invs);
+    if(n < 0)
+        return -1;
+    //the player's game in progress with the lowest id, if there is one
+    int id = -1;
+    for(int i = 0; i < n; i++){
+        GAME *game = inv_get_game(invs[i]);
+        if(id == -1 && game != NULL && !game_is_over(game)
+           && (id = watch(client, invs[i], -1)) >= 0)
+            *strp = game_unparse_state(game);
+        inv_unref(invs[i], "invitation snapshot");
+    }
+    free(ids);
+    free(invs);
+    return id;
+}
+
+int client_unwatch_game(CLIENT *client, int id){
+    INVITATION *inv = NULL;
+    sem_wait(&client->semaphore_block);
+    if(id >= 0 && id < client->watch_cap && client->watching[id] != NULL){
+        inv = client->watching[id];
+        client->watching[id] = NULL;
+    }
+    sem_post(&client->semaphore_block);
+    if(inv == NULL)
+        return -1;
+    inv_remove_watcher(inv, client);
+    inv_unref(inv, "removed from client's watch list");
+    return 0;
+}
+
+int client_list_watches(CLIENT *client, int **idsp, INVITATION ***invsp){
+    sem_wait(&client->semaphore_block);
+    int n = 0;
+    for(int i = 0; i < client->watch_cap; i++)
+        if(client->watching[i] != NULL)
+            n++;
+    int *ids = malloc((n + 1) * sizeof(int));
+    INVITATION **invs = malloc((n + 1) * sizeof(INVITATION *));
+    if(ids == NULL || invs == NULL){
+        sem_post(&client->semaphore_block);
+        free(ids);
+        free(invs);
+        return -1;
+    }
+    n = 0;
+    for(int i = 0; i < client->watch_cap; i++){
+        if(client->watching[i] == NULL)
+            continue;
+        ids[n] = i;
+        invs[n++] = inv_ref(client->watching[i], "watch snapshot");
+    }
+    sem_post(&client->semaphore_block);
+    *idsp = ids;
+    *invsp = invs;
+    return n;
+}
+
+int client_restore_watch(CLIENT *client, INVITATION *inv, int id){
+    return id >= 0 && watch(client, inv, id) == id ? 0 : -1;
+}
@@ -5,18 +5,24 @@
 #include "debug.h"
 #include "csapp.h"
 #include "client_registry.h"
+#include "client_registry_ext.h"
+#include "stats.h"
 
 //struct
 //double check what things to add and shit
 typedef struct client_registry {
-    //max number of clients is 64
-    CLIENT *clients[MAX_CLIENTS];
+    //starts out with MAX_CLIENTS slots and doubles whenever it fills up,
+    //so the event loop isn't capped at 64 connections
+    CLIENT **clients;
+    unsigned int capacity;
     //name variable? (make it the username it's logined under)
     //how do i set this though
     //char *name;
     //unsigned int client_index;
     unsigned int client_count;
     sem_t semaphore_block;
+    //threads blocked in creg_wait_for_empty(), each waiting for a post
+    unsigned int empty_waiters;
     sem_t empty_sem;
 }CLIENT_REGISTRY;
 
@@ -29,10 +35,19 @@ typedef struct client_registry {
 CLIENT_REGISTRY *creg_init(){
     debug("CREG INIT ENTER");
     CLIENT_REGISTRY *new_reg = malloc(sizeof(CLIENT_REGISTRY));
+    if(new_reg == NULL)
+        return NULL;
+    new_reg->capacity = MAX_CLIENTS;
+    new_reg->clients = malloc(MAX_CLIENTS * sizeof(CLIENT *));
+    if(new_reg->clients == NULL){
+        free(new_reg);
+        return NULL;
+    }
     //(semaphore address, 0 b/c shared btwn threads not processes,init value for how many threads are running at the same time)
     sem_init(&((*new_reg).semaphore_block),0,1);
     sem_init(&((*new_reg).empty_sem),0,0);
     new_reg->client_count=0;
+    new_reg->empty_waiters=0;
     //how do i set the name variable
 
     //go through array and set values
@@ -57,9 +72,9 @@ CLIENT_REGISTRY *creg_init(){
  */
 void creg_fini(CLIENT_REGISTRY *cr){
     debug("CREG FINI");
-    // sem_wait(&(cr->empty_sem));
-    // sem_destroy(&(cr->semaphore_block));
-    // sem_destroy(&(cr->empty_sem));
+    sem_destroy(&(cr->semaphore_block));
+    sem_destroy(&(cr->empty_sem));
+    free(cr->clients);
     free(cr);
 }
 
@@ -79,11 +94,26 @@ CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd){
     sem_wait(&(cr->semaphore_block));
     CLIENT *newClient = client_create(cr,fd);
     if (newClient == NULL) {
+        sem_post(&(cr->semaphore_block));
         return NULL;
     }
 
-    int i;
-    for (i = 0; i < MAX_CLIENTS; i++) {
+    //no free slot left, so double the table
+    if (cr->client_count == cr->capacity) {
+        CLIENT **grown = realloc(cr->clients, 2 * cr->capacity * sizeof(CLIENT *));
+        if (grown == NULL) {
+            sem_post(&(cr->semaphore_block));
+            client_unref(newClient, "registry full");
+            return NULL;
+        }
+        for (unsigned int j = cr->capacity; j < 2 * cr->capacity; j++)
+            grown[j] = NULL;
+        cr->clients = grown;
+        cr->capacity *= 2;
+    }
+
+    unsigned int i;
+    for (i = 0; i < cr->capacity; i++) {
         if (cr->clients[i] == NULL) {
             cr->clients[i] = newClient;
             debug("REGISTER cr->clients[%d]: %p\n", i, cr->clients[i]);
@@ -94,9 +124,12 @@ CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd){
     }
 
     //if end of array reached then no space is found
-    if (i == MAX_CLIENTS) {
+    if (i == cr->capacity) {
+        sem_post(&(cr->semaphore_block));
+        client_unref(newClient, "registry full");
         return NULL;
     }
+    stats_add(STAT_CLIENTS, 1);
     //return address of index of array (DOUBLE CHECK THIS)
     //or do i return the newClient itself after putting the fd into the array
     //return &cr->clients[i];
@@ -123,8 +156,8 @@ int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client){
     sem_wait(&(cr->semaphore_block));
     //find matching fd in the thing
     int found = 0;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (client_get_fd(cr->clients[i]) == client_get_fd(client)) {
+    for (unsigned int i = 0; i < cr->capacity; i++) {
+        if (cr->clients[i] == client) {
             cr->clients[i] = NULL;
             cr->client_count--;
             found = 1;
@@ -138,15 +171,16 @@ int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client){
         return -1;
     }
 
+    stats_add(STAT_CLIENTS, -1);
     //unref
     client_unref(client, "Unregister ref--");
 
-    //if # of ref clients is 0, continue
-    if (cr->client_count == 0) { 
-        //DOUBLE CHECK THIS CONDITION
-        //function shall unblock all threads currently blocked on the specified condition variable cond.
-        // pthread_cond_broadcast(&(cr->semaphore_block));
-        sem_post(&cr->empty_sem);
+    //if # of ref clients is 0, let every waiter go (one post each)
+    if (cr->client_count == 0) {
+        while (cr->empty_waiters > 0) {
+            sem_post(&cr->empty_sem);
+            cr->empty_waiters--;
+        }
     }
     sem_post(&(cr->semaphore_block)); 
     debug("CREG UNREG exit");
@@ -167,20 +201,17 @@ CLIENT *creg_lookup(CLIENT_REGISTRY *cr, char *user){
     debug("CREG LOOKUP ENTER");
     CLIENT *foundClient = NULL;
     sem_wait(&(cr->semaphore_block));
-    int i=0;
-    for(; i<MAX_CLIENTS; i++) {
+    for(unsigned int i=0; i<cr->capacity; i++) {
         // FIND ANOTHER WAY TO COMPARE NAMES OR SOMETHING
+        if(cr->clients[i] == NULL)
+            continue;
         PLAYER *targetPlayer = client_get_player(cr->clients[i]);
-        char *playerName = player_get_name(targetPlayer);
-        if(cr->clients[i] != NULL && strcmp(playerName, user) == 0) {
+        if(targetPlayer != NULL && strcmp(player_get_name(targetPlayer), user) == 0) {
             foundClient = cr->clients[i];
             foundClient = client_ref(foundClient, "lookup ref++");
             break;
         }
     }
-    if(i==MAX_CLIENTS){
-        return NULL;
-    }
     sem_post(&(cr->semaphore_block));
     debug("CREG LOOKUP EXIT");
 
@@ -196,14 +227,15 @@ CLIENT *creg_lookup(CLIENT_REGISTRY *cr, char *user){
  *
  * @param cr  The registry for which the set of usernames is to be
  * obtained.
- * @return the list of players as a NULL-terminated array of pointers.
+ * @return the list of players as a NULL-terminated array of pointers,
+ * or NULL if memory could not be allocated.
  */
 PLAYER **creg_all_players(CLIENT_REGISTRY *cr){
     debug("CREG ALL PLAYERS ENTER");
     sem_wait(&cr->semaphore_block); // acquire the registry's mutex
 
     int count = 0;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
+    for (unsigned int i = 0; i < cr->capacity; i++) {
         if (cr->clients[i] != NULL) {
             count++;
             debug("Player Count: %d", count);
@@ -211,31 +243,54 @@ PLAYER **creg_all_players(CLIENT_REGISTRY *cr){
     }
 
     PLAYER **players = malloc(sizeof(PLAYER *) * (count + 1)); // allocate array for players
+    if(players == NULL){
+        sem_post(&cr->semaphore_block);
+        return NULL;
+    }
     //PLAYER **players[8056];
     debug("Size of players: %lu bytes\n", sizeof(PLAYER *) * (count + 1));
     int j = 0;
-    for (int i = 0; i < count; i++) {
+    for (unsigned int i = 0; i < cr->capacity; i++) {
         //USE CLIENT_GET_PLAYER HERE ON EACH INDEX
-        debug("client get player at index: %d", i);
+        if (cr->clients[i] == NULL)
+            continue;
         debug("ALL PLAYERS cr->clients[%d]: %p\n", i, cr->clients[i]);
         PLAYER *targetPlayer = client_get_player(cr->clients[i]);
         debug("TARGET PLAYER: %p", targetPlayer);
-        // if (cr->clients[i] != NULL && targetPlayer != NULL) {
         if (targetPlayer != NULL) {
-            players[j++] = targetPlayer;
+            //caller unrefs each entry, so count the reference we hand out
+            players[j++] = player_ref(targetPlayer, "creg_all_players ref++");
             //P(&cr->client[i]->player->mutex); // acquire each player's mutex to increment their ref count
             //do something with the ref count?
 
             //V(&cr->client[i]->player->mutex); // release each player's mutex
         }
     }
-    players[count] = NULL; // mark end of array with NULL pointer
+    players[j] = NULL; // mark end of array with NULL pointer
     sem_post(&cr->semaphore_block); // release the registry's mutex
     debug("CREG ALL PLAYERS ENTER");
 
     return players;
 }
 
+CLIENT **creg_all_clients(CLIENT_REGISTRY *cr){
+    sem_wait(&cr->semaphore_block);
+    //room for every client, logged in or not, saves counting twice
+    CLIENT **clients = malloc(sizeof(CLIENT *) * (cr->client_count + 1));
+    if(clients == NULL){
+        sem_post(&cr->semaphore_block);
+        return NULL;
+    }
+    int j = 0;
+    for(unsigned int i = 0; i < cr->capacity; i++){
+        if(cr->clients[i] != NULL && client_get_player(cr->clients[i]) != NULL)
+            clients[j++] = client_ref(cr->clients[i], "creg_all_clients ref++");
+    }
+    clients[j] = NULL;
+    sem_post(&cr->semaphore_block);
+    return clients;
+}
+
 /*
  * A thread calling this function will block in the call until
  * the number of registered clients has reached zero, at which
@@ -247,7 +302,14 @@ PLAYER **creg_all_players(CLIENT_REGISTRY *cr){
 void creg_wait_for_empty(CLIENT_REGISTRY *cr){
     debug("CREG WAIT EMPTY");
     sem_wait(&(cr->semaphore_block));
-    return;
+    if (cr->client_count == 0) {
+        sem_post(&(cr->semaphore_block));
+        return;
+    }
+    //registered under the lock, so the post can't be missed
+    cr->empty_waiters++;
+    sem_post(&(cr->semaphore_block));
+    sem_wait(&(cr->empty_sem));
 }
 
 /*
@@ -263,7 +325,7 @@ void creg_wait_for_empty(CLIENT_REGISTRY *cr){
 void creg_shutdown_all(CLIENT_REGISTRY *cr){
     debug("CREG SHUTDOWN ALL");
     sem_wait(&(cr->semaphore_block));
-    for (int i=0; i<MAX_CLIENTS; i++)
+    for (unsigned int i=0; i<cr->capacity; i++)
     {
         if(cr->clients[i] != NULL){
             shutdown(client_get_fd(cr->clients[i]), SHUT_RD);
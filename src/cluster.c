@@ -0,0 +1,1476 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "debug.h"
+#include "cluster.h"
+#include "client_registry.h"
+#include "client_ext.h"
+#include "player_registry.h"
+#include "event_loop.h"
+#include "stats.h"
+#include "jeux_globals.h"
+#include "csapp.h"
+
+CLUSTER *cluster;
+
+#define CL_MAX_PAYLOAD   1024     // a name or two, or a move
+#define CL_MAX_BACKLOG   (16 << 20)  // unsent to a node before it is given up on
+#define CL_READ_CHUNK    65536
+#define CL_LISTEN_TRIES  20       // a hot-restarted node waits for the old one to let go
+#define CL_LISTEN_WAIT_US 50000
+
+/*
+ * What the nodes send one another.  Each message is a CL_HEADER, in
+ * network byte order, followed by size bytes of payload: NUL-terminated
+ * strings, as many as the type calls for.  The messages about an
+ * invitation name it by the node where it was made and that node's
+ * number for it.
+ */
+typedef enum cl_type {
+    CL_HELLO = 1,       // role is 1 if the sender has just started
+    CL_REGISTER,        // name; handle is a token for the answer, 0 for none
+    CL_REGISTERED,      // handle is the token
+    CL_TAKEN,           // handle is the token
+    CL_UNREGISTER,      // name
+    CL_INVITE,          // inviter, invitee; role is the invitee's
+    CL_BOUND,           // the invitation has been mirrored
+    CL_ACCEPT,
+    CL_DECLINE,
+    CL_REVOKE,
+    CL_MOVE,            // the move
+    CL_RESIGN,
+    CL_END              // role is the winner, NULL_ROLE for none
+} CL_TYPE;
+
+typedef struct cl_header {
+    uint32_t size;
+    uint8_t type;
+    uint8_t role;
+    uint16_t from;      // the sending node
+    uint32_t origin;    // the node where the invitation was made
+    uint32_t handle;    // that node's number for it
+} CL_HEADER;
+
+/*
+ * The directory, the proxies and the mirrored invitations are each kept
+ * in a chained hash table, which doubles when it gets as full as it has
+ * buckets.  Whatever goes in one starts with a CL_HNODE.
+ */
+typedef struct cl_hnode {
+    struct cl_hnode *next;
+    uint64_t hash;
+} CL_HNODE;
+
+typedef struct cl_table {
+    CL_HNODE **buckets;
+    size_t nbuckets, count;
+} CL_TABLE;
+
+typedef struct cl_proxy CL_PROXY;
+
+/*
+ * An invitation between a local player and a proxy, which is mirrored on
+ * the node of the player the proxy stands in for.
+ */
+typedef struct cl_game {
+    CL_HNODE h;
+    uint32_t origin, handle;
+    int node;                   // the other node, -1 until it is known
+    CL_PROXY *proxy;
+    int id;                     // the proxy's ID for the invitation
+    INVITATION *inv;
+    int settled;                // the other node knows how the game ends
+} CL_GAME;
+
+struct cl_proxy {
+    CL_HNODE h;
+    CLUSTER *cl;
+    char *name;
+    CLIENT *client;
+    CL_GAME **games;            // by the proxy's ID
+    int cap;
+};
+
+typedef struct cl_entry {
+    CL_HNODE h;
+    char *name;
+    int node;
+} CL_ENTRY;
+
+/*
+ * A LOGIN waiting for the name's home to answer.
+ */
+typedef struct cl_pending {
+    uint32_t token;
+    int home;
+    CLIENT *client;
+} CL_PENDING;
+
+/*
+ * A connection from another node.
+ */
+typedef struct cl_link {
+    CLUSTER *cl;
+    int fd;
+    int node;                   // -1 until its first message
+    char *buf;
+    size_t len, cap;
+} CL_LINK;
+
+/*
+ * Another node, as far as sending to it goes.  Messages for it are
+ * appended to its output buffer as they are queued, and the buffer is
+ * written out once per pass of the event loop (see flush()), so that a
+ * busy node's moves, from however many games, go over in a few large
+ * writes rather than one write each.  There is a single connection to
+ * each node, so messages arrive in the order they were queued, and those
+ * about any one game in particular do.
+ */
+typedef struct cl_node {
+    CLUSTER *cl;
+    int index;
+    char *host;
+    int port;
+    int fd;                     // our connection to it, or -1
+    int connecting;             // connect(2) still in progress
+    int waiting;                // for fd to be writable
+    int dirty;                  // has output and is on the dirty list
+    char *out;                  // whole messages, of which
+    size_t out_len, out_sent, out_cap;  // out_sent bytes have been written
+    CL_LINK *in;                // its latest connection to us
+} CL_NODE;
+
+typedef struct cl_point {
+    uint64_t hash;
+    int node;
+} CL_POINT;
+
+/*
+ * A message from this node to itself, waiting to be handled.
+ */
+typedef struct cl_out {
+    struct cl_out *next;
+    size_t len;
+    char data[];
+} CL_OUT;
+
+struct cluster {
+    int self, nnodes;
+    CL_NODE nodes[CL_MAX_NODES];
+    CL_POINT *ring;
+    int npoints;
+    int listenfd;
+    CL_LINK **links;
+    int nlinks;
+    CL_TABLE directory, proxies, games;
+    uint32_t next_handle, next_token;
+    CL_PENDING *pending;
+    int npending, pending_cap;
+    CL_OUT *out_head, *out_tail;
+    int dirty[CL_MAX_NODES];    // nodes with output to write
+    int ndirty;
+    EV_CALL flush;              // posted while there are messages to send
+    int closing;
+    sem_t semaphore_block;
+};
+
+static uint64_t hash_bytes(const void *data, size_t len, uint64_t seed){
+    //FNV-1a, then a finalizer to spread the bits
+    const unsigned char *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+    for(size_t i = 0; i < len; i++){
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t hash_name(const char *name){
+    return hash_bytes(name, strlen(name), 0);
+}
+
+static uint64_t hash_game(uint32_t origin, uint32_t handle){
+    uint32_t key[2] = { origin, handle };
+    return hash_bytes(key, sizeof(key), 0);
+}
+
+static CL_HNODE *table_first(CL_TABLE *t, uint64_t hash){
+    return t->nbuckets == 0 ? NULL : t->buckets[hash & (t->nbuckets - 1)];
+}
+
+static int table_insert(CL_TABLE *t, CL_HNODE *n){
+    if(t->count >= t->nbuckets){
+        size_t nb = t->nbuckets ? 2 * t->nbuckets : 64;
+        CL_HNODE **b = calloc(nb, sizeof(CL_HNODE *));
+        if(b == NULL)
+            return -1;
+        for(size_t i = 0; i < t->nbuckets; i++){
+            CL_HNODE *e = t->buckets[i];
+            while(e != NULL){
+                CL_HNODE *next = e->next;
+                e->next = b[e->hash & (nb - 1)];
+                b[e->hash & (nb - 1)] = e;
+                e = next;
+            }
+        }
+        free(t->buckets);
+        t->buckets = b;
+        t->nbuckets = nb;
+    }
+    CL_HNODE **head = &t->buckets[n->hash & (t->nbuckets - 1)];
+    n->next = *head;
+    *head = n;
+    t->count++;
+    return 0;
+}
+
+static void table_remove(CL_TABLE *t, CL_HNODE *n){
+    CL_HNODE **pp = &t->buckets[n->hash & (t->nbuckets - 1)];
+    while(*pp != NULL && *pp != n)
+        pp = &(*pp)->next;
+    if(*pp != NULL){
+        *pp = n->next;
+        t->count--;
+    }
+}
+
+static int compare_points(const void *a, const void *b){
+    uint64_t x = ((const CL_POINT *)a)->hash, y = ((const CL_POINT *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * The node a name belongs to: the owner of the first point on the ring at
+ * or after the name's hash, going round to the first point if need be.
+ */
+static int home_of(CLUSTER *cl, const char *name){
+    uint64_t h = hash_name(name);
+    int lo = 0, hi = cl->npoints;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(cl->ring[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return cl->ring[lo == cl->npoints ? 0 : lo].node;
+}
+
+static CL_ENTRY *find_entry(CLUSTER *cl, const char *name){
+    uint64_t h = hash_name(name);
+    for(CL_HNODE *n = table_first(&cl->directory, h); n != NULL; n = n->next){
+        CL_ENTRY *e = (CL_ENTRY *)n;
+        if(n->hash == h && strcmp(e->name, name) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static void remove_entry(CLUSTER *cl, CL_ENTRY *e){
+    table_remove(&cl->directory, &e->h);
+    free(e->name);
+    free(e);
+}
+
+static CL_PROXY *find_proxy(CLUSTER *cl, const char *name){
+    uint64_t h = hash_name(name);
+    for(CL_HNODE *n = table_first(&cl->proxies, h); n != NULL; n = n->next){
+        CL_PROXY *p = (CL_PROXY *)n;
+        if(n->hash == h && strcmp(p->name, name) == 0)
+            return p;
+    }
+    return NULL;
+}
+
+static CL_GAME *find_game(CLUSTER *cl, uint32_t origin, uint32_t handle){
+    uint64_t h = hash_game(origin, handle);
+    for(CL_HNODE *n = table_first(&cl->games, h); n != NULL; n = n->next){
+        CL_GAME *g = (CL_GAME *)n;
+        if(g->origin == origin && g->handle == handle)
+            return g;
+    }
+    return NULL;
+}
+
+static CL_GAME *proxy_game(CL_PROXY *p, int id){
+    return id >= 0 && id < p->cap ? p->games[id] : NULL;
+}
+
+/*
+ * Forget a mirrored invitation, once it is over or there is nobody left
+ * to tell about it.  The lock is held.
+ */
+static void drop_game(CLUSTER *cl, CL_GAME *g){
+    table_remove(&cl->games, &g->h);
+    if(proxy_game(g->proxy, g->id) == g)
+        g->proxy->games[g->id] = NULL;
+    if(g->inv != NULL)
+        inv_unref(g->inv, "mirror dropped");
+    free(g);
+}
+
+/*
+ * Start keeping track of a mirrored invitation.  The lock is held.
+ */
+static CL_GAME *add_game(CLUSTER *cl, CL_PROXY *p, int id, uint32_t origin, uint32_t handle,
+                         int node){
+    if(id >= p->cap){
+        int cap = p->cap ? 2 * p->cap : 8;
+        while(cap <= id)
+            cap *= 2;
+        CL_GAME **grown = realloc(p->games, cap * sizeof(CL_GAME *));
+        if(grown == NULL)
+            return NULL;
+        memset(grown + p->cap, 0, (cap - p->cap) * sizeof(CL_GAME *));
+        p->games = grown;
+        p->cap = cap;
+    }
+    CL_GAME *g = calloc(1, sizeof(CL_GAME));
+    if(g == NULL)
+        return NULL;
+    g->h.hash = hash_game(origin, handle);
+    g->origin = origin;
+    g->handle = handle;
+    g->node = node;
+    g->proxy = p;
+    g->id = id;
+    if(table_insert(&cl->games, &g->h) == -1){
+        free(g);
+        return NULL;
+    }
+    p->games[id] = g;
+    return g;
+}
+
+static void flush(EV_CALL *call, void *arg);
+
+/*
+ * Make room for len more bytes of output to a node.  The lock is held.
+ */
+static int reserve(CL_NODE *n, size_t len){
+    if(n->out_cap - n->out_len >= len)
+        return 0;
+    size_t cap = n->out_cap ? n->out_cap : 4096;
+    while(cap - n->out_len < len)
+        cap *= 2;
+    char *grown = realloc(n->out, cap);
+    if(grown == NULL)
+        return -1;
+    n->out = grown;
+    n->out_cap = cap;
+    return 0;
+}
+
+/*
+ * Queue up a message for a node (possibly this one), to go out once
+ * whatever is being done now is finished.  s1 and s2 are the strings of
+ * the payload; either may be NULL.
+ */
+static void queue(CLUSTER *cl, int node, CL_TYPE type, int role, uint32_t origin,
+                  uint32_t handle, const char *s1, const char *s2){
+    if(node < 0 || node >= cl->nnodes || cl->closing)
+        return;
+    size_t l1 = s1 != NULL ? strlen(s1) + 1 : 0;
+    size_t l2 = s2 != NULL ? strlen(s2) + 1 : 0;
+    if(l1 + l2 > CL_MAX_PAYLOAD)
+        return;
+    size_t len = sizeof(CL_HEADER) + l1 + l2;
+    CL_HEADER hdr = {
+        .size = htonl(l1 + l2), .type = type, .role = role, .from = htons(cl->self),
+        .origin = htonl(origin), .handle = htonl(handle)
+    };
+    char *data;
+    CL_OUT *out = NULL;
+    sem_wait(&cl->semaphore_block);
+    if(node == cl->self){
+        if((out = malloc(sizeof(CL_OUT) + len)) == NULL){
+            sem_post(&cl->semaphore_block);
+            return;
+        }
+        out->next = NULL;
+        out->len = len;
+        data = out->data;
+        if(cl->out_tail != NULL)
+            cl->out_tail->next = out;
+        else
+            cl->out_head = out;
+        cl->out_tail = out;
+    }
+    else{
+        CL_NODE *n = &cl->nodes[node];
+        if(reserve(n, len) == -1){
+            sem_post(&cl->semaphore_block);
+            return;
+        }
+        data = n->out + n->out_len;
+        n->out_len += len;
+        if(!n->dirty){
+            n->dirty = 1;
+            cl->dirty[cl->ndirty++] = node;
+        }
+    }
+    memcpy(data, &hdr, sizeof(hdr));
+    if(l1 > 0)
+        memcpy(data + sizeof(hdr), s1, l1);
+    if(l2 > 0)
+        memcpy(data + sizeof(hdr) + l1, s2, l2);
+    sem_post(&cl->semaphore_block);
+    ev_loop_post(&cl->flush);
+}
+
+static CL_PROXY *get_proxy(CLUSTER *cl, const char *name){
+    sem_wait(&cl->semaphore_block);
+    CL_PROXY *p = find_proxy(cl, name);
+    sem_post(&cl->semaphore_block);
+    return p;
+}
+
+static void proxy_receive(CLIENT *client, JEUX_PACKET_HEADER *hdr, void *data, void *arg);
+
+/*
+ * Get the proxy for a remote player, making it if there isn't one yet.
+ *
+ * @return the proxy, or NULL if it could not be made (the name being in
+ * use here, for one).
+ */
+static CL_PROXY *make_proxy(CLUSTER *cl, const char *name){
+    CL_PROXY *p = get_proxy(cl, name);
+    if(p != NULL)
+        return p;
+    p = calloc(1, sizeof(CL_PROXY));
+    if(p == NULL)
+        return NULL;
+    p->h.hash = hash_name(name);
+    p->cl = cl;
+    p->name = strdup(name);
+    //a CLIENT of the registry, for lookups, but not registered in it
+    p->client = client_create(client_registry, -1);
+    PLAYER *player = p->name != NULL ? preg_register(player_registry, p->name) : NULL;
+    if(p->client != NULL)
+        client_set_receiver(p->client, proxy_receive, p);
+    if(player == NULL || p->client == NULL || client_login(p->client, player) == -1){
+        if(player != NULL)
+            player_unref(player, "proxy not logged in");
+        if(p->client != NULL)
+            client_unref(p->client, "proxy not made");
+        free(p->name);
+        free(p);
+        return NULL;
+    }
+    player_unref(player, "reference from preg_register discarded after proxy login");
+    sem_wait(&cl->semaphore_block);
+    if(table_insert(&cl->proxies, &p->h) == -1){
+        sem_post(&cl->semaphore_block);
+        client_logout(p->client);
+        client_unref(p->client, "proxy not made");
+        free(p->name);
+        free(p);
+        return NULL;
+    }
+    sem_post(&cl->semaphore_block);
+    debug("CLUSTER proxy %p for %s", p, name);
+    return p;
+}
+
+/*
+ * The receiver for a proxy's CLIENT: what it is sent is what the player
+ * it stands in for has to be told about, so it becomes a message to the
+ * node that player is on.
+ */
+static void proxy_receive(CLIENT *client, JEUX_PACKET_HEADER *hdr, void *data, void *arg){
+    CL_PROXY *p = arg;
+    CLUSTER *cl = p->cl;
+    if(cl->closing)
+        return;
+    if(hdr->type == JEUX_INVITED_PKT){
+        //a local player invites the remote one: the invitation is ours
+        INVITATION *inv = client_get_invitation(client, hdr->id);
+        size_t size = ntohs(hdr->size);
+        char *from = data != NULL ? strndup(data, size) : NULL;
+        sem_wait(&cl->semaphore_block);
+        uint32_t handle = ++cl->next_handle;
+        CL_GAME *g = inv != NULL && from != NULL
+            ? add_game(cl, p, hdr->id, cl->self, handle, -1) : NULL;
+        if(g != NULL)
+            g->inv = inv;
+        sem_post(&cl->semaphore_block);
+        if(g != NULL)
+            queue(cl, home_of(cl, p->name), CL_INVITE, hdr->role, cl->self, handle, from, p->name);
+        else if(inv != NULL)
+            inv_unref(inv, "invitation not mirrored");
+        free(from);
+        return;
+    }
+
+    sem_wait(&cl->semaphore_block);
+    CL_GAME *g = proxy_game(p, hdr->id);
+    if(g == NULL){
+        sem_post(&cl->semaphore_block);
+        return;
+    }
+    int node = g->node;
+    uint32_t origin = g->origin, handle = g->handle;
+    CL_TYPE type = 0;
+    int role = 0;
+    char *move = NULL;
+    switch(hdr->type){
+        case JEUX_ACCEPTED_PKT:
+            type = CL_ACCEPT;
+            break;
+        case JEUX_DECLINED_PKT:
+        case JEUX_REVOKED_PKT:
+            type = hdr->type == JEUX_DECLINED_PKT ? CL_DECLINE : CL_REVOKE;
+            drop_game(cl, g);
+            break;
+        case JEUX_MOVED_PKT: {
+            int n;
+            char **moves = inv_get_moves(g->inv, &n);
+            if(n > 0 && (move = strdup(moves[n - 1])) != NULL)
+                type = CL_MOVE;
+            break;
+        }
+        case JEUX_RESIGNED_PKT:
+            if(!g->settled)
+                type = CL_RESIGN;
+            g->settled = 1;
+            break;
+        case JEUX_ENDED_PKT: {
+            //ended by a move or a resignation, it ended over there too
+            GAME *game = inv_get_game(g->inv);
+            if(!g->settled && (game == NULL || !game_is_over(game))){
+                type = CL_END;
+                role = hdr->role;
+            }
+            drop_game(cl, g);
+            break;
+        }
+        default:
+            break;
+    }
+    sem_post(&cl->semaphore_block);
+    if(type != 0)
+        queue(cl, node, type, role, origin, handle, move, NULL);
+    free(move);
+}
+
+static void disconnect(CLUSTER *cl, CL_NODE *n);
+
+/*
+ * Get rid of everything to do with a node that has gone away (or come
+ * back as a new process): its players are forgotten, their invitations
+ * and games with ours ended without a result, and the logins waiting for
+ * it to answer refused.
+ */
+static void node_gone(CLUSTER *cl, int node){
+    //and if it is there again, it is to be connected to anew
+    disconnect(cl, &cl->nodes[node]);
+    sem_wait(&cl->semaphore_block);
+    for(size_t i = 0; i < cl->directory.nbuckets; i++){
+        CL_HNODE *n = cl->directory.buckets[i];
+        while(n != NULL){
+            CL_HNODE *next = n->next;
+            if(((CL_ENTRY *)n)->node == node)
+                remove_entry(cl, (CL_ENTRY *)n);
+            n = next;
+        }
+    }
+    //the games are ended once the lock is let go, their mirrors dropped
+    //first so that nothing is sent back
+    int ngames = 0;
+    struct { CLIENT *client; int id; INVITATION *inv; } *ended =
+        malloc((cl->games.count + 1) * sizeof(*ended));
+    for(size_t i = 0; i < cl->games.nbuckets && ended != NULL; i++){
+        CL_HNODE *n = cl->games.buckets[i];
+        while(n != NULL){
+            CL_HNODE *next = n->next;
+            CL_GAME *g = (CL_GAME *)n;
+            if(g->node == node){
+                ended[ngames].client = client_ref(g->proxy->client, "node gone");
+                ended[ngames].id = g->id;
+                ended[ngames++].inv = inv_ref(g->inv, "node gone");
+                drop_game(cl, g);
+            }
+            n = next;
+        }
+    }
+    int npending = 0;
+    CL_PENDING *refused = malloc((cl->npending + 1) * sizeof(CL_PENDING));
+    for(int i = 0; i < cl->npending && refused != NULL; ){
+        if(cl->pending[i].home == node){
+            refused[npending++] = cl->pending[i];
+            cl->pending[i] = cl->pending[--cl->npending];
+        }
+        else{
+            i++;
+        }
+    }
+    sem_post(&cl->semaphore_block);
+
+    for(int i = 0; i < ngames; i++){
+        CLIENT *proxy = ended[i].client;
+        INVITATION *inv = ended[i].inv;
+        if(inv_get_game(inv) != NULL)
+            client_end_game(proxy, ended[i].id, NULL_ROLE);
+        else if(inv_get_source(inv) == proxy)
+            client_revoke_invitation(proxy, ended[i].id);
+        else
+            client_decline_invitation(proxy, ended[i].id);
+        inv_unref(inv, "node gone");
+        client_unref(proxy, "node gone");
+    }
+    for(int i = 0; i < npending; i++){
+        client_logout(refused[i].client);
+        client_send_nack(refused[i].client);
+        client_unref(refused[i].client, "login refused");
+    }
+    free(ended);
+    free(refused);
+    if(ngames > 0 || npending > 0)
+        debug("CLUSTER node %d gone: %d invitations ended, %d logins refused",
+              node, ngames, npending);
+}
+
+/*
+ * An invitation has come to the node where the invitee is (or says it
+ * is): it is made again here, by a proxy for the inviter.
+ */
+static void mirror_invitation(CLUSTER *cl, CL_HEADER *hdr, char *from, char *to){
+    GAME_ROLE target_role = hdr->role;
+    GAME_ROLE source_role = target_role == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE
+                                                             : FIRST_PLAYER_ROLE;
+    CLIENT *target = creg_lookup(client_registry, to);
+    CL_PROXY *p = NULL;
+    int id = -1;
+    if(target != NULL && hdr->origin != (uint32_t)cl->self
+       && (target_role == FIRST_PLAYER_ROLE || target_role == SECOND_PLAYER_ROLE)
+       && (p = make_proxy(cl, from)) != NULL)
+        id = client_make_invitation(p->client, target, source_role, target_role);
+    if(target != NULL)
+        client_unref(target, "reference from creg_lookup discarded after mirroring");
+    if(id < 0){
+        queue(cl, hdr->origin, CL_DECLINE, 0, hdr->origin, hdr->handle, NULL, NULL);
+        return;
+    }
+    INVITATION *inv = client_get_invitation(p->client, id);
+    sem_wait(&cl->semaphore_block);
+    CL_GAME *g = inv != NULL ? add_game(cl, p, id, hdr->origin, hdr->handle, hdr->origin) : NULL;
+    if(g != NULL)
+        g->inv = inv;
+    sem_post(&cl->semaphore_block);
+    if(g == NULL){
+        if(inv != NULL)
+            inv_unref(inv, "invitation not mirrored");
+        client_revoke_invitation(p->client, id);
+        queue(cl, hdr->origin, CL_DECLINE, 0, hdr->origin, hdr->handle, NULL, NULL);
+        return;
+    }
+    queue(cl, hdr->origin, CL_BOUND, 0, hdr->origin, hdr->handle, NULL, NULL);
+}
+
+/*
+ * An invitation has come to the invitee's home, or to where the home
+ * said the invitee was: it goes on to the invitee's node, or back as
+ * declined if the invitee isn't logged in anywhere.
+ */
+static void route_invitation(CLUSTER *cl, CL_HEADER *hdr, char *from, char *to){
+    CLIENT *target = creg_lookup(client_registry, to);
+    if(target != NULL){
+        client_unref(target, "invitee is here");
+        mirror_invitation(cl, hdr, from, to);
+        return;
+    }
+    int node = -1;
+    if(home_of(cl, to) == cl->self){
+        sem_wait(&cl->semaphore_block);
+        CL_ENTRY *e = find_entry(cl, to);
+        if(e != NULL && e->node != cl->self)
+            node = e->node;
+        sem_post(&cl->semaphore_block);
+    }
+    if(node >= 0)
+        queue(cl, node, CL_INVITE, hdr->role, hdr->origin, hdr->handle, from, to);
+    else
+        queue(cl, hdr->origin, CL_DECLINE, 0, hdr->origin, hdr->handle, NULL, NULL);
+}
+
+/*
+ * The answer to a registration made for a LOGIN.
+ */
+static void login_answered(CLUSTER *cl, uint32_t token, int ok){
+    CLIENT *client = NULL;
+    sem_wait(&cl->semaphore_block);
+    for(int i = 0; i < cl->npending; i++){
+        if(cl->pending[i].token == token){
+            client = cl->pending[i].client;
+            cl->pending[i] = cl->pending[--cl->npending];
+            break;
+        }
+    }
+    sem_post(&cl->semaphore_block);
+    //nobody waiting any more if the client has gone
+    if(client == NULL)
+        return;
+    if(ok){
+        client_send_ack(client, NULL, 0);
+    }
+    else{
+        client_logout(client);
+        stats_nack(STAT_NACK_LOGIN);
+        client_send_nack(client);
+    }
+    client_unref(client, "login answered");
+}
+
+static void register_players(CLUSTER *cl, int home){
+    PLAYER **players = creg_all_players(client_registry);
+    if(players == NULL)
+        return;
+    for(PLAYER **pp = players; *pp != NULL; pp++){
+        char *name = player_get_name(*pp);
+        int h = home_of(cl, name);
+        if(home < 0 || h == home)
+            queue(cl, h, CL_REGISTER, 0, 0, 0, name, NULL);
+        player_unref(*pp, "registered with the cluster");
+    }
+    free(players);
+}
+
+/*
+ * Handle a message, from another node or from this one.  The header has
+ * been converted to host byte order and the payload checked to end in a
+ * NUL, if there is one.
+ */
+static void handle(CLUSTER *cl, CL_HEADER *hdr, char *payload){
+    int from = hdr->from;
+    char *s1 = hdr->size > 0 ? payload : NULL;
+    char *s2 = s1 != NULL && strlen(s1) + 1 < hdr->size ? s1 + strlen(s1) + 1 : NULL;
+
+    switch(hdr->type){
+        case CL_HELLO:
+            if(hdr->role){
+                node_gone(cl, from);
+                register_players(cl, from);
+            }
+            return;
+        case CL_REGISTER: {
+            if(s1 == NULL)
+                return;
+            sem_wait(&cl->semaphore_block);
+            CL_ENTRY *e = find_entry(cl, s1);
+            int ok = e == NULL || e->node == from;
+            if(e == NULL && (e = calloc(1, sizeof(CL_ENTRY))) != NULL){
+                e->h.hash = hash_name(s1);
+                e->name = strdup(s1);
+                e->node = from;
+                if(e->name == NULL || table_insert(&cl->directory, &e->h) == -1){
+                    free(e->name);
+                    free(e);
+                    ok = 0;
+                }
+            }
+            sem_post(&cl->semaphore_block);
+            if(hdr->handle != 0)
+                queue(cl, from, ok ? CL_REGISTERED : CL_TAKEN, 0, 0, hdr->handle, NULL, NULL);
+            return;
+        }
+        case CL_REGISTERED:
+        case CL_TAKEN:
+            login_answered(cl, hdr->handle, hdr->type == CL_REGISTERED);
+            return;
+        case CL_UNREGISTER: {
+            if(s1 == NULL)
+                return;
+            sem_wait(&cl->semaphore_block);
+            CL_ENTRY *e = find_entry(cl, s1);
+            if(e != NULL && e->node == from)
+                remove_entry(cl, e);
+            sem_post(&cl->semaphore_block);
+            return;
+        }
+        case CL_INVITE:
+            if(s1 != NULL && s2 != NULL && hdr->origin < (uint32_t)cl->nnodes)
+                route_invitation(cl, hdr, s1, s2);
+            return;
+        default:
+            break;
+    }
+
+    //the rest are about a mirrored invitation, which the proxy acts on
+    sem_wait(&cl->semaphore_block);
+    CL_GAME *g = find_game(cl, hdr->origin, hdr->handle);
+    if(g == NULL){
+        sem_post(&cl->semaphore_block);
+        //revoked before the other side got round to mirroring it
+        if(hdr->type == CL_BOUND)
+            queue(cl, from, CL_REVOKE, 0, hdr->origin, hdr->handle, NULL, NULL);
+        return;
+    }
+    CLIENT *proxy = client_ref(g->proxy->client, "acting for a remote player");
+    int id = g->id;
+    switch(hdr->type){
+        case CL_BOUND:
+            g->node = from;
+            break;
+        case CL_DECLINE:
+        case CL_REVOKE:
+            drop_game(cl, g);
+            break;
+        case CL_RESIGN:
+        case CL_END:
+            g->settled = 1;
+            break;
+        default:
+            break;
+    }
+    sem_post(&cl->semaphore_block);
+
+    //g may be gone once the proxy has acted
+    switch(hdr->type){
+        case CL_ACCEPT: {
+            char *state = NULL;
+            client_accept_invitation(proxy, id, &state);
+            free(state);
+            break;
+        }
+        case CL_DECLINE:
+            client_decline_invitation(proxy, id);
+            break;
+        case CL_REVOKE:
+            client_revoke_invitation(proxy, id);
+            break;
+        case CL_MOVE:
+            if(s1 == NULL || client_make_move(proxy, id, s1) == -1)
+                debug("CLUSTER move %s from node %d refused", s1 != NULL ? s1 : "", from);
+            break;
+        case CL_RESIGN:
+            client_resign_game(proxy, id);
+            break;
+        case CL_END: {
+            //the proxy's role is the remote player's
+            INVITATION *inv = client_get_invitation(proxy, id);
+            GAME_ROLE loser = NULL_ROLE;
+            if(inv != NULL && hdr->role != NULL_ROLE){
+                GAME_ROLE mine = inv_get_source(inv) == proxy ? inv_get_source_role(inv)
+                                                                : inv_get_target_role(inv);
+                GAME_ROLE theirs = mine == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE
+                                                             : FIRST_PLAYER_ROLE;
+                loser = hdr->role == mine ? theirs : mine;
+            }
+            if(inv != NULL)
+                inv_unref(inv, "ended elsewhere");
+            client_end_game(proxy, id, loser);
+            break;
+        }
+        default:
+            break;
+    }
+    client_unref(proxy, "acting for a remote player");
+}
+
+/*
+ * A message could not be sent: whatever was waiting on it is told no.
+ */
+static void bounce(CLUSTER *cl, char *data){
+    CL_HEADER hdr;
+    memcpy(&hdr, data, sizeof(hdr));
+    if(hdr.type == CL_REGISTER && hdr.handle != 0)
+        login_answered(cl, ntohl(hdr.handle), 0);
+    else if(hdr.type == CL_INVITE)
+        queue(cl, ntohl(hdr.origin), CL_DECLINE, 0, ntohl(hdr.origin), ntohl(hdr.handle),
+              NULL, NULL);
+}
+
+static size_t frame_length(char *data){
+    CL_HEADER hdr;
+    memcpy(&hdr, data, sizeof(hdr));
+    return sizeof(hdr) + ntohl(hdr.size);
+}
+
+/*
+ * Give up on sending to a node: the messages not yet written are
+ * bounced, and the node is taken to be gone.
+ */
+static void node_failed(CLUSTER *cl, int node){
+    CL_NODE *n = &cl->nodes[node];
+    sem_wait(&cl->semaphore_block);
+    char *buf = n->out;
+    size_t len = n->out_len, sent = n->out_sent;
+    n->out = NULL;
+    n->out_len = n->out_sent = n->out_cap = 0;
+    sem_post(&cl->semaphore_block);
+    debug("CLUSTER node %d unreachable, %zu bytes unsent", node, len - sent);
+    node_gone(cl, node);
+    for(size_t off = 0; off < len; ){
+        size_t flen = frame_length(buf + off);
+        if(off + flen > sent)
+            bounce(cl, buf + off);
+        off += flen;
+    }
+    free(buf);
+}
+
+static void node_write(CLUSTER *cl, int node);
+
+static void node_writable(int fd, void *arg){
+    CL_NODE *n = arg;
+    n->waiting = 0;
+    if(n->connecting){
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0){
+            node_failed(n->cl, n->index);
+            return;
+        }
+        n->connecting = 0;
+        debug("CLUSTER connected to node %d (%s:%d)", n->index, n->host, n->port);
+    }
+    node_write(n->cl, n->index);
+}
+
+/*
+ * Start connecting to a node, without waiting for the connection to be
+ * made.  The node is told who we are before anything else.
+ */
+static int node_connect(CLUSTER *cl, CL_NODE *n){
+    char port[16];
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", n->port);
+    if(getaddrinfo(n->host, port, &hints, &ai) != 0)
+        return -1;
+    int fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if(fd >= 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int ret = fd >= 0 ? connect(fd, ai->ai_addr, ai->ai_addrlen) : -1;
+    freeaddrinfo(ai);
+    if(ret == -1 && (fd < 0 || errno != EINPROGRESS)){
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if(ret == -1 && ev_loop_watch_writable(fd, node_writable, n) == -1){
+        close(fd);
+        return -1;
+    }
+    sem_wait(&cl->semaphore_block);
+    if(reserve(n, sizeof(CL_HEADER)) == -1){
+        sem_post(&cl->semaphore_block);
+        if(ret == -1)
+            ev_loop_unwatch(fd);
+        close(fd);
+        return -1;
+    }
+    CL_HEADER hello = { .type = CL_HELLO, .from = htons(cl->self) };
+    memmove(n->out + sizeof(hello), n->out, n->out_len);
+    memcpy(n->out, &hello, sizeof(hello));
+    n->out_len += sizeof(hello);
+    sem_post(&cl->semaphore_block);
+    n->fd = fd;
+    n->connecting = n->waiting = ret == -1;
+    return 0;
+}
+
+/*
+ * Write as much of a node's output as its connection will take, and
+ * have the rest written when it will take more.
+ */
+static void node_write(CLUSTER *cl, int node){
+    CL_NODE *n = &cl->nodes[node];
+    if(n->out_len - n->out_sent > CL_MAX_BACKLOG){
+        node_failed(cl, node);
+        return;
+    }
+    if(n->fd < 0 && node_connect(cl, n) == -1){
+        node_failed(cl, node);
+        return;
+    }
+    if(n->waiting)
+        return;
+    sem_wait(&cl->semaphore_block);
+    while(n->out_sent < n->out_len){
+        ssize_t w = write(n->fd, n->out + n->out_sent, n->out_len - n->out_sent);
+        if(w > 0){
+            n->out_sent += w;
+            continue;
+        }
+        if(w < 0 && errno == EINTR)
+            continue;
+        if(w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)
+           && ev_loop_watch_writable(n->fd, node_writable, n) == 0){
+            n->waiting = 1;
+            break;
+        }
+        sem_post(&cl->semaphore_block);
+        node_failed(cl, node);
+        return;
+    }
+    if(n->out_sent == n->out_len)
+        n->out_len = n->out_sent = 0;
+    sem_post(&cl->semaphore_block);
+}
+
+/*
+ * Close the connection to a node.  What was queued for it and not yet
+ * written is kept, to go out on the next connection, except for a
+ * message that was only partly written.
+ */
+static void disconnect(CLUSTER *cl, CL_NODE *n){
+    if(n->fd < 0)
+        return;
+    if(n->waiting)
+        ev_loop_unwatch(n->fd);
+    close(n->fd);
+    n->fd = -1;
+    n->connecting = n->waiting = 0;
+    sem_wait(&cl->semaphore_block);
+    size_t off = 0;
+    while(off < n->out_sent)
+        off += frame_length(n->out + off);
+    memmove(n->out, n->out + off, n->out_len - off);
+    n->out_len -= off;
+    n->out_sent = 0;
+    sem_post(&cl->semaphore_block);
+}
+
+/*
+ * Handle the messages this node sent itself and write out everything
+ * queued for the others, including anything queued while doing so.
+ */
+static void flush(EV_CALL *call, void *arg){
+    CLUSTER *cl = arg;
+    for(;;){
+        sem_wait(&cl->semaphore_block);
+        CL_OUT *out = cl->out_head;
+        if(out != NULL && (cl->out_head = out->next) == NULL)
+            cl->out_tail = NULL;
+        int node = -1;
+        if(out == NULL && cl->ndirty > 0){
+            node = cl->dirty[--cl->ndirty];
+            cl->nodes[node].dirty = 0;
+        }
+        sem_post(&cl->semaphore_block);
+        if(out != NULL){
+            CL_HEADER hdr;
+            memcpy(&hdr, out->data, sizeof(hdr));
+            hdr.size = ntohl(hdr.size);
+            hdr.from = cl->self;
+            hdr.origin = ntohl(hdr.origin);
+            hdr.handle = ntohl(hdr.handle);
+            handle(cl, &hdr, out->data + sizeof(hdr));
+            free(out);
+        }
+        else if(node >= 0){
+            node_write(cl, node);
+        }
+        else{
+            break;
+        }
+    }
+}
+
+static void close_link(CLUSTER *cl, CL_LINK *link){
+    int node = link->node;
+    ev_loop_unwatch(link->fd);
+    close(link->fd);
+    for(int i = 0; i < cl->nlinks; i++){
+        if(cl->links[i] == link){
+            cl->links[i] = cl->links[--cl->nlinks];
+            break;
+        }
+    }
+    free(link->buf);
+    free(link);
+    //a node that has since connected again is still there
+    if(node >= 0 && cl->nodes[node].in == link){
+        cl->nodes[node].in = NULL;
+        debug("CLUSTER node %d disconnected", node);
+        node_gone(cl, node);
+    }
+}
+
+/*
+ * Handle the whole messages at the start of a link's buffer, and keep
+ * whatever is left of a message that has yet to arrive in full.
+ *
+ * @return 0, or -1 if the link has been closed.
+ */
+static int link_consume(CLUSTER *cl, CL_LINK *link){
+    size_t off = 0;
+    while(link->len - off >= sizeof(CL_HEADER)){
+        CL_HEADER hdr;
+        memcpy(&hdr, link->buf + off, sizeof(hdr));
+        hdr.size = ntohl(hdr.size);
+        hdr.from = ntohs(hdr.from);
+        hdr.origin = ntohl(hdr.origin);
+        hdr.handle = ntohl(hdr.handle);
+        if(hdr.size > CL_MAX_PAYLOAD || hdr.from >= cl->nnodes || hdr.from == cl->self
+           || (link->node >= 0 && hdr.from != link->node)){
+            debug("CLUSTER bad message from fd %d", link->fd);
+            close_link(cl, link);
+            return -1;
+        }
+        if(link->len - off < sizeof(hdr) + hdr.size)
+            break;
+        char *payload = link->buf + off + sizeof(hdr);
+        off += sizeof(hdr) + hdr.size;
+        if(hdr.size > 0 && payload[hdr.size - 1] != '\0')
+            continue;
+        if(link->node < 0){
+            link->node = hdr.from;
+            cl->nodes[hdr.from].in = link;
+        }
+        handle(cl, &hdr, payload);
+    }
+    memmove(link->buf, link->buf + off, link->len - off);
+    link->len -= off;
+    return 0;
+}
+
+/*
+ * Read what a link has for us a chunk at a time, handling the messages
+ * in each chunk before reading the next, so that the buffer never holds
+ * more than a chunk and part of a message however fast the other node
+ * writes.
+ */
+static void link_readable(int fd, void *arg){
+    CL_LINK *link = arg;
+    CLUSTER *cl = link->cl;
+    for(;;){
+        if(link->cap - link->len < CL_READ_CHUNK){
+            size_t cap = link->cap ? 2 * link->cap : 2 * CL_READ_CHUNK;
+            char *grown = realloc(link->buf, cap);
+            if(grown == NULL){
+                close_link(cl, link);
+                return;
+            }
+            link->buf = grown;
+            link->cap = cap;
+        }
+        ssize_t n = read(fd, link->buf + link->len, CL_READ_CHUNK);
+        if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+            close_link(cl, link);
+            return;
+        }
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+        link->len += n;
+        if(link_consume(cl, link) == -1)
+            return;
+    }
+}
+
+static void link_accepted(int fd, void *arg){
+    CLUSTER *cl = arg;
+    for(;;){
+        int conn = accept(fd, NULL, NULL);
+        if(conn < 0)
+            return;
+        CL_LINK *link = calloc(1, sizeof(CL_LINK));
+        CL_LINK **grown = link != NULL
+            ? realloc(cl->links, (cl->nlinks + 1) * sizeof(CL_LINK *)) : NULL;
+        if(grown == NULL){
+            free(link);
+            close(conn);
+            continue;
+        }
+        cl->links = grown;
+        link->cl = cl;
+        link->fd = conn;
+        link->node = -1;
+        fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) | O_NONBLOCK);
+        if(ev_loop_watch(conn, link_readable, link) == -1){
+            close(conn);
+            free(link);
+            continue;
+        }
+        cl->links[cl->nlinks++] = link;
+    }
+}
+
+static int parse_spec(CLUSTER *cl, char *spec){
+    char *end;
+    cl->self = strtol(spec, &end, 10);
+    if(end == spec || *end != ':')
+        return -1;
+    char *list = strdup(end + 1);
+    if(list == NULL)
+        return -1;
+    char *save = NULL;
+    for(char *addr = strtok_r(list, ",", &save); addr != NULL; addr = strtok_r(NULL, ",", &save)){
+        char *colon = strrchr(addr, ':');
+        if(colon == NULL || cl->nnodes == CL_MAX_NODES){
+            free(list);
+            return -1;
+        }
+        *colon = '\0';
+        CL_NODE *n = &cl->nodes[cl->nnodes];
+        n->cl = cl;
+        n->index = cl->nnodes++;
+        n->host = strdup(addr);
+        n->port = atoi(colon + 1);
+        n->fd = -1;
+        if(n->host == NULL || n->port <= 0){
+            free(list);
+            return -1;
+        }
+    }
+    free(list);
+    return cl->self >= 0 && cl->self < cl->nnodes ? 0 : -1;
+}
+
+static void free_cluster(CLUSTER *cl){
+    for(int i = 0; i < cl->nnodes; i++){
+        CL_NODE *n = &cl->nodes[i];
+        if(n->fd >= 0){
+            if(n->waiting)
+                ev_loop_unwatch(n->fd);
+            close(n->fd);
+        }
+        free(n->host);
+        free(n->out);
+    }
+    free(cl->ring);
+    sem_destroy(&cl->semaphore_block);
+    free(cl);
+}
+
+CLUSTER *cluster_init(char *spec){
+    CLUSTER *cl = calloc(1, sizeof(CLUSTER));
+    if(cl == NULL)
+        return NULL;
+    sem_init(&cl->semaphore_block, 0, 1);
+    ev_call_init(&cl->flush, flush, cl);
+    cl->listenfd = -1;
+    if(parse_spec(cl, spec) == -1){
+        free_cluster(cl);
+        return NULL;
+    }
+
+    cl->npoints = cl->nnodes * CL_VNODES;
+    cl->ring = malloc(cl->npoints * sizeof(CL_POINT));
+    if(cl->ring == NULL){
+        free_cluster(cl);
+        return NULL;
+    }
+    for(int i = 0; i < cl->nnodes; i++){
+        for(int v = 0; v < CL_VNODES; v++){
+            char point[300];
+            int len = snprintf(point, sizeof(point), "%s:%d#%d", cl->nodes[i].host,
+                               cl->nodes[i].port, v);
+            cl->ring[i * CL_VNODES + v].hash = hash_bytes(point, len, 0);
+            cl->ring[i * CL_VNODES + v].node = i;
+        }
+    }
+    qsort(cl->ring, cl->npoints, sizeof(CL_POINT), compare_points);
+
+    for(int tries = 0; cl->listenfd < 0 && tries < CL_LISTEN_TRIES; tries++){
+        if(tries > 0)
+            usleep(CL_LISTEN_WAIT_US);
+        cl->listenfd = open_listenfd(cl->nodes[cl->self].port);
+    }
+    if(cl->listenfd < 0){
+        free_cluster(cl);
+        return NULL;
+    }
+    fcntl(cl->listenfd, F_SETFL, fcntl(cl->listenfd, F_GETFL) | O_NONBLOCK);
+    if(ev_loop_watch(cl->listenfd, link_accepted, cl) == -1){
+        close(cl->listenfd);
+        free_cluster(cl);
+        return NULL;
+    }
+
+    //whatever the others remember of a previous process here is stale
+    for(int i = 0; i < cl->nnodes; i++)
+        if(i != cl->self)
+            queue(cl, i, CL_HELLO, 1, 0, 0, NULL, NULL);
+    register_players(cl, -1);
+    debug("CLUSTER node %d of %d listening on port %d", cl->self, cl->nnodes,
+          cl->nodes[cl->self].port);
+    return cl;
+}
+
+void cluster_fini(CLUSTER *cl){
+    ev_loop_cancel_post(&cl->flush);
+    flush(&cl->flush, cl);
+    cl->closing = 1;
+    //the loop is done, so what the connections won't take now they are
+    //waited on for
+    for(int i = 0; i < cl->nnodes; i++){
+        CL_NODE *n = &cl->nodes[i];
+        if(n->fd < 0 || n->connecting || n->out_sent == n->out_len)
+            continue;
+        fcntl(n->fd, F_SETFL, fcntl(n->fd, F_GETFL) & ~O_NONBLOCK);
+        rio_writen(n->fd, n->out + n->out_sent, n->out_len - n->out_sent);
+    }
+
+    for(size_t i = 0; i < cl->games.nbuckets; i++){
+        CL_HNODE *n = cl->games.buckets[i];
+        while(n != NULL){
+            CL_HNODE *next = n->next;
+            drop_game(cl, (CL_GAME *)n);
+            n = next;
+        }
+    }
+    for(size_t i = 0; i < cl->proxies.nbuckets; i++){
+        CL_HNODE *n = cl->proxies.buckets[i];
+        while(n != NULL){
+            CL_HNODE *next = n->next;
+            CL_PROXY *p = (CL_PROXY *)n;
+            client_logout(p->client);
+            client_unref(p->client, "proxy freed");
+            free(p->games);
+            free(p->name);
+            free(p);
+            n = next;
+        }
+    }
+    for(size_t i = 0; i < cl->directory.nbuckets; i++){
+        CL_HNODE *n = cl->directory.buckets[i];
+        while(n != NULL){
+            CL_HNODE *next = n->next;
+            free(((CL_ENTRY *)n)->name);
+            free(n);
+            n = next;
+        }
+    }
+    free(cl->directory.buckets);
+    free(cl->proxies.buckets);
+    free(cl->games.buckets);
+    for(int i = 0; i < cl->npending; i++)
+        client_unref(cl->pending[i].client, "cluster closed");
+    free(cl->pending);
+
+    while(cl->nlinks > 0){
+        CL_LINK *link = cl->links[--cl->nlinks];
+        ev_loop_unwatch(link->fd);
+        close(link->fd);
+        free(link->buf);
+        free(link);
+    }
+    free(cl->links);
+    ev_loop_unwatch(cl->listenfd);
+    close(cl->listenfd);
+    free_cluster(cl);
+}
+
+int cluster_register(CLUSTER *cl, CLIENT *client){
+    PLAYER *player = client_get_player(client);
+    if(player == NULL)
+        return -1;
+    char *name = player_get_name(player);
+    int home = home_of(cl, name);
+    if(home == cl->self){
+        int ret = 0;
+        sem_wait(&cl->semaphore_block);
+        CL_ENTRY *e = find_entry(cl, name);
+        if(e != NULL){
+            ret = e->node == cl->self ? 0 : -1;
+        }
+        else if((e = calloc(1, sizeof(CL_ENTRY))) == NULL || (e->name = strdup(name)) == NULL){
+            free(e);
+            ret = -1;
+        }
+        else{
+            e->h.hash = hash_name(name);
+            e->node = cl->self;
+            if(table_insert(&cl->directory, &e->h) == -1){
+                free(e->name);
+                free(e);
+                ret = -1;
+            }
+        }
+        sem_post(&cl->semaphore_block);
+        return ret;
+    }
+
+    sem_wait(&cl->semaphore_block);
+    if(cl->npending == cl->pending_cap){
+        int cap = cl->pending_cap ? 2 * cl->pending_cap : 16;
+        CL_PENDING *grown = realloc(cl->pending, cap * sizeof(CL_PENDING));
+        if(grown == NULL){
+            sem_post(&cl->semaphore_block);
+            return -1;
+        }
+        cl->pending = grown;
+        cl->pending_cap = cap;
+    }
+    uint32_t token = ++cl->next_token;
+    if(token == 0)
+        token = ++cl->next_token;
+    cl->pending[cl->npending++] = (CL_PENDING){
+        token, home, client_ref(client, "login waiting for the cluster")
+    };
+    sem_post(&cl->semaphore_block);
+    queue(cl, home, CL_REGISTER, 0, 0, token, name, NULL);
+    return 1;
+}
+
+void cluster_unregister(CLUSTER *cl, CLIENT *client){
+    PLAYER *player = client_get_player(client);
+    if(player == NULL)
+        return;
+    char *name = player_get_name(player);
+    int home = home_of(cl, name);
+    CLIENT *waiting = NULL;
+    sem_wait(&cl->semaphore_block);
+    for(int i = 0; i < cl->npending; i++){
+        if(cl->pending[i].client == client){
+            waiting = client;
+            cl->pending[i] = cl->pending[--cl->npending];
+            break;
+        }
+    }
+    if(home == cl->self){
+        CL_ENTRY *e = find_entry(cl, name);
+        if(e != NULL && e->node == cl->self)
+            remove_entry(cl, e);
+    }
+    sem_post(&cl->semaphore_block);
+    if(waiting != NULL)
+        client_unref(waiting, "login no longer waiting");
+    if(home != cl->self)
+        queue(cl, home, CL_UNREGISTER, 0, 0, 0, name, NULL);
+}
+
+CLIENT *cluster_lookup(CLUSTER *cl, char *name){
+    if(home_of(cl, name) == cl->self){
+        sem_wait(&cl->semaphore_block);
+        CL_ENTRY *e = find_entry(cl, name);
+        int elsewhere = e != NULL && e->node != cl->self;
+        sem_post(&cl->semaphore_block);
+        if(!elsewhere)
+            return NULL;
+    }
+    CL_PROXY *p = make_proxy(cl, name);
+    return p != NULL ? client_ref(p->client, "proxy looked up") : NULL;
+}
+
+int cluster_is_proxy(CLUSTER *cl, CLIENT *client){
+    PLAYER *player = client_get_player(client);
+    if(client_get_fd(client) >= 0 || player == NULL)
+        return 0;
+    CL_PROXY *p = get_proxy(cl, player_get_name(player));
+    return p != NULL && p->client == client;
+}
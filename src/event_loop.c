@@ -0,0 +1,1486 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "debug.h"
+#include "event_loop.h"
+#include "proto_io.h"
+#include "uring.h"
+#include "client.h"
+
+#define EV_MAX_EVENTS 256
+// most queued packets gathered into one sendmsg(2)
+#define EV_MAX_IOV    64
+// most sessions whose held-back output is written per pass of the loop
+#define EV_FANOUT_BATCH 256
+// most output queued for a session before the client is taken to be gone
+#define EV_MAX_QUEUED (1024 * 1024)
+
+/*
+ * How long ev_loop_close_all() waits for the kernel to hand back the
+ * io_uring operations of connections it has shut down.  They fail as soon
+ * as the sockets are shut down, so this is only a safety net.
+ */
+#define EV_REAP_MS 1000
+
+/*
+ * Sizing of the io_uring backend.  Receive buffers are shared by all
+ * connections (the kernel picks one per completion); send slots are a
+ * registered region that most packets fit into, anything bigger is
+ * malloc'ed.
+ */
+#define EVU_ENTRIES      4096
+#define EVU_RBUF_GROUP   1
+#define EVU_RBUF_COUNT   1024
+#define EVU_RBUF_SIZE    4096
+#define EVU_SLOT_COUNT   4096
+#define EVU_SLOT_SIZE    256
+
+/*
+ * What a completion refers to.  The fd is kept in the upper bits of the
+ * user_data so that a completion can be matched to its session.
+ */
+#define EVU_ACCEPT  1
+#define EVU_RECV    2
+#define EVU_SEND    3
+#define EVU_CANCEL  4
+#define EVU_WATCH   5
+#define EVU_DATA(fd, op)   (((uint64_t)(fd) << 8) | (op))
+#define EVU_FD(data)       ((int)((data) >> 8))
+#define EVU_OP(data)       ((int)((data) & 0xff))
+
+/*
+ * State of the (single) event loop.  Sessions are indexed by file
+ * descriptor, which the kernel keeps small and dense, so lookup on
+ * each event is an array access.
+ */
+static int epfd = -1;
+static int listen_fd = -1;
+static SESSION **sessions;           // sessions[fd], NULL if fd is not a session
+static int sessions_cap;
+static int session_count;
+static int accepting;
+static int quiescing;                // ev_loop_quiesce(): no new requests
+static volatile sig_atomic_t stop_requested;
+// sessions with output to submit (io_uring), and sessions with fan-out
+// output held back until those have been seen to (both backends, oldest
+// first); a session is on at most one of the lists, dirty says which
+static SESSION *dirty_head;
+static SESSION *deferred_head, *deferred_tail;
+
+/*
+ * Timers, and the session timeouts kept on them (0 for none).
+ */
+static TIMER_WHEEL *timers;
+static unsigned int login_timeout_ms;
+static unsigned int idle_timeout_ms;
+
+/*
+ * The wall clock as of the loop's last wakeup.  Thread-local, so that
+ * only the loop's own thread ever finds one.
+ */
+static __thread struct timespec wall_now;
+static __thread int wall_valid;
+
+/*
+ * Calls posted with ev_loop_post(), oldest first.
+ */
+static EV_CALL *posted_head, *posted_tail;
+
+/*
+ * Other file descriptors the loop watches for readability (or, once, for
+ * writability) on behalf of the rest of the server.  There are only ever
+ * a few of these.
+ */
+#define EV_MAX_WATCHES 64
+static struct {
+    int fd;
+    int writable;
+    EV_WATCH_FUNC *func;
+    void *arg;
+} watches[EV_MAX_WATCHES];
+static int nwatches;
+
+/*
+ * State of the io_uring backend, used instead of epoll when use_uring is set.
+ */
+static int use_uring;
+static URING ring;
+static URING_BUF_RING rbufs;
+static char *slots;                  // EVU_SLOT_COUNT send buffers
+static int *free_slots;              // stack of unused slot numbers
+static int nfree_slots;
+static int slots_registered;         // slots can be used with WRITE_FIXED
+static int accept_armed;
+static int frozen;                   // submit no more output
+
+static int set_nonblocking(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static uint64_t now_ms(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static long ms_since(const struct timespec *start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static int find_watch(int fd){
+    for(int i = 0; i < nwatches; i++)
+        if(watches[i].fd == fd)
+            return i;
+    return -1;
+}
+
+static int grow_sessions(int fd){
+    if(fd < sessions_cap)
+        return 0;
+    int cap = sessions_cap ? sessions_cap : 1024;
+    while(cap <= fd)
+        cap *= 2;
+    SESSION **ns = realloc(sessions, cap * sizeof(SESSION *));
+    if(ns == NULL)
+        return -1;
+    memset(ns + sessions_cap, 0, (cap - sessions_cap) * sizeof(SESSION *));
+    sessions = ns;
+    sessions_cap = cap;
+    return 0;
+}
+
+/*
+ * Session timeouts.  Each session has one timer, which is not touched as
+ * input arrives: when it goes off, it works out the actual deadline from
+ * the time of the last input and the session's login state, and starts
+ * itself again if that is still in the future.  So a busy connection
+ * costs one timer expiry per timeout period, not a timer update per
+ * packet.
+ */
+
+static uint64_t session_deadline(SESSION *s){
+    unsigned int timeout = client_get_player(s->client) != NULL ? idle_timeout_ms : login_timeout_ms;
+    return timeout > 0 ? s->active_ms + timeout : 0;
+}
+
+static void drop_output(SESSION *s);
+
+static void session_timeout(TIMER *timer, void *arg){
+    SESSION *s = arg;
+    if(s->closing || s->shut)
+        return;
+    uint64_t deadline = session_deadline(s);
+    uint64_t now = tw_now(timers);
+    if(deadline > now){
+        tw_add(timers, timer, deadline - now);
+        return;
+    }
+    if(deadline == 0){
+        // not timed in its current state, but it may change state
+        unsigned int recheck = login_timeout_ms > 0 ? login_timeout_ms : idle_timeout_ms;
+        if(recheck > 0)
+            tw_add(timers, timer, recheck);
+        return;
+    }
+    // the peer is presumably gone, so what's queued for it can go too;
+    // the session sees EOF and cleans up like for any disconnect
+    debug("[%d] timed out after %lu ms", s->fd, (unsigned long)(now - s->active_ms));
+    drop_output(s);
+}
+
+static void start_session_timer(SESSION *s){
+    s->active_ms = tw_now(timers);
+    timer_init(&s->timer, session_timeout, s);
+    unsigned int first = login_timeout_ms > 0 ? login_timeout_ms : idle_timeout_ms;
+    if(first > 0)
+        tw_add(timers, &s->timer, first);
+}
+
+/*
+ * Read the wall clock for the pass of the loop that is starting, quiescing
+ * or not, for stamping what goes out (see ev_loop_wall_time()).
+ */
+static void refresh_wall(void){
+    clock_gettime(CLOCK_REALTIME, &wall_now);
+    wall_valid = 1;
+}
+
+/*
+ * Run whatever timers have come due.  Not while quiescing, since nothing
+ * is supposed to change then.
+ */
+static void run_timers(void){
+    if(!quiescing)
+        tw_advance(timers, now_ms());
+}
+
+/*
+ * Make the calls that have been posted, but not ones they post in turn,
+ * which wait for the next pass.  Not while quiescing, for the same reason
+ * as the timers.
+ */
+static void run_posted(void){
+    if(quiescing)
+        return;
+    EV_CALL *last = posted_tail;
+    while(posted_head != NULL){
+        EV_CALL *call = posted_head;
+        posted_head = call->next;
+        if(posted_head == NULL)
+            posted_tail = NULL;
+        call->next = NULL;
+        call->posted = 0;
+        call->func(call, call->arg);
+        if(call == last)
+            break;
+    }
+}
+
+/*
+ * The wait timeout for one pass of the loop: the given one, or less if a
+ * timer is due sooner.
+ */
+static int wait_timeout(int timeout_ms){
+    int next = quiescing ? -1 : tw_next_ms(timers, now_ms());
+    if(next >= 0 && (timeout_ms < 0 || next < timeout_ms))
+        return next;
+    return timeout_ms;
+}
+
+/*
+ * io_uring backend
+ */
+
+static void evu_arm_accept(void){
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if(sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = EVU_DATA(listen_fd, EVU_ACCEPT);
+    accept_armed = 1;
+}
+
+/*
+ * Cancel every operation of the given kind outstanding on fd.
+ */
+static void evu_cancel(int fd, int op){
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if(sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = EVU_DATA(fd, op);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = EVU_DATA(fd, EVU_CANCEL);
+}
+
+static void evu_arm_watch(int fd, int writable){
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if(sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = writable ? POLLOUT : POLLIN;
+    sqe->len = writable ? 0 : IORING_POLL_ADD_MULTI;
+    sqe->user_data = EVU_DATA(fd, EVU_WATCH);
+}
+
+static int evu_arm_recv(SESSION *s){
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if(sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = s->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = EVU_RBUF_GROUP;
+    sqe->user_data = EVU_DATA(s->fd, EVU_RECV);
+    s->recv_armed = 1;
+    return 0;
+}
+
+#define EV_DIRTY     1
+#define EV_DEFERRED  2
+
+static void mark_dirty(SESSION *s){
+    if(s->dirty)
+        return;
+    s->dirty = EV_DIRTY;
+    s->next_dirty = dirty_head;
+    dirty_head = s;
+}
+
+static void mark_deferred(SESSION *s){
+    if(s->dirty)
+        return;
+    s->dirty = EV_DEFERRED;
+    s->next_dirty = NULL;
+    if(deferred_tail != NULL)
+        deferred_tail->next_dirty = s;
+    else
+        deferred_head = s;
+    deferred_tail = s;
+}
+
+/*
+ * Take the session at the front of the deferred list off it, or return
+ * NULL if the list is empty.
+ */
+static SESSION *pop_deferred(void){
+    SESSION *s = deferred_head;
+    if(s == NULL)
+        return NULL;
+    deferred_head = s->next_dirty;
+    if(deferred_head == NULL)
+        deferred_tail = NULL;
+    s->dirty = 0;
+    return s;
+}
+
+static void free_out(SESSION_OUT *out){
+    if(out->shared != NULL)
+        proto_buf_unref(out->shared);
+    else if(out->slot >= 0)
+        free_slots[nfree_slots++] = out->slot;
+    else
+        free(out->buf);
+    free(out);
+}
+
+/*
+ * The connection is broken, so nothing queued will get through: throw
+ * the output away and make sure the session sees EOF.
+ */
+static void drop_output(SESSION *s){
+    while(s->out_head != NULL){
+        SESSION_OUT *out = s->out_head;
+        s->out_head = out->next;
+        free_out(out);
+    }
+    s->out_tail = NULL;
+    s->out_bytes = 0;
+    if(!s->shut){
+        s->shut = 1;
+        shutdown(s->fd, SHUT_RDWR);
+    }
+}
+
+static void append_output(SESSION *s, SESSION_OUT *out){
+    if(s->out_tail != NULL)
+        s->out_tail->next = out;
+    else
+        s->out_head = out;
+    s->out_tail = out;
+    s->out_bytes += out->len - out->off;
+}
+
+/*
+ * A client that doesn't read what it's sent (a spectator that has gone
+ * away without closing, say) would have its queue grow with every packet,
+ * so once it would pass EV_MAX_QUEUED the connection is treated as
+ * broken.
+ *
+ * @return nonzero if the session has been cut off.
+ */
+static int over_limit(SESSION *s, size_t more){
+    if(s->out_bytes + more <= EV_MAX_QUEUED)
+        return 0;
+    debug("[%d] %lu bytes of output queued, cutting off", s->fd, (unsigned long)s->out_bytes);
+    drop_output(s);
+    errno = EPIPE;
+    return 1;
+}
+
+/*
+ * Append a packet to a session's output queue, skipping the first
+ * written bytes of it, which have already gone out.
+ */
+static int queue_output(SESSION *s, const void *hdr, size_t hdrlen,
+                        const void *data, size_t datalen, size_t written){
+    SESSION_OUT *out = malloc(sizeof(SESSION_OUT));
+    if(out == NULL)
+        return -1;
+    out->len = hdrlen + datalen;
+    out->off = written;
+    out->next = NULL;
+    out->shared = NULL;
+    if(use_uring && out->len <= EVU_SLOT_SIZE && nfree_slots > 0){
+        out->slot = free_slots[--nfree_slots];
+        out->buf = slots + (size_t)out->slot * EVU_SLOT_SIZE;
+    }
+    else{
+        out->slot = -1;
+        out->buf = malloc(out->len);
+        if(out->buf == NULL){
+            free(out);
+            return -1;
+        }
+    }
+    memcpy(out->buf, hdr, hdrlen);
+    if(datalen > 0)
+        memcpy(out->buf + hdrlen, data, datalen);
+    append_output(s, out);
+    return 0;
+}
+
+static void update_events(SESSION *s);
+
+/*
+ * Installed as the PROTO_SENDER, so every proto_send_packet() to a
+ * session's fd ends up here.  With io_uring the packet is queued, and
+ * the queues are submitted in one batch per loop iteration by
+ * evu_flush().  With epoll the packet is written straight away unless
+ * there's output queued ahead of it, and whatever the socket won't take
+ * is queued until it becomes writable, so that a client that stops
+ * reading can never stall the loop.
+ */
+static int ev_sender(int fd, const void *hdr, size_t hdrlen,
+                     const void *data, size_t datalen){
+    SESSION *s = (fd >= 0 && fd < sessions_cap) ? sessions[fd] : NULL;
+    if(s == NULL)
+        return PROTO_SEND_DECLINED;
+    if(s->shut){
+        errno = EPIPE;
+        return -1;
+    }
+    size_t written = 0;
+    if(!use_uring && s->out_head == NULL){
+        struct iovec iov[2];
+        iov[0].iov_base = (void *)hdr;
+        iov[0].iov_len = hdrlen;
+        iov[1].iov_base = (void *)data;
+        iov[1].iov_len = datalen;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = datalen > 0 ? 2 : 1;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if(n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return -1;
+        if(n == (ssize_t)(hdrlen + datalen))
+            return 0;
+        written = n > 0 ? n : 0;
+    }
+    if(over_limit(s, hdrlen + datalen - written))
+        return -1;
+    if(queue_output(s, hdr, hdrlen, data, datalen, written) == -1)
+        return -1;
+    if(use_uring)
+        mark_dirty(s);
+    else
+        update_events(s);
+    return 0;
+}
+
+/*
+ * Installed as the PROTO_SHARED_SENDER.  The header is queued as a packet
+ * of its own and the payload after it by reference.  Nothing is written
+ * straight away with either backend: the session goes on the deferred
+ * list, and the fan-out to all of the sessions a payload was sent to is
+ * written from the next pass of the loop on, after the output of the
+ * requests in hand, EV_FANOUT_BATCH sessions per pass.  Passes don't wait
+ * while any of it is left, but they do see to new requests in between.
+ * That way the players of a game with any number of spectators hear about
+ * its moves as quickly as if nobody was watching.
+ */
+static int ev_shared_sender(int fd, const void *hdr, size_t hdrlen, PROTO_BUF *buf){
+    SESSION *s = (fd >= 0 && fd < sessions_cap) ? sessions[fd] : NULL;
+    if(s == NULL)
+        return PROTO_SEND_DECLINED;
+    if(s->shut){
+        errno = EPIPE;
+        return -1;
+    }
+    if(over_limit(s, hdrlen + buf->len))
+        return -1;
+    // allocated up front, so that a header never goes out without its payload
+    SESSION_OUT *out = NULL;
+    if(buf->len > 0 && (out = malloc(sizeof(SESSION_OUT))) == NULL)
+        return -1;
+    if(queue_output(s, hdr, hdrlen, NULL, 0, 0) == -1){
+        free(out);
+        return -1;
+    }
+    if(out != NULL){
+        out->next = NULL;
+        out->buf = buf->data;
+        out->len = buf->len;
+        out->off = 0;
+        out->slot = -1;
+        out->shared = proto_buf_ref(buf);
+        append_output(s, out);
+    }
+    mark_deferred(s);
+    return 0;
+}
+
+/*
+ * Submit the queued output of one session as a chain of linked writes,
+ * so that the kernel performs them strictly in order.  Only one chain per
+ * session is in flight at a time; anything queued meanwhile waits for the
+ * next flush.
+ *
+ * The kernel only severs a chain when a request fails, and a SEND that
+ * puts out part of its buffer has not failed unless it was asked for all
+ * of it: so the sends carry MSG_WAITALL, which has the kernel keep at it
+ * until the whole buffer is gone, and complete short (failing the chain)
+ * only if the connection breaks or the send is cancelled.  A WRITE_FIXED
+ * that comes up short fails the chain by itself.  Either way the requests
+ * after a short one complete with -ECANCELED without writing anything,
+ * and once the whole chain is back the remainder is resubmitted from
+ * where it stopped (see evu_sent()).
+ */
+static void evu_submit_output(SESSION *s){
+    struct io_uring_sqe *prev = NULL;
+    for(SESSION_OUT *out = s->out_head; out != NULL; out = out->next){
+        struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+        if(sqe == NULL){
+            // ring full: this partial chain goes now, the rest next time
+            mark_dirty(s);
+            break;
+        }
+        if(out->slot >= 0 && slots_registered){
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->buf_index = 0;
+        }
+        else{
+            sqe->opcode = IORING_OP_SEND;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        }
+        sqe->fd = s->fd;
+        sqe->addr = (unsigned long)(out->buf + out->off);
+        sqe->len = out->len - out->off;
+        sqe->user_data = EVU_DATA(s->fd, EVU_SEND);
+        if(prev != NULL)
+            prev->flags |= IOSQE_IO_LINK;
+        prev = sqe;
+        s->out_inflight++;
+    }
+}
+
+static void evu_flush_list(SESSION *list){
+    while(list != NULL){
+        SESSION *s = list;
+        list = s->next_dirty;
+        s->dirty = 0;
+        if(s->out_inflight == 0 && s->out_head != NULL)
+            evu_submit_output(s);
+    }
+}
+
+static void evu_flush(void){
+    if(frozen)
+        return;
+    SESSION *list = dirty_head;
+    dirty_head = NULL;
+    evu_flush_list(list);
+    // the fan-out goes into the ring after everything else
+    SESSION *s;
+    for(int i = 0; i < EV_FANOUT_BATCH && (s = pop_deferred()) != NULL; i++)
+        if(s->out_inflight == 0 && s->out_head != NULL)
+            evu_submit_output(s);
+}
+
+static void remove_session(SESSION *s);
+
+/*
+ * A session whose coroutine has finished is only finalized once its
+ * output has been written and the multishot receive has terminated,
+ * since the kernel still refers to its fd and buffers until then.
+ */
+static void evu_maybe_finish(SESSION *s){
+    if(!s->closing || s->out_inflight > 0)
+        return;
+    if(s->out_head != NULL){
+        mark_dirty(s);
+        return;
+    }
+    if(s->recv_armed){
+        if(!s->shut){
+            s->shut = 1;
+            shutdown(s->fd, SHUT_RDWR);
+        }
+        return;
+    }
+    remove_session(s);
+}
+
+static void evu_run_session(SESSION *s){
+    // nothing more will arrive for input that's already buffered, so keep
+    // going until the session has consumed all of it
+    do {
+        if(session_run(s) == CO_DONE){
+            s->closing = 1;
+            break;
+        }
+    } while(session_has_input(s));
+    evu_maybe_finish(s);
+}
+
+static int evu_add_session(SESSION *s){
+    if(grow_sessions(s->fd) == -1)
+        return -1;
+    s->buffered = 1;
+    if(evu_arm_recv(s) == -1)
+        return -1;
+    sessions[s->fd] = s;
+    session_count++;
+    start_session_timer(s);
+    return 0;
+}
+
+static void evu_accepted(int fd){
+    if(fd < 0){
+        debug("multishot accept: %s", strerror(-fd));
+        return;
+    }
+    if(!accept_armed){
+        close(fd);
+        return;
+    }
+    SESSION *s = session_create(fd);
+    if(s == NULL){
+        close(fd);
+        return;
+    }
+    if(evu_add_session(s) == -1){
+        session_fini(s);
+        return;
+    }
+    debug("[%d] accepted, %d sessions", fd, session_count);
+}
+
+static void evu_received(SESSION *s, struct io_uring_cqe *cqe){
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    if(cqe->flags & IORING_CQE_F_BUFFER){
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if(cqe->res > 0)
+            s->active_ms = tw_now(timers);
+        if(cqe->res > 0 && !s->closing
+           && session_feed(s, rbufs.base + (size_t)bid * rbufs.size, cqe->res) == -1)
+            session_feed(s, NULL, 0);
+        uring_buf_ring_recycle(&rbufs, bid);
+    }
+    if(!more){
+        s->recv_armed = 0;
+        // ENOBUFS just means we fell behind recycling; 0 or another error is
+        // EOF; and while quiescing the receive was cancelled on purpose
+        if(s->closing || quiescing)
+            ;
+        else if(cqe->res > 0 || cqe->res == -ENOBUFS){
+            if(evu_arm_recv(s) == -1)
+                session_feed(s, NULL, 0);
+        }
+        else
+            session_feed(s, NULL, 0);
+    }
+    if(!s->closing && !quiescing)
+        evu_run_session(s);
+    else
+        evu_maybe_finish(s);
+}
+
+/*
+ * A write of the chain submitted by evu_submit_output() has completed.
+ * The completions of a chain come back in the order it was submitted, so
+ * this one is for the packet at the head of the queue.
+ */
+static void evu_sent(SESSION *s, int res){
+    SESSION_OUT *out = s->out_head;
+    s->out_inflight--;
+    if(res == -ECANCELED){
+        // cancelled after a short write, or by ev_loop_quiesce(): nothing
+        // of it went out, so it stays at the head to be resubmitted
+    }
+    else if(res < 0){
+        drop_output(s);
+    }
+    else if(s->out_short || out == NULL || (size_t)res > out->len - out->off){
+        // written after a gap in the stream, or not what was asked for:
+        // the client can't make sense of what it gets from here on
+        debug("[%d] io_uring write of %d bytes out of order", s->fd, res);
+        drop_output(s);
+    }
+    else{
+        out->off += res;
+        s->out_bytes -= res;
+        if(out->off < out->len){
+            // the rest of the chain won't be written; see evu_submit_output()
+            s->out_short = 1;
+        }
+        else{
+            s->out_head = out->next;
+            if(s->out_head == NULL)
+                s->out_tail = NULL;
+            free_out(out);
+        }
+    }
+    if(s->out_inflight == 0){
+        s->out_short = 0;
+        if(s->out_head != NULL)
+            mark_dirty(s);
+    }
+    evu_maybe_finish(s);
+}
+
+static int evu_once(const sigset_t *sigmask, int timeout_ms){
+    evu_flush();
+    if(deferred_head != NULL && !frozen)
+        timeout_ms = 0;
+    if(uring_submit(&ring, 1, sigmask, timeout_ms) == -1 && errno != EINTR && errno != EBUSY)
+        return -1;
+    refresh_wall();
+    run_timers();
+
+    struct io_uring_cqe *cqe;
+    while((cqe = uring_peek_cqe(&ring)) != NULL){
+        uint64_t data = cqe->user_data;
+        int fd = EVU_FD(data);
+        SESSION *s = fd < sessions_cap ? sessions[fd] : NULL;
+        switch(EVU_OP(data)){
+            case EVU_ACCEPT:
+                evu_accepted(cqe->res);
+                if(!(cqe->flags & IORING_CQE_F_MORE) && accept_armed){
+                    accept_armed = 0;
+                    if(accepting)
+                        evu_arm_accept();
+                }
+                break;
+            case EVU_RECV:
+                if(s != NULL)
+                    evu_received(s, cqe);
+                break;
+            case EVU_SEND:
+                if(s != NULL)
+                    evu_sent(s, cqe->res);
+                break;
+            case EVU_WATCH: {
+                int w = find_watch(fd);
+                if(w == -1)
+                    break;
+                EV_WATCH_FUNC *func = watches[w].func;
+                void *arg = watches[w].arg;
+                if(watches[w].writable){
+                    //a poll cancelled by ev_loop_unwatch(), not this one
+                    if(cqe->res == -ECANCELED)
+                        break;
+                    watches[w] = watches[--nwatches];
+                }
+                else if(!(cqe->flags & IORING_CQE_F_MORE))
+                    evu_arm_watch(fd, 0);
+                if(cqe->res > 0)
+                    func(fd, arg);
+                break;
+            }
+            default:
+                break;
+        }
+        uring_cqe_seen(&ring);
+    }
+    return 0;
+}
+
+/*
+ * The operations the backend uses.  It also needs them to be multishot
+ * where it asks for that, which is checked for separately.
+ */
+static const unsigned char evu_ops[] = {
+    IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_WRITE_FIXED,
+    IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL
+};
+
+static int evu_init(int listenfd){
+    if(uring_init(&ring, EVU_ENTRIES) == -1)
+        return -1;
+    // a kernel that can only do some of it gets the epoll backend, rather
+    // than sessions whose every receive fails
+    if(uring_probe(&ring, evu_ops, sizeof(evu_ops)) == -1 || uring_check_multishot() == -1){
+        uring_fini(&ring);
+        return -1;
+    }
+    if(uring_buf_ring_init(&ring, &rbufs, EVU_RBUF_GROUP, EVU_RBUF_COUNT, EVU_RBUF_SIZE) == -1){
+        uring_fini(&ring);
+        return -1;
+    }
+    slots = malloc((size_t)EVU_SLOT_COUNT * EVU_SLOT_SIZE);
+    free_slots = malloc(EVU_SLOT_COUNT * sizeof(int));
+    if(slots == NULL || free_slots == NULL){
+        free(slots);
+        free(free_slots);
+        uring_buf_ring_fini(&ring, &rbufs);
+        uring_fini(&ring);
+        return -1;
+    }
+    for(int i = 0; i < EVU_SLOT_COUNT; i++)
+        free_slots[i] = EVU_SLOT_COUNT - 1 - i;
+    nfree_slots = EVU_SLOT_COUNT;
+    // without registration (e.g. RLIMIT_MEMLOCK) the slots still work,
+    // they're just sent with plain SEND instead of WRITE_FIXED
+    slots_registered = uring_register_buffer(&ring, slots,
+                                             (size_t)EVU_SLOT_COUNT * EVU_SLOT_SIZE) == 0;
+    listen_fd = listenfd;
+    evu_arm_accept();
+    proto_set_sender(ev_sender);
+    proto_set_shared_sender(ev_shared_sender);
+    return 0;
+}
+
+static void evu_fini(void){
+    proto_set_sender(NULL);
+    proto_set_shared_sender(NULL);
+    uring_buf_ring_fini(&ring, &rbufs);
+    uring_fini(&ring);
+    free(slots);
+    free(free_slots);
+    slots = NULL;
+    free_slots = NULL;
+}
+
+/*
+ * epoll backend
+ */
+
+static int add_session(SESSION *s){
+    if(grow_sessions(s->fd) == -1 || set_nonblocking(s->fd) == -1)
+        return -1;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = s->fd;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev) == -1)
+        return -1;
+    s->ev_mask = ev.events;
+    sessions[s->fd] = s;
+    session_count++;
+    start_session_timer(s);
+    return 0;
+}
+
+static void remove_session(SESSION *s){
+    // it may still be waiting on the dirty list from an earlier send
+    if(s->dirty){
+        SESSION **pp = s->dirty == EV_DEFERRED ? &deferred_head : &dirty_head;
+        SESSION *prev = NULL;
+        while(*pp != s){
+            prev = *pp;
+            pp = &(*pp)->next_dirty;
+        }
+        *pp = s->next_dirty;
+        if(s == deferred_tail)
+            deferred_tail = prev;
+    }
+    tw_cancel(timers, &s->timer);
+    // closing the fd in session_fini() also drops it from the epoll set
+    sessions[s->fd] = NULL;
+    session_count--;
+    session_fini(s);
+}
+
+/*
+ * Watch for input until the session is closing, and for writability
+ * while it has output queued.
+ */
+static void update_events(SESSION *s){
+    unsigned int mask = s->closing || quiescing ? 0 : EPOLLIN | EPOLLRDHUP;
+    if(s->out_head != NULL)
+        mask |= EPOLLOUT;
+    if(mask == s->ev_mask)
+        return;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = mask;
+    ev.data.fd = s->fd;
+    if(epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev) == 0)
+        s->ev_mask = mask;
+}
+
+static void write_output(SESSION *s){
+    while(s->out_head != NULL){
+        struct iovec iov[EV_MAX_IOV];
+        size_t total = 0;
+        int n = 0;
+        for(SESSION_OUT *out = s->out_head; out != NULL && n < EV_MAX_IOV; out = out->next, n++){
+            iov[n].iov_base = out->buf + out->off;
+            iov[n].iov_len = out->len - out->off;
+            total += iov[n].iov_len;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t w = sendmsg(s->fd, &msg, MSG_NOSIGNAL);
+        if(w == -1){
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                drop_output(s);
+            return;
+        }
+        size_t left = w;
+        s->out_bytes -= w;
+        while(left > 0){
+            SESSION_OUT *out = s->out_head;
+            if(left < out->len - out->off){
+                out->off += left;
+                break;
+            }
+            left -= out->len - out->off;
+            s->out_head = out->next;
+            if(s->out_head == NULL)
+                s->out_tail = NULL;
+            free_out(out);
+        }
+        // a short write means the socket buffer is full
+        if((size_t)w < total)
+            return;
+    }
+}
+
+/*
+ * A finished session stays around until its queued output is written.
+ */
+static void maybe_finish(SESSION *s){
+    if(s->closing && s->out_head == NULL)
+        remove_session(s);
+    else
+        update_events(s);
+}
+
+static void accept_connections(void){
+    while(1){
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(fd == -1){
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            // EAGAIN means the backlog is empty; anything else (EMFILE etc.)
+            // is retried on the next readiness notification
+            return;
+        }
+        SESSION *s = session_create(fd);
+        if(s == NULL){
+            close(fd);
+            continue;
+        }
+        if(add_session(s) == -1){
+            session_fini(s);
+            continue;
+        }
+        debug("[%d] accepted, %d sessions", fd, session_count);
+    }
+}
+
+/*
+ * Write out the packets that were held back for the epoll backend's
+ * deferred sessions (see ev_shared_sender()), a batch at a time.
+ * Whatever the sockets won't take waits for EPOLLOUT as usual.
+ */
+static void flush_deferred(void){
+    SESSION *s;
+    for(int i = 0; i < EV_FANOUT_BATCH && (s = pop_deferred()) != NULL; i++){
+        write_output(s);
+        maybe_finish(s);
+    }
+}
+
+/*
+ * One pass of the loop: wait (at most timeout_ms, or indefinitely if that
+ * is -1) for events and dispatch them.
+ */
+static int ev_loop_once(const sigset_t *sigmask, int timeout_ms){
+    run_posted();
+    timeout_ms = posted_head != NULL && !quiescing ? 0 : wait_timeout(timeout_ms);
+    if(use_uring)
+        return evu_once(sigmask, timeout_ms);
+
+    flush_deferred();
+    if(deferred_head != NULL)
+        timeout_ms = 0;
+    struct epoll_event events[EV_MAX_EVENTS];
+    int n = epoll_pwait(epfd, events, EV_MAX_EVENTS, timeout_ms, sigmask);
+    if(n == -1 && errno != EINTR)
+        return -1;
+    refresh_wall();
+    run_timers();
+    for(int i = 0; i < n; i++){
+        int fd = events[i].data.fd;
+        if(fd == listen_fd){
+            if(accepting)
+                accept_connections();
+            continue;
+        }
+        int w = find_watch(fd);
+        if(w != -1){
+            EV_WATCH_FUNC *func = watches[w].func;
+            void *arg = watches[w].arg;
+            if(watches[w].writable){
+                watches[w] = watches[--nwatches];
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+            }
+            func(fd, arg);
+            continue;
+        }
+        SESSION *s = fd < sessions_cap ? sessions[fd] : NULL;
+        if(s == NULL)
+            continue;
+        if(events[i].events & ~EPOLLOUT)
+            s->active_ms = tw_now(timers);
+        if(events[i].events & EPOLLOUT)
+            write_output(s);
+        if(!s->closing && !quiescing && (events[i].events & ~EPOLLOUT)
+           && session_run(s) == CO_DONE)
+            s->closing = 1;
+        maybe_finish(s);
+    }
+    return 0;
+}
+
+int ev_loop_init(int listenfd, int want_uring){
+    debug("EV LOOP INIT");
+    stop_requested = 0;
+    accepting = 1;
+    timers = tw_create(EV_TICK_MS, now_ms());
+    if(timers == NULL)
+        return -1;
+    if(want_uring){
+        if(evu_init(listenfd) == 0){
+            use_uring = 1;
+            return 0;
+        }
+        debug("io_uring unavailable (%s), falling back to epoll", strerror(errno));
+    }
+
+    use_uring = 0;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epfd == -1)
+        return -1;
+    if(set_nonblocking(listenfd) == -1)
+        return -1;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = listenfd;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) == -1)
+        return -1;
+    listen_fd = listenfd;
+    proto_set_sender(ev_sender);
+    proto_set_shared_sender(ev_shared_sender);
+    return 0;
+}
+
+void ev_loop_set_timeouts(unsigned int login_ms, unsigned int idle_ms){
+    login_timeout_ms = login_ms;
+    idle_timeout_ms = idle_ms;
+}
+
+void ev_loop_start_timer(TIMER *timer, uint64_t ms){
+    tw_add(timers, timer, ms);
+}
+
+void ev_loop_cancel_timer(TIMER *timer){
+    tw_cancel(timers, timer);
+}
+
+void ev_call_init(EV_CALL *call, EV_CALL_FUNC *func, void *arg){
+    call->next = NULL;
+    call->posted = 0;
+    call->func = func;
+    call->arg = arg;
+}
+
+void ev_loop_post(EV_CALL *call){
+    if(call->posted)
+        return;
+    call->posted = 1;
+    call->next = NULL;
+    if(posted_tail != NULL)
+        posted_tail->next = call;
+    else
+        posted_head = call;
+    posted_tail = call;
+}
+
+void ev_loop_cancel_post(EV_CALL *call){
+    if(!call->posted)
+        return;
+    //only ever a few pending, so a walk down the list will do
+    EV_CALL **pp = &posted_head, *prev = NULL;
+    while(*pp != call){
+        prev = *pp;
+        pp = &(*pp)->next;
+    }
+    *pp = call->next;
+    if(posted_tail == call)
+        posted_tail = prev;
+    call->next = NULL;
+    call->posted = 0;
+}
+
+uint64_t ev_loop_now(void){
+    return tw_now(timers);
+}
+
+int ev_loop_wall_time(struct timespec *ts){
+    if(!wall_valid)
+        return -1;
+    *ts = wall_now;
+    return 0;
+}
+
+const char *ev_loop_backend(void){
+    return use_uring ? "io_uring" : "epoll";
+}
+
+/*
+ * Sessions can hold complete requests that no event is going to announce
+ * (adopted ones, or ones that were quiesced), so give each of those a
+ * turn before waiting for anything.
+ */
+static void run_buffered_sessions(void){
+    for(int fd = 0; fd < sessions_cap; fd++){
+        SESSION *s = sessions[fd];
+        if(s == NULL || s->closing || !session_has_input(s))
+            continue;
+        if(use_uring){
+            evu_run_session(s);
+        }
+        else{
+            if(session_run(s) == CO_DONE)
+                s->closing = 1;
+            maybe_finish(s);
+        }
+    }
+}
+
+int ev_loop_run(const sigset_t *sigmask){
+    debug("EV LOOP RUN (%s)", ev_loop_backend());
+    run_buffered_sessions();
+    while(!stop_requested){
+        if(ev_loop_once(sigmask, -1) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+int ev_loop_poll(void){
+    return ev_loop_once(NULL, 0);
+}
+
+void ev_loop_stop(void){
+    stop_requested = 1;
+}
+
+void ev_loop_stop_accepting(void){
+    if(!accepting)
+        return;
+    debug("EV LOOP STOP ACCEPTING");
+    accepting = 0;
+    if(use_uring){
+        // connections the kernel accepts before the cancel lands are
+        // closed by evu_accepted()
+        if(accept_armed){
+            evu_cancel(listen_fd, EVU_ACCEPT);
+            accept_armed = 0;
+            uring_submit(&ring, 0, NULL, -1);
+        }
+    }
+    else if(epfd != -1){
+        epoll_ctl(epfd, EPOLL_CTL_DEL, listen_fd, NULL);
+    }
+}
+
+void ev_loop_for_each_session(void (*func)(SESSION *, void *), void *arg){
+    for(int fd = 0; fd < sessions_cap; fd++)
+        if(sessions[fd] != NULL)
+            func(sessions[fd], arg);
+}
+
+int ev_loop_drain(int timeout_ms){
+    debug("EV LOOP DRAIN (%d sessions, %d ms)", session_count, timeout_ms);
+    ev_loop_stop_accepting();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(session_count > 0){
+        int left = -1;
+        if(timeout_ms >= 0){
+            left = timeout_ms - ms_since(&start);
+            if(left <= 0)
+                return 1;
+        }
+        if(ev_loop_once(NULL, left) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+int ev_loop_close_all(size_t *unsentp){
+    debug("EV LOOP CLOSE ALL (%d sessions)", session_count);
+    int closed = 0;
+    size_t unsent = 0;
+    for(int fd = 0; fd < sessions_cap; fd++){
+        SESSION *s = sessions[fd];
+        if(s == NULL)
+            continue;
+        for(SESSION_OUT *out = s->out_head; out != NULL; out = out->next)
+            unsent += out->len - out->off;
+        closed++;
+        s->closing = 1;
+        if(use_uring){
+            // the kernel still owns buffers of in-flight operations, so
+            // the session is freed once those fail, which they do as soon
+            // as the socket is shut down
+            if(!s->shut){
+                s->shut = 1;
+                shutdown(s->fd, SHUT_RDWR);
+            }
+            evu_maybe_finish(s);
+        }
+        else{
+            drop_output(s);
+            remove_session(s);
+        }
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(session_count > 0 && ms_since(&start) < EV_REAP_MS){
+        if(ev_loop_once(NULL, EV_REAP_MS) == -1)
+            break;
+    }
+    // should never happen, but the registry must end up empty regardless;
+    // uring_fini() is about to cancel whatever is left
+    for(int fd = 0; fd < sessions_cap && session_count > 0; fd++){
+        if(sessions[fd] != NULL){
+            drop_output(sessions[fd]);
+            remove_session(sessions[fd]);
+        }
+    }
+    if(unsentp != NULL)
+        *unsentp = unsent;
+    return closed;
+}
+
+static int add_watch(int fd, int writable, EV_WATCH_FUNC *func, void *arg){
+    if(nwatches == EV_MAX_WATCHES || find_watch(fd) != -1)
+        return -1;
+    if(use_uring){
+        evu_arm_watch(fd, writable);
+    }
+    else{
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = writable ? EPOLLOUT | EPOLLONESHOT : EPOLLIN;
+        ev.data.fd = fd;
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+            return -1;
+    }
+    watches[nwatches].fd = fd;
+    watches[nwatches].writable = writable;
+    watches[nwatches].func = func;
+    watches[nwatches].arg = arg;
+    nwatches++;
+    return 0;
+}
+
+int ev_loop_watch(int fd, EV_WATCH_FUNC *func, void *arg){
+    return add_watch(fd, 0, func, arg);
+}
+
+int ev_loop_watch_writable(int fd, EV_WATCH_FUNC *func, void *arg){
+    return add_watch(fd, 1, func, arg);
+}
+
+void ev_loop_unwatch(int fd){
+    int w = find_watch(fd);
+    if(w == -1)
+        return;
+    watches[w] = watches[--nwatches];
+    if(use_uring){
+        evu_cancel(fd, EVU_WATCH);
+        uring_submit(&ring, 0, NULL, -1);
+    }
+    else{
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+}
+
+/*
+ * Nothing is in the kernel's hands, and (unless the time is up)
+ * nothing is waiting to be written.
+ */
+static int is_quiet(int output_too){
+    for(int fd = 0; fd < sessions_cap; fd++){
+        SESSION *s = sessions[fd];
+        if(s == NULL)
+            continue;
+        if(s->recv_armed || s->out_inflight > 0 || (output_too && s->out_head != NULL))
+            return 0;
+    }
+    return 1;
+}
+
+int ev_loop_quiesce(int timeout_ms){
+    debug("EV LOOP QUIESCE (%d sessions)", session_count);
+    ev_loop_stop_accepting();
+    quiescing = 1;
+    for(int fd = 0; fd < sessions_cap; fd++){
+        SESSION *s = sessions[fd];
+        if(s == NULL)
+            continue;
+        if(use_uring){
+            // whatever the receive has already picked up lands in the inbox
+            if(s->recv_armed)
+                evu_cancel(fd, EVU_RECV);
+        }
+        else{
+            update_events(s);
+        }
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(!is_quiet(1)){
+        int left = timeout_ms - ms_since(&start);
+        if(left <= 0)
+            break;
+        if(ev_loop_once(NULL, left) == -1)
+            return -1;
+    }
+    if(!use_uring || is_quiet(1))
+        return 0;
+
+    // out of time: take back the writes that haven't completed, so that
+    // what's left of each queue is exactly what hasn't been sent
+    frozen = 1;
+    for(int fd = 0; fd < sessions_cap; fd++)
+        if(sessions[fd] != NULL && sessions[fd]->out_inflight > 0)
+            evu_cancel(fd, EVU_SEND);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(!is_quiet(0) && ms_since(&start) < EV_REAP_MS){
+        if(ev_loop_once(NULL, EV_REAP_MS) == -1)
+            return -1;
+    }
+    return is_quiet(0) ? 0 : -1;
+}
+
+void ev_loop_resume(void){
+    debug("EV LOOP RESUME");
+    quiescing = 0;
+    frozen = 0;
+    stop_requested = 0;
+    accepting = 1;
+    if(use_uring)
+        evu_arm_accept();
+    else{
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = listen_fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+    }
+    for(int fd = 0; fd < sessions_cap; fd++){
+        SESSION *s = sessions[fd];
+        if(s == NULL)
+            continue;
+        if(!use_uring)
+            update_events(s);
+        else if(s->closing)
+            evu_maybe_finish(s);
+        else if(!s->recv_armed && !s->shut && evu_arm_recv(s) == -1)
+            session_feed(s, NULL, 0);
+        if(use_uring && s->out_head != NULL)
+            mark_dirty(s);
+    }
+}
+
+size_t ev_loop_unsent(SESSION *s, char **bufp){
+    size_t len = 0;
+    for(SESSION_OUT *out = s->out_head; out != NULL; out = out->next)
+        len += out->len - out->off;
+    *bufp = NULL;
+    if(len == 0)
+        return 0;
+    char *buf = malloc(len);
+    if(buf == NULL)
+        return 0;
+    size_t off = 0;
+    for(SESSION_OUT *out = s->out_head; out != NULL; out = out->next){
+        memcpy(buf + off, out->buf + out->off, out->len - out->off);
+        off += out->len - out->off;
+    }
+    *bufp = buf;
+    return len;
+}
+
+SESSION *ev_loop_adopt(int fd, const void *in, size_t inlen,
+                       const void *out, size_t outlen){
+    SESSION *s = session_create(fd);
+    if(s == NULL)
+        return NULL;
+    if(inlen > 0 && session_feed(s, in, inlen) == -1){
+        session_fini(s);
+        return NULL;
+    }
+    if(outlen > 0 && queue_output(s, out, outlen, NULL, 0, 0) == -1){
+        session_fini(s);
+        return NULL;
+    }
+    if((use_uring ? evu_add_session(s) : add_session(s)) == -1){
+        drop_output(s);
+        session_fini(s);
+        return NULL;
+    }
+    if(s->out_head != NULL){
+        if(use_uring)
+            mark_dirty(s);
+        else
+            update_events(s);
+    }
+    debug("[%d] adopted, %d sessions", fd, session_count);
+    return s;
+}
+
+int ev_loop_session_count(void){
+    return session_count;
+}
+
+void ev_loop_fini(void){
+    debug("EV LOOP FINI");
+    if(use_uring)
+        evu_fini();
+    else{
+        proto_set_sender(NULL);
+        proto_set_shared_sender(NULL);
+    }
+    if(epfd != -1)
+        close(epfd);
+    epfd = -1;
+    free(sessions);
+    sessions = NULL;
+    sessions_cap = 0;
+    if(timers != NULL)
+        tw_fini(timers);
+    timers = NULL;
+    //calls still pending are forgotten, like the timers
+    while(posted_head != NULL){
+        EV_CALL *call = posted_head;
+        posted_head = call->next;
+        call->next = NULL;
+        call->posted = 0;
+    }
+    posted_tail = NULL;
+}
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+
+#include "debug.h"
+#include "game_clock.h"
+#include "event_loop.h"
+
+typedef struct game_clock {
+    uint64_t remaining[3];       // indexed by GAME_ROLE; [NULL_ROLE] unused
+    uint64_t increment;
+    GAME_ROLE running;           // NULL_ROLE while stopped
+    uint64_t started;            // when the running side's clock started
+    TIMER flag_timer;            // goes off when the running side runs out
+    GAME_CLOCK_FUNC *flag;
+    void *arg;
+} GAME_CLOCK;
+
+static void flag_fell(TIMER *timer, void *arg){
+    GAME_CLOCK *clock = arg;
+    GAME_ROLE role = clock->running;
+    debug("CLOCK %p flag fell for role %d", clock, role);
+    clock->remaining[role] = 0;
+    clock->running = NULL_ROLE;
+    //last thing, since this may well free the clock
+    clock->flag(clock, role, clock->arg);
+}
+
+GAME_CLOCK *gclock_create(uint64_t first_ms, uint64_t second_ms, uint64_t increment_ms,
+                          GAME_CLOCK_FUNC *flag, void *arg){
+    GAME_CLOCK *clock = calloc(1, sizeof(GAME_CLOCK));
+    if(clock == NULL)
+        return NULL;
+    clock->remaining[FIRST_PLAYER_ROLE] = first_ms;
+    clock->remaining[SECOND_PLAYER_ROLE] = second_ms;
+    clock->increment = increment_ms;
+    clock->running = NULL_ROLE;
+    clock->flag = flag;
+    clock->arg = arg;
+    timer_init(&clock->flag_timer, flag_fell, clock);
+    return clock;
+}
+
+void gclock_free(GAME_CLOCK *clock){
+    ev_loop_cancel_timer(&clock->flag_timer);
+    free(clock);
+}
+
+int gclock_start(GAME_CLOCK *clock, GAME_ROLE role){
+    if(clock->running != NULL_ROLE || (role != FIRST_PLAYER_ROLE && role != SECOND_PLAYER_ROLE))
+        return -1;
+    clock->running = role;
+    clock->started = ev_loop_now();
+    ev_loop_start_timer(&clock->flag_timer, clock->remaining[role]);
+    return 0;
+}
+
+//time the running side has used since its clock started
+static uint64_t elapsed(GAME_CLOCK *clock){
+    uint64_t now = ev_loop_now();
+    return now > clock->started ? now - clock->started : 0;
+}
+
+int gclock_press(GAME_CLOCK *clock, GAME_ROLE role){
+    if(clock->running != role || role == NULL_ROLE)
+        return -1;
+    uint64_t used = elapsed(clock);
+    //the timer can be up to a tick late; the flag has fallen regardless
+    if(used >= clock->remaining[role])
+        return -1;
+    clock->remaining[role] -= used;
+    clock->remaining[role] += clock->increment;
+    clock->running = NULL_ROLE;
+    return gclock_start(clock, role == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE);
+}
+
+void gclock_stop(GAME_CLOCK *clock){
+    if(clock->running == NULL_ROLE)
+        return;
+    clock->remaining[clock->running] = gclock_remaining(clock, clock->running);
+    clock->running = NULL_ROLE;
+    ev_loop_cancel_timer(&clock->flag_timer);
+}
+
+uint64_t gclock_remaining(GAME_CLOCK *clock, GAME_ROLE role){
+    if(role != FIRST_PLAYER_ROLE && role != SECOND_PLAYER_ROLE)
+        return 0;
+    if(role != clock->running)
+        return clock->remaining[role];
+    uint64_t used = elapsed(clock);
+    return used < clock->remaining[role] ? clock->remaining[role] - used : 0;
+}
+
+uint64_t gclock_increment(GAME_CLOCK *clock){
+    return clock->increment;
+}
+
+GAME_ROLE gclock_running(GAME_CLOCK *clock){
+    return clock->running;
+}
@@ -0,0 +1,680 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "debug.h"
+#include "handoff.h"
+#include "event_loop.h"
+#include "client_registry.h"
+#include "client_ext.h"
+#include "invitation_ext.h"
+#include "match_queue.h"
+#include "player_ext.h"
+#include "player_registry_ext.h"
+#include "game.h"
+#include "jeux_globals.h"
+
+#define HANDOFF_MAGIC    0x4a455558        // "JEUX"
+#define HANDOFF_VERSION  4
+#define HANDOFF_ACK      'K'
+// most file descriptors one SCM_RIGHTS message can carry (SCM_MAX_FD)
+#define HANDOFF_FDS_PER_MSG 253
+// how long the old server waits for the new one to acknowledge
+#define HANDOFF_ACK_MS   10000
+
+typedef struct handoff_player {
+    char *name;
+    int rating;
+} HANDOFF_PLAYER;
+
+typedef struct handoff_session {
+    int fd;
+    char *name;                  // player it is logged in as, or NULL
+    char *in, *out;
+    size_t inlen, outlen;
+    int queued;                  // waiting for a match
+} HANDOFF_SESSION;
+
+typedef struct handoff_invitation {
+    unsigned int source, target; // indices into the sessions
+    int source_role, target_role;
+    int source_id, target_id;
+    int accepted;
+    unsigned int nmoves;
+    char **moves;
+    int clock_running;           // role whose clock runs, NULL_ROLE if untimed
+    unsigned int first_ms, second_ms, increment_ms;
+} HANDOFF_INVITATION;
+
+typedef struct handoff_watch {
+    unsigned int spectator;      // index into the sessions
+    int id;                      // the spectator's id for the game
+    unsigned int source;         // the game, by its source's session index
+    int source_id;               // and the source's id for it
+} HANDOFF_WATCH;
+
+/*
+ * The received state.  All of the strings and buffers point into blob.
+ */
+struct handoff {
+    char *blob;
+    int listenfd;
+    unsigned int nplayers, nsessions, ninvitations, nwatches;
+    HANDOFF_PLAYER *players;
+    HANDOFF_SESSION *sessions;
+    HANDOFF_INVITATION *invitations;
+    HANDOFF_WATCH *watches;
+};
+
+/*
+ * Snapshot encoding.  Everything is in host byte order, since both ends
+ * are on the same machine; strings include their NUL.
+ */
+
+static void put_u32(FILE *f, uint32_t v){
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+static void put_bytes(FILE *f, const void *p, size_t len){
+    put_u32(f, len);
+    if(len > 0)
+        fwrite(p, 1, len, f);
+}
+
+static void put_str(FILE *f, const char *s){
+    put_bytes(f, s, s != NULL ? strlen(s) + 1 : 0);
+}
+
+typedef struct cursor {
+    char *p, *end;
+    int bad;
+} CURSOR;
+
+static uint32_t get_u32(CURSOR *c){
+    uint32_t v = 0;
+    if(c->end - c->p < (long)sizeof(v)){
+        c->bad = 1;
+        return 0;
+    }
+    memcpy(&v, c->p, sizeof(v));
+    c->p += sizeof(v);
+    return v;
+}
+
+static char *get_bytes(CURSOR *c, size_t *lenp){
+    size_t len = get_u32(c);
+    *lenp = 0;
+    if(c->bad || (size_t)(c->end - c->p) < len){
+        c->bad = 1;
+        return NULL;
+    }
+    char *p = len > 0 ? c->p : NULL;
+    c->p += len;
+    *lenp = len;
+    return p;
+}
+
+static char *get_str(CURSOR *c){
+    size_t len;
+    char *s = get_bytes(c, &len);
+    if(s != NULL && s[len - 1] != '\0'){
+        c->bad = 1;
+        return NULL;
+    }
+    return s;
+}
+
+static int write_fully(int fd, const void *buf, size_t len){
+    while(len > 0){
+        ssize_t n = write(fd, buf, len);
+        if(n == -1){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_fully(int fd, void *buf, size_t len){
+    while(len > 0){
+        ssize_t n = read(fd, buf, len);
+        if(n == 0)
+            errno = ECONNRESET;
+        if(n <= 0){
+            if(n == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (char *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_fds(int conn, const int *fds, int n){
+    while(n > 0){
+        int batch = n < HANDOFF_FDS_PER_MSG ? n : HANDOFF_FDS_PER_MSG;
+        char byte = 0;
+        struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+        char ctl[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+        memset(ctl, 0, sizeof(ctl));
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl;
+        msg.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(batch * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, batch * sizeof(int));
+        if(sendmsg(conn, &msg, 0) == -1){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        fds += batch;
+        n -= batch;
+    }
+    return 0;
+}
+
+static int recv_fds(int conn, int *fds, int n){
+    int got = 0;
+    while(got < n){
+        char byte;
+        struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+        char ctl[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl;
+        msg.msg_controllen = sizeof(ctl);
+        ssize_t r = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+        if(r == -1 && errno == EINTR)
+            continue;
+        if(r <= 0 || (msg.msg_flags & MSG_CTRUNC))
+            return -1;
+        for(struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)){
+            if(cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+                continue;
+            int k = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if(got + k > n)
+                return -1;
+            memcpy(fds + got, CMSG_DATA(cm), k * sizeof(int));
+            got += k;
+        }
+    }
+    return 0;
+}
+
+static int unix_address(const char *path, struct sockaddr_un *addr){
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr->sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int handoff_listen(const char *path){
+    struct sockaddr_un addr;
+    if(unix_address(path, &addr) == -1)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+        return -1;
+    // the previous server's socket file, if any; that server is gone or
+    // about to be
+    unlink(path);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 1) == -1){
+        close(fd);
+        return -1;
+    }
+    debug("handoff control socket %s", path);
+    return fd;
+}
+
+/*
+ * Old server side
+ */
+
+static void collect_session(SESSION *s, void *arg){
+    SESSION ***pp = arg;
+    *(*pp)++ = s;
+}
+
+static void put_snapshot(FILE *f, SESSION **ss, int n){
+    put_u32(f, HANDOFF_MAGIC);
+    put_u32(f, HANDOFF_VERSION);
+
+    PLAYER **players = preg_all_players(player_registry);
+    int np = 0;
+    while(players != NULL && players[np] != NULL)
+        np++;
+    put_u32(f, np);
+    for(int i = 0; i < np; i++){
+        put_str(f, player_get_name(players[i]));
+        put_u32(f, player_get_rating(players[i]));
+        player_unref(players[i], "handoff snapshot");
+    }
+    free(players);
+
+    // session indices of the clients, by file descriptor
+    int maxfd = 0;
+    for(int i = 0; i < n; i++)
+        if(ss[i]->fd > maxfd)
+            maxfd = ss[i]->fd;
+    int *index = malloc((maxfd + 1) * sizeof(int));
+    if(index != NULL)
+        for(int i = 0; i < n; i++)
+            index[ss[i]->fd] = i;
+
+    put_u32(f, n);
+    for(int i = 0; i < n; i++){
+        PLAYER *player = client_get_player(ss[i]->client);
+        put_str(f, player != NULL ? player_get_name(player) : NULL);
+        char *buf;
+        size_t len = session_unconsumed(ss[i], &buf);
+        put_bytes(f, buf, len);
+        free(buf);
+        len = ev_loop_unsent(ss[i], &buf);
+        put_bytes(f, buf, len);
+        free(buf);
+        put_u32(f, mq_is_waiting(match_queue, ss[i]->client));
+    }
+
+    // each invitation once, from its source's side; they are counted as
+    // they go, so they are gathered separately and appended after the count
+    char *invbuf = NULL;
+    size_t invlen = 0;
+    FILE *g = open_memstream(&invbuf, &invlen);
+    int ninv = 0;
+    for(int i = 0; i < n && index != NULL && g != NULL; i++){
+        CLIENT *client = ss[i]->client;
+        int *ids;
+        INVITATION **invs;
+        int k = client_list_invitations(client, &ids, &invs);
+        for(int j = 0; j < k; j++){
+            INVITATION *inv = invs[j];
+            CLIENT *target = inv_get_target(inv);
+            int tid = client_invitation_id(target, inv);
+            // games with bots are not carried over: the bots have no
+            // sessions, and the new server starts its own
+            if(inv_get_source(inv) == client && tid >= 0 && client_get_fd(target) >= 0
+               && client_get_fd(target) <= maxfd){
+                put_u32(g, i);
+                put_u32(g, index[client_get_fd(target)]);
+                put_u32(g, inv_get_source_role(inv));
+                put_u32(g, inv_get_target_role(inv));
+                put_u32(g, ids[j]);
+                put_u32(g, tid);
+                put_u32(g, inv_get_game(inv) != NULL);
+                int nmoves;
+                char **moves = inv_get_moves(inv, &nmoves);
+                put_u32(g, nmoves);
+                for(int m = 0; m < nmoves; m++)
+                    put_str(g, moves[m]);
+                // the time that passes during the handoff is on the house
+                GAME_CLOCK *clock = inv_get_clock(inv);
+                put_u32(g, clock != NULL ? gclock_running(clock) : NULL_ROLE);
+                put_u32(g, clock != NULL ? gclock_remaining(clock, FIRST_PLAYER_ROLE) : 0);
+                put_u32(g, clock != NULL ? gclock_remaining(clock, SECOND_PLAYER_ROLE) : 0);
+                put_u32(g, clock != NULL ? gclock_increment(clock) : 0);
+                ninv++;
+            }
+            inv_unref(inv, "handoff snapshot");
+        }
+        if(k >= 0){
+            free(ids);
+            free(invs);
+        }
+    }
+    if(g != NULL)
+        fclose(g);
+    put_u32(f, ninv);
+    if(invlen > 0)
+        fwrite(invbuf, 1, invlen, f);
+    free(invbuf);
+
+    // what each spectator is watching, the game identified by its source
+    invbuf = NULL;
+    invlen = 0;
+    g = open_memstream(&invbuf, &invlen);
+    int nwatch = 0;
+    for(int i = 0; i < n && index != NULL && g != NULL; i++){
+        int *ids;
+        INVITATION **invs;
+        int k = client_list_watches(ss[i]->client, &ids, &invs);
+        for(int j = 0; j < k; j++){
+            CLIENT *source = inv_get_source(invs[j]);
+            int sid = client_invitation_id(source, invs[j]);
+            if(sid >= 0 && client_get_fd(source) >= 0 && client_get_fd(source) <= maxfd){
+                put_u32(g, i);
+                put_u32(g, ids[j]);
+                put_u32(g, index[client_get_fd(source)]);
+                put_u32(g, sid);
+                nwatch++;
+            }
+            inv_unref(invs[j], "handoff snapshot");
+        }
+        if(k >= 0){
+            free(ids);
+            free(invs);
+        }
+    }
+    free(index);
+    if(g != NULL)
+        fclose(g);
+    put_u32(f, nwatch);
+    if(invlen > 0)
+        fwrite(invbuf, 1, invlen, f);
+    free(invbuf);
+}
+
+int handoff_send(int conn, int listenfd){
+    int n = ev_loop_session_count();
+    SESSION **ss = malloc((n + 1) * sizeof(SESSION *));
+    int *fds = malloc((n + 1) * sizeof(int));
+    char *blob = NULL;
+    size_t bloblen = 0;
+    FILE *f = open_memstream(&blob, &bloblen);
+    if(ss == NULL || fds == NULL || f == NULL){
+        if(f != NULL)
+            fclose(f);
+        free(blob);
+        free(ss);
+        free(fds);
+        return -1;
+    }
+    SESSION **p = ss;
+    ev_loop_for_each_session(collect_session, &p);
+    put_snapshot(f, ss, n);
+    fclose(f);
+
+    fds[0] = listenfd;
+    for(int i = 0; i < n; i++)
+        fds[i + 1] = ss[i]->fd;
+    uint32_t len = bloblen;
+    int ret = -1;
+    if(write_fully(conn, &len, sizeof(len)) == 0 && write_fully(conn, blob, bloblen) == 0
+       && send_fds(conn, fds, n + 1) == 0){
+        struct pollfd pfd = { .fd = conn, .events = POLLIN };
+        char ack;
+        if(poll(&pfd, 1, HANDOFF_ACK_MS) == 1 && read(conn, &ack, 1) == 1 && ack == HANDOFF_ACK)
+            ret = 0;
+    }
+    debug("handoff of %d sessions (%zu bytes of state): %s", n, bloblen, ret == 0 ? "done" : "failed");
+    free(blob);
+    free(ss);
+    free(fds);
+    return ret;
+}
+
+/*
+ * New server side
+ */
+
+static int parse_snapshot(HANDOFF *h, size_t len){
+    CURSOR c = { .p = h->blob, .end = h->blob + len, .bad = 0 };
+    if(get_u32(&c) != HANDOFF_MAGIC || get_u32(&c) != HANDOFF_VERSION)
+        return -1;
+
+    // every entry takes at least four bytes, which bounds the counts
+    h->nplayers = get_u32(&c);
+    if(c.bad || h->nplayers > len / 4)
+        return -1;
+    h->players = calloc(h->nplayers + 1, sizeof(HANDOFF_PLAYER));
+    if(h->players == NULL)
+        return -1;
+    for(unsigned int i = 0; i < h->nplayers; i++){
+        h->players[i].name = get_str(&c);
+        h->players[i].rating = (int)get_u32(&c);
+        if(h->players[i].name == NULL)
+            c.bad = 1;
+    }
+
+    h->nsessions = get_u32(&c);
+    if(c.bad || h->nsessions > len / 4)
+        return -1;
+    h->sessions = calloc(h->nsessions + 1, sizeof(HANDOFF_SESSION));
+    if(h->sessions == NULL)
+        return -1;
+    for(unsigned int i = 0; i < h->nsessions; i++){
+        HANDOFF_SESSION *s = &h->sessions[i];
+        s->fd = -1;
+        s->name = get_str(&c);
+        s->in = get_bytes(&c, &s->inlen);
+        s->out = get_bytes(&c, &s->outlen);
+        s->queued = get_u32(&c);
+    }
+
+    h->ninvitations = get_u32(&c);
+    if(c.bad || h->ninvitations > len / 4)
+        return -1;
+    h->invitations = calloc(h->ninvitations + 1, sizeof(HANDOFF_INVITATION));
+    if(h->invitations == NULL)
+        return -1;
+    for(unsigned int i = 0; i < h->ninvitations && !c.bad; i++){
+        HANDOFF_INVITATION *inv = &h->invitations[i];
+        inv->source = get_u32(&c);
+        inv->target = get_u32(&c);
+        inv->source_role = get_u32(&c);
+        inv->target_role = get_u32(&c);
+        inv->source_id = get_u32(&c);
+        inv->target_id = get_u32(&c);
+        inv->accepted = get_u32(&c);
+        inv->nmoves = get_u32(&c);
+        if(inv->source >= h->nsessions || inv->target >= h->nsessions
+           || inv->nmoves > len / 4){
+            c.bad = 1;
+            break;
+        }
+        inv->moves = calloc(inv->nmoves + 1, sizeof(char *));
+        if(inv->moves == NULL)
+            return -1;
+        for(unsigned int m = 0; m < inv->nmoves; m++)
+            if((inv->moves[m] = get_str(&c)) == NULL)
+                c.bad = 1;
+        inv->clock_running = get_u32(&c);
+        inv->first_ms = get_u32(&c);
+        inv->second_ms = get_u32(&c);
+        inv->increment_ms = get_u32(&c);
+    }
+
+    h->nwatches = get_u32(&c);
+    if(c.bad || h->nwatches > len / 4)
+        return -1;
+    h->watches = calloc(h->nwatches + 1, sizeof(HANDOFF_WATCH));
+    if(h->watches == NULL)
+        return -1;
+    for(unsigned int i = 0; i < h->nwatches && !c.bad; i++){
+        HANDOFF_WATCH *w = &h->watches[i];
+        w->spectator = get_u32(&c);
+        w->id = get_u32(&c);
+        w->source = get_u32(&c);
+        w->source_id = get_u32(&c);
+        if(w->spectator >= h->nsessions || w->source >= h->nsessions)
+            c.bad = 1;
+    }
+    return c.bad ? -1 : 0;
+}
+
+int handoff_receive(const char *path, HANDOFF **hp){
+    *hp = NULL;
+    struct sockaddr_un addr;
+    if(unix_address(path, &addr) == -1)
+        return -1;
+    int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(conn == -1)
+        return -1;
+    if(connect(conn, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+        close(conn);
+        // no server (or a stale socket file): start from scratch
+        return errno == ENOENT || errno == ECONNREFUSED ? 0 : -1;
+    }
+    debug("taking over from the server at %s", path);
+
+    HANDOFF *h = calloc(1, sizeof(HANDOFF));
+    int *fds = NULL;
+    uint32_t len;
+    if(h == NULL || read_fully(conn, &len, sizeof(len)) == -1)
+        goto fail;
+    h->listenfd = -1;
+    h->blob = malloc(len);
+    if(h->blob == NULL || read_fully(conn, h->blob, len) == -1 || parse_snapshot(h, len) == -1)
+        goto fail;
+    fds = malloc((h->nsessions + 1) * sizeof(int));
+    if(fds == NULL || recv_fds(conn, fds, h->nsessions + 1) == -1)
+        goto fail;
+    h->listenfd = fds[0];
+    for(unsigned int i = 0; i < h->nsessions; i++)
+        h->sessions[i].fd = fds[i + 1];
+    free(fds);
+
+    char ack = HANDOFF_ACK;
+    if(write_fully(conn, &ack, 1) == -1){
+        // the old server carries on; drop our copies of its sockets
+        close(h->listenfd);
+        for(unsigned int i = 0; i < h->nsessions; i++)
+            close(h->sessions[i].fd);
+        fds = NULL;
+        goto fail;
+    }
+    close(conn);
+    *hp = h;
+    return 0;
+
+fail:
+    free(fds);
+    close(conn);
+    if(h != NULL)
+        handoff_free(h);
+    return -1;
+}
+
+int handoff_listen_fd(HANDOFF *h){
+    return h->listenfd;
+}
+
+static void restore_invitation(HANDOFF_INVITATION *hi, CLIENT *source, CLIENT *target){
+    INVITATION *inv = inv_create(source, target, hi->source_role, hi->target_role);
+    if(inv == NULL)
+        return;
+    if(hi->accepted){
+        if(inv_accept(inv) == -1){
+            inv_unref(inv, "handoff restore failed");
+            return;
+        }
+        GAME *game = inv_get_game(inv);
+        for(unsigned int m = 0; m < hi->nmoves; m++){
+            GAME_MOVE *move = game_parse_move(game, NULL_ROLE, hi->moves[m]);
+            if(move == NULL || game_apply_move(game, move) == -1){
+                free(move);
+                break;
+            }
+            free(move);
+            inv_record_move(inv, hi->moves[m]);
+        }
+        if(hi->clock_running != NULL_ROLE
+           && client_start_clock(inv, hi->first_ms, hi->second_ms, hi->increment_ms,
+                                 hi->clock_running) == -1)
+            debug("handoff: game clock not restored");
+    }
+    else if(client_start_expiry(inv) == -1)
+        debug("handoff: invitation will not expire");
+    if(client_restore_invitation(source, inv, hi->source_id) == 0
+       && client_restore_invitation(target, inv, hi->target_id) == -1)
+        client_remove_invitation(source, inv);
+    inv_unref(inv, "handoff restore");
+}
+
+static void restore_watch(HANDOFF_WATCH *hw, CLIENT *spectator, CLIENT *source){
+    if(spectator == NULL || source == NULL)
+        return;
+    int *ids;
+    INVITATION **invs;
+    int k = client_list_invitations(source, &ids, &invs);
+    for(int j = 0; j < k; j++){
+        if(ids[j] == hw->source_id && client_restore_watch(spectator, invs[j], hw->id) == -1)
+            debug("handoff: watch not restored");
+        inv_unref(invs[j], "handoff restore");
+    }
+    if(k >= 0){
+        free(ids);
+        free(invs);
+    }
+}
+
+int handoff_restore(HANDOFF *h){
+    for(unsigned int i = 0; i < h->nplayers; i++){
+        PLAYER *player = preg_register(player_registry, h->players[i].name);
+        if(player == NULL)
+            continue;
+        player_set_rating(player, h->players[i].rating);
+        player_unref(player, "handoff restore");
+    }
+
+    CLIENT **clients = calloc(h->nsessions + 1, sizeof(CLIENT *));
+    int adopted = 0;
+    for(unsigned int i = 0; i < h->nsessions; i++){
+        HANDOFF_SESSION *hs = &h->sessions[i];
+        SESSION *s = ev_loop_adopt(hs->fd, hs->in, hs->inlen, hs->out, hs->outlen);
+        if(s == NULL){
+            close(hs->fd);
+            continue;
+        }
+        adopted++;
+        if(clients != NULL)
+            clients[i] = s->client;
+        if(hs->name != NULL){
+            PLAYER *player = preg_register(player_registry, hs->name);
+            if(player != NULL){
+                client_login(s->client, player);
+                player_unref(player, "handoff restore");
+            }
+        }
+    }
+
+    for(unsigned int i = 0; i < h->ninvitations && clients != NULL; i++){
+        HANDOFF_INVITATION *hi = &h->invitations[i];
+        if(clients[hi->source] != NULL && clients[hi->target] != NULL)
+            restore_invitation(hi, clients[hi->source], clients[hi->target]);
+    }
+    for(unsigned int i = 0; i < h->nwatches && clients != NULL; i++)
+        restore_watch(&h->watches[i], clients[h->watches[i].spectator],
+                      clients[h->watches[i].source]);
+    //back in the queue once the games in progress are in place; they wait
+    //afresh, with the narrowest window
+    for(unsigned int i = 0; i < h->nsessions && clients != NULL; i++)
+        if(h->sessions[i].queued && clients[i] != NULL)
+            mq_join(match_queue, clients[i]);
+    free(clients);
+    debug("took over %d sessions, %u invitations", adopted, h->ninvitations);
+    return adopted;
+}
+
+void handoff_free(HANDOFF *h){
+    if(h->invitations != NULL)
+        for(unsigned int i = 0; i < h->ninvitations; i++)
+            free(h->invitations[i].moves);
+    free(h->invitations);
+    free(h->watches);
+    free(h->sessions);
+    free(h->players);
+    free(h->blob);
+    free(h);
+}
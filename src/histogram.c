@@ -0,0 +1,69 @@
+#include <stdint.h>
+
+#include "histogram.h"
+
+#define HIST_SUB (1 << HIST_SUB_BITS)
+
+/*
+ * The bucket for a value: its top HIST_SUB_BITS + 1 bits, less the
+ * leading 1, together with where that leading 1 is.
+ */
+static int bucket(uint64_t v){
+    if(v >= (uint64_t)1 << HIST_MAX_BITS)
+        v = ((uint64_t)1 << HIST_MAX_BITS) - 1;
+    if(v < 2 * HIST_SUB)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)(v >> shift) - HIST_SUB;
+}
+
+// the middle of the values in a bucket
+static double bucket_value(int i){
+    if(i < 2 * HIST_SUB)
+        return i;
+    int shift = i / HIST_SUB - 1;
+    uint64_t low = (uint64_t)(HIST_SUB + i % HIST_SUB) << shift;
+    return low + ((uint64_t)1 << shift) / 2.0;
+}
+
+static inline long get(HISTOGRAM *h, int i){
+    return __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+}
+
+void hist_record(HISTOGRAM *h, uint64_t value){
+    long *b = &h->buckets[bucket(value)];
+    __atomic_store_n(b, __atomic_load_n(b, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+void hist_merge(HISTOGRAM *into, HISTOGRAM *from){
+    for(int i = 0; i < HIST_BUCKETS; i++)
+        into->buckets[i] += get(from, i);
+}
+
+long hist_count(HISTOGRAM *h){
+    long total = 0;
+    for(int i = 0; i < HIST_BUCKETS; i++)
+        total += get(h, i);
+    return total;
+}
+
+double hist_percentile(HISTOGRAM *h, double q){
+    long total = hist_count(h);
+    long rank = (long)(q * total + 0.999999);
+    if(rank < 1)
+        rank = 1;
+    long seen = 0;
+    for(int i = 0; i < HIST_BUCKETS; i++){
+        if((seen += get(h, i)) >= rank)
+            return bucket_value(i);
+    }
+    return 0;
+}
+
+double hist_max(HISTOGRAM *h){
+    for(int i = HIST_BUCKETS - 1; i >= 0; i--){
+        if(get(h, i) > 0)
+            return bucket_value(i);
+    }
+    return 0;
+}
@@ -10,6 +10,12 @@
 #include "player.h"
 #include "game.h"
 #include "invitation.h"
+#include "invitation_ext.h"
+#include "game_clock.h"
+#include "event_loop.h"
+#include "stats.h"
+#include "trace.h"
+#include "reftrack.h"
 
 typedef struct invitation{
     INVITATION_STATE invi_state;
@@ -19,9 +25,33 @@ typedef struct invitation{
     GAME_ROLE reciever_role;
     sem_t semaphore_block;
     GAME *game_state;
+    //the moves made in the game so far, as game_unparse_move() strings
+    char **moves;
+    int move_count;
+    int move_cap;
+    //the game's clock, if it is played with a time control
+    GAME_CLOCK *clock;
+    //spectators of the game, each with its id for it
+    INV_WATCHER *watchers;
+    int watcher_count;
+    int watcher_cap;
+    //told how the game came out, once it is over (see inv_report_result())
+    INV_RESULT_FUNC *result_func;
+    void *result_arg;
+    //goes off if the invitation is still open when its time is up
+    TIMER expiry;
+    INV_EXPIRY_FUNC *expiry_func;
+    void *expiry_arg;
     int ref_count;
 }INVITATION;
 
+static void expired(TIMER *timer, void *arg){
+    INVITATION *inv = arg;
+    debug("INVITATION %p expired", inv);
+    if(inv->expiry_func != NULL)
+        inv->expiry_func(inv, inv->expiry_arg);
+}
+
 /*
  * Create an INVITATION in the OPEN state, containing reference to
  * specified source and target CLIENTs, which cannot be the same CLIENT.
@@ -36,34 +66,50 @@ typedef struct invitation{
  * was successful, otherwise NULL.
  */
 INVITATION *inv_create(CLIENT *source, CLIENT *target, GAME_ROLE source_role, GAME_ROLE target_role){
-    INVITATION *new_inv = malloc(sizeof(INVITATION));
-    sem_init(&((*new_inv).semaphore_block),0,1);
-    new_inv->invi_state = INV_OPEN_STATE;
-    new_inv->ref_count = 1;
     //make sure not the same
     if(source == target){
         return NULL;
     }
-    else{
-        source = client_ref(source, "new invitation source");
-        target = client_ref(target, "new invitation target");
-        debug("source: %p, target: %p", (void*)source, (void*)target);
-        // if(strcmp(player_get_name(client_get_player(source)), player_get_name(client_get_player(target))) != 0){
-        //     return NULL;
-        // }
-        new_inv->sender = source;
-        new_inv->reciever = target;
-        new_inv->sender_role = source_role;
-        new_inv->reciever_role = target_role;
-        new_inv->game_state = NULL;
-        // if(client_make_invitation(source,target,source_role,target_role) == -1){
-        //     return NULL;
-        // }
-        // if(client_add_invitation(source,new_inv) == -1 || client_add_invitation(target,new_inv) == -1){
-        //     return NULL;
-        // }
+    INVITATION *new_inv = malloc(sizeof(INVITATION));
+    if(new_inv == NULL){
+        return NULL;
     }
+    sem_init(&((*new_inv).semaphore_block),0,1);
+    new_inv->invi_state = INV_OPEN_STATE;
+    new_inv->ref_count = 1;
+    trace(TRACE_INV_STATE, (uintptr_t)new_inv, INV_OPEN_STATE, INV_OPEN_STATE, "inv_create");
+    reftrack_create(REF_INVITATION, new_inv, "inv_create");
+    source = client_ref(source, "new invitation source");
+    target = client_ref(target, "new invitation target");
+    debug("source: %p, target: %p", (void*)source, (void*)target);
+    // if(strcmp(player_get_name(client_get_player(source)), player_get_name(client_get_player(target))) != 0){
+    //     return NULL;
+    // }
+    new_inv->sender = source;
+    new_inv->reciever = target;
+    new_inv->sender_role = source_role;
+    new_inv->reciever_role = target_role;
+    new_inv->game_state = NULL;
+    new_inv->moves = NULL;
+    new_inv->move_count = 0;
+    new_inv->move_cap = 0;
+    new_inv->clock = NULL;
+    new_inv->watchers = NULL;
+    new_inv->watcher_count = 0;
+    new_inv->watcher_cap = 0;
+    new_inv->result_func = NULL;
+    new_inv->result_arg = NULL;
+    timer_init(&new_inv->expiry, expired, new_inv);
+    new_inv->expiry_func = NULL;
+    new_inv->expiry_arg = NULL;
+    // if(client_make_invitation(source,target,source_role,target_role) == -1){
+    //     return NULL;
+    // }
+    // if(client_add_invitation(source,new_inv) == -1 || client_add_invitation(target,new_inv) == -1){
+    //     return NULL;
+    // }
     debug("NEW INVITE CREATED SENDING");
+    stats_add(STAT_INVITATIONS, 1);
     return new_inv;
 }
 
@@ -81,6 +127,8 @@ INVITATION *inv_ref(INVITATION *inv, char *why){
     //int new=++inv->ref_count;
     debug("(%d->%d) %s", inv->ref_count, inv->ref_count+1, why);
     inv->ref_count++;
+    trace(TRACE_INV_REF, (uintptr_t)inv, inv->ref_count, 0, why);
+    reftrack_ref(REF_INVITATION, inv, why);
     //debug("%s",why);
     sem_post(&inv->semaphore_block);
     return inv;
@@ -104,17 +152,38 @@ void inv_unref(INVITATION *inv, char *why){
     sem_wait(&inv->semaphore_block);
     debug("(%d->%d) %s", inv->ref_count, inv->ref_count-1, why);
     inv->ref_count--;
-    if(inv->ref_count == 0){
-        debug("Free invitation");
-        client_unref(inv->sender, "sender in invitation unref");
-        client_unref(inv->reciever, "receiver in invitation unref");
-        if (inv->game_state != NULL) {
-            game_unref(inv->game_state, "game in invitation unref");
-        }
-        sem_destroy(&inv->semaphore_block);
-        free(inv);
+    trace(TRACE_INV_UNREF, (uintptr_t)inv, inv->ref_count, 0, why);
+    reftrack_unref(REF_INVITATION, inv, why);
+    if(inv->ref_count > 0){
+        sem_post(&inv->semaphore_block);
+        return;
     }
+    //last reference, so nobody else can be waiting on the lock
     sem_post(&inv->semaphore_block);
+    debug("Free invitation");
+    if(inv->invi_state == INV_OPEN_STATE)
+        stats_add(STAT_INVITATIONS, -1);
+    else if(inv->invi_state == INV_ACCEPTED_STATE)
+        stats_add(STAT_GAMES, -1);
+    client_unref(inv->sender, "sender in invitation unref");
+    client_unref(inv->reciever, "receiver in invitation unref");
+    if (inv->game_state != NULL) {
+        game_unref(inv->game_state, "game in invitation unref");
+    }
+    for (int i = 0; i < inv->move_count; i++) {
+        free(inv->moves[i]);
+    }
+    free(inv->moves);
+    ev_loop_cancel_timer(&inv->expiry);
+    if (inv->clock != NULL) {
+        gclock_free(inv->clock);
+    }
+    for (int i = 0; i < inv->watcher_count; i++) {
+        client_unref(inv->watchers[i].client, "watcher in invitation unref");
+    }
+    free(inv->watchers);
+    sem_destroy(&inv->semaphore_block);
+    free(inv);
 }
 
 /*
@@ -193,14 +262,20 @@ int inv_accept(INVITATION *inv){
     debug("INVITATION ACCEPT");
     //if not init in open state return error
     if(inv->invi_state != INV_OPEN_STATE){
+        sem_post(&inv->semaphore_block);
         return -1;
     }
-    inv->invi_state = INV_ACCEPTED_STATE;
     inv->game_state = game_create();
     if(inv->game_state == NULL){
+        sem_post(&inv->semaphore_block);
         return -1;
     }
+    inv->invi_state = INV_ACCEPTED_STATE;
+    trace(TRACE_INV_STATE, (uintptr_t)inv, INV_ACCEPTED_STATE, INV_OPEN_STATE, "inv_accept");
+    ev_loop_cancel_timer(&inv->expiry);
     sem_post(&inv->semaphore_block);
+    stats_add(STAT_INVITATIONS, -1);
+    stats_add(STAT_GAMES, 1);
     return 0;
 }
 
@@ -229,32 +304,257 @@ int inv_close(INVITATION *inv, GAME_ROLE role){
         return -1;
     }
 
-    //if null and no game in progress
-    debug("GAME STATE: %p", inv->game_state);
-    if(role == NULL_ROLE && inv->game_state == NULL){
-        inv->invi_state = INV_CLOSED_STATE;
+    //a game in progress can only be closed by someone resigning it
+    //(the references held by the clients' lists are theirs to drop)
+    if(inv->game_state != NULL && game_is_over(inv->game_state) == 0){
+        if(role == NULL_ROLE || game_resign(inv->game_state,role) == -1){
+            sem_post(&inv->semaphore_block);
+            return -1;
+        }
+    }
+    stats_add(inv->invi_state == INV_OPEN_STATE ? STAT_INVITATIONS : STAT_GAMES, -1);
+    trace(TRACE_INV_STATE, (uintptr_t)inv, INV_CLOSED_STATE, inv->invi_state, "inv_close");
+    inv->invi_state = INV_CLOSED_STATE;
+    ev_loop_cancel_timer(&inv->expiry);
+    if(inv->clock != NULL)
+        gclock_stop(inv->clock);
+    sem_post(&inv->semaphore_block);
+    return 0;
+}
+
+/*
+ * Close an ACCEPTED INVITATION whose GAME is still in progress, without
+ * anyone resigning.
+ *
+ * @param inv  The INVITATION to be closed.
+ * @return 0 if the INVITATION was closed, otherwise -1.
+ */
+int inv_abort(INVITATION *inv){
+    sem_wait(&inv->semaphore_block);
+    debug("ABORT INVITATION");
+    if(inv->invi_state != INV_ACCEPTED_STATE || game_is_over(inv->game_state)){
+        sem_post(&inv->semaphore_block);
+        return -1;
+    }
+    trace(TRACE_INV_STATE, (uintptr_t)inv, INV_CLOSED_STATE, INV_ACCEPTED_STATE, "inv_abort");
+    inv->invi_state = INV_CLOSED_STATE;
+    if(inv->clock != NULL)
+        gclock_stop(inv->clock);
+    sem_post(&inv->semaphore_block);
+    stats_add(STAT_GAMES, -1);
+    return 0;
+}
+
+/*
+ * Have an OPEN INVITATION expire after a while.
+ *
+ * @param inv  The INVITATION.
+ * @param ms  How long from now it expires.
+ * @param func  Called if it is still open then.
+ * @param arg  Passed to func along with the INVITATION.
+ * @return 0 if successful, -1 if it is not open.
+ */
+int inv_set_expiry(INVITATION *inv, uint64_t ms, INV_EXPIRY_FUNC *func, void *arg){
+    sem_wait(&inv->semaphore_block);
+    if(inv->invi_state != INV_OPEN_STATE){
         sem_post(&inv->semaphore_block);
-        debug("NULL ROLE AND NO GAME");
-        inv_unref(inv, "invitation being removed from client's list");
-        debug("RETURN 0 AFTER UNREF");
-        return 0;
+        return -1;
     }
+    inv->expiry_func = func;
+    inv->expiry_arg = arg;
+    ev_loop_start_timer(&inv->expiry, ms);
+    sem_post(&inv->semaphore_block);
+    return 0;
+}
+
+/*
+ * Give an INVITATION a clock for its game.
+ *
+ * @param inv  The INVITATION.
+ * @param clock  The clock, which now belongs to the INVITATION.
+ * @return 0 if successful, -1 if it already has one.
+ */
+int inv_set_clock(INVITATION *inv, GAME_CLOCK *clock){
+    sem_wait(&inv->semaphore_block);
+    if(inv->clock != NULL){
+        sem_post(&inv->semaphore_block);
+        return -1;
+    }
+    inv->clock = clock;
+    sem_post(&inv->semaphore_block);
+    return 0;
+}
+
+/*
+ * Have a function told how the game of an INVITATION came out.
+ *
+ * @param inv  The INVITATION.
+ * @param func  The function.
+ * @param arg  Passed to func along with the result.
+ */
+void inv_set_result_func(INVITATION *inv, INV_RESULT_FUNC *func, void *arg){
+    sem_wait(&inv->semaphore_block);
+    inv->result_func = func;
+    inv->result_arg = arg;
+    sem_post(&inv->semaphore_block);
+}
 
-    //1 if game is over, 0 if still going on
-    if(game_is_over(inv->game_state) == 0){
-        if(game_resign(inv->game_state,role) == -1){
+/*
+ * Pass the result of the game of an INVITATION on to its result function,
+ * if it has one and has not been told already.
+ *
+ * @param inv  The INVITATION.
+ * @param winner  The role of the winner, or NULL_ROLE.
+ * @param aborted  Nonzero if the game was cut short without a result.
+ */
+void inv_report_result(INVITATION *inv, GAME_ROLE winner, int aborted){
+    sem_wait(&inv->semaphore_block);
+    INV_RESULT_FUNC *func = inv->result_func;
+    void *arg = inv->result_arg;
+    inv->result_func = NULL;
+    sem_post(&inv->semaphore_block);
+    if(func != NULL)
+        func(inv, winner, aborted, arg);
+}
+
+/*
+ * Get the clock of the game of an INVITATION.
+ *
+ * @param inv  The INVITATION.
+ * @return the clock, or NULL if the game is untimed.
+ */
+GAME_CLOCK *inv_get_clock(INVITATION *inv){
+    return inv->clock;
+}
+
+/*
+ * Append a move to the record of the moves made in the game of an
+ * INVITATION.
+ *
+ * @param inv  The INVITATION.
+ * @param move  The move, which is copied.
+ * @return 0 if successful, otherwise -1.
+ */
+int inv_record_move(INVITATION *inv, const char *move){
+    char *copy = strdup(move);
+    if(copy == NULL)
+        return -1;
+    sem_wait(&inv->semaphore_block);
+    if(inv->move_count == inv->move_cap){
+        int cap = inv->move_cap ? 2 * inv->move_cap : 16;
+        char **moves = realloc(inv->moves, cap * sizeof(char *));
+        if(moves == NULL){
             sem_post(&inv->semaphore_block);
+            free(copy);
             return -1;
         }
-        else{
-            inv->invi_state = INV_CLOSED_STATE;
+        inv->moves = moves;
+        inv->move_cap = cap;
+    }
+    inv->moves[inv->move_count++] = copy;
+    sem_post(&inv->semaphore_block);
+    return 0;
+}
+
+/*
+ * Get the moves recorded for the game of an INVITATION, oldest first.
+ *
+ * @param inv  The INVITATION.
+ * @param countp  The number of moves is stored here.
+ * @return the moves, which belong to the INVITATION.
+ */
+char **inv_get_moves(INVITATION *inv, int *countp){
+    *countp = inv->move_count;
+    return inv->moves;
+}
+
+/*
+ * Add a spectator to the game of an INVITATION.
+ *
+ * @param inv  The INVITATION.
+ * @param client  The spectator, whose reference count is incremented.
+ * @param id  The spectator's id for the game.
+ * @return 0 if successful, -1 if there is no game in progress.
+ */
+int inv_add_watcher(INVITATION *inv, CLIENT *client, int id){
+    sem_wait(&inv->semaphore_block);
+    if(inv->invi_state != INV_ACCEPTED_STATE || game_is_over(inv->game_state)){
+        sem_post(&inv->semaphore_block);
+        return -1;
+    }
+    if(inv->watcher_count == inv->watcher_cap){
+        int cap = inv->watcher_cap ? 2 * inv->watcher_cap : 8;
+        INV_WATCHER *watchers = realloc(inv->watchers, cap * sizeof(INV_WATCHER));
+        if(watchers == NULL){
             sem_post(&inv->semaphore_block);
-            inv_unref(inv, "invitation being removed from client's list");
-            return 0;
+            return -1;
         }
+        inv->watchers = watchers;
+        inv->watcher_cap = cap;
     }
-    inv->invi_state = INV_CLOSED_STATE;
+    inv->watchers[inv->watcher_count].client = client_ref(client, "watching a game");
+    inv->watchers[inv->watcher_count].id = id;
+    inv->watcher_count++;
     sem_post(&inv->semaphore_block);
-    inv_unref(inv, "invitation being removed from client's list");
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Remove a spectator from the game of an INVITATION.
+ *
+ * @param inv  The INVITATION.
+ * @param client  The spectator.
+ * @return 0 if successful, -1 if it was not watching.
+ */
+int inv_remove_watcher(INVITATION *inv, CLIENT *client){
+    sem_wait(&inv->semaphore_block);
+    int i;
+    for(i = 0; i < inv->watcher_count; i++)
+        if(inv->watchers[i].client == client)
+            break;
+    if(i == inv->watcher_count){
+        sem_post(&inv->semaphore_block);
+        return -1;
+    }
+    //order doesn't matter, so the last one fills the gap
+    inv->watchers[i] = inv->watchers[--inv->watcher_count];
+    sem_post(&inv->semaphore_block);
+    client_unref(client, "stopped watching a game");
+    return 0;
+}
+
+/*
+ * Call a function for each spectator of the game of an INVITATION.
+ *
+ * @param inv  The INVITATION.
+ * @param func  The function, which must not call back into the INVITATION.
+ * @param arg  Passed to func along with each spectator and its id.
+ * @return the number of spectators.
+ */
+int inv_for_each_watcher(INVITATION *inv, void (*func)(CLIENT *, int, void *), void *arg){
+    sem_wait(&inv->semaphore_block);
+    int n = inv->watcher_count;
+    for(int i = 0; i < n; i++)
+        func(inv->watchers[i].client, inv->watchers[i].id, arg);
+    sem_post(&inv->semaphore_block);
+    return n;
+}
+
+/*
+ * Take all the spectators away from the game of an INVITATION.
+ *
+ * @param inv  The INVITATION.
+ * @param countp  The number of spectators is stored here.
+ * @return the spectators, with the references to them, or NULL if there
+ * are none.
+ */
+INV_WATCHER *inv_take_watchers(INVITATION *inv, int *countp){
+    sem_wait(&inv->semaphore_block);
+    INV_WATCHER *watchers = inv->watchers;
+    *countp = inv->watcher_count;
+    inv->watchers = NULL;
+    inv->watcher_count = 0;
+    inv->watcher_cap = 0;
+    sem_post(&inv->semaphore_block);
+    return watchers;
+}
@@ -0,0 +1,569 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "debug.h"
+#include "journal.h"
+
+#define JOURNAL_MAGIC      0x4c4a584a      // "JXJL"
+#define JOURNAL_VERSION    1
+#define JOURNAL_HDR_BYTES  16              // magic, version, first ID
+#define JOURNAL_REC_BYTES  8               // length and CRC of a record
+// no game comes anywhere near this; anything bigger is garbage
+#define JOURNAL_MAX_RECORD (1024 * 1024)
+#define JOURNAL_NAME_LEN   24              // 20 digits and ".jnl"
+
+JOURNAL *journal;
+
+/*
+ * A growable byte buffer.
+ */
+typedef struct jbuf {
+    char *data;
+    size_t len, cap;
+} JBUF;
+
+typedef struct journal {
+    char *dir;
+    int fd;                      // current segment
+    size_t seg_bytes;            // how big it is
+    pthread_t writer;
+    sem_t semaphore_block;       // protects everything below
+    sem_t work_sem;              // posted when pending stops being empty
+    sem_t flushed_sem;           // posted for journal_flush()
+    JBUF pending;                // records waiting for the writer
+    uint64_t next_id;
+    uint64_t committed;          // last ID written and synced
+    uint64_t handled;            // last ID the writer is done with, written or not
+    uint64_t failed;             // last ID of a batch that couldn't be written
+    uint64_t flushed;            // last ID a journal_flush() has answered for
+    uint64_t flush_target;       // the ID journal_flush() is waiting for
+    int flush_waiting;
+    int stopping;
+} JOURNAL;
+
+typedef struct journal_reader {
+    char *dir;
+    uint64_t *firsts;            // first ID of each segment, in order
+    int nsegs;
+    int seg;                     // the one being read
+    FILE *f;
+    uint64_t from_id;
+    char *rec;                   // the record just read
+    char *strs;                  // its strings, NUL-terminated
+    size_t rec_cap;
+    char **moves;
+    int moves_cap;
+} JOURNAL_READER;
+
+/*
+ * CRC-32 (IEEE), as used by zlib and friends.
+ */
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void){
+    for(uint32_t i = 0; i < 256; i++){
+        uint32_t c = i;
+        for(int k = 0; k < 8; k++)
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const void *data, size_t len){
+    pthread_once(&crc_once, crc_init);
+    const unsigned char *p = data;
+    uint32_t c = 0xffffffff;
+    while(len-- > 0)
+        c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffff;
+}
+
+/*
+ * Little-endian encoding.
+ */
+static void put_le(char *p, uint64_t v, int n){
+    for(int i = 0; i < n; i++)
+        p[i] = v >> (8 * i);
+}
+
+static uint64_t get_le(const char *p, int n){
+    uint64_t v = 0;
+    for(int i = 0; i < n; i++)
+        v |= (uint64_t)(unsigned char)p[i] << (8 * i);
+    return v;
+}
+
+static int jbuf_reserve(JBUF *b, size_t more){
+    if(b->len + more <= b->cap)
+        return 0;
+    size_t cap = b->cap ? b->cap : 4096;
+    while(cap < b->len + more)
+        cap *= 2;
+    char *data = realloc(b->data, cap);
+    if(data == NULL)
+        return -1;
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+static int write_fully(int fd, const char *buf, size_t len){
+    while(len > 0){
+        ssize_t n = write(fd, buf, len);
+        if(n == -1){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int is_segment_name(const char *name){
+    if(strlen(name) != JOURNAL_NAME_LEN || strcmp(name + 20, ".jnl") != 0)
+        return 0;
+    for(int i = 0; i < 20; i++)
+        if(name[i] < '0' || name[i] > '9')
+            return 0;
+    return 1;
+}
+
+static int segment_filter(const struct dirent *d){
+    return is_segment_name(d->d_name);
+}
+
+/*
+ * The first IDs of the segments in a directory, in order (their names
+ * are zero-padded, so alphabetical order is the same thing).
+ */
+static int list_segments(const char *dir, uint64_t **firstsp){
+    struct dirent **names;
+    int n = scandir(dir, &names, segment_filter, alphasort);
+    if(n == -1)
+        return -1;
+    uint64_t *firsts = malloc((n + 1) * sizeof(uint64_t));
+    for(int i = 0; i < n; i++){
+        if(firsts != NULL)
+            firsts[i] = strtoull(names[i]->d_name, NULL, 10);
+        free(names[i]);
+    }
+    free(names);
+    if(firsts == NULL)
+        return -1;
+    *firstsp = firsts;
+    return n;
+}
+
+static char *segment_path(const char *dir, uint64_t first){
+    char *path = NULL;
+    if(asprintf(&path, "%s/%020" PRIu64 ".jnl", dir, first) == -1)
+        return NULL;
+    return path;
+}
+
+/*
+ * Writer side
+ */
+
+/*
+ * Start a new segment for games from first on, and make sure its
+ * directory entry is on disk along with it.
+ */
+static int start_segment(JOURNAL *j, uint64_t first){
+    char *path = segment_path(j->dir, first);
+    if(path == NULL)
+        return -1;
+    // a segment that has this name already has no games in it
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    free(path);
+    if(fd == -1)
+        return -1;
+    char hdr[JOURNAL_HDR_BYTES];
+    put_le(hdr, JOURNAL_MAGIC, 4);
+    put_le(hdr + 4, JOURNAL_VERSION, 4);
+    put_le(hdr + 8, first, 8);
+    if(write_fully(fd, hdr, sizeof(hdr)) == -1 || fdatasync(fd) == -1){
+        close(fd);
+        return -1;
+    }
+    int dfd = open(j->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dfd != -1){
+        fsync(dfd);
+        close(dfd);
+    }
+    if(j->fd != -1)
+        close(j->fd);
+    j->fd = fd;
+    j->seg_bytes = sizeof(hdr);
+    debug("journal segment %020" PRIu64 " started", first);
+    return 0;
+}
+
+static void *writer_thread(void *arg){
+    JOURNAL *j = arg;
+    JBUF batch = { NULL, 0, 0 };
+    uint64_t first = j->handled + 1;     // of the next batch
+    for(;;){
+        sem_wait(&j->work_sem);
+        // take everything that has piled up, leaving an empty buffer
+        sem_wait(&j->semaphore_block);
+        JBUF tmp = j->pending;
+        j->pending = batch;
+        batch = tmp;
+        uint64_t last = j->next_id - 1;
+        int stopping = j->stopping;
+        sem_post(&j->semaphore_block);
+
+        int ok = 1;
+        if(batch.len > 0){
+            // after a failure, the games carry on in a segment of their own,
+            // rather than after what may be a torn record
+            ok = (j->fd != -1 || start_segment(j, first) == 0)
+                 && write_fully(j->fd, batch.data, batch.len) == 0 && fdatasync(j->fd) == 0;
+            if(ok){
+                j->seg_bytes += batch.len;
+                if(j->seg_bytes >= JOURNAL_SEGMENT_BYTES && start_segment(j, last + 1) == -1)
+                    debug("journal segment not started: %s", strerror(errno));
+            }
+            else{
+                debug("journal write of games %" PRIu64 " to %" PRIu64 " failed: %s",
+                      first, last, strerror(errno));
+                if(j->fd != -1){
+                    close(j->fd);
+                    j->fd = -1;
+                }
+            }
+            batch.len = 0;
+        }
+        first = last + 1;
+
+        sem_wait(&j->semaphore_block);
+        if(ok)
+            j->committed = last;
+        else
+            j->failed = last;
+        j->handled = last;
+        if(j->flush_waiting && j->handled >= j->flush_target){
+            j->flush_waiting = 0;
+            sem_post(&j->flushed_sem);
+        }
+        int done = stopping && j->pending.len == 0;
+        sem_post(&j->semaphore_block);
+        if(done)
+            break;
+    }
+    free(batch.data);
+    return NULL;
+}
+
+/*
+ * The ID after the last game in the journal, going by the last segment
+ * in which there are any.
+ */
+static uint64_t find_next_id(const char *dir){
+    JOURNAL_READER *r = journal_reader_open(dir, UINT64_MAX);
+    if(r == NULL)
+        return 1;
+    uint64_t next = r->nsegs > 0 ? r->firsts[r->nsegs - 1] : 1;
+    r->from_id = 0;
+    JOURNAL_GAME g;
+    while(journal_read(r, &g) == 1)
+        next = g.id + 1;
+    journal_reader_close(r);
+    return next;
+}
+
+JOURNAL *journal_open(const char *dir){
+    JOURNAL *j = calloc(1, sizeof(JOURNAL));
+    if(j == NULL)
+        return NULL;
+    j->fd = -1;
+    j->dir = strdup(dir);
+    if(j->dir == NULL){
+        free(j);
+        return NULL;
+    }
+    j->next_id = find_next_id(dir);
+    j->committed = j->handled = j->flushed = j->next_id - 1;
+    if(start_segment(j, j->next_id) == -1){
+        free(j->dir);
+        free(j);
+        return NULL;
+    }
+    sem_init(&j->semaphore_block, 0, 1);
+    sem_init(&j->work_sem, 0, 0);
+    sem_init(&j->flushed_sem, 0, 0);
+    if(pthread_create(&j->writer, NULL, writer_thread, j) != 0){
+        close(j->fd);
+        free(j->dir);
+        free(j);
+        return NULL;
+    }
+    debug("journal %s open, next game %" PRIu64, dir, j->next_id);
+    return j;
+}
+
+uint64_t journal_record(JOURNAL *j, const char *first, const char *second,
+                        GAME_ROLE winner, int aborted, char **moves, int nmoves){
+    if(first == NULL)
+        first = "";
+    if(second == NULL)
+        second = "";
+    size_t len1 = strnlen(first, UINT16_MAX), len2 = strnlen(second, UINT16_MAX);
+    if(nmoves > UINT16_MAX)
+        return 0;
+    size_t body = 8 + 8 + 1 + 1 + 2 + 2 + len1 + 2 + len2;
+    for(int i = 0; i < nmoves; i++)
+        body += 2 + strnlen(moves[i], UINT16_MAX);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    sem_wait(&j->semaphore_block);
+    if(jbuf_reserve(&j->pending, JOURNAL_REC_BYTES + body) == -1){
+        sem_post(&j->semaphore_block);
+        return 0;
+    }
+    int was_empty = j->pending.len == 0;
+    uint64_t id = j->next_id++;
+    char *rec = j->pending.data + j->pending.len;
+    char *p = rec + JOURNAL_REC_BYTES;
+    put_le(p, id, 8);
+    put_le(p + 8, now, 8);
+    p[16] = winner;
+    p[17] = aborted != 0;
+    put_le(p + 18, nmoves, 2);
+    p += 20;
+    put_le(p, len1, 2);
+    memcpy(p + 2, first, len1);
+    p += 2 + len1;
+    put_le(p, len2, 2);
+    memcpy(p + 2, second, len2);
+    p += 2 + len2;
+    for(int i = 0; i < nmoves; i++){
+        size_t len = strnlen(moves[i], UINT16_MAX);
+        put_le(p, len, 2);
+        memcpy(p + 2, moves[i], len);
+        p += 2 + len;
+    }
+    put_le(rec, body, 4);
+    put_le(rec + 4, crc32(rec + JOURNAL_REC_BYTES, body), 4);
+    j->pending.len += JOURNAL_REC_BYTES + body;
+    sem_post(&j->semaphore_block);
+    if(was_empty)
+        sem_post(&j->work_sem);
+    debug("journal: game %" PRIu64 " (%d moves)", id, nmoves);
+    return id;
+}
+
+int journal_flush(JOURNAL *j){
+    sem_wait(&j->semaphore_block);
+    uint64_t target = j->next_id - 1;
+    if(j->handled < target){
+        j->flush_target = target;
+        j->flush_waiting = 1;
+        sem_post(&j->semaphore_block);
+        sem_post(&j->work_sem);
+        sem_wait(&j->flushed_sem);
+        sem_wait(&j->semaphore_block);
+    }
+    int ret = j->failed > j->flushed ? -1 : 0;
+    if(target > j->flushed)
+        j->flushed = target;
+    sem_post(&j->semaphore_block);
+    return ret;
+}
+
+void journal_close(JOURNAL *j){
+    sem_wait(&j->semaphore_block);
+    j->stopping = 1;
+    sem_post(&j->semaphore_block);
+    sem_post(&j->work_sem);
+    pthread_join(j->writer, NULL);
+    debug("journal closed, last game %" PRIu64, j->committed);
+    if(j->fd != -1)
+        close(j->fd);
+    sem_destroy(&j->semaphore_block);
+    sem_destroy(&j->work_sem);
+    sem_destroy(&j->flushed_sem);
+    free(j->pending.data);
+    free(j->dir);
+    free(j);
+}
+
+/*
+ * Reader side
+ */
+
+JOURNAL_READER *journal_reader_open(const char *dir, uint64_t from_id){
+    JOURNAL_READER *r = calloc(1, sizeof(JOURNAL_READER));
+    if(r == NULL)
+        return NULL;
+    r->dir = strdup(dir);
+    r->nsegs = r->dir != NULL ? list_segments(dir, &r->firsts) : -1;
+    if(r->nsegs == -1){
+        free(r->dir);
+        free(r);
+        return NULL;
+    }
+    // the last segment that starts at or before the first game wanted
+    r->from_id = from_id;
+    while(r->seg + 1 < r->nsegs && r->firsts[r->seg + 1] <= from_id)
+        r->seg++;
+    return r;
+}
+
+static int open_segment(JOURNAL_READER *r){
+    char *path = segment_path(r->dir, r->firsts[r->seg]);
+    if(path == NULL)
+        return -1;
+    r->f = fopen(path, "re");
+    free(path);
+    if(r->f == NULL)
+        return -1;
+    setvbuf(r->f, NULL, _IOFBF, 1 << 16);
+    char hdr[JOURNAL_HDR_BYTES];
+    if(fread(hdr, 1, sizeof(hdr), r->f) != sizeof(hdr)
+       || get_le(hdr, 4) != JOURNAL_MAGIC || get_le(hdr + 4, 4) != JOURNAL_VERSION){
+        // not one of ours, or never got its header: nothing in it
+        fseek(r->f, 0, SEEK_END);
+    }
+    return 0;
+}
+
+/*
+ * Decode a record into g, copying its strings out with NULs after them.
+ */
+static int decode(JOURNAL_READER *r, size_t len, JOURNAL_GAME *g){
+    const char *p = r->rec, *end = r->rec + len;
+    if(len < 20)
+        return -1;
+    g->id = get_le(p, 8);
+    g->time_ms = get_le(p + 8, 8);
+    g->winner = (unsigned char)p[16];
+    g->aborted = p[17];
+    g->nmoves = get_le(p + 18, 2);
+    p += 20;
+    if(g->nmoves + 1 > r->moves_cap){
+        char **moves = realloc(r->moves, (g->nmoves + 1) * sizeof(char *));
+        if(moves == NULL)
+            return -1;
+        r->moves = moves;
+        r->moves_cap = g->nmoves + 1;
+    }
+    char *s = r->strs;
+    for(int i = -2; i < g->nmoves; i++){
+        if(end - p < 2)
+            return -1;
+        size_t n = get_le(p, 2);
+        if((size_t)(end - p - 2) < n)
+            return -1;
+        memcpy(s, p + 2, n);
+        s[n] = '\0';
+        if(i == -2)
+            g->first = s;
+        else if(i == -1)
+            g->second = s;
+        else
+            r->moves[i] = s;
+        s += n + 1;
+        p += 2 + n;
+    }
+    g->moves = r->moves;
+    return 0;
+}
+
+int journal_read(JOURNAL_READER *r, JOURNAL_GAME *g){
+    while(r->seg < r->nsegs){
+        if(r->f == NULL && open_segment(r) == -1)
+            return -1;
+        char hdr[JOURNAL_REC_BYTES];
+        size_t len = 0;
+        int ok = fread(hdr, 1, sizeof(hdr), r->f) == sizeof(hdr);
+        if(ok){
+            len = get_le(hdr, 4);
+            ok = len <= JOURNAL_MAX_RECORD;
+        }
+        if(ok && len > r->rec_cap){
+            // each string takes at least two bytes of length, so the
+            // decoded ones fit in the same space again
+            char *rec = realloc(r->rec, len);
+            char *strs = realloc(r->strs, len);
+            if(rec != NULL)
+                r->rec = rec;
+            if(strs != NULL)
+                r->strs = strs;
+            if(rec == NULL || strs == NULL)
+                return -1;
+            r->rec_cap = len;
+        }
+        if(ok)
+            ok = fread(r->rec, 1, len, r->f) == len
+                 && crc32(r->rec, len) == get_le(hdr + 4, 4)
+                 && decode(r, len, g) == 0;
+        if(!ok){
+            // the end of the segment, or a record torn by a crash
+            fclose(r->f);
+            r->f = NULL;
+            r->seg++;
+            continue;
+        }
+        if(g->id >= r->from_id)
+            return 1;
+    }
+    return 0;
+}
+
+int journal_find(JOURNAL_READER *r, uint64_t id, JOURNAL_GAME *g){
+    int ret;
+    while((ret = journal_read(r, g)) == 1){
+        if(g->id == id)
+            return 1;
+        if(g->id > id)
+            return 0;
+    }
+    return ret;
+}
+
+void journal_reader_close(JOURNAL_READER *r){
+    if(r->f != NULL)
+        fclose(r->f);
+    free(r->firsts);
+    free(r->rec);
+    free(r->strs);
+    free(r->moves);
+    free(r->dir);
+    free(r);
+}
+
+GAME *journal_replay(JOURNAL_GAME *g, int upto){
+    if(upto < 0 || upto > g->nmoves)
+        upto = g->nmoves;
+    GAME *game = game_create();
+    if(game == NULL)
+        return NULL;
+    for(int i = 0; i < upto; i++){
+        GAME_MOVE *move = game_parse_move(game, NULL_ROLE, g->moves[i]);
+        if(move == NULL || game_apply_move(game, move) == -1){
+            free(move);
+            game_unref(game, "journal replay failed");
+            return NULL;
+        }
+        free(move);
+    }
+    return game;
+}
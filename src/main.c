@@ -9,6 +9,7 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <getopt.h>
+#include <time.h>
 
 #include "debug.h"
 #include "protocol.h"
@@ -16,6 +17,18 @@
 #include "client_registry.h"
 #include "player_registry.h"
 #include "jeux_globals.h"
+#include "event_loop.h"
+#include "client_ext.h"
+#include "handoff.h"
+#include "match_queue.h"
+#include "tournament.h"
+#include "journal.h"
+#include "bot.h"
+#include "cluster.h"
+#include "stats.h"
+#include "rate_limit.h"
+#include "trace.h"
+#include "reftrack.h"
 #include "csapp.h"
 
 #ifdef DEBUG
@@ -23,21 +36,57 @@ int _debug_packets_ = 1;
 #endif
 
 static void terminate(int status);
-void *thread(void *vargp);
+
+// how long (in ms) shutdown waits for clients to receive what's queued for
+// them before their connections are closed regardless
+#define DEFAULT_DRAIN_MS 5000
+static int drain_ms = DEFAULT_DRAIN_MS;
+
+// how long (in ms) a connection may go without sending anything, before
+// and after logging in, before it's taken for dead and closed
+#define DEFAULT_LOGIN_TIMEOUT_MS 30000
+#define DEFAULT_IDLE_TIMEOUT_MS 1800000
+
+// how long (in ms) an invitation may stay open before it's withdrawn
+#define DEFAULT_INVITATION_TTL_MS 600000
+
+// how long (in ms) a hot restart waits for queued output to go out before
+// handing what's left to the new server
+#define HANDOFF_QUIESCE_MS 500
+
+static volatile sig_atomic_t hup_received;
+static int handoff_conn = -1;
 
 // sighup handler
+// the actual cleanup happens back in main() once the event loop returns,
+// since the handler runs on the loop thread and can't wait for sessions
 void sighup_handler(int signum) {
-    //printf for test
-    debug("Received SIGHUP signal");
-    //exit(EXIT_SUCCESS);
-    //is this what it means to clean up 
-    terminate(EXIT_SUCCESS);
+    hup_received = 1;
+    ev_loop_stop();
+}
+
+// a new server connected on the control socket, wanting to take over
+static void handoff_requested(int ctlfd, void *arg) {
+    int conn = accept(ctlfd, NULL, NULL);
+    if (conn == -1)
+        return;
+    if (handoff_conn != -1) {
+        close(conn);
+        return;
+    }
+    handoff_conn = conn;
+    ev_loop_stop();
 }
 
 /*
  * "Jeux" game server.
  *
- * Usage: jeux <port>
+ * Usage: jeux -p <port> [-u] [-d <drain_ms>] [-H <control_socket>]
+ *             [-l <login_timeout_ms>] [-i <idle_timeout_ms>]
+ *             [-c <base_ms>[+<increment_ms>]] [-j <journal_dir>]
+ *             [-b <bots>] [-C <node>:<host>:<port>,...]
+ *             [-S <stats_socket>] [-T] [-t <trace_file>]
+ *             [-e <invitation_ttl_ms>] [-r <rate_limit_factor>]
  */
 int main(int argc, char* argv[]){
     // Option processing should be performed here.
@@ -45,12 +94,77 @@ int main(int argc, char* argv[]){
     // on which the server should listen.
 
     // Obtain the port number from the command-line arguments
-    int opt, port;
-    while ((opt = getopt(argc, argv, "p:")) != -1) {
+    // Option '-u' asks for the io_uring backend instead of epoll.
+    // Option '-d <ms>' sets the shutdown drain deadline.
+    // Option '-H <path>' enables hot restart through a control socket.
+    // Options '-l <ms>' and '-i <ms>' set the login and idle timeouts
+    // (0 for none).
+    // Option '-c <base_ms>[+<increment_ms>]' plays games with a chess clock.
+    // Option '-j <dir>' keeps a journal of finished games in a directory.
+    // Option '-b <count>' starts that many bots for people to play.
+    // Option '-C <node>:<host>:<port>,...' makes this server one node of a
+    // cluster: its place in the list of nodes, then the list.
+    // Option '-S <path>' reports the runtime statistics on a Unix socket.
+    // Option '-T' stamps every packet with a fresh reading of the clock,
+    // instead of the time the event loop last woke up.
+    // Option '-t <path>' is where the trace is dumped on SIGUSR1 or a crash.
+    // Option '-e <ms>' sets how long invitations stay open (0 for ever).
+    // Option '-r <factor>' scales each client's rate limits (0 for none).
+    int opt, port, uring = 0, nbots = 0;
+    char *handoff_path = NULL, *journal_dir = NULL, *cluster_spec = NULL;
+    char *stats_path = NULL, *trace_path = NULL;
+    unsigned int login_ms = DEFAULT_LOGIN_TIMEOUT_MS, idle_ms = DEFAULT_IDLE_TIMEOUT_MS;
+    unsigned long clock_base_ms = 0, clock_increment_ms = 0;
+    unsigned long invitation_ttl_ms = DEFAULT_INVITATION_TTL_MS;
+    char *end;
+    while ((opt = getopt(argc, argv, "p:ud:H:l:i:c:j:b:C:S:Tt:e:r:")) != -1) {
         switch (opt) {
             case 'p':
                 port = atoi(optarg);
                 break;
+            case 'u':
+                uring = 1;
+                break;
+            case 'd':
+                drain_ms = atoi(optarg);
+                break;
+            case 'H':
+                handoff_path = optarg;
+                break;
+            case 'l':
+                login_ms = atoi(optarg);
+                break;
+            case 'i':
+                idle_ms = atoi(optarg);
+                break;
+            case 'c':
+                clock_base_ms = strtoul(optarg, &end, 10);
+                clock_increment_ms = *end == '+' ? strtoul(end + 1, NULL, 10) : 0;
+                break;
+            case 'j':
+                journal_dir = optarg;
+                break;
+            case 'b':
+                nbots = atoi(optarg);
+                break;
+            case 'C':
+                cluster_spec = optarg;
+                break;
+            case 'S':
+                stats_path = optarg;
+                break;
+            case 'T':
+                client_set_precise_stamps(1);
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
+            case 'e':
+                invitation_ttl_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                rl_set_scale(strtoul(optarg, NULL, 10));
+                break;
         }
     }
 
@@ -58,6 +172,8 @@ int main(int argc, char* argv[]){
     // player_registry.
     client_registry = creg_init();
     player_registry = preg_init();
+    match_queue = mq_init();
+    tournaments = treg_init();
 
     // TODO: Set up the server socket and enter a loop to accept connections
     // on this socket.  For each connection, a thread should be started to
@@ -70,68 +186,195 @@ int main(int argc, char* argv[]){
     memset(&act, 0, sizeof(act));
     act.sa_handler = sighup_handler;
     sigaction(SIGHUP, &act, NULL);
+    // a client that disconnects mid-write shouldn't kill the server
+    signal(SIGPIPE, SIG_IGN);
+    // SIGUSR1 (or a crash) dumps the trace of what the server has been doing
+    if (trace_init(trace_path) == -1) {
+        fprintf(stderr, "Unable to set up tracing\n");
+        terminate(EXIT_FAILURE);
+    }
+
+    // SIGHUP is only let through while the event loop is waiting for events
+    sigset_t blocked, waitmask;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGHUP);
+    sigprocmask(SIG_BLOCK, &blocked, &waitmask);
+    sigdelset(&waitmask, SIGHUP);
     //TEST FOR SIGINT
     // struct sigaction act2;
     // memset(&act, 0, sizeof(act2));
     // act2.sa_handler = sigint_handler;
     // sigaction(SIGTERM, &act, NULL);
 
-    // Server socket setup and enter loop to accept connections on socket and start new thread for each connection
-    int listenfd, *connfdp;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    pthread_t tid;
+    // Server socket setup, then every connection is serviced by a session
+    // coroutine on the event loop instead of a thread of its own
+    int listenfd;
+
+    // With a control socket, first take over from the server already
+    // running there (if any): its listening socket and clients become ours
+    HANDOFF *handoff = NULL;
+    if (handoff_path != NULL && handoff_receive(handoff_path, &handoff) == -1) {
+        fprintf(stderr, "Unable to take over from %s\n", handoff_path);
+        terminate(EXIT_FAILURE);
+    }
+
+    // the journal carries on where the previous server left off, so it is
+    // only opened once that server has synced it and stopped
+    if (journal_dir != NULL && (journal = journal_open(journal_dir)) == NULL) {
+        fprintf(stderr, "Unable to open the journal in %s\n", journal_dir);
+        terminate(EXIT_FAILURE);
+    }
 
     //listen from this port number
-    listenfd = open_listenfd(port);
+    listenfd = handoff != NULL ? handoff_listen_fd(handoff) : open_listenfd(port);
+    if (listenfd < 0 || ev_loop_init(listenfd, uring) == -1) {
+        fprintf(stderr, "Unable to listen on port %d\n", port);
+        terminate(EXIT_FAILURE);
+    }
+    ev_loop_set_timeouts(login_ms, idle_ms);
+    client_set_time_control(clock_base_ms, clock_increment_ms);
+    client_set_invitation_ttl(invitation_ttl_ms);
+    if (handoff != NULL) {
+        int n = handoff_restore(handoff);
+        handoff_free(handoff);
+        fprintf(stderr, "Took over %d connections from %s\n", n, handoff_path);
+    }
+    // after the takeover, so that the players carried over keep their names
+    if (nbots > 0 && bot_start(nbots) != nbots)
+        fprintf(stderr, "Only some of the %d bots could be started\n", nbots);
+    // and after that, so that the players already here are registered
+    if (cluster_spec != NULL && (cluster = cluster_init(cluster_spec)) == NULL) {
+        fprintf(stderr, "Unable to join the cluster %s\n", cluster_spec);
+        terminate(EXIT_FAILURE);
+    }
+    if (stats_path != NULL && stats_listen(stats_path) == -1) {
+        fprintf(stderr, "Unable to listen on %s\n", stats_path);
+        terminate(EXIT_FAILURE);
+    }
+    int ctlfd = -1;
+    if (handoff_path != NULL) {
+        ctlfd = handoff_listen(handoff_path);
+        if (ctlfd < 0 || ev_loop_watch(ctlfd, handoff_requested, NULL) == -1) {
+            fprintf(stderr, "Unable to listen on %s\n", handoff_path);
+            terminate(EXIT_FAILURE);
+        }
+    }
 
+    debug("listening on port %d (%s)", port, ev_loop_backend());
     while (1) {
-        debug("listening on port %d", port);
-        clientlen=sizeof(struct sockaddr_storage);
-        connfdp = malloc(sizeof(int));
-        *connfdp = accept(listenfd, (SA*) &clientaddr, &clientlen);
-        pthread_create(&tid, NULL, thread, connfdp);
+        if (ev_loop_run(&waitmask) == -1)
+            terminate(EXIT_FAILURE);
+        if (hup_received || handoff_conn == -1)
+            break;
+        // hot restart: once the new server has everything, just go away
+        // (without so much as a shutdown(2) on the connections it now owns)
+        if (journal != NULL && journal_flush(journal) == -1)
+            fprintf(stderr, "Some games could not be written to the journal\n");
+        if (ev_loop_quiesce(HANDOFF_QUIESCE_MS) == 0 && handoff_send(handoff_conn, listenfd) == 0) {
+            debug("Handed off to the new server");
+            exit(EXIT_SUCCESS);
+        }
+        fprintf(stderr, "Hot restart failed, carrying on\n");
+        close(handoff_conn);
+        handoff_conn = -1;
+        ev_loop_resume();
+    }
+    debug("Received SIGHUP signal");
+    if (ctlfd >= 0) {
+        ev_loop_unwatch(ctlfd);
+        close(ctlfd);
+        unlink(handoff_path);
     }
+    stats_unlisten();
+    close(listenfd);
+    terminate(EXIT_SUCCESS);
 
     // fprintf(stderr, "You have to finish implementing main() "
 	//     "before the Jeux server will function.\n");
     // terminate(EXIT_FAILURE);
 }
 
-/* Thread routine */
-void *thread(void *vargp){
-    int *temp = malloc(sizeof(int));
-    int connfd = *((int *)vargp);
-    *temp = connfd;
-    
-    pthread_detach(pthread_self());
-    //echo(connfd);
-
-    //connection descriptor
-    free(vargp);
-    jeux_client_service(temp);
-
-    //free(temp);
-    close(connfd);
-    return NULL;
+static void end_games(SESSION *s, void *arg){
+    int n = client_end_games(s->client);
+    if (n > 0)
+        *(int *)arg += n;
 }
 
+// milliseconds since *t, which is then reset to now
+static double lap(struct timespec *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ms = (now.tv_sec - t->tv_sec) * 1e3 + (now.tv_nsec - t->tv_nsec) / 1e6;
+    *t = now;
+    return ms;
+}
 
 /*
  * Function called to cleanly shut down the server.
+ * This happens in stages, so that clients find out what happened to
+ * them instead of just losing the connection:
+ *   1. stop accepting connections;
+ *   2. end the games in progress (ENDED, no winner, ratings untouched);
+ *   3. shut the connections down for reading and keep the sessions going
+ *      until they have handled what they already received and their
+ *      output has gone out, or the drain deadline passes;
+ *   4. close whatever is left.
+ * How long each stage took is reported on stderr.
  */
 void terminate(int status) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    ev_loop_stop_accepting();
+    double accept_ms = lap(&t);
+
+    int games = 0;
+    ev_loop_for_each_session(end_games, &games);
+    double end_ms = lap(&t);
+
     // Shutdown all client connections.
-    // This will trigger the eventual termination of service threads.
+    // This will trigger the eventual termination of the sessions.
     creg_shutdown_all(client_registry);
-    
+    int sessions = ev_loop_session_count();
     debug("%ld: Waiting for service threads to terminate...", pthread_self());
+    // the sessions only notice the shutdown if the loop keeps running them
+    ev_loop_drain(drain_ms);
+    int drained = sessions - ev_loop_session_count();
+    double drain_ms_taken = lap(&t);
+
+    size_t unsent = 0;
+    int forced = ev_loop_close_all(&unsent);
+    // the bots' games ended with everyone else's, so they can go now
+    bot_stop();
+    // and with them, every game a proxy was in
+    if (cluster != NULL) {
+        cluster_fini(cluster);
+        cluster = NULL;
+    }
     creg_wait_for_empty(client_registry);
+    double close_ms = lap(&t);
     debug("%ld: All service threads terminated.", pthread_self());
 
+    if (status == EXIT_SUCCESS)
+        fprintf(stderr, "shutdown: stop accepting %.1fms, ended %d games %.1fms, "
+                "drained %d sessions %.1fms, closed %d sessions (%zu bytes unsent) %.1fms\n",
+                accept_ms, games, end_ms, drained, drain_ms_taken, forced, unsent, close_ms);
+
+    if (status == EXIT_SUCCESS)
+        stats_write_latency(stderr);
+
     // Finalize modules.
+    if (journal != NULL)
+        journal_close(journal);
+    ev_loop_fini();
+    if (match_queue != NULL)
+        mq_fini(match_queue);
+    if (tournaments != NULL)
+        treg_fini(tournaments);
     creg_fini(client_registry);
     preg_fini(player_registry);
+    // with everything gone, whatever is still referenced has been leaked
+    if (reftrack_report(stderr, 1) > 0)
+        fprintf(stderr, "reftrack: objects leaked\n");
 
     debug("%ld: Jeux server terminating", pthread_self());
     exit(status);
@@ -0,0 +1,324 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <semaphore.h>
+
+#include "debug.h"
+#include "match_queue.h"
+#include "client_ext.h"
+#include "player.h"
+#include "event_loop.h"
+
+/*
+ * Ratings are clamped into the range the buckets cover; a player outside
+ * it just waits in the end bucket.
+ */
+#define MQ_BUCKETS       256
+#define MQ_WORDS         (MQ_BUCKETS / 64)
+#define MQ_INITIAL_TABLE 64
+
+MATCH_QUEUE *match_queue;
+
+typedef struct mq_entry {
+    MATCH_QUEUE *mq;
+    CLIENT *client;
+    int rating;
+    int bucket;
+    int window;
+    uint64_t seq;                        // order of arrival
+    TIMER widen_timer;
+    struct mq_entry *prev, *next;        // in the bucket, oldest first
+    struct mq_entry *hnext;              // in the lookup table
+} MQ_ENTRY;
+
+typedef struct match_queue {
+    MQ_ENTRY *head[MQ_BUCKETS], *tail[MQ_BUCKETS];
+    uint64_t nonempty[MQ_WORDS];         // bit per bucket with someone in it
+    //who is waiting, by CLIENT, for MATCH/UNMATCH and disconnects
+    MQ_ENTRY **table;
+    unsigned int table_size;
+    int count;
+    uint64_t next_seq;
+    sem_t semaphore_block;
+} MATCH_QUEUE;
+
+static int bucket_of(int rating){
+    int b = rating / MQ_BUCKET_WIDTH;
+    return b < 0 ? 0 : b >= MQ_BUCKETS ? MQ_BUCKETS - 1 : b;
+}
+
+static unsigned int hash_client(MATCH_QUEUE *mq, CLIENT *client){
+    uintptr_t h = (uintptr_t)client;
+    h ^= h >> 17;
+    h *= 0x9e3779b1u;
+    return (h >> 7) & (mq->table_size - 1);
+}
+
+MATCH_QUEUE *mq_init(void){
+    debug("MQ INIT");
+    MATCH_QUEUE *mq = calloc(1, sizeof(MATCH_QUEUE));
+    if(mq == NULL)
+        return NULL;
+    mq->table = calloc(MQ_INITIAL_TABLE, sizeof(MQ_ENTRY *));
+    if(mq->table == NULL){
+        free(mq);
+        return NULL;
+    }
+    mq->table_size = MQ_INITIAL_TABLE;
+    sem_init(&mq->semaphore_block, 0, 1);
+    return mq;
+}
+
+void mq_fini(MATCH_QUEUE *mq){
+    debug("MQ FINI (%d waiting)", mq->count);
+    for(int b = 0; b < MQ_BUCKETS; b++){
+        MQ_ENTRY *e = mq->head[b];
+        while(e != NULL){
+            MQ_ENTRY *next = e->next;
+            ev_loop_cancel_timer(&e->widen_timer);
+            client_unref(e->client, "match queue finalized");
+            free(e);
+            e = next;
+        }
+    }
+    sem_destroy(&mq->semaphore_block);
+    free(mq->table);
+    free(mq);
+}
+
+static MQ_ENTRY *lookup(MATCH_QUEUE *mq, CLIENT *client){
+    MQ_ENTRY *e = mq->table[hash_client(mq, client)];
+    while(e != NULL && e->client != client)
+        e = e->hnext;
+    return e;
+}
+
+static void grow_table(MATCH_QUEUE *mq){
+    unsigned int old_size = mq->table_size;
+    MQ_ENTRY **old = mq->table;
+    MQ_ENTRY **table = calloc(2 * old_size, sizeof(MQ_ENTRY *));
+    if(table == NULL)
+        return;    //just longer chains
+    mq->table = table;
+    mq->table_size = 2 * old_size;
+    for(unsigned int i = 0; i < old_size; i++){
+        MQ_ENTRY *e = old[i];
+        while(e != NULL){
+            MQ_ENTRY *next = e->hnext;
+            unsigned int h = hash_client(mq, e->client);
+            e->hnext = table[h];
+            table[h] = e;
+            e = next;
+        }
+    }
+    free(old);
+}
+
+static void insert(MATCH_QUEUE *mq, MQ_ENTRY *e){
+    if((unsigned int)mq->count >= mq->table_size)
+        grow_table(mq);
+    unsigned int h = hash_client(mq, e->client);
+    e->hnext = mq->table[h];
+    mq->table[h] = e;
+
+    int b = e->bucket;
+    e->next = NULL;
+    e->prev = mq->tail[b];
+    if(mq->tail[b] != NULL)
+        mq->tail[b]->next = e;
+    else
+        mq->head[b] = e;
+    mq->tail[b] = e;
+    mq->nonempty[b / 64] |= (uint64_t)1 << (b % 64);
+    mq->count++;
+}
+
+static void remove_entry(MATCH_QUEUE *mq, MQ_ENTRY *e){
+    MQ_ENTRY **pp = &mq->table[hash_client(mq, e->client)];
+    while(*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+
+    int b = e->bucket;
+    if(e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        mq->head[b] = e->next;
+    if(e->next != NULL)
+        e->next->prev = e->prev;
+    else
+        mq->tail[b] = e->prev;
+    if(mq->head[b] == NULL)
+        mq->nonempty[b / 64] &= ~((uint64_t)1 << (b % 64));
+    ev_loop_cancel_timer(&e->widen_timer);
+    mq->count--;
+}
+
+//first non-empty bucket in [from, to], or -1
+static int next_nonempty(MATCH_QUEUE *mq, int from, int to){
+    for(int w = from / 64; from <= to && w < MQ_WORDS; w++, from = w * 64){
+        uint64_t bits = mq->nonempty[w] & (~(uint64_t)0 << (from % 64));
+        if(bits != 0){
+            int b = w * 64 + __builtin_ctzll(bits);
+            return b <= to ? b : -1;
+        }
+    }
+    return -1;
+}
+
+//last non-empty bucket in [to, from], or -1
+static int prev_nonempty(MATCH_QUEUE *mq, int from, int to){
+    for(int w = from / 64; from >= to && w >= 0; w--, from = w * 64 + 63){
+        uint64_t bits = mq->nonempty[w] & (~(uint64_t)0 >> (63 - from % 64));
+        if(bits != 0){
+            int b = w * 64 + 63 - __builtin_clzll(bits);
+            return b >= to ? b : -1;
+        }
+    }
+    return -1;
+}
+
+static int rating_gap(MQ_ENTRY *a, int rating){
+    return a->rating > rating ? a->rating - rating : rating - a->rating;
+}
+
+/*
+ * The longest-waiting player in bucket b (other than self) within window
+ * of rating, or NULL.  Only a bucket at the edge of the window, or one of
+ * the end buckets that ratings are clamped into, can hold players who
+ * are out of range, so the walk is usually over at the head.
+ */
+static MQ_ENTRY *first_within(MATCH_QUEUE *mq, int b, MQ_ENTRY *self, int rating, int window){
+    for(MQ_ENTRY *e = mq->head[b]; e != NULL; e = e->next)
+        if(e != self && rating_gap(e, rating) <= window)
+            return e;
+    return NULL;
+}
+
+/*
+ * The closest waiting opponent (other than self) within window of
+ * rating: the longest-waiting player in range in the player's own bucket
+ * or in the nearest non-empty bucket on either side, whichever is
+ * closest.  Every bucket between those and the player's own is empty, and
+ * every player in them is in range unless they're at the window's edge,
+ * so nobody closer is missed.
+ */
+static MQ_ENTRY *find_opponent(MATCH_QUEUE *mq, MQ_ENTRY *self, int rating, int window){
+    int b = bucket_of(rating);
+    MQ_ENTRY *candidates[3] = { NULL, NULL, NULL };
+    candidates[0] = first_within(mq, b, self, rating, window);
+    int above = b + 1 < MQ_BUCKETS ? next_nonempty(mq, b + 1, bucket_of(rating + window)) : -1;
+    int below = b > 0 ? prev_nonempty(mq, b - 1, bucket_of(rating - window)) : -1;
+    if(above >= 0)
+        candidates[1] = first_within(mq, above, self, rating, window);
+    if(below >= 0)
+        candidates[2] = first_within(mq, below, self, rating, window);
+    MQ_ENTRY *best = NULL;
+    for(int i = 0; i < 3; i++){
+        MQ_ENTRY *c = candidates[i];
+        if(c == NULL)
+            continue;
+        if(best == NULL || rating_gap(c, rating) < rating_gap(best, rating))
+            best = c;
+    }
+    return best;
+}
+
+/*
+ * Start the game between two players who have been taken out of the
+ * queue, and drop the queue's references to them.
+ */
+static void pair(CLIENT *first, CLIENT *second){
+    if(client_make_match(first, second) == -1)
+        debug("match could not be made");
+    client_unref(first, "matched");
+    client_unref(second, "matched");
+}
+
+static void widen(TIMER *timer, void *arg){
+    MQ_ENTRY *e = arg;
+    MATCH_QUEUE *mq = e->mq;
+    sem_wait(&mq->semaphore_block);
+    if(e->window < MQ_MAX_WINDOW)
+        e->window += MQ_WIDEN_STEP;
+    MQ_ENTRY *opp = find_opponent(mq, e, e->rating, e->window);
+    if(opp == NULL){
+        //still nobody; at the widest, keep looking for newcomers anyway,
+        //since their own windows are narrower than ours
+        ev_loop_start_timer(&e->widen_timer, MQ_WIDEN_MS);
+        sem_post(&mq->semaphore_block);
+        return;
+    }
+    remove_entry(mq, e);
+    remove_entry(mq, opp);
+    sem_post(&mq->semaphore_block);
+    debug("MQ matched %d and %d (window %d)", e->rating, opp->rating, e->window);
+    if(e->seq < opp->seq)
+        pair(e->client, opp->client);
+    else
+        pair(opp->client, e->client);
+    free(e);
+    free(opp);
+}
+
+int mq_join(MATCH_QUEUE *mq, CLIENT *client){
+    PLAYER *player = client_get_player(client);
+    if(player == NULL)
+        return -1;
+    MQ_ENTRY *e = calloc(1, sizeof(MQ_ENTRY));
+    if(e == NULL)
+        return -1;
+    e->mq = mq;
+    e->rating = player_get_rating(player);
+    e->bucket = bucket_of(e->rating);
+    e->window = MQ_INITIAL_WINDOW;
+    timer_init(&e->widen_timer, widen, e);
+
+    sem_wait(&mq->semaphore_block);
+    if(lookup(mq, client) != NULL){
+        sem_post(&mq->semaphore_block);
+        free(e);
+        return -1;
+    }
+    e->seq = mq->next_seq++;
+    MQ_ENTRY *opp = find_opponent(mq, NULL, e->rating, e->window);
+    if(opp == NULL){
+        e->client = client_ref(client, "waiting in match queue");
+        insert(mq, e);
+        ev_loop_start_timer(&e->widen_timer, MQ_WIDEN_MS);
+        sem_post(&mq->semaphore_block);
+        debug("MQ %d waiting (rating %d)", mq->count, e->rating);
+        return 0;
+    }
+    remove_entry(mq, opp);
+    sem_post(&mq->semaphore_block);
+    debug("MQ matched %d and %d on arrival", opp->rating, e->rating);
+    //the one who was waiting goes first
+    pair(opp->client, client_ref(client, "matched on arrival"));
+    free(opp);
+    free(e);
+    return 0;
+}
+
+int mq_leave(MATCH_QUEUE *mq, CLIENT *client){
+    sem_wait(&mq->semaphore_block);
+    MQ_ENTRY *e = lookup(mq, client);
+    if(e != NULL)
+        remove_entry(mq, e);
+    sem_post(&mq->semaphore_block);
+    if(e == NULL)
+        return -1;
+    client_unref(e->client, "left match queue");
+    free(e);
+    return 0;
+}
+
+int mq_is_waiting(MATCH_QUEUE *mq, CLIENT *client){
+    sem_wait(&mq->semaphore_block);
+    int waiting = lookup(mq, client) != NULL;
+    sem_post(&mq->semaphore_block);
+    return waiting;
+}
+
+int mq_count(MATCH_QUEUE *mq){
+    return mq->count;
+}
@@ -4,10 +4,14 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <math.h>
 
 #include "player.h"
+#include "player_ext.h"
 #include "debug.h"
 #include "protocol.h"
+#include "trace.h"
+#include "reftrack.h"
 
 typedef struct player{
     char *name;
@@ -42,6 +46,7 @@ PLAYER *player_create(char *name){
     }
     new_player->ref_count = 1;
     new_player->rating = PLAYER_INITIAL_RATING;
+    reftrack_create(REF_PLAYER, new_player, "player_create");
     return new_player;
 }
 
@@ -59,6 +64,8 @@ PLAYER *player_ref(PLAYER *player, char *why){
     //int new=++inv->ref_count;
     debug("(%d->%d) %s", player->ref_count, player->ref_count+1, why);
     player->ref_count++;
+    trace(TRACE_PLAYER_REF, (uintptr_t)player, player->ref_count, 0, why);
+    reftrack_ref(REF_PLAYER, player, why);
     //debug("%s",why);
     sem_post(&player->semaphore_block);
     return player;
@@ -79,10 +86,16 @@ void player_unref(PLAYER *player, char *why){
     sem_wait(&player->semaphore_block);
     debug("(%d->%d) %s", player->ref_count, player->ref_count-1, why);
     player->ref_count--;
-    if(player->ref_count == 0){
-        free(player);
+    trace(TRACE_PLAYER_UNREF, (uintptr_t)player, player->ref_count, 0, why);
+    reftrack_unref(REF_PLAYER, player, why);
+    if(player->ref_count > 0){
+        sem_post(&player->semaphore_block);
+        return;
     }
     sem_post(&player->semaphore_block);
+    sem_destroy(&player->semaphore_block);
+    free(player->name);
+    free(player);
 }
 
 /*
@@ -125,12 +138,8 @@ int player_get_rating(PLAYER *player){
  * @param result   0 if draw, 1 if player1 won, 2 if player2 won.
  */
 void player_post_result(PLAYER *player1, PLAYER *player2, int result){
-    int S1,S2;
-    if(result == 0){
-        S1 = 0.5;
-        S2 = 0.5;
-    }
-    else if(result == 1){
+    double S1, S2;
+    if(result == 1){
         S1 = 1;
         S2 = 0;
     }
@@ -138,11 +147,36 @@ void player_post_result(PLAYER *player1, PLAYER *player2, int result){
         S1 = 0;
         S2 = 1;
     }
+    else{
+        S1 = 0.5;
+        S2 = 0.5;
+    }
+    //both ratings are read before either is written, so the two updates
+    //see the same pair of old ratings
+    sem_wait(&player1->semaphore_block);
     int R1 = player1->rating;
+    sem_post(&player1->semaphore_block);
+    sem_wait(&player2->semaphore_block);
     int R2 = player2->rating;
-    //DOUBLE CHECK THE CALCULATIONS FOR E1 AND E2 TO SEE IF IT REQUIRES A POINTER INSTEAD
-    int E1 = 1/(1 + 10*((R2-R1)/400));
-    int E2 = 1/(1 + 10*((R1-R2)/400));
-    R1 = R1 + 32*(S1-E1);
-    R2 = R2 + 32*(S2-E2);
-}
\ No newline at end of file
+    sem_post(&player2->semaphore_block);
+    double E1 = 1/(1 + pow(10, (R2-R1)/400.0));
+    double E2 = 1/(1 + pow(10, (R1-R2)/400.0));
+    sem_wait(&player1->semaphore_block);
+    player1->rating += (int)lround(32*(S1-E1));
+    sem_post(&player1->semaphore_block);
+    sem_wait(&player2->semaphore_block);
+    player2->rating += (int)lround(32*(S2-E2));
+    sem_post(&player2->semaphore_block);
+}
+
+/*
+ * Set the rating of a player outright.
+ *
+ * @param player  The PLAYER to be updated.
+ * @param rating  The new rating.
+ */
+void player_set_rating(PLAYER *player, int rating){
+    sem_wait(&player->semaphore_block);
+    player->rating = rating;
+    sem_post(&player->semaphore_block);
+}
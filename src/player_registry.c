@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <string.h>
+#include <semaphore.h>
+
+#include "debug.h"
+#include "player_registry.h"
+#include "player_registry_ext.h"
+
+//initial number of hash buckets, doubled whenever the load factor hits 1
+#define PREG_INITIAL_BUCKETS 64
+
+typedef struct preg_entry {
+    PLAYER *player;
+    unsigned int hash;
+    struct preg_entry *next;
+} PREG_ENTRY;
+
+typedef struct player_registry {
+    //players are never removed, so this only ever grows
+    PREG_ENTRY **buckets;
+    unsigned int nbuckets;
+    unsigned int count;
+    sem_t semaphore_block;
+} PLAYER_REGISTRY;
+
+//FNV-1a
+static unsigned int hash_name(const char *name){
+    unsigned int h = 2166136261u;
+    for(; *name != '\0'; name++){
+        h ^= (unsigned char)*name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+PLAYER_REGISTRY *preg_init(void){
+    debug("PREG INIT");
+    PLAYER_REGISTRY *preg = malloc(sizeof(PLAYER_REGISTRY));
+    if(preg == NULL)
+        return NULL;
+    preg->buckets = calloc(PREG_INITIAL_BUCKETS, sizeof(PREG_ENTRY *));
+    if(preg->buckets == NULL){
+        free(preg);
+        return NULL;
+    }
+    preg->nbuckets = PREG_INITIAL_BUCKETS;
+    preg->count = 0;
+    sem_init(&preg->semaphore_block, 0, 1);
+    return preg;
+}
+
+void preg_fini(PLAYER_REGISTRY *preg){
+    debug("PREG FINI");
+    for(unsigned int i = 0; i < preg->nbuckets; i++){
+        PREG_ENTRY *e = preg->buckets[i];
+        while(e != NULL){
+            PREG_ENTRY *next = e->next;
+            player_unref(e->player, "player registry finalized");
+            free(e);
+            e = next;
+        }
+    }
+    sem_destroy(&preg->semaphore_block);
+    free(preg->buckets);
+    free(preg);
+}
+
+static void grow_buckets(PLAYER_REGISTRY *preg){
+    unsigned int nb = 2 * preg->nbuckets;
+    PREG_ENTRY **buckets = calloc(nb, sizeof(PREG_ENTRY *));
+    if(buckets == NULL)
+        return;    //just longer chains
+    for(unsigned int i = 0; i < preg->nbuckets; i++){
+        PREG_ENTRY *e = preg->buckets[i];
+        while(e != NULL){
+            PREG_ENTRY *next = e->next;
+            e->next = buckets[e->hash & (nb - 1)];
+            buckets[e->hash & (nb - 1)] = e;
+            e = next;
+        }
+    }
+    free(preg->buckets);
+    preg->buckets = buckets;
+    preg->nbuckets = nb;
+}
+
+PLAYER *preg_register(PLAYER_REGISTRY *preg, char *name){
+    unsigned int h = hash_name(name);
+    sem_wait(&preg->semaphore_block);
+    for(PREG_ENTRY *e = preg->buckets[h & (preg->nbuckets - 1)]; e != NULL; e = e->next){
+        if(e->hash == h && strcmp(player_get_name(e->player), name) == 0){
+            PLAYER *player = player_ref(e->player, "preg_register existing player");
+            sem_post(&preg->semaphore_block);
+            return player;
+        }
+    }
+    PREG_ENTRY *e = malloc(sizeof(PREG_ENTRY));
+    PLAYER *player = e != NULL ? player_create(name) : NULL;
+    if(player == NULL){
+        free(e);
+        sem_post(&preg->semaphore_block);
+        return NULL;
+    }
+    debug("PREG REGISTER new player %s", name);
+    if(preg->count == preg->nbuckets)
+        grow_buckets(preg);
+    e->player = player;
+    e->hash = h;
+    e->next = preg->buckets[h & (preg->nbuckets - 1)];
+    preg->buckets[h & (preg->nbuckets - 1)] = e;
+    preg->count++;
+    player_ref(player, "preg_register new player");
+    sem_post(&preg->semaphore_block);
+    return player;
+}
+
+PLAYER **preg_all_players(PLAYER_REGISTRY *preg){
+    sem_wait(&preg->semaphore_block);
+    PLAYER **players = malloc((preg->count + 1) * sizeof(PLAYER *));
+    if(players == NULL){
+        sem_post(&preg->semaphore_block);
+        return NULL;
+    }
+    int n = 0;
+    for(unsigned int i = 0; i < preg->nbuckets; i++)
+        for(PREG_ENTRY *e = preg->buckets[i]; e != NULL; e = e->next)
+            players[n++] = player_ref(e->player, "preg_all_players");
+    players[n] = NULL;
+    sem_post(&preg->semaphore_block);
+    return players;
+}
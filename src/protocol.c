@@ -1,11 +1,112 @@
 #include "protocol.h"
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
 
 #include "debug.h"
 #include "csapp.h"
+#include "proto_io.h"
+#include "proto_codec.h"
+
+static PROTO_SENDER *proto_sender;
+static PROTO_SHARED_SENDER *proto_shared_sender;
+
+void proto_set_sender(PROTO_SENDER *sender){
+    proto_sender = sender;
+}
+
+void proto_set_shared_sender(PROTO_SHARED_SENDER *sender){
+    proto_shared_sender = sender;
+}
+
+PROTO_BUF *proto_buf_create(const void *data, size_t len){
+    PROTO_BUF *buf = malloc(sizeof(PROTO_BUF) + len);
+    if(buf == NULL)
+        return NULL;
+    buf->refs = 1;
+    buf->len = len;
+    if(len > 0)
+        memcpy(buf->data, data, len);
+    return buf;
+}
+
+PROTO_BUF *proto_buf_ref(PROTO_BUF *buf){
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+void proto_buf_unref(PROTO_BUF *buf){
+    if(__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(buf);
+}
+
+/*
+ * Write everything described by iov to fd.  Connections serviced by the
+ * event loop are non-blocking, so a short write or EAGAIN just means the
+ * socket buffer is full: wait for it to drain and carry on, so that a
+ * packet is never left half-sent on the wire.
+ *
+ * @return 0 if everything was written, -1 otherwise (errno is set).
+ */
+static int writev_fully(int fd, struct iovec *iov, int iovcnt){
+    while(iovcnt > 0){
+        ssize_t n = writev(fd, iov, iovcnt);
+        if(n > 0){
+            //skip over whatever made it out, possibly part of an iovec
+            while(iovcnt > 0 && (size_t)n >= iov->iov_len){
+                n -= iov->iov_len;
+                iov++;
+                iovcnt--;
+            }
+            if(iovcnt > 0){
+                iov->iov_base = (char *)iov->iov_base + n;
+                iov->iov_len -= n;
+            }
+        }
+        else if(n == 0){
+            errno = EOF;
+            return -1;
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK){
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            if(poll(&pfd, 1, -1) == -1 && errno != EINTR)
+                return -1;
+        }
+        else if(errno != EINTR){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read exactly len bytes from fd, however many reads that takes; a packet
+ * can arrive in pieces.
+ *
+ * @return 0 if everything was read, -1 otherwise (errno is EOF if the
+ * connection ended first).
+ */
+static int read_fully(int fd, void *buf, size_t len){
+    size_t have = 0;
+    while(have < len){
+        ssize_t n = read(fd, (char *)buf + have, len - have);
+        if(n > 0){
+            have += n;
+        }
+        else if(n == 0){
+            errno = EOF;
+            return -1;
+        }
+        else if(errno != EINTR){
+            return -1;
+        }
+    }
+    return 0;
+}
 
 /*
  * Send a packet, which consists of a fixed-size header followed by an
@@ -22,35 +123,35 @@
  */
 int proto_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data){
     debug("SENDING PACKET");
-    JEUX_PACKET_HEADER *pHead = hdr;
-    void* incomingPayload = data;
+    unsigned char wire[JEUX_WIRE_HEADER_SIZE];
+    size_t size = (data != NULL) ? ntohs(hdr->size) : 0;
+    proto_encode_header(wire, hdr);
 
-    //write header to "wire" connection first
-    int status = write(fd,pHead,sizeof(JEUX_PACKET_HEADER));
-    if(status == 0){
-        errno = EOF;
-        return -1;
-    }
-    else if(status < 0){
-        errno = EINTR;
-        return -1;
+    //let the event loop queue it if it's managing this connection
+    if(proto_sender != NULL){
+        int ret = proto_sender(fd, wire, sizeof(wire), data, size);
+        if(ret != PROTO_SEND_DECLINED)
+            return ret;
     }
 
-    //if size is 0 and (maybe data != null) write payload immediately
-    //convert multi-byte quantities from host to network byte order
-    if(htons(pHead->size) > 0 && data != NULL){
-        int status2 = write(fd,incomingPayload,htons(pHead->size));
-        if(status2 == 0){
-            errno = EOF;
-            return -1;
-        }
-        else if(status2 < 0){
-            errno = EINTR;
-            return -1;
-        }
+    //header and payload go out in one system call
+    struct iovec iov[2];
+    iov[0].iov_base = wire;
+    iov[0].iov_len = sizeof(wire);
+    iov[1].iov_base = data;
+    iov[1].iov_len = size;
+    return writev_fully(fd, iov, size > 0 ? 2 : 1);
+}
+
+int proto_send_shared(int fd, JEUX_PACKET_HEADER *hdr, PROTO_BUF *buf){
+    if(proto_shared_sender != NULL){
+        unsigned char wire[JEUX_WIRE_HEADER_SIZE];
+        proto_encode_header(wire, hdr);
+        int ret = proto_shared_sender(fd, wire, sizeof(wire), buf);
+        if(ret != PROTO_SEND_DECLINED)
+            return ret;
     }
-    //successful write
-    return 0;
+    return proto_send_packet(fd, hdr, buf->len > 0 ? buf->data : NULL);
 }
 
 /*
@@ -70,33 +171,25 @@ int proto_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data){
  */
 int proto_recv_packet(int fd, JEUX_PACKET_HEADER *hdr, void **payloadp){
     debug("GETTING PACKET");
-    int status = read(fd, hdr, sizeof(JEUX_PACKET_HEADER));
-    if(status == 0){
-        errno = EOF;
+    unsigned char wire[JEUX_WIRE_HEADER_SIZE];
+    *payloadp = NULL;
+    if(read_fully(fd, wire, sizeof(wire)) == -1)
         return -1;
-    }
-    else if (status < 0){
-        errno = EINTR;
-        return -1;
-    }
-    debug("Read %d bytes", status);
-
-    // do i read uint8_t type as well?
+    proto_decode_header(hdr, wire);
     hdr->size = ntohs(hdr->size);
 
-    //A pointer to the payload is stored in a variable supplied by the caller
-    if ((hdr->size) > 0){
-        *payloadp = malloc(hdr->size);
-        int status2 =read(fd, *payloadp, hdr->size);
-        if(status2 == 0){
-            errno = EOF;
+    //A pointer to the payload is stored in a variable supplied by the caller,
+    //with room for the null terminator after however many bytes were sent
+    if(hdr->size > 0){
+        char *payload = malloc(hdr->size + 1);
+        if(payload == NULL)
             return -1;
-        }
-        else if(status2 < 0){
-            errno = EINTR;
+        if(read_fully(fd, payload, hdr->size) == -1){
+            free(payload);
             return -1;
         }
-        ((char *)*payloadp)[hdr->size] = '\0'; // add null terminator
+        payload[hdr->size] = '\0';
+        *payloadp = payload;
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,72 @@
+#include <stdint.h>
+
+#include "debug.h"
+#include "protocol_ext.h"
+#include "rate_limit.h"
+
+/*
+ * The steady rate and burst of one kind of bucket, at a scale of 1.
+ */
+typedef struct rl_limit {
+    unsigned int per_second;
+    unsigned int burst;
+} RL_LIMIT;
+
+static const RL_LIMIT limits[RL_CLASSES] = {
+    [RL_REQUESTS] = { 100, 200 },
+    [RL_LISTINGS] = { 4, 16 },
+    [RL_OFFERS]   = { 10, 40 },
+    [RL_PATIENCE] = { 1, 32 }
+};
+
+static unsigned int scale = 1;
+
+void rl_set_scale(unsigned int factor){
+    scale = factor;
+}
+
+void rl_init(RATE_LIMITER *rl){
+    for(int c = 0; c < RL_CLASSES; c++)
+        rl->full_at[c] = 0;
+}
+
+static RL_CLASS class_of(int type){
+    switch(type){
+        case JEUX_USERS_PKT:
+        case JEUX_STANDINGS_PKT:
+        case JEUX_STATS_PKT:
+            return RL_LISTINGS;
+        case JEUX_INVITE_PKT:
+        case JEUX_MATCH_PKT:
+        case JEUX_WATCH_PKT:
+        case JEUX_TOURNEY_PKT:
+            return RL_OFFERS;
+        default:
+            return RL_REQUESTS;
+    }
+}
+
+/*
+ * Take a token from a bucket, if it has one: it has as long as it would
+ * not take more than burst - 1 intervals to fill back up without this
+ * token.
+ */
+static int take(RATE_LIMITER *rl, RL_CLASS c, uint64_t now){
+    uint64_t interval = 1000000000ULL / ((uint64_t)limits[c].per_second * scale);
+    uint64_t slack = interval * ((uint64_t)limits[c].burst * scale - 1);
+    uint64_t full_at = rl->full_at[c] > now ? rl->full_at[c] : now;
+    if(full_at - now > slack)
+        return -1;
+    rl->full_at[c] = full_at + interval;
+    return 0;
+}
+
+RL_VERDICT rl_check(RATE_LIMITER *rl, int type, uint64_t now_ns){
+    if(scale == 0)
+        return RL_OK;
+    RL_CLASS c = class_of(type);
+    if(take(rl, RL_REQUESTS, now_ns) == 0 && (c == RL_REQUESTS || take(rl, c, now_ns) == 0))
+        return RL_OK;
+    debug("over the limit for type %d", type);
+    return take(rl, RL_PATIENCE, now_ns) == 0 ? RL_REFUSED : RL_CUT_OFF;
+}
@@ -0,0 +1,254 @@
+#ifdef REFTRACK
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "reftrack.h"
+#include "game.h"
+
+#define REFTRACK_BUCKETS 65536       // a power of two
+#define REFTRACK_LIST_MAX 100        // objects listed in a detailed report
+#define REFTRACK_OVER_MAX 16         // over-releases remembered
+
+/*
+ * The references taken and dropped for one reason.
+ */
+typedef struct ref_reason {
+    const char *why;
+    int refs, unrefs;
+} REF_REASON;
+
+typedef struct ref_object {
+    struct ref_object *next;         // in its bucket
+    void *obj;
+    REF_KIND kind;
+    int count;
+    REF_REASON *reasons;
+    int nreasons, cap;
+} REF_OBJECT;
+
+typedef struct ref_over {
+    REF_KIND kind;
+    void *obj;
+    const char *why;
+} REF_OVER;
+
+static REF_OBJECT *buckets[REFTRACK_BUCKETS];
+static int live[REF_KINDS];
+static long over_count[REF_KINDS];
+static REF_OVER overs[REFTRACK_OVER_MAX];
+static int nover;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *kind_names[REF_KINDS] = { "CLIENT", "PLAYER", "INVITATION", "GAME" };
+
+static unsigned int bucket_of(void *obj){
+    uintptr_t h = (uintptr_t)obj;
+    h ^= h >> 17;
+    h *= 0x9e3779b97f4a7c15ULL;
+    return (h >> 32) & (REFTRACK_BUCKETS - 1);
+}
+
+// where an object is, or would be, in its bucket
+static REF_OBJECT **slot(void *obj){
+    REF_OBJECT **pp = &buckets[bucket_of(obj)];
+    while(*pp != NULL && (*pp)->obj != obj)
+        pp = &(*pp)->next;
+    return pp;
+}
+
+/*
+ * The counts for a reason; whys are compared as strings, since the same
+ * literal in two files need not be one string.
+ */
+static REF_REASON *reason(REF_OBJECT *o, const char *why){
+    if(why == NULL)
+        why = "(none)";
+    for(int i = 0; i < o->nreasons; i++)
+        if(o->reasons[i].why == why || strcmp(o->reasons[i].why, why) == 0)
+            return &o->reasons[i];
+    if(o->nreasons == o->cap){
+        int cap = o->cap ? 2 * o->cap : 4;
+        REF_REASON *grown = realloc(o->reasons, cap * sizeof(REF_REASON));
+        if(grown == NULL)
+            return NULL;
+        o->reasons = grown;
+        o->cap = cap;
+    }
+    REF_REASON *r = &o->reasons[o->nreasons++];
+    r->why = why;
+    r->refs = r->unrefs = 0;
+    return r;
+}
+
+static void over_released(REF_KIND kind, void *obj, const char *why){
+    over_count[kind]++;
+    if(nover < REFTRACK_OVER_MAX)
+        overs[nover++] = (REF_OVER){ kind, obj, why };
+    debug("over-release of %s %p: %s", kind_names[kind], obj, why);
+}
+
+void reftrack_create(REF_KIND kind, void *obj, const char *why){
+    pthread_mutex_lock(&lock);
+    REF_OBJECT **pp = slot(obj);
+    //still there, so its last reference was never dropped; it has been
+    //freed some other way, or this is a bug of ours
+    if(*pp != NULL){
+        REF_OBJECT *stale = *pp;
+        *pp = stale->next;
+        live[stale->kind]--;
+        free(stale->reasons);
+        free(stale);
+    }
+    REF_OBJECT *o = calloc(1, sizeof(REF_OBJECT));
+    REF_REASON *r;
+    if(o != NULL){
+        o->obj = obj;
+        o->kind = kind;
+        o->count = 1;
+        if((r = reason(o, why)) != NULL)
+            r->refs++;
+        o->next = buckets[bucket_of(obj)];
+        buckets[bucket_of(obj)] = o;
+        live[kind]++;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void reftrack_ref(REF_KIND kind, void *obj, const char *why){
+    pthread_mutex_lock(&lock);
+    REF_OBJECT *o = *slot(obj);
+    REF_REASON *r;
+    if(o != NULL){
+        o->count++;
+        if((r = reason(o, why)) != NULL)
+            r->refs++;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void reftrack_unref(REF_KIND kind, void *obj, const char *why){
+    pthread_mutex_lock(&lock);
+    REF_OBJECT **pp = slot(obj);
+    REF_OBJECT *o = *pp;
+    REF_REASON *r;
+    if(o == NULL || o->count <= 0){
+        over_released(kind, obj, why);
+    }
+    else if(--o->count == 0){
+        *pp = o->next;
+        live[o->kind]--;
+        free(o->reasons);
+        free(o);
+    }
+    else if((r = reason(o, why)) != NULL){
+        r->unrefs++;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * The references taken for one reason less those dropped for it, over
+ * all the objects of one kind there are.
+ */
+typedef struct ref_held {
+    REF_KIND kind;
+    const char *why;
+    long refs;
+    int objects;
+} REF_HELD;
+
+static int by_refs(const void *a, const void *b){
+    const REF_HELD *x = a, *y = b;
+    return x->refs < y->refs ? 1 : x->refs > y->refs ? -1 : 0;
+}
+
+int reftrack_report(FILE *f, int detail){
+    pthread_mutex_lock(&lock);
+    int total = 0;
+    fprintf(f, "reftrack live");
+    for(int k = 0; k < REF_KINDS; k++){
+        fprintf(f, " %s %d", kind_names[k], live[k]);
+        total += live[k];
+    }
+    fprintf(f, "\nreftrack over-released");
+    for(int k = 0; k < REF_KINDS; k++)
+        fprintf(f, " %s %ld", kind_names[k], over_count[k]);
+    fputc('\n', f);
+    for(int i = 0; i < nover; i++)
+        fprintf(f, "reftrack over-release %s %p \"%s\"\n", kind_names[overs[i].kind],
+                overs[i].obj, overs[i].why != NULL ? overs[i].why : "(none)");
+
+    REF_HELD *held = NULL;
+    int nheld = 0, cap = 0, listed = 0;
+    for(int b = 0; b < REFTRACK_BUCKETS; b++){
+        for(REF_OBJECT *o = buckets[b]; o != NULL; o = o->next){
+            if(detail && listed++ < REFTRACK_LIST_MAX){
+                fprintf(f, "reftrack %s %p count %d:", kind_names[o->kind], o->obj, o->count);
+                for(int i = 0; i < o->nreasons; i++)
+                    if(o->reasons[i].refs != o->reasons[i].unrefs)
+                        fprintf(f, " \"%s\" %+d", o->reasons[i].why,
+                                o->reasons[i].refs - o->reasons[i].unrefs);
+                fputc('\n', f);
+            }
+            for(int i = 0; i < o->nreasons; i++){
+                REF_REASON *r = &o->reasons[i];
+                if(r->refs == r->unrefs)
+                    continue;
+                int h;
+                for(h = 0; h < nheld; h++)
+                    if(held[h].kind == o->kind && strcmp(held[h].why, r->why) == 0)
+                        break;
+                if(h == nheld){
+                    if(nheld == cap){
+                        cap = cap ? 2 * cap : 16;
+                        REF_HELD *grown = realloc(held, cap * sizeof(REF_HELD));
+                        if(grown == NULL)
+                            continue;
+                        held = grown;
+                    }
+                    held[nheld++] = (REF_HELD){ o->kind, r->why, 0, 0 };
+                }
+                held[h].refs += r->refs - r->unrefs;
+                held[h].objects++;
+            }
+        }
+    }
+    qsort(held, nheld, sizeof(REF_HELD), by_refs);
+    for(int h = 0; h < nheld; h++)
+        fprintf(f, "reftrack held %s \"%s\" %+ld on %d\n", kind_names[held[h].kind],
+                held[h].why, held[h].refs, held[h].objects);
+    free(held);
+    pthread_mutex_unlock(&lock);
+    return total;
+}
+
+/*
+ * GAMEs, caught on their way into the game library (the link wraps these
+ * three functions; see the Makefile).
+ */
+GAME *__real_game_create(void);
+GAME *__real_game_ref(GAME *game, char *why);
+void __real_game_unref(GAME *game, char *why);
+
+GAME *__wrap_game_create(void){
+    GAME *game = __real_game_create();
+    if(game != NULL)
+        reftrack_create(REF_GAME, game, "game_create");
+    return game;
+}
+
+GAME *__wrap_game_ref(GAME *game, char *why){
+    reftrack_ref(REF_GAME, game, why);
+    return __real_game_ref(game, why);
+}
+
+void __wrap_game_unref(GAME *game, char *why){
+    reftrack_unref(REF_GAME, game, why);
+    __real_game_unref(game, why);
+}
+
+#endif
@@ -0,0 +1,332 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "debug.h"
+#include "server.h"
+#include "service.h"
+#include "client_registry.h"
+#include "client_registry_ext.h"
+#include "client_ext.h"
+#include "player_registry.h"
+#include "protocol_ext.h"
+#include "match_queue.h"
+#include "tournament.h"
+#include "cluster.h"
+#include "stats.h"
+#include "trace.h"
+#include "jeux_globals.h"
+
+/*
+ * Send an ACK whose header carries an invitation ID (the reply to INVITE,
+ * or to WATCH along with the game state).  client_send_ack() has no way
+ * to set the id field, so build it here.  data may be NULL.
+ */
+static int send_ack_with_id(CLIENT *client, int id, char *data){
+    JEUX_PACKET_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = JEUX_ACK_PKT;
+    hdr.id = id;
+    hdr.size = htons(data != NULL ? strlen(data) : 0);
+    return client_send_packet(client, &hdr, data);
+}
+
+/*
+ * Build the payload for a USERS request: one line per logged in player,
+ * username followed by a TAB and the player's rating, and then the timing
+ * of the player's connection (see protocol_ext.h).
+ * Returns a malloc'ed string, or NULL on failure.
+ */
+static char *users_payload(size_t *lenp){
+    CLIENT **clients = creg_all_clients(client_registry);
+    if(clients == NULL)
+        return NULL;
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&buf, &len);
+    for(CLIENT **cp = clients; *cp != NULL; cp++){
+        PLAYER *player = client_get_player(*cp);
+        CLIENT_TIMING t;
+        //logged out since the list was made
+        if(out != NULL && player != NULL){
+            fprintf(out, "%s\t%d", player_get_name(player), player_get_rating(player));
+            if(client_get_timing(*cp, &t) == -1)
+                fputc('\n', out);
+            else if(t.stamped == 0)
+                fprintf(out, "\t%ld\n", t.rtt_us);
+            else
+                fprintf(out, "\t%ld\t%ld\t%ld\n", t.rtt_us, t.delay_us, t.skew_us);
+        }
+        client_unref(*cp, "USERS list entry discarded");
+    }
+    free(clients);
+    if(out == NULL)
+        return NULL;
+    fclose(out);
+    *lenp = len;
+    return buf;
+}
+
+static int do_login(CLIENT *client, char *name){
+    if(client_get_player(client) != NULL || name == NULL || *name == '\0')
+        return -1;
+    PLAYER *player = preg_register(player_registry, name);
+    if(player == NULL)
+        return -1;
+    int ret = client_login(client, player);
+    player_unref(player, "reference from preg_register discarded after login");
+    //in a cluster the name has to be free on the other nodes as well
+    if(ret == 0 && cluster != NULL && (ret = cluster_register(cluster, client)) == -1)
+        client_logout(client);
+    return ret;
+}
+
+static int do_invite(CLIENT *client, JEUX_PACKET_HEADER *hdr, char *name){
+    GAME_ROLE target_role = hdr->role;
+    GAME_ROLE source_role;
+    if(name == NULL)
+        return -1;
+    if(target_role == FIRST_PLAYER_ROLE)
+        source_role = SECOND_PLAYER_ROLE;
+    else if(target_role == SECOND_PLAYER_ROLE)
+        source_role = FIRST_PLAYER_ROLE;
+    else
+        return -1;
+    CLIENT *target = creg_lookup(client_registry, name);
+    if(target == NULL && cluster != NULL)
+        target = cluster_lookup(cluster, name);
+    if(target == NULL)
+        return -1;
+    int id = client_make_invitation(client, target, source_role, target_role);
+    client_unref(target, "reference from creg_lookup discarded after INVITE");
+    if(id < 0)
+        return -1;
+    return send_ack_with_id(client, id, NULL) == 0 ? 0 : -1;
+}
+
+static int do_accept(CLIENT *client, int id){
+    char *state = NULL;
+    if(client_accept_invitation(client, id, &state) == -1)
+        return -1;
+    int ret = client_send_ack(client, state, state != NULL ? strlen(state) : 0);
+    free(state);
+    return ret;
+}
+
+static int do_watch(CLIENT *client, char *name){
+    if(name == NULL)
+        return -1;
+    CLIENT *player = creg_lookup(client_registry, name);
+    if(player == NULL)
+        return -1;
+    char *state = NULL;
+    int id = client_watch_game(client, player, &state);
+    client_unref(player, "reference from creg_lookup discarded after WATCH");
+    if(id < 0)
+        return -1;
+    int ret = send_ack_with_id(client, id, state);
+    free(state);
+    return ret == 0 ? 0 : -1;
+}
+
+static int do_tourney(CLIENT *client, char *spec){
+    TRN_FORMAT format;
+    int rounds = 0;
+    if(spec == NULL)
+        return -1;
+    if(sscanf(spec, "swiss %d", &rounds) == 1)
+        format = TRN_SWISS;
+    else if(strcmp(spec, "roundrobin") == 0)
+        format = TRN_ROUND_ROBIN;
+    else
+        return -1;
+    int id = treg_create(tournaments, client, format, rounds);
+    if(id < 0)
+        return -1;
+    return send_ack_with_id(client, id, NULL) == 0 ? 0 : -1;
+}
+
+static int do_stats(CLIENT *client){
+    size_t len = 0;
+    char *report = stats_report(&len);
+    if(report == NULL)
+        return -1;
+    int ret = client_send_ack(client, report, len);
+    free(report);
+    return ret;
+}
+
+static int do_standings(CLIENT *client, int id){
+    char *table = treg_standings(tournaments, id);
+    if(table == NULL)
+        return -1;
+    int ret = client_send_ack(client, table, strlen(table));
+    free(table);
+    return ret;
+}
+
+int service_dispatch(CLIENT *client, JEUX_PACKET_HEADER *hdr, char *payload){
+    int ret = -1;
+    STAT_NACK why = STAT_NACK_REFUSED;
+    debug("%ld: dispatch type %d id %d", pthread_self(), hdr->type, hdr->id);
+    stats_packet_in(hdr->type, hdr->size);
+    trace(TRACE_PKT_IN, client_get_fd(client), hdr->size, hdr->type, NULL);
+
+    // a client over its limits gets nothing but a NACK, before anything
+    // is looked up for it
+    RL_VERDICT verdict = client_check_rate(client, hdr->type);
+    if(verdict != RL_OK){
+        stats_nack(STAT_NACK_RATE);
+        client_send_nack(client);
+        if(verdict == RL_REFUSED)
+            return -1;
+        debug("%ld: cutting off a flood", pthread_self());
+        stats_add(STAT_CUT_OFF, 1);
+        return -2;
+    }
+
+    // nothing but LOGIN is honored before a login, and LOGIN isn't after
+    if(hdr->type == JEUX_LOGIN_PKT){
+        ret = do_login(client, payload);
+        if(ret == 0)
+            return client_send_ack(client, NULL, 0);
+        // the ACK or NACK comes once the cluster has answered
+        if(ret == 1)
+            return 0;
+        stats_nack(STAT_NACK_LOGIN);
+        client_send_nack(client);
+        return -1;
+    }
+    if(client_get_player(client) == NULL){
+        stats_nack(STAT_NACK_NOT_LOGGED_IN);
+        client_send_nack(client);
+        return -1;
+    }
+
+    switch(hdr->type){
+        case JEUX_USERS_PKT: {
+            size_t len = 0;
+            char *list = users_payload(&len);
+            if(list != NULL){
+                ret = client_send_ack(client, list, len);
+                free(list);
+                return ret;
+            }
+            break;
+        }
+        case JEUX_INVITE_PKT:
+            // do_invite sends its own ACK because of the ID in the header
+            if(do_invite(client, hdr, payload) == 0)
+                return 0;
+            break;
+        case JEUX_REVOKE_PKT:
+            ret = client_revoke_invitation(client, hdr->id);
+            break;
+        case JEUX_DECLINE_PKT:
+            ret = client_decline_invitation(client, hdr->id);
+            break;
+        case JEUX_ACCEPT_PKT:
+            if(do_accept(client, hdr->id) == 0)
+                return 0;
+            break;
+        case JEUX_MOVE_PKT:
+            if(payload != NULL)
+                ret = client_make_move(client, hdr->id, payload);
+            break;
+        case JEUX_RESIGN_PKT:
+            ret = client_resign_game(client, hdr->id);
+            break;
+        case JEUX_MATCH_PKT:
+            ret = mq_join(match_queue, client);
+            break;
+        case JEUX_UNMATCH_PKT:
+            ret = mq_leave(match_queue, client);
+            break;
+        case JEUX_WATCH_PKT:
+            // do_watch sends its own ACK because of the ID in the header
+            if(do_watch(client, payload) == 0)
+                return 0;
+            break;
+        case JEUX_UNWATCH_PKT:
+            ret = client_unwatch_game(client, hdr->id);
+            break;
+        case JEUX_TOURNEY_PKT:
+            // do_tourney sends its own ACK because of the ID in the header
+            if(do_tourney(client, payload) == 0)
+                return 0;
+            break;
+        case JEUX_ENTER_PKT:
+            ret = treg_enter(tournaments, hdr->id, client);
+            break;
+        case JEUX_START_PKT:
+            ret = treg_start(tournaments, hdr->id, client);
+            break;
+        case JEUX_STANDINGS_PKT:
+            if(do_standings(client, hdr->id) == 0)
+                return 0;
+            break;
+        case JEUX_STATS_PKT:
+            if(do_stats(client) == 0)
+                return 0;
+            break;
+        default:
+            debug("unknown packet type %d", hdr->type);
+            why = STAT_NACK_UNKNOWN;
+            break;
+    }
+    if(ret == 0)
+        return client_send_ack(client, NULL, 0);
+    stats_nack(why);
+    client_send_nack(client);
+    return -1;
+}
+
+void service_disconnect(CLIENT *client){
+    if(match_queue != NULL)
+        mq_leave(match_queue, client);
+    if(tournaments != NULL)
+        treg_leave(tournaments, client);
+    if(cluster != NULL)
+        cluster_unregister(cluster, client);
+    if(client_get_player(client) != NULL)
+        client_logout(client);
+    creg_unregister(client_registry, client);
+}
+
+/*
+ * Thread function for the thread that handles a particular client.
+ * See server.h for the full specification.  The event loop does not use
+ * this; it runs the same requests through session_run() instead.
+ */
+void *jeux_client_service(void *arg){
+    int fd = *(int *)arg;
+    free(arg);
+    pthread_detach(pthread_self());
+    debug("%ld: [%d] Starting client service", pthread_self(), fd);
+
+    CLIENT *client = creg_register(client_registry, fd);
+    if(client == NULL){
+        close(fd);
+        return NULL;
+    }
+
+    JEUX_PACKET_HEADER hdr;
+    void *payload = NULL;
+    while(proto_recv_packet(fd, &hdr, &payload) == 0){
+        stats_request_begin(hdr.type, stats_clock_ns());
+        client_note_request(client, &hdr);
+        int cut_off = service_dispatch(client, &hdr, payload) == -2;
+        stats_request_end();
+        free(payload);
+        payload = NULL;
+        if(cut_off)
+            break;
+    }
+    debug("%ld: [%d] Ending client service", pthread_self(), fd);
+    service_disconnect(client);
+    close(fd);
+    return NULL;
+}
@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "debug.h"
+#include "session.h"
+#include "service.h"
+#include "client_registry.h"
+#include "client_ext.h"
+#include "jeux_globals.h"
+#include "stats.h"
+
+SESSION *session_create(int fd){
+    debug("[%d] SESSION CREATE", fd);
+    SESSION *s = calloc(1, sizeof(SESSION));
+    if(s == NULL)
+        return NULL;
+    s->client = creg_register(client_registry, fd);
+    if(s->client == NULL){
+        free(s);
+        return NULL;
+    }
+    s->fd = fd;
+    // replies are small and go out one at a time, so waiting to coalesce
+    // them (Nagle) only stalls the client for a delayed ACK, 40ms or so
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    CO_INIT(&s->co);
+    return s;
+}
+
+int session_feed(SESSION *s, const void *data, size_t len){
+    if(data == NULL){
+        s->in_eof = 1;
+        return 0;
+    }
+    //slide what's left to the front before growing
+    if(s->in_off > 0){
+        memmove(s->in, s->in + s->in_off, s->in_len - s->in_off);
+        s->in_len -= s->in_off;
+        s->in_off = 0;
+    }
+    if(s->in_len + len > s->in_cap){
+        size_t cap = s->in_cap ? s->in_cap : 256;
+        while(cap < s->in_len + len)
+            cap *= 2;
+        char *in = realloc(s->in, cap);
+        if(in == NULL)
+            return -1;
+        s->in = in;
+        s->in_cap = cap;
+    }
+    memcpy(s->in + s->in_len, data, len);
+    s->in_len += len;
+    return 0;
+}
+
+int session_has_input(SESSION *s){
+    return s->in_off < s->in_len;
+}
+
+/*
+ * Read into buf until len bytes (counting the s->have already there) have
+ * been received.  Returns 1 once the buffer is full, 0 if the socket has
+ * no more data for now, -1 on EOF or error.
+ */
+static int session_read(SESSION *s, void *buf, size_t len){
+    while(s->have < len){
+        if(session_has_input(s)){
+            size_t n = s->in_len - s->in_off;
+            if(n > len - s->have)
+                n = len - s->have;
+            memcpy((char *)buf + s->have, s->in + s->in_off, n);
+            s->in_off += n;
+            s->have += n;
+            continue;
+        }
+        if(s->buffered)
+            return s->in_eof ? -1 : 0;
+        ssize_t n = read(s->fd, (char *)buf + s->have, len - s->have);
+        if(n > 0){
+            s->have += n;
+        }
+        else if(n == 0){
+            return -1;
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK){
+            return 0;
+        }
+        else if(errno != EINTR){
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * The service loop.  This reads exactly like the blocking version in
+ * jeux_client_service(), except that every read is a CO_AWAIT, which
+ * suspends the session whenever the socket runs dry.
+ */
+int session_run(SESSION *s){
+    CO_BEGIN(&s->co);
+    while(1){
+        s->have = 0;
+        CO_AWAIT(&s->co, session_read(s, s->wire, sizeof(s->wire)));
+        if(s->co.rc < 0)
+            CO_EXIT(&s->co);
+        proto_decode_header(&s->hdr, s->wire);
+        s->hdr.size = ntohs(s->hdr.size);
+        s->hdr_ns = stats_clock_ns();
+        client_note_request(s->client, &s->hdr);
+
+        if(s->hdr.size > 0){
+            s->payload = malloc(s->hdr.size + 1);
+            if(s->payload == NULL)
+                CO_EXIT(&s->co);
+            s->have = 0;
+            CO_AWAIT(&s->co, session_read(s, s->payload, s->hdr.size));
+            if(s->co.rc < 0)
+                CO_EXIT(&s->co);
+            s->payload[s->hdr.size] = '\0';
+        }
+
+        stats_request_begin(s->hdr.type, s->hdr_ns);
+        int cut_off = service_dispatch(s->client, &s->hdr, s->payload) == -2;
+        stats_request_end();
+        free(s->payload);
+        s->payload = NULL;
+        s->have = 0;
+        if(cut_off)
+            CO_EXIT(&s->co);
+
+        // one request per wakeup, so a chatty client can't starve the rest
+        CO_YIELD(&s->co);
+    }
+    CO_END(&s->co);
+}
+
+size_t session_unconsumed(SESSION *s, char **bufp){
+    //whatever of the current packet has been read, as it was on the wire
+    size_t partial = 0;
+    if(s->payload != NULL)
+        partial = sizeof(s->wire) + s->have;
+    else if(s->have < sizeof(s->wire))
+        partial = s->have;
+    size_t len = partial + (s->in_len - s->in_off);
+    *bufp = NULL;
+    if(len == 0)
+        return 0;
+    char *buf = malloc(len);
+    if(buf == NULL)
+        return 0;
+    if(s->payload != NULL){
+        memcpy(buf, s->wire, sizeof(s->wire));
+        memcpy(buf + sizeof(s->wire), s->payload, s->have);
+    }
+    else{
+        memcpy(buf, s->wire, partial);
+    }
+    //s->in may never have been allocated
+    if(s->in_len > s->in_off)
+        memcpy(buf + partial, s->in + s->in_off, s->in_len - s->in_off);
+    *bufp = buf;
+    return len;
+}
+
+void session_fini(SESSION *s){
+    debug("[%d] SESSION FINI", s->fd);
+    free(s->payload);
+    free(s->in);
+    service_disconnect(s->client);
+    close(s->fd);
+    free(s);
+}
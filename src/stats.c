@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "debug.h"
+#include "stats.h"
+#include "histogram.h"
+#include "reftrack.h"
+#include "protocol_ext.h"
+#include "proto_codec.h"
+#include "event_loop.h"
+#include "csapp.h"
+
+#define STATS_LINE 64                // bytes in a cache line
+#define STATS_MOVED STATS_MAX_TYPES  // the histogram for MOVE to MOVED
+#define STATS_RTT   (STATS_MOVED + 1)   // connections' round trip times
+#define STATS_DELAY (STATS_MOVED + 2)   // requests' one-way delays
+#define STATS_HISTS (STATS_MOVED + 3)
+
+/*
+ * One thread's counters.  Only that thread writes them, so an increment
+ * is a load and a store; the loads and stores are atomic only so that
+ * the thread adding them all up never sees half of one.
+ */
+typedef struct stats_block {
+    struct stats_block *next;
+    long counters[STAT_COUNTERS];
+    long nacks[STAT_NACK_REASONS];
+    long in[STATS_MAX_TYPES];
+    long out[STATS_MAX_TYPES];
+    HISTOGRAM *hists[STATS_HISTS];
+} __attribute__((aligned(STATS_LINE))) STATS_BLOCK;
+
+static __thread STATS_BLOCK *mine;
+
+// the request the thread is working on, if any
+static __thread int req_type = -1;
+static __thread uint64_t req_start;
+static __thread int req_answered, req_moved;
+
+// every block there has been; a thread's block stays on after it exits
+static STATS_BLOCK *blocks;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int stats_fd = -1;
+static char *stats_path;
+
+static const char *counter_names[STAT_COUNTERS] = {
+    "bytes_in", "bytes_out", "clients", "invitations", "games",
+    "invitations_expired", "cut_off"
+};
+
+static const char *nack_names[STAT_NACK_REASONS] = {
+    "not_logged_in", "login", "unknown", "refused", "rate"
+};
+
+static const char *type_names[] = {
+    [JEUX_NO_PKT] = "NONE",
+    [JEUX_LOGIN_PKT] = "LOGIN",
+    [JEUX_USERS_PKT] = "USERS",
+    [JEUX_INVITE_PKT] = "INVITE",
+    [JEUX_REVOKE_PKT] = "REVOKE",
+    [JEUX_ACCEPT_PKT] = "ACCEPT",
+    [JEUX_DECLINE_PKT] = "DECLINE",
+    [JEUX_MOVE_PKT] = "MOVE",
+    [JEUX_RESIGN_PKT] = "RESIGN",
+    [JEUX_ACK_PKT] = "ACK",
+    [JEUX_NACK_PKT] = "NACK",
+    [JEUX_INVITED_PKT] = "INVITED",
+    [JEUX_REVOKED_PKT] = "REVOKED",
+    [JEUX_ACCEPTED_PKT] = "ACCEPTED",
+    [JEUX_DECLINED_PKT] = "DECLINED",
+    [JEUX_MOVED_PKT] = "MOVED",
+    [JEUX_RESIGNED_PKT] = "RESIGNED",
+    [JEUX_ENDED_PKT] = "ENDED",
+    [JEUX_MATCH_PKT] = "MATCH",
+    [JEUX_UNMATCH_PKT] = "UNMATCH",
+    [JEUX_WATCH_PKT] = "WATCH",
+    [JEUX_UNWATCH_PKT] = "UNWATCH",
+    [JEUX_TOURNEY_PKT] = "TOURNEY",
+    [JEUX_ENTER_PKT] = "ENTER",
+    [JEUX_START_PKT] = "START",
+    [JEUX_STANDINGS_PKT] = "STANDINGS",
+    [JEUX_STATS_PKT] = "STATS"
+};
+
+/*
+ * The calling thread's block, which it gets the first time it counts
+ * something.  That is the only time the lock is taken.
+ */
+static STATS_BLOCK *block(void){
+    if(mine != NULL)
+        return mine;
+    STATS_BLOCK *b;
+    if(posix_memalign((void **)&b, STATS_LINE, sizeof(STATS_BLOCK)) != 0)
+        abort();
+    memset(b, 0, sizeof(*b));
+    pthread_mutex_lock(&blocks_lock);
+    b->next = blocks;
+    __atomic_store_n(&blocks, b, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&blocks_lock);
+    return mine = b;
+}
+
+static inline void bump(long *counter, long delta){
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + delta,
+                     __ATOMIC_RELAXED);
+}
+
+static int type_slot(int type){
+    return type >= 0 && type < STATS_MAX_TYPES ? type : STATS_MAX_TYPES - 1;
+}
+
+void stats_add(STAT_COUNTER counter, long delta){
+    bump(&block()->counters[counter], delta);
+}
+
+void stats_packet_in(int type, size_t size){
+    STATS_BLOCK *b = block();
+    bump(&b->in[type_slot(type)], 1);
+    bump(&b->counters[STAT_BYTES_IN], JEUX_WIRE_HEADER_SIZE + size);
+}
+
+static void record(int slot, uint64_t ns){
+    STATS_BLOCK *b = block();
+    HISTOGRAM *h = b->hists[slot];
+    if(h == NULL){
+        if((h = calloc(1, sizeof(HISTOGRAM))) == NULL)
+            return;
+        __atomic_store_n(&b->hists[slot], h, __ATOMIC_RELEASE);
+    }
+    hist_record(h, ns);
+}
+
+uint64_t stats_clock_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_request_begin(int type, uint64_t start_ns){
+    req_type = type_slot(type);
+    req_start = start_ns;
+    req_answered = req_moved = 0;
+}
+
+void stats_request_end(void){
+    req_type = -1;
+}
+
+void stats_packet_out(int type, size_t size){
+    STATS_BLOCK *b = block();
+    bump(&b->out[type_slot(type)], 1);
+    bump(&b->counters[STAT_BYTES_OUT], JEUX_WIRE_HEADER_SIZE + size);
+    if(req_type < 0)
+        return;
+    if((type == JEUX_ACK_PKT || type == JEUX_NACK_PKT) && !req_answered){
+        req_answered = 1;
+        record(req_type, stats_clock_ns() - req_start);
+    }
+    else if(type == JEUX_MOVED_PKT && req_type == JEUX_MOVE_PKT && !req_moved){
+        req_moved = 1;
+        record(STATS_MOVED, stats_clock_ns() - req_start);
+    }
+}
+
+void stats_rtt(uint64_t ns){
+    record(STATS_RTT, ns);
+}
+
+void stats_delay(uint64_t ns){
+    record(STATS_DELAY, ns);
+}
+
+void stats_nack(STAT_NACK reason){
+    bump(&block()->nacks[reason], 1);
+}
+
+static long sum(size_t offset){
+    long total = 0;
+    for(STATS_BLOCK *b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b != NULL; b = b->next)
+        total += __atomic_load_n((long *)((char *)b + offset), __ATOMIC_RELAXED);
+    return total;
+}
+
+static void report_types(FILE *f, const char *dir, size_t offset){
+    for(int t = 0; t < STATS_MAX_TYPES; t++){
+        long n = sum(offset + t * sizeof(long));
+        if(n == 0)
+            continue;
+        const char *name = t < (int)(sizeof(type_names) / sizeof(type_names[0])) ? type_names[t] : NULL;
+        if(name != NULL)
+            fprintf(f, "%s %s %ld\n", dir, name, n);
+        else
+            fprintf(f, "%s %d %ld\n", dir, t, n);
+    }
+}
+
+void stats_write_latency(FILE *f){
+    HISTOGRAM *merged = malloc(sizeof(HISTOGRAM));
+    if(merged == NULL)
+        return;
+    STATS_BLOCK *first = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE);
+    for(int slot = 0; slot < STATS_HISTS; slot++){
+        memset(merged, 0, sizeof(HISTOGRAM));
+        for(STATS_BLOCK *b = first; b != NULL; b = b->next){
+            HISTOGRAM *h = __atomic_load_n(&b->hists[slot], __ATOMIC_ACQUIRE);
+            if(h != NULL)
+                hist_merge(merged, h);
+        }
+        long total = hist_count(merged);
+        if(total == 0)
+            continue;
+        const char *name = slot == STATS_MOVED ? "MOVE>MOVED"
+                         : slot == STATS_RTT ? "RTT"
+                         : slot == STATS_DELAY ? "DELAY"
+                         : slot < (int)(sizeof(type_names) / sizeof(type_names[0])) ? type_names[slot]
+                         : NULL;
+        if(name != NULL)
+            fprintf(f, "latency %s", name);
+        else
+            fprintf(f, "latency %d", slot);
+        fprintf(f, " count %ld p50 %.1f p99 %.1f p999 %.1f max %.1f\n", total,
+                hist_percentile(merged, 0.50) / 1e3, hist_percentile(merged, 0.99) / 1e3,
+                hist_percentile(merged, 0.999) / 1e3, hist_max(merged) / 1e3);
+    }
+    free(merged);
+}
+
+char *stats_report(size_t *lenp){
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&buf, &len);
+    if(f == NULL)
+        return NULL;
+    for(int c = 0; c < STAT_COUNTERS; c++)
+        fprintf(f, "%s %ld\n", counter_names[c],
+                sum(offsetof(STATS_BLOCK, counters) + c * sizeof(long)));
+    report_types(f, "in", offsetof(STATS_BLOCK, in));
+    report_types(f, "out", offsetof(STATS_BLOCK, out));
+    for(int r = 0; r < STAT_NACK_REASONS; r++)
+        fprintf(f, "nack %s %ld\n", nack_names[r],
+                sum(offsetof(STATS_BLOCK, nacks) + r * sizeof(long)));
+    stats_write_latency(f);
+    reftrack_report(f, 0);
+    if(fclose(f) != 0){
+        free(buf);
+        return NULL;
+    }
+    *lenp = len;
+    return buf;
+}
+
+// something connected to the stats socket
+static void stats_requested(int fd, void *arg){
+    int conn = accept(fd, NULL, NULL);
+    if(conn == -1)
+        return;
+    size_t len;
+    char *report = stats_report(&len);
+    //a report is a few hundred bytes, which the socket buffer takes whole
+    if(report != NULL && rio_writen(conn, report, len) != (ssize_t)len)
+        debug("stats report not sent: %s", strerror(errno));
+    free(report);
+    close(conn);
+}
+
+int stats_listen(const char *path){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+        return -1;
+    unlink(path);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1
+       || ev_loop_watch(fd, stats_requested, NULL) == -1){
+        close(fd);
+        return -1;
+    }
+    stats_fd = fd;
+    stats_path = strdup(path);
+    debug("stats socket %s", path);
+    return 0;
+}
+
+void stats_unlisten(void){
+    if(stats_fd < 0)
+        return;
+    ev_loop_unwatch(stats_fd);
+    close(stats_fd);
+    stats_fd = -1;
+    if(stats_path != NULL)
+        unlink(stats_path);
+    free(stats_path);
+    stats_path = NULL;
+}
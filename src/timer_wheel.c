@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "debug.h"
+#include "timer_wheel.h"
+
+#define TW_MASK     (TW_SLOTS - 1)
+// furthest a timer can be placed from the current tick; anything beyond
+// goes into the last slot in reach and is placed again when it comes round
+#define TW_SPAN     ((uint64_t)1 << (TW_LEVELS * TW_LEVEL_BITS))
+
+typedef struct timer_wheel {
+    unsigned int tick_ms;
+    uint64_t now_ms;                 // time given to the last tw_advance()
+    uint64_t tick;                   // every tick up to this one has been run
+    unsigned int count;
+    uint64_t occupied[TW_LEVELS];    // bit per slot that has timers in it
+    TIMER *slots[TW_LEVELS][TW_SLOTS];
+} TIMER_WHEEL;
+
+TIMER_WHEEL *tw_create(unsigned int tick_ms, uint64_t now_ms){
+    TIMER_WHEEL *tw = calloc(1, sizeof(TIMER_WHEEL));
+    if(tw == NULL)
+        return NULL;
+    tw->tick_ms = tick_ms > 0 ? tick_ms : 1;
+    tw->now_ms = now_ms;
+    tw->tick = now_ms / tw->tick_ms;
+    return tw;
+}
+
+void tw_fini(TIMER_WHEEL *tw){
+    // pending timers live in their owners, so just detach them
+    for(int l = 0; l < TW_LEVELS; l++)
+        for(int i = 0; i < TW_SLOTS; i++)
+            for(TIMER *t = tw->slots[l][i]; t != NULL; t = t->next)
+                t->pprev = NULL;
+    free(tw);
+}
+
+void timer_init(TIMER *timer, TIMER_FUNC *func, void *arg){
+    memset(timer, 0, sizeof(TIMER));
+    timer->func = func;
+    timer->arg = arg;
+}
+
+int timer_pending(const TIMER *timer){
+    return timer->pprev != NULL;
+}
+
+/*
+ * Put a timer in the slot for its expiry, relative to the current tick:
+ * on level 0 if it's due within TW_SLOTS ticks, else on the lowest level
+ * whose slots still cover it.  A timer that's already due goes in the
+ * current tick's slot, which only happens while a tick is being run (in
+ * which case that slot is run next).
+ */
+static void place(TIMER_WHEEL *tw, TIMER *t){
+    uint64_t expires = t->expires > tw->tick ? t->expires : tw->tick;
+    uint64_t delta = expires - tw->tick;
+    if(delta >= TW_SPAN){
+        expires = tw->tick + TW_SPAN - 1;
+        delta = TW_SPAN - 1;
+    }
+    int level = 0;
+    while(delta >= (uint64_t)1 << ((level + 1) * TW_LEVEL_BITS))
+        level++;
+    int slot = (expires >> (level * TW_LEVEL_BITS)) & TW_MASK;
+    TIMER **head = &tw->slots[level][slot];
+    t->next = *head;
+    if(*head != NULL)
+        (*head)->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+    t->level = level;
+    t->slot = slot;
+    tw->occupied[level] |= (uint64_t)1 << slot;
+}
+
+static void unlink_timer(TIMER_WHEEL *tw, TIMER *t){
+    *t->pprev = t->next;
+    if(t->next != NULL)
+        t->next->pprev = t->pprev;
+    if(tw->slots[t->level][t->slot] == NULL)
+        tw->occupied[t->level] &= ~((uint64_t)1 << t->slot);
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+void tw_add(TIMER_WHEEL *tw, TIMER *timer, uint64_t ms){
+    if(timer_pending(timer))
+        unlink_timer(tw, timer);
+    else
+        tw->count++;
+    // rounded up from the actual time rather than the current tick, so
+    // that a timer can go off late by up to a tick but never early
+    timer->expires = (tw->now_ms + ms + tw->tick_ms - 1) / tw->tick_ms;
+    if(timer->expires <= tw->tick)
+        timer->expires = tw->tick + 1;
+    place(tw, timer);
+}
+
+void tw_cancel(TIMER_WHEEL *tw, TIMER *timer){
+    if(!timer_pending(timer))
+        return;
+    unlink_timer(tw, timer);
+    tw->count--;
+}
+
+/*
+ * Move the timers in one slot of a higher level down to where they now
+ * belong.
+ */
+static void cascade(TIMER_WHEEL *tw, int level, int slot){
+    TIMER *t;
+    while((t = tw->slots[level][slot]) != NULL){
+        unlink_timer(tw, t);
+        place(tw, t);
+    }
+}
+
+int tw_advance(TIMER_WHEEL *tw, uint64_t now_ms){
+    if(now_ms > tw->now_ms)
+        tw->now_ms = now_ms;
+    uint64_t target = tw->now_ms / tw->tick_ms;
+    int fired = 0;
+    while(tw->tick < target){
+        if(tw->count == 0){
+            // nothing to do on the ticks in between
+            tw->tick = target;
+            break;
+        }
+        tw->tick++;
+        int slot = tw->tick & TW_MASK;
+        // when a level wraps, bring down the next slot of the level above
+        for(int l = 1; l < TW_LEVELS; l++){
+            if(((tw->tick >> ((l - 1) * TW_LEVEL_BITS)) & TW_MASK) != 0)
+                break;
+            cascade(tw, l, (tw->tick >> (l * TW_LEVEL_BITS)) & TW_MASK);
+        }
+        // a timer started from a callback is always due on a later tick,
+        // so this slot only ever empties
+        TIMER *t;
+        while((t = tw->slots[0][slot]) != NULL){
+            unlink_timer(tw, t);
+            tw->count--;
+            fired++;
+            t->func(t, t->arg);
+        }
+    }
+    return fired;
+}
+
+uint64_t tw_now(TIMER_WHEEL *tw){
+    return tw->now_ms;
+}
+
+int tw_next_ms(TIMER_WHEEL *tw, uint64_t now_ms){
+    if(tw->count == 0)
+        return -1;
+    // level 0 holds the ticks after the current one, round from there
+    uint64_t due;
+    uint64_t occupied = tw->occupied[0];
+    if(occupied != 0){
+        int shift = (tw->tick + 1) & TW_MASK;
+        uint64_t rotated = shift == 0 ? occupied
+            : (occupied >> shift) | (occupied << (TW_SLOTS - shift));
+        due = tw->tick + 1 + __builtin_ctzll(rotated);
+    }
+    else{
+        // nothing on level 0: the next thing that can happen is a cascade
+        due = (tw->tick | TW_MASK) + 1;
+    }
+    uint64_t due_ms = due * tw->tick_ms;
+    if(due_ms <= now_ms)
+        return 0;
+    return due_ms - now_ms > INT_MAX ? INT_MAX : (int)(due_ms - now_ms);
+}
+
+unsigned int tw_count(TIMER_WHEEL *tw){
+    return tw->count;
+}
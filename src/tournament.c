@@ -0,0 +1,585 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <semaphore.h>
+
+#include "debug.h"
+#include "tournament.h"
+#include "client_ext.h"
+#include "player.h"
+#include "protocol_ext.h"
+#include "event_loop.h"
+
+TOURNAMENT_REGISTRY *tournaments;
+
+typedef enum trn_state {
+    TRN_SIGNUP,
+    TRN_RUNNING,
+    TRN_FINISHED
+} TRN_STATE;
+
+typedef struct trn_player {
+    CLIENT *client;
+    PLAYER *player;
+    int points;                  // in half-points
+    int out;                     // dropped out
+    int had_bye;
+    int balance;                 // games moving first minus games moving second
+    int *opponents;              // one per round, -1 for none
+} TRN_PLAYER;
+
+typedef struct tournament TOURNAMENT;
+
+/*
+ * A game of the current round, by the indices of its players; it is what
+ * the game's result function is given.
+ */
+typedef struct trn_game {
+    TOURNAMENT *t;
+    int first, second;
+} TRN_GAME;
+
+struct tournament {
+    TOURNAMENT_REGISTRY *treg;
+    int id;
+    TRN_FORMAT format;
+    TRN_STATE state;
+    int rounds;
+    int round;                   // rounds started
+    int played;                  // rounds over
+    CLIENT *organizer;           // NULL once gone
+    TRN_PLAYER *players;
+    int nplayers, cap;
+    //Swiss: the players in standings order, carried from round to round;
+    //round robin: the circle, with -1 for the dummy if there's an odd number
+    int *order;
+    int norder;
+    TRN_GAME *games;             // this round's
+    int ngames;
+    int outstanding;             // games of this round not over yet
+    int aborted;                 // the server is going away
+    EV_CALL round_over;
+};
+
+typedef struct tournament_registry {
+    TOURNAMENT *table[TRN_MAX_TOURNAMENTS];
+    sem_t semaphore_block;
+} TOURNAMENT_REGISTRY;
+
+static const char *format_name(TRN_FORMAT format){
+    return format == TRN_SWISS ? "swiss" : "roundrobin";
+}
+
+TOURNAMENT_REGISTRY *treg_init(void){
+    debug("TREG INIT");
+    TOURNAMENT_REGISTRY *treg = calloc(1, sizeof(TOURNAMENT_REGISTRY));
+    if(treg == NULL)
+        return NULL;
+    sem_init(&treg->semaphore_block, 0, 1);
+    return treg;
+}
+
+static void free_tournament(TOURNAMENT *t){
+    ev_loop_cancel_post(&t->round_over);
+    for(int i = 0; i < t->nplayers; i++){
+        client_unref(t->players[i].client, "tournament freed");
+        player_unref(t->players[i].player, "tournament freed");
+        free(t->players[i].opponents);
+    }
+    if(t->organizer != NULL)
+        client_unref(t->organizer, "tournament freed");
+    free(t->players);
+    free(t->order);
+    free(t->games);
+    free(t);
+}
+
+void treg_fini(TOURNAMENT_REGISTRY *treg){
+    debug("TREG FINI");
+    for(int i = 0; i < TRN_MAX_TOURNAMENTS; i++)
+        if(treg->table[i] != NULL)
+            free_tournament(treg->table[i]);
+    sem_destroy(&treg->semaphore_block);
+    free(treg);
+}
+
+static void round_over(EV_CALL *call, void *arg);
+
+int treg_create(TOURNAMENT_REGISTRY *treg, CLIENT *organizer, TRN_FORMAT format, int rounds){
+    if(client_get_player(organizer) == NULL || (format == TRN_SWISS && rounds <= 0))
+        return -1;
+    TOURNAMENT *t = calloc(1, sizeof(TOURNAMENT));
+    if(t == NULL)
+        return -1;
+    t->treg = treg;
+    t->format = format;
+    t->state = TRN_SIGNUP;
+    t->rounds = rounds;
+    ev_call_init(&t->round_over, round_over, t);
+
+    sem_wait(&treg->semaphore_block);
+    //a free slot, or failing that the first finished tournament's
+    int id = -1;
+    for(int i = 0; i < TRN_MAX_TOURNAMENTS && id == -1; i++)
+        if(treg->table[i] == NULL)
+            id = i;
+    for(int i = 0; i < TRN_MAX_TOURNAMENTS && id == -1; i++)
+        if(treg->table[i]->state == TRN_FINISHED)
+            id = i;
+    if(id == -1){
+        sem_post(&treg->semaphore_block);
+        free(t);
+        return -1;
+    }
+    if(treg->table[id] != NULL)
+        free_tournament(treg->table[id]);
+    t->id = id;
+    t->organizer = client_ref(organizer, "organizing tournament");
+    treg->table[id] = t;
+    sem_post(&treg->semaphore_block);
+    debug("TREG created %s tournament %d", format_name(format), id);
+    return id;
+}
+
+static TOURNAMENT *lookup(TOURNAMENT_REGISTRY *treg, int id){
+    return id >= 0 && id < TRN_MAX_TOURNAMENTS ? treg->table[id] : NULL;
+}
+
+int treg_enter(TOURNAMENT_REGISTRY *treg, int id, CLIENT *client){
+    PLAYER *player = client_get_player(client);
+    if(player == NULL)
+        return -1;
+    sem_wait(&treg->semaphore_block);
+    TOURNAMENT *t = lookup(treg, id);
+    int ok = t != NULL && t->state == TRN_SIGNUP;
+    for(int i = 0; ok && i < t->nplayers; i++)
+        if(t->players[i].client == client)
+            ok = 0;
+    if(ok && t->nplayers == t->cap){
+        int cap = t->cap ? 2 * t->cap : 16;
+        TRN_PLAYER *grown = realloc(t->players, cap * sizeof(TRN_PLAYER));
+        if(grown == NULL){
+            ok = 0;
+        }
+        else{
+            t->players = grown;
+            t->cap = cap;
+        }
+    }
+    if(!ok){
+        sem_post(&treg->semaphore_block);
+        return -1;
+    }
+    TRN_PLAYER *p = &t->players[t->nplayers++];
+    memset(p, 0, sizeof(*p));
+    p->client = client_ref(client, "entered in tournament");
+    p->player = player_ref(player, "entered in tournament");
+    sem_post(&treg->semaphore_block);
+    return 0;
+}
+
+static int by_rating(const void *a, const void *b, void *arg){
+    TRN_PLAYER *players = arg;
+    return player_get_rating(players[*(const int *)b].player)
+        - player_get_rating(players[*(const int *)a].player);
+}
+
+static void start_round(TOURNAMENT *t);
+
+int treg_start(TOURNAMENT_REGISTRY *treg, int id, CLIENT *client){
+    sem_wait(&treg->semaphore_block);
+    TOURNAMENT *t = lookup(treg, id);
+    if(t == NULL || t->state != TRN_SIGNUP || t->organizer != client || t->nplayers < 2){
+        sem_post(&treg->semaphore_block);
+        return -1;
+    }
+    int n = t->nplayers;
+    t->norder = t->format == TRN_ROUND_ROBIN && n % 2 == 1 ? n + 1 : n;
+    if(t->format == TRN_ROUND_ROBIN)
+        t->rounds = t->norder - 1;
+    t->order = malloc(t->norder * sizeof(int));
+    t->games = malloc((t->norder / 2 + 1) * sizeof(TRN_GAME));
+    int ok = t->order != NULL && t->games != NULL;
+    for(int i = 0; ok && i < n; i++){
+        int *opponents = malloc(t->rounds * sizeof(int));
+        if(opponents == NULL){
+            ok = 0;
+            break;
+        }
+        for(int r = 0; r < t->rounds; r++)
+            opponents[r] = -1;
+        t->players[i].opponents = opponents;
+    }
+    if(!ok){
+        for(int i = 0; i < n; i++){
+            free(t->players[i].opponents);
+            t->players[i].opponents = NULL;
+        }
+        free(t->order);
+        free(t->games);
+        t->order = NULL;
+        t->games = NULL;
+        sem_post(&treg->semaphore_block);
+        return -1;
+    }
+    //seeded by rating, the dummy (if any) last
+    for(int i = 0; i < n; i++)
+        t->order[i] = i;
+    qsort_r(t->order, n, sizeof(int), by_rating, t->players);
+    if(t->norder > n)
+        t->order[n] = -1;
+    t->state = TRN_RUNNING;
+    sem_post(&treg->semaphore_block);
+    debug("TREG tournament %d started: %d players, %d rounds", id, n, t->rounds);
+    start_round(t);
+    return 0;
+}
+
+/*
+ * Whether a player is still in the tournament.  Players who have left are
+ * only noticed when the next round is paired.
+ */
+static int still_in(TRN_PLAYER *p){
+    if(!p->out && client_get_player(p->client) == NULL)
+        p->out = 1;
+    return !p->out;
+}
+
+static int have_met(TOURNAMENT *t, int a, int b){
+    int *opponents = t->players[a].opponents;
+    for(int r = 0; r < t->round; r++)
+        if(opponents[r] == b)
+            return 1;
+    return 0;
+}
+
+/*
+ * Put a game between two players in this round's list, the one who has
+ * moved first less often moving first.
+ */
+static void add_game(TOURNAMENT *t, int a, int b){
+    TRN_PLAYER *pa = &t->players[a], *pb = &t->players[b];
+    int a_first = pa->balance != pb->balance ? pa->balance < pb->balance : t->round % 2 == 0;
+    TRN_GAME *g = &t->games[t->ngames++];
+    g->t = t;
+    g->first = a_first ? a : b;
+    g->second = a_first ? b : a;
+    t->players[g->first].balance++;
+    t->players[g->second].balance--;
+    pa->opponents[t->round] = b;
+    pb->opponents[t->round] = a;
+}
+
+/*
+ * One of a pair of players for this round, with the other unable to play
+ * (out of the tournament, or a bye): the one who is still in gets the
+ * points if there are any to be had.
+ */
+static void add_walkover(TOURNAMENT *t, int a, int points){
+    if(a >= 0 && still_in(&t->players[a]))
+        t->players[a].points += points;
+}
+
+/*
+ * Swiss pairing.  t->order is re-sorted by points, stably so that players
+ * on the same points stay in the order they were in, then paired greedily
+ * from the top.
+ */
+static void pair_swiss(TOURNAMENT *t){
+    int n = t->nplayers;
+    int top = 2 * t->rounds;
+    int *count = calloc(top + 2, sizeof(int));
+    int *sorted = malloc(n * sizeof(int));
+    char *paired = calloc(n, 1);
+    if(count == NULL || sorted == NULL || paired == NULL){
+        free(count);
+        free(sorted);
+        free(paired);
+        return;
+    }
+    //counting sort, highest points first
+    for(int i = 0; i < n; i++)
+        count[top - t->players[i].points + 1]++;
+    for(int s = 1; s <= top + 1; s++)
+        count[s] += count[s - 1];
+    for(int i = 0; i < n; i++)
+        sorted[count[top - t->players[t->order[i]].points]++] = t->order[i];
+    memcpy(t->order, sorted, n * sizeof(int));
+
+    //sorted is reused for the players still in
+    int active = 0;
+    for(int i = 0; i < n; i++)
+        if(still_in(&t->players[t->order[i]]))
+            sorted[active++] = t->order[i];
+    if(active % 2 == 1){
+        int bye = active - 1;
+        for(int i = active - 1; i >= 0; i--){
+            if(!t->players[sorted[i]].had_bye){
+                bye = i;
+                break;
+            }
+        }
+        t->players[sorted[bye]].had_bye = 1;
+        add_walkover(t, sorted[bye], 2);
+        memmove(&sorted[bye], &sorted[bye + 1], (active - bye - 1) * sizeof(int));
+        active--;
+    }
+    for(int i = 0; i < active; i++){
+        int a = sorted[i];
+        if(paired[a])
+            continue;
+        int b = -1, fallback = -1;
+        for(int j = i + 1, seen = 0; j < active && seen < TRN_PAIRING_WINDOW; j++){
+            if(paired[sorted[j]])
+                continue;
+            seen++;
+            if(fallback == -1)
+                fallback = sorted[j];
+            if(!have_met(t, a, sorted[j])){
+                b = sorted[j];
+                break;
+            }
+        }
+        if(b == -1)
+            b = fallback;
+        if(b == -1)
+            break;
+        paired[a] = paired[b] = 1;
+        add_game(t, a, b);
+    }
+    free(count);
+    free(sorted);
+    free(paired);
+}
+
+/*
+ * Round robin pairing by the circle method: the first place in the circle
+ * stays put and the others rotate one place each round.
+ */
+static void pair_round_robin(TOURNAMENT *t){
+    int n = t->norder;
+    for(int k = 0; k < n / 2; k++){
+        int a = k == 0 ? t->order[0] : t->order[1 + (k - 1 + t->round) % (n - 1)];
+        int b = t->order[1 + (n - 2 - k + t->round) % (n - 1)];
+        if(a == -1 || b == -1){
+            //a bye, which is worth nothing in a round robin
+            continue;
+        }
+        int a_in = still_in(&t->players[a]), b_in = still_in(&t->players[b]);
+        if(a_in && b_in)
+            add_game(t, a, b);
+        else
+            add_walkover(t, a_in ? a : b, 2);
+    }
+}
+
+static void game_over(INVITATION *inv, GAME_ROLE winner, int aborted, void *arg){
+    TRN_GAME *g = arg;
+    TOURNAMENT *t = g->t;
+    sem_wait(&t->treg->semaphore_block);
+    if(aborted){
+        t->aborted = 1;
+    }
+    else{
+        if(winner == FIRST_PLAYER_ROLE)
+            t->players[g->first].points += 2;
+        else if(winner == SECOND_PLAYER_ROLE)
+            t->players[g->second].points += 2;
+        else{
+            t->players[g->first].points++;
+            t->players[g->second].points++;
+        }
+    }
+    if(--t->outstanding == 0)
+        ev_loop_post(&t->round_over);
+    sem_post(&t->treg->semaphore_block);
+}
+
+/*
+ * Pair the next round and start its games.
+ */
+static void start_round(TOURNAMENT *t){
+    TOURNAMENT_REGISTRY *treg = t->treg;
+    sem_wait(&treg->semaphore_block);
+    t->ngames = 0;
+    if(t->format == TRN_SWISS)
+        pair_swiss(t);
+    else
+        pair_round_robin(t);
+    t->outstanding = t->ngames;
+    int ngames = t->ngames;
+    t->round++;
+    sem_post(&treg->semaphore_block);
+    debug("TREG tournament %d round %d: %d games", t->id, t->round, ngames);
+
+    //the games don't change once paired, and can't end before they start
+    int failed = 0;
+    for(int i = 0; i < ngames; i++){
+        TRN_GAME *g = &t->games[i];
+        if(client_make_game(t->players[g->first].client, t->players[g->second].client,
+                            game_over, g) == -1)
+            failed++;
+    }
+    sem_wait(&treg->semaphore_block);
+    t->outstanding -= failed;
+    if(t->outstanding == 0)
+        ev_loop_post(&t->round_over);
+    sem_post(&treg->semaphore_block);
+}
+
+/*
+ * Tiebreak scores, and the players in standings order.
+ */
+typedef struct standing {
+    TRN_PLAYER *players;
+    int *buchholz;
+} STANDING;
+
+static int by_standing(const void *a, const void *b, void *arg){
+    STANDING *s = arg;
+    int i = *(const int *)a, j = *(const int *)b;
+    TRN_PLAYER *pi = &s->players[i], *pj = &s->players[j];
+    if(pi->points != pj->points)
+        return pj->points - pi->points;
+    if(s->buchholz[i] != s->buchholz[j])
+        return s->buchholz[j] - s->buchholz[i];
+    if(player_get_rating(pi->player) != player_get_rating(pj->player))
+        return player_get_rating(pj->player) - player_get_rating(pi->player);
+    return strcmp(player_get_name(pi->player), player_get_name(pj->player));
+}
+
+/*
+ * Write out the standings (see protocol_ext.h).  If offsets is not NULL,
+ * offsets[i] is set to where player i's line starts.
+ *
+ * @return a malloc'ed string, or NULL if memory could not be allocated.
+ */
+static char *standings(TOURNAMENT *t, size_t *offsets){
+    int n = t->nplayers;
+    int *rank = malloc((n + 1) * sizeof(int));
+    int *buchholz = calloc(n + 1, sizeof(int));
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out = rank != NULL && buchholz != NULL ? open_memstream(&buf, &len) : NULL;
+    if(out == NULL){
+        free(rank);
+        free(buchholz);
+        return NULL;
+    }
+    for(int i = 0; i < n; i++){
+        rank[i] = i;
+        for(int r = 0; r < t->round && t->players[i].opponents != NULL; r++)
+            if(t->players[i].opponents[r] >= 0)
+                buchholz[i] += t->players[t->players[i].opponents[r]].points;
+    }
+    STANDING s = { t->players, buchholz };
+    qsort_r(rank, n, sizeof(int), by_standing, &s);
+    fprintf(out, "%s\t%d\t%d\n", format_name(t->format), t->played, t->rounds);
+    for(int k = 0; k < n; k++){
+        TRN_PLAYER *p = &t->players[rank[k]];
+        if(offsets != NULL){
+            fflush(out);
+            offsets[rank[k]] = len;
+        }
+        fprintf(out, "%d\t%s\t%d.%d\t%d.%d\n", k + 1, player_get_name(p->player),
+                p->points / 2, p->points % 2 * 5, buchholz[rank[k]] / 2,
+                buchholz[rank[k]] % 2 * 5);
+    }
+    fclose(out);
+    free(rank);
+    free(buchholz);
+    return buf;
+}
+
+char *treg_standings(TOURNAMENT_REGISTRY *treg, int id){
+    sem_wait(&treg->semaphore_block);
+    TOURNAMENT *t = lookup(treg, id);
+    char *str = t != NULL ? standings(t, NULL) : NULL;
+    sem_post(&treg->semaphore_block);
+    return str;
+}
+
+/*
+ * Tell everyone in the tournament the standings: each player gets the
+ * first line and their own, the organizer the lot.
+ */
+static void publish(TOURNAMENT *t){
+    TOURNAMENT_REGISTRY *treg = t->treg;
+    size_t *offsets = malloc((t->nplayers + 1) * sizeof(size_t));
+    sem_wait(&treg->semaphore_block);
+    char *table = offsets != NULL ? standings(t, offsets) : NULL;
+    sem_post(&treg->semaphore_block);
+    if(table == NULL){
+        free(offsets);
+        return;
+    }
+    size_t head = strchr(table, '\n') - table + 1;
+    for(int i = 0; i < t->nplayers; i++){
+        TRN_PLAYER *p = &t->players[i];
+        if(!still_in(p))
+            continue;
+        char *line = table + offsets[i];
+        size_t linelen = strchr(line, '\n') - line + 1;
+        char *payload = malloc(head + linelen + 1);
+        if(payload == NULL)
+            continue;
+        memcpy(payload, table, head);
+        memcpy(payload + head, line, linelen);
+        payload[head + linelen] = '\0';
+        client_send_notification(p->client, JEUX_STANDINGS_PKT, t->id, t->played, payload);
+        free(payload);
+    }
+    if(t->organizer != NULL)
+        client_send_notification(t->organizer, JEUX_STANDINGS_PKT, t->id, t->played, table);
+    free(table);
+    free(offsets);
+}
+
+/*
+ * The last game of a round is over: out with the standings, and on to
+ * the next round, if there is one.
+ */
+static void round_over(EV_CALL *call, void *arg){
+    TOURNAMENT *t = arg;
+    t->played = t->round;
+    publish(t);
+    if(t->played < t->rounds && !t->aborted){
+        start_round(t);
+        return;
+    }
+    debug("TREG tournament %d finished", t->id);
+    sem_wait(&t->treg->semaphore_block);
+    t->state = TRN_FINISHED;
+    sem_post(&t->treg->semaphore_block);
+}
+
+void treg_leave(TOURNAMENT_REGISTRY *treg, CLIENT *client){
+    sem_wait(&treg->semaphore_block);
+    for(int id = 0; id < TRN_MAX_TOURNAMENTS; id++){
+        TOURNAMENT *t = treg->table[id];
+        if(t == NULL)
+            continue;
+        if(t->state == TRN_SIGNUP && t->organizer == client){
+            debug("TREG tournament %d called off", id);
+            treg->table[id] = NULL;
+            free_tournament(t);
+            continue;
+        }
+        if(t->organizer == client){
+            t->organizer = NULL;
+            client_unref(client, "organizer left");
+        }
+        if(t->state != TRN_SIGNUP)
+            continue;
+        for(int i = 0; i < t->nplayers; i++){
+            if(t->players[i].client != client)
+                continue;
+            client_unref(client, "left tournament");
+            player_unref(t->players[i].player, "left tournament");
+            t->players[i] = t->players[--t->nplayers];
+            break;
+        }
+    }
+    sem_post(&treg->semaphore_block);
+}
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "debug.h"
+#include "trace.h"
+
+#define TRACE_PATH_MAX 256
+#define TRACE_BUF 65536              // the dump is written this much at a time
+
+__thread TRACE_RING *trace_ring;
+
+// every ring there has been; rings are never freed, only handed on
+static TRACE_RING *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static uint64_t tsc_start, ns_start;
+static char dump_path[TRACE_PATH_MAX];
+static int dumping;
+
+static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+
+static uint64_t wall_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// a thread with a ring has exited: the ring is free for the next one
+static void ring_released(void *arg){
+    TRACE_RING *r = arg;
+    __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_key(void){
+    pthread_key_create(&ring_key, ring_released);
+}
+
+TRACE_RING *trace_ring_get(void){
+    pthread_once(&ring_key_once, make_key);
+    pthread_mutex_lock(&rings_lock);
+    TRACE_RING *r;
+    for(r = rings; r != NULL; r = r->next)
+        if(!r->in_use)
+            break;
+    if(r == NULL){
+        if((r = calloc(1, sizeof(TRACE_RING))) == NULL){
+            pthread_mutex_unlock(&rings_lock);
+            return NULL;
+        }
+        r->next = rings;
+        __atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+    }
+    r->in_use = 1;
+    r->thread = syscall(SYS_gettid);
+    pthread_mutex_unlock(&rings_lock);
+    pthread_setspecific(ring_key, r);
+    return trace_ring = r;
+}
+
+/*
+ * The output of a dump, gathered into a buffer so that the thousands of
+ * little records don't each take a system call.
+ */
+typedef struct dump_out {
+    int fd;
+    int failed;
+    size_t len;
+    char buf[TRACE_BUF];
+} DUMP_OUT;
+
+static void out_flush(DUMP_OUT *out){
+    size_t done = 0;
+    while(done < out->len && !out->failed){
+        ssize_t n = write(out->fd, out->buf + done, out->len - done);
+        if(n > 0)
+            done += n;
+        else if(n == -1 && errno != EINTR)
+            out->failed = 1;
+    }
+    out->len = 0;
+}
+
+static void out_put(DUMP_OUT *out, const void *data, size_t len){
+    if(out->len + len > TRACE_BUF)
+        out_flush(out);
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+static void dump_ring(DUMP_OUT *out, TRACE_RING *r){
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+    TRACE_RING_HEADER rh = { .thread = r->thread, .dropped = first, .count = head - first };
+    out_put(out, &rh, sizeof(rh));
+    for(uint64_t i = first; i < head; i++){
+        TRACE_EVENT *e = &r->events[i & (TRACE_EVENTS - 1)];
+        TRACE_RECORD rec = { .tsc = e->tsc, .obj = e->obj, .arg = e->arg,
+                             .type = e->type, .arg2 = e->arg2 };
+        const char *why = e->why;
+        rec.why_len = why != NULL ? strnlen(why, 255) : 0;
+        out_put(out, &rec, sizeof(rec));
+        out_put(out, why, rec.why_len);
+    }
+}
+
+int trace_dump(void){
+    //a dump can be asked for while one is being written, by a crash in it
+    //if nothing else; the buffer is static, being too big for the stack
+    //of whatever thread the signal interrupts
+    if(__atomic_exchange_n(&dumping, 1, __ATOMIC_ACQUIRE))
+        return -1;
+    static DUMP_OUT out;
+    int ret = -1;
+    out.fd = open(dump_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(out.fd != -1){
+        out.failed = 0;
+        out.len = 0;
+        TRACE_RING *first = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+        TRACE_FILE_HEADER fh = { .tsc_start = tsc_start, .ns_start = ns_start,
+                                 .pid = getpid() };
+        memcpy(fh.magic, TRACE_MAGIC, sizeof(fh.magic));
+        for(TRACE_RING *r = first; r != NULL; r = r->next)
+            fh.rings++;
+        fh.tsc_dump = trace_clock();
+        fh.ns_dump = wall_ns();
+        out_put(&out, &fh, sizeof(fh));
+        for(TRACE_RING *r = first; r != NULL; r = r->next)
+            dump_ring(&out, r);
+        out_flush(&out);
+        ret = out.failed ? -1 : 0;
+        close(out.fd);
+    }
+    __atomic_store_n(&dumping, 0, __ATOMIC_RELEASE);
+    return ret;
+}
+
+static void dump_requested(int sig){
+    int saved = errno;
+    trace_dump();
+    errno = saved;
+}
+
+// the handler is reset to the default by now, so this dies of the signal
+static void crashed(int sig){
+    trace_dump();
+    raise(sig);
+}
+
+int trace_init(const char *path){
+    if(path == NULL)
+        snprintf(dump_path, sizeof(dump_path), "/tmp/jeux.%d.trace", (int)getpid());
+    else if(strlen(path) < sizeof(dump_path))
+        strcpy(dump_path, path);
+    else
+        return -1;
+    tsc_start = trace_clock();
+    ns_start = wall_ns();
+
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    sigemptyset(&act.sa_mask);
+    act.sa_handler = dump_requested;
+    act.sa_flags = SA_RESTART;
+    if(sigaction(SIGUSR1, &act, NULL) == -1)
+        return -1;
+    act.sa_handler = crashed;
+    act.sa_flags = SA_RESETHAND | SA_NODEFER;
+    for(size_t i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); i++)
+        if(sigaction(crash_signals[i], &act, NULL) == -1)
+            return -1;
+    debug("trace dumps go to %s", dump_path);
+    return 0;
+}
@@ -0,0 +1,262 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "debug.h"
+#include "uring.h"
+
+/*
+ * The kernel and this process share the ring indices, so loads of indices
+ * the kernel writes need acquire semantics and stores of indices it reads
+ * need release semantics.
+ */
+#define load_acquire(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int sys_uring_setup(unsigned entries, struct io_uring_params *p){
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                           unsigned flags, const sigset_t *sig){
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   sig, sig != NULL ? _NSIG / 8 : 0);
+}
+
+static int sys_uring_enter_ext(int fd, unsigned to_submit, unsigned min_complete,
+                               unsigned flags, struct io_uring_getevents_arg *arg){
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                   flags | IORING_ENTER_EXT_ARG, arg, sizeof(*arg));
+}
+
+static int sys_uring_register(int fd, unsigned opcode, void *arg, unsigned nr){
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+int uring_init(URING *r, unsigned entries){
+    struct io_uring_params p;
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = sys_uring_setup(entries, &p);
+    if(r->fd == -1)
+        return -1;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)){
+        // every kernel new enough for multishot receive has these
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(cq_sz > r->sq_ring_sz)
+        r->sq_ring_sz = cq_sz;
+    r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->sq_ring == MAP_FAILED)
+        goto fail;
+    r->cq_ring = r->sq_ring;      // single mmap covers both rings
+
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED){
+        munmap(r->sq_ring, r->sq_ring_sz);
+        goto fail;
+    }
+
+    char *sq = r->sq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    char *cq = r->cq_ring;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sqe_head = r->sqe_tail = *r->sq_tail;
+    debug("io_uring fd %d: %u sq entries, %u cq entries", r->fd, p.sq_entries, p.cq_entries);
+    return 0;
+
+fail:
+    close(r->fd);
+    return -1;
+}
+
+int uring_probe(URING *r, const unsigned char *ops, int nops){
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if(probe == NULL)
+        return -1;
+    int ret = sys_uring_register(r->fd, IORING_REGISTER_PROBE, probe, 256) < 0 ? -1 : 0;
+    for(int i = 0; ret == 0 && i < nops; i++){
+        if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)){
+            debug("io_uring opcode %d not supported", ops[i]);
+            errno = ENOSYS;
+            ret = -1;
+        }
+    }
+    free(probe);
+    return ret;
+}
+
+int uring_check_multishot(void){
+    URING r;
+    URING_BUF_RING br;
+    int sv[2];
+    int ok = 0;
+    if(uring_init(&r, 4) == -1)
+        return -1;
+    if(uring_buf_ring_init(&r, &br, 0, 2, 64) == -1){
+        uring_fini(&r);
+        return -1;
+    }
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == 0){
+        struct io_uring_sqe *sqe = uring_get_sqe(&r);
+        if(sqe != NULL && write(sv[1], "x", 1) == 1){
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = sv[0];
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = 0;
+            struct io_uring_cqe *cqe;
+            if(uring_submit(&r, 1, NULL, 1000) >= 0 && (cqe = uring_peek_cqe(&r)) != NULL){
+                // a receive still armed after the first byte is multishot
+                ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE);
+                debug("io_uring multishot receive: res %d, flags %#x", cqe->res, cqe->flags);
+                uring_cqe_seen(&r);
+            }
+        }
+        close(sv[0]);
+        close(sv[1]);
+    }
+    // closing the ring takes care of the receive, if it's still armed
+    uring_buf_ring_fini(&r, &br);
+    uring_fini(&r);
+    if(!ok){
+        errno = ENOSYS;
+        return -1;
+    }
+    return 0;
+}
+
+void uring_fini(URING *r){
+    munmap(r->sqes, r->sqes_sz);
+    munmap(r->sq_ring, r->sq_ring_sz);
+    close(r->fd);
+    r->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(URING *r){
+    unsigned head = load_acquire(r->sq_head);
+    if(r->sqe_tail - head >= r->sq_entries)
+        return NULL;
+    struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+    r->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit(URING *r, unsigned wait_nr, const sigset_t *sigmask, int timeout_ms){
+    unsigned mask = *r->sq_mask;
+    unsigned tail = *r->sq_tail;
+    unsigned n = r->sqe_tail - r->sqe_head;
+    for(unsigned i = 0; i < n; i++){
+        r->sq_array[tail & mask] = r->sqe_head & mask;
+        tail++;
+        r->sqe_head++;
+    }
+    store_release(r->sq_tail, tail);
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    if(n == 0 && wait_nr == 0)
+        return 0;
+    if(wait_nr == 0 || timeout_ms < 0)
+        return sys_uring_enter(r->fd, n, wait_nr, flags, sigmask);
+
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask = (unsigned long)sigmask;
+    arg.sigmask_sz = sigmask != NULL ? _NSIG / 8 : 0;
+    arg.ts = (unsigned long)&ts;
+    int ret = sys_uring_enter_ext(r->fd, n, wait_nr, flags, &arg);
+    // running out of time isn't an error, there's just nothing to reap
+    if(ret == -1 && errno == ETIME)
+        return n;
+    return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(URING *r){
+    unsigned head = *r->cq_head;
+    if(head == load_acquire(r->cq_tail))
+        return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(URING *r){
+    store_release(r->cq_head, *r->cq_head + 1);
+}
+
+int uring_register_buffer(URING *r, void *base, size_t len){
+    struct iovec iov = { .iov_base = base, .iov_len = len };
+    return sys_uring_register(r->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0 ? -1 : 0;
+}
+
+int uring_buf_ring_init(URING *r, URING_BUF_RING *brp, unsigned short bgid,
+                        unsigned nbufs, unsigned size){
+    size_t ring_sz = nbufs * sizeof(struct io_uring_buf);
+    memset(brp, 0, sizeof(*brp));
+    brp->br = mmap(NULL, ring_sz, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(brp->br == MAP_FAILED)
+        return -1;
+    brp->base = malloc((size_t)nbufs * size);
+    if(brp->base == NULL){
+        munmap(brp->br, ring_sz);
+        return -1;
+    }
+    brp->nbufs = nbufs;
+    brp->size = size;
+    brp->bgid = bgid;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)brp->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = bgid;
+    if(sys_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+        free(brp->base);
+        munmap(brp->br, ring_sz);
+        return -1;
+    }
+    for(unsigned i = 0; i < nbufs; i++)
+        uring_buf_ring_recycle(brp, i);
+    return 0;
+}
+
+void uring_buf_ring_recycle(URING_BUF_RING *brp, unsigned short bid){
+    struct io_uring_buf *buf = &brp->br->bufs[brp->tail & (brp->nbufs - 1)];
+    buf->addr = (unsigned long)(brp->base + (size_t)bid * brp->size);
+    buf->len = brp->size;
+    buf->bid = bid;
+    brp->tail++;
+    store_release(&brp->br->tail, brp->tail);
+}
+
+void uring_buf_ring_fini(URING *r, URING_BUF_RING *brp){
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = brp->bgid;
+    sys_uring_register(r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(brp->br, brp->nbufs * sizeof(struct io_uring_buf));
+    free(brp->base);
+}
@@ -4,7 +4,29 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <errno.h>
 #include <wait.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "timer_wheel.h"
+#include "event_loop.h"
+#include "match_queue.h"
+#include "player_ext.h"
+#include "proto_io.h"
+#include "proto_codec.h"
+#include "game.h"
+#include "jeux_globals.h"
+#include "journal.h"
+#include "tournament.h"
+#include "protocol_ext.h"
+#include "rate_limit.h"
+#include "client_ext.h"
+#include "stats.h"
+#include "game_clock.h"
 
 /* Directory in which to create test output files. */
 #define TEST_OUTPUT "test_output/"
@@ -74,3 +96,1273 @@ Test(student_suite, 01_connect, .init = init, .fini = fini, .timeout = 5) {
     int ret = system("util/jclient -p 9999 </dev/null | grep 'Connected to server'");
     cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
 }
+
+/*
+ * Timer wheel: timers are kept in coarser slots the further out they are,
+ * and have to come down a level at a time to go off on exactly the right
+ * tick.
+ */
+
+#define TW_TEST_TIMERS 8
+
+static TIMER tw_timers[TW_TEST_TIMERS];
+static uint64_t tw_fired_at[TW_TEST_TIMERS];
+static int tw_order[TW_TEST_TIMERS], tw_nfired;
+static TIMER_WHEEL *tw_test_wheel;
+
+static void tw_record(TIMER *timer, void *arg) {
+    int i = (int)(long)arg;
+    tw_fired_at[i] = tw_now(tw_test_wheel);
+    tw_order[tw_nfired++] = i;
+}
+
+static void tw_setup(void) {
+    tw_test_wheel = tw_create(1, 0);
+    cr_assert_not_null(tw_test_wheel);
+    tw_nfired = 0;
+    for(int i = 0; i < TW_TEST_TIMERS; i++) {
+        timer_init(&tw_timers[i], tw_record, (void *)(long)i);
+        tw_fired_at[i] = 0;
+    }
+}
+
+static void tw_teardown(void) {
+    tw_fini(tw_test_wheel);
+}
+
+Test(timer_wheel_suite, cascades_to_exact_tick, .init = tw_setup, .fini = tw_teardown, .timeout = 5) {
+    // either side of each level boundary, and one beyond the wheel's span
+    uint64_t due[TW_TEST_TIMERS] = { 1, 63, 64, 65, 4095, 4096, 4097, 300000 };
+    for(int i = 0; i < TW_TEST_TIMERS; i++)
+        tw_add(tw_test_wheel, &tw_timers[i], due[i]);
+    cr_assert_eq(tw_count(tw_test_wheel), TW_TEST_TIMERS);
+    for(uint64_t now = 1; now <= 300000; now++)
+        tw_advance(tw_test_wheel, now);
+    cr_assert_eq(tw_nfired, TW_TEST_TIMERS);
+    for(int i = 0; i < TW_TEST_TIMERS; i++) {
+        cr_assert_eq(tw_order[i], i, "timer %d went off out of order", i);
+        cr_assert_eq(tw_fired_at[i], due[i], "timer %d due at %lu went off at %lu",
+                     i, (unsigned long)due[i], (unsigned long)tw_fired_at[i]);
+    }
+    cr_assert_eq(tw_count(tw_test_wheel), 0);
+    cr_assert_eq(tw_next_ms(tw_test_wheel, 300000), -1);
+}
+
+Test(timer_wheel_suite, one_big_advance, .init = tw_setup, .fini = tw_teardown, .timeout = 5) {
+    uint64_t due[TW_TEST_TIMERS] = { 70000, 5000, 64, 1, 200, 4096, 100000, 63 };
+    for(int i = 0; i < TW_TEST_TIMERS; i++)
+        tw_add(tw_test_wheel, &tw_timers[i], due[i]);
+    cr_assert_eq(tw_next_ms(tw_test_wheel, 0), 1);
+    cr_assert_eq(tw_advance(tw_test_wheel, 100000), TW_TEST_TIMERS);
+    for(int i = 1; i < TW_TEST_TIMERS; i++)
+        cr_assert_leq(due[tw_order[i - 1]], due[tw_order[i]], "timers went off out of order");
+}
+
+Test(timer_wheel_suite, never_early, .init = tw_setup, .fini = tw_teardown, .timeout = 5) {
+    tw_advance(tw_test_wheel, 1000);
+    tw_add(tw_test_wheel, &tw_timers[0], 100);
+    cr_assert_eq(tw_advance(tw_test_wheel, 1099), 0);
+    cr_assert(timer_pending(&tw_timers[0]));
+    cr_assert_eq(tw_next_ms(tw_test_wheel, 1099), 1);
+    cr_assert_eq(tw_advance(tw_test_wheel, 1100), 1);
+    cr_assert_not(timer_pending(&tw_timers[0]));
+}
+
+/*
+ * Callbacks for cancelling and restarting from within a tick.
+ */
+static void tw_cancel_next(TIMER *timer, void *arg) {
+    tw_record(timer, arg);
+    int i = (int)(long)arg;
+    tw_cancel(tw_test_wheel, &tw_timers[(i + 1) % TW_TEST_TIMERS]);
+}
+
+static void tw_restart(TIMER *timer, void *arg) {
+    tw_record(timer, arg);
+    if(tw_nfired < 3)
+        tw_add(tw_test_wheel, timer, 10);
+}
+
+Test(timer_wheel_suite, cancel_during_tick, .init = tw_setup, .fini = tw_teardown, .timeout = 5) {
+    // two timers due on the same tick, each cancelling the other: whichever
+    // runs first, the other must not
+    timer_init(&tw_timers[0], tw_cancel_next, (void *)0L);
+    timer_init(&tw_timers[1], tw_cancel_next, (void *)1L);
+    tw_add(tw_test_wheel, &tw_timers[1], 50);
+    tw_add(tw_test_wheel, &tw_timers[0], 50);
+    // and one far out, cancelled from a tick before it has come down
+    timer_init(&tw_timers[2], tw_cancel_next, (void *)2L);
+    tw_add(tw_test_wheel, &tw_timers[2], 60);
+    tw_add(tw_test_wheel, &tw_timers[3], 10000);
+    cr_assert_eq(tw_advance(tw_test_wheel, 50), 1);
+    cr_assert_eq(tw_count(tw_test_wheel), 2);
+    cr_assert_eq(tw_advance(tw_test_wheel, 20000), 1);
+    cr_assert_eq(tw_order[1], 2);
+    cr_assert_not(timer_pending(&tw_timers[3]));
+    cr_assert_eq(tw_count(tw_test_wheel), 0);
+    // cancelling what isn't pending does nothing
+    tw_cancel(tw_test_wheel, &tw_timers[3]);
+    cr_assert_eq(tw_count(tw_test_wheel), 0);
+}
+
+Test(timer_wheel_suite, restart_from_callback, .init = tw_setup, .fini = tw_teardown, .timeout = 5) {
+    timer_init(&tw_timers[0], tw_restart, (void *)0L);
+    tw_add(tw_test_wheel, &tw_timers[0], 10);
+    cr_assert_eq(tw_advance(tw_test_wheel, 10), 1);
+    cr_assert(timer_pending(&tw_timers[0]));
+    // the wheel's time is already 1000 when the timer goes off at 20, so
+    // restarted from there it waits for a later advance
+    cr_assert_eq(tw_advance(tw_test_wheel, 1000), 1);
+    cr_assert_eq(tw_advance(tw_test_wheel, 1009), 0);
+    cr_assert_eq(tw_advance(tw_test_wheel, 1010), 1);
+    cr_assert_eq(tw_fired_at[0], 1010);
+    cr_assert_eq(tw_count(tw_test_wheel), 0);
+}
+
+/*
+ * Matchmaking queue: who gets paired with whom.  The players are logged
+ * in on connections to /dev/null, and what the server would send them is
+ * caught instead, to see the INVITED notifications of the games made.
+ * Every packet's type and id are logged as well.
+ */
+
+#define MQ_TEST_INVITES 64
+#define MQ_TEST_PACKETS 256
+
+static struct {
+    int fd;
+    int id;
+    int role;
+    char opponent[32];
+} mq_invites[MQ_TEST_INVITES];
+static int mq_ninvites;
+static struct {
+    int fd;
+    int type;
+    int id;
+    int role;
+} mq_packets[MQ_TEST_PACKETS];
+static int mq_npackets;
+static int mq_listen[2];
+
+static int mq_sender(int fd, const void *hdr, size_t hdrlen, const void *data, size_t datalen) {
+    JEUX_PACKET_HEADER h;
+    proto_decode_header(&h, hdr);
+    if(mq_npackets < MQ_TEST_PACKETS) {
+        mq_packets[mq_npackets].fd = fd;
+        mq_packets[mq_npackets].type = h.type;
+        mq_packets[mq_npackets].id = h.id;
+        mq_packets[mq_npackets].role = h.role;
+        mq_npackets++;
+    }
+    if(h.type == JEUX_INVITED_PKT && mq_ninvites < MQ_TEST_INVITES) {
+        mq_invites[mq_ninvites].fd = fd;
+        mq_invites[mq_ninvites].id = h.id;
+        mq_invites[mq_ninvites].role = h.role;
+        snprintf(mq_invites[mq_ninvites].opponent, sizeof(mq_invites[0].opponent),
+                 "%.*s", (int)datalen, (const char *)data);
+        mq_ninvites++;
+    }
+    return 0;
+}
+
+static void mq_setup(void) {
+    cr_assert_eq(pipe(mq_listen), 0);
+    cr_assert_eq(ev_loop_init(mq_listen[0], 0), 0);
+    proto_set_sender(mq_sender);
+    client_registry = creg_init();
+    player_registry = preg_init();
+    match_queue = mq_init();
+    cr_assert_not_null(match_queue);
+    mq_ninvites = 0;
+    mq_npackets = 0;
+}
+
+static void mq_teardown(void) {
+    mq_fini(match_queue);
+    ev_loop_fini();
+}
+
+static CLIENT *mq_player(char *name, int rating) {
+    int fd = open("/dev/null", O_RDWR);
+    cr_assert_neq(fd, -1);
+    CLIENT *client = creg_register(client_registry, fd);
+    PLAYER *player = preg_register(player_registry, name);
+    cr_assert(client != NULL && player != NULL);
+    player_set_rating(player, rating);
+    cr_assert_eq(client_login(client, player), 0);
+    player_unref(player, "logged in for test");
+    return client;
+}
+
+/*
+ * The name of the opponent a client was paired with, or NULL, and the
+ * role it was given.
+ */
+static char *mq_opponent(CLIENT *client, int *rolep) {
+    for(int i = 0; i < mq_ninvites; i++) {
+        if(mq_invites[i].fd == client_get_fd(client)) {
+            if(rolep != NULL)
+                *rolep = mq_invites[i].role;
+            return mq_invites[i].opponent;
+        }
+    }
+    return NULL;
+}
+
+Test(match_queue_suite, pairs_across_bitmap_words, .init = mq_setup, .fini = mq_teardown, .timeout = 5) {
+    // buckets 63 and 64 are at the ends of different words of the bitmap
+    CLIENT *a = mq_player("a", 1600);
+    CLIENT *b = mq_player("b", 1575);
+    cr_assert_eq(mq_join(match_queue, a), 0);
+    cr_assert_eq(mq_count(match_queue), 1);
+    cr_assert_eq(mq_join(match_queue, b), 0);
+    cr_assert_eq(mq_count(match_queue), 0);
+    int role;
+    cr_assert_str_eq(mq_opponent(b, &role), "a");
+    cr_assert_eq(role, SECOND_PLAYER_ROLE);
+    cr_assert_str_eq(mq_opponent(a, &role), "b");
+    cr_assert_eq(role, FIRST_PLAYER_ROLE, "the player who waited should go first");
+
+    CLIENT *c = mq_player("c", 1599);
+    CLIENT *d = mq_player("d", 1600);
+    cr_assert_eq(mq_join(match_queue, c), 0);
+    cr_assert_eq(mq_join(match_queue, d), 0);
+    cr_assert_str_eq(mq_opponent(d, NULL), "c");
+}
+
+Test(match_queue_suite, pairs_at_top_bucket_edge, .init = mq_setup, .fini = mq_teardown, .timeout = 5) {
+    // buckets 254 and 255, the last
+    CLIENT *a = mq_player("a", 6374);
+    CLIENT *b = mq_player("b", 6375);
+    cr_assert_eq(mq_join(match_queue, a), 0);
+    cr_assert_eq(mq_join(match_queue, b), 0);
+    cr_assert_str_eq(mq_opponent(b, NULL), "a");
+    cr_assert_eq(mq_count(match_queue), 0);
+}
+
+Test(match_queue_suite, skips_out_of_window_in_bottom_bucket, .init = mq_setup, .fini = mq_teardown, .timeout = 5) {
+    // a rating below the range is clamped into bucket 0, ahead of someone
+    // who is in range
+    CLIENT *a = mq_player("a", -300);
+    CLIENT *b = mq_player("b", 10);
+    CLIENT *c = mq_player("c", 0);
+    cr_assert_eq(mq_join(match_queue, a), 0);
+    cr_assert_eq(mq_join(match_queue, b), 0);
+    cr_assert_eq(mq_count(match_queue), 2);
+    cr_assert_eq(mq_join(match_queue, c), 0);
+    cr_assert_str_eq(mq_opponent(c, NULL), "b");
+    cr_assert(mq_is_waiting(match_queue, a));
+    cr_assert_eq(mq_count(match_queue), 1);
+}
+
+Test(match_queue_suite, skips_out_of_window_in_top_bucket, .init = mq_setup, .fini = mq_teardown, .timeout = 5) {
+    CLIENT *a = mq_player("a", 9000);
+    CLIENT *b = mq_player("b", 6380);
+    CLIENT *c = mq_player("c", 6400);
+    cr_assert_eq(mq_join(match_queue, a), 0);
+    cr_assert_eq(mq_join(match_queue, b), 0);
+    cr_assert_eq(mq_join(match_queue, c), 0);
+    cr_assert_str_eq(mq_opponent(c, NULL), "b");
+    cr_assert(mq_is_waiting(match_queue, a));
+}
+
+Test(match_queue_suite, closest_in_window_wins, .init = mq_setup, .fini = mq_teardown, .timeout = 5) {
+    CLIENT *a = mq_player("a", 1000);
+    CLIENT *b = mq_player("b", 1100);
+    CLIENT *c = mq_player("c", 1060);
+    CLIENT *d = mq_player("d", 1200);
+    cr_assert_eq(mq_join(match_queue, a), 0);
+    cr_assert_eq(mq_join(match_queue, b), 0);
+    cr_assert_eq(mq_join(match_queue, c), 0);
+    cr_assert_str_eq(mq_opponent(c, NULL), "b");
+    // a is too far from d to be paired with it yet
+    cr_assert_eq(mq_join(match_queue, d), 0);
+    cr_assert_null(mq_opponent(d, NULL));
+    cr_assert_eq(mq_count(match_queue), 2);
+}
+
+Test(match_queue_suite, join_and_leave, .init = mq_setup, .fini = mq_teardown, .timeout = 5) {
+    CLIENT *a = mq_player("a", 1500);
+    CLIENT *b = mq_player("b", 1500);
+    cr_assert_eq(mq_join(match_queue, a), 0);
+    cr_assert_eq(mq_join(match_queue, a), -1, "joined twice");
+    cr_assert(mq_is_waiting(match_queue, a));
+    cr_assert_eq(mq_leave(match_queue, a), 0);
+    cr_assert_eq(mq_leave(match_queue, a), -1, "left twice");
+    cr_assert_not(mq_is_waiting(match_queue, a));
+    // nobody left to be paired with
+    cr_assert_eq(mq_join(match_queue, b), 0);
+    cr_assert_null(mq_opponent(b, NULL));
+    cr_assert_eq(mq_count(match_queue), 1);
+    // the hash table grows past its first size without losing anyone (all
+    // of them too far apart to be paired, in the clamped top bucket)
+    char name[16];
+    for(int i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "p%d", i);
+        cr_assert_eq(mq_join(match_queue, mq_player(name, 10000 + 100 * i)), 0);
+    }
+    cr_assert_eq(mq_count(match_queue), 101);
+    cr_assert(mq_is_waiting(match_queue, b));
+    cr_assert_eq(mq_leave(match_queue, b), 0);
+    cr_assert_eq(mq_count(match_queue), 100);
+}
+
+Test(match_queue_suite, widening_pairs_longest_waiting_first, .init = mq_setup, .fini = mq_teardown, .timeout = 10) {
+    CLIENT *a = mq_player("a", 1500);
+    CLIENT *b = mq_player("b", 1570);
+    cr_assert_eq(mq_join(match_queue, a), 0);
+    cr_assert_eq(mq_join(match_queue, b), 0);
+    cr_assert_eq(mq_count(match_queue), 2);
+    cr_assert_eq(ev_loop_poll(), 0);
+    cr_assert_eq(mq_count(match_queue), 2, "paired before the windows widened");
+    usleep((MQ_WIDEN_MS + 100) * 1000);
+    cr_assert_eq(ev_loop_poll(), 0);
+    cr_assert_eq(mq_count(match_queue), 0);
+    int role;
+    cr_assert_str_eq(mq_opponent(a, &role), "b");
+    cr_assert_eq(role, FIRST_PLAYER_ROLE);
+    cr_assert_str_eq(mq_opponent(b, &role), "a");
+    cr_assert_eq(role, SECOND_PLAYER_ROLE);
+}
+
+/*
+ * Journal: games written by the writer thread, read back, and found
+ * again after a crash has torn the last record.  Each test has a
+ * directory of its own.
+ */
+
+static char jn_dir[] = "/tmp/jeux_journal_XXXXXX";
+static char *jn_moves[] = { "1<-X", "5<-O", "9<-X" };
+
+static void jn_setup(void) {
+    cr_assert_not_null(mkdtemp(jn_dir));
+}
+
+static void jn_teardown(void) {
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", jn_dir);
+    system(cmd);
+}
+
+static int jn_segments(void) {
+    DIR *d = opendir(jn_dir);
+    cr_assert_not_null(d);
+    int n = 0;
+    struct dirent *e;
+    while((e = readdir(d)) != NULL)
+        n += strstr(e->d_name, ".jnl") != NULL;
+    closedir(d);
+    return n;
+}
+
+Test(journal_suite, write_flush_read, .init = jn_setup, .fini = jn_teardown, .timeout = 5) {
+    JOURNAL *j = journal_open(jn_dir);
+    cr_assert_not_null(j);
+    cr_assert_eq(journal_record(j, "alice", "bob", FIRST_PLAYER_ROLE, 0, jn_moves, 3), 1);
+    cr_assert_eq(journal_record(j, "bob", "carol", NULL_ROLE, 1, jn_moves, 1), 2);
+    cr_assert_eq(journal_record(j, "carol", "alice", SECOND_PLAYER_ROLE, 0, NULL, 0), 3);
+    cr_assert_eq(journal_flush(j), 0);
+
+    // everything flushed is readable while the journal is still open
+    JOURNAL_READER *r = journal_reader_open(jn_dir, 0);
+    cr_assert_not_null(r);
+    JOURNAL_GAME g;
+    cr_assert_eq(journal_read(r, &g), 1);
+    cr_assert_eq(g.id, 1);
+    cr_assert_str_eq(g.first, "alice");
+    cr_assert_str_eq(g.second, "bob");
+    cr_assert_eq(g.winner, FIRST_PLAYER_ROLE);
+    cr_assert_eq(g.aborted, 0);
+    cr_assert_eq(g.nmoves, 3);
+    for(int i = 0; i < 3; i++)
+        cr_assert_str_eq(g.moves[i], jn_moves[i]);
+    cr_assert_eq(journal_read(r, &g), 1);
+    cr_assert_eq(g.id, 2);
+    cr_assert_eq(g.winner, NULL_ROLE);
+    cr_assert_eq(g.aborted, 1);
+    cr_assert_eq(g.nmoves, 1);
+    cr_assert_eq(journal_read(r, &g), 1);
+    cr_assert_eq(g.nmoves, 0);
+    cr_assert_eq(journal_read(r, &g), 0);
+    journal_reader_close(r);
+    journal_close(j);
+
+    r = journal_reader_open(jn_dir, 2);
+    cr_assert_eq(journal_find(r, 2, &g), 1);
+    cr_assert_str_eq(g.first, "bob");
+    journal_reader_close(r);
+}
+
+Test(journal_suite, resumes_after_torn_record, .init = jn_setup, .fini = jn_teardown, .timeout = 5) {
+    JOURNAL *j = journal_open(jn_dir);
+    cr_assert_not_null(j);
+    for(int i = 0; i < 3; i++)
+        journal_record(j, "alice", "bob", FIRST_PLAYER_ROLE, 0, jn_moves, 3);
+    journal_close(j);
+
+    // a crash in the middle of writing the last game
+    char path[64];
+    snprintf(path, sizeof(path), "%s/%020d.jnl", jn_dir, 1);
+    struct stat st;
+    cr_assert_eq(stat(path, &st), 0);
+    cr_assert_eq(truncate(path, st.st_size - 3), 0);
+
+    // the torn game is as good as never written, so its ID is used again
+    j = journal_open(jn_dir);
+    cr_assert_not_null(j);
+    cr_assert_eq(journal_record(j, "carol", "dave", SECOND_PLAYER_ROLE, 0, jn_moves, 2), 3);
+    journal_close(j);
+    cr_assert_eq(jn_segments(), 2);
+
+    JOURNAL_READER *r = journal_reader_open(jn_dir, 0);
+    JOURNAL_GAME g;
+    for(int id = 1; id <= 3; id++) {
+        cr_assert_eq(journal_read(r, &g), 1);
+        cr_assert_eq(g.id, id);
+    }
+    cr_assert_str_eq(g.first, "carol");
+    cr_assert_eq(g.nmoves, 2);
+    cr_assert_eq(journal_read(r, &g), 0);
+    journal_reader_close(r);
+}
+
+Test(journal_suite, segment_rollover, .init = jn_setup, .fini = jn_teardown, .timeout = 20) {
+    // games with long names, so that a few hundred fill more than a segment
+    size_t len = 60000;
+    char *name = malloc(len + 1);
+    cr_assert_not_null(name);
+    memset(name, 'x', len);
+    name[len] = '\0';
+    int ngames = 2 * JOURNAL_SEGMENT_BYTES / (2 * len) + 1;
+    JOURNAL *j = journal_open(jn_dir);
+    cr_assert_not_null(j);
+    for(int i = 0; i < ngames; i++) {
+        cr_assert_eq(journal_record(j, name, "bob", FIRST_PLAYER_ROLE, 0, jn_moves, 3), i + 1);
+        // a batch at a time, so that the segments roll over where they fill
+        if(i % 16 == 15)
+            cr_assert_eq(journal_flush(j), 0);
+    }
+    journal_close(j);
+    cr_assert_geq(jn_segments(), 2);
+
+    JOURNAL_READER *r = journal_reader_open(jn_dir, 0);
+    JOURNAL_GAME g;
+    int id = 0;
+    while(journal_read(r, &g) == 1) {
+        cr_assert_eq(g.id, ++id);
+        cr_assert_eq(strlen(g.first), len);
+    }
+    cr_assert_eq(id, ngames);
+    journal_reader_close(r);
+
+    // starting from a game in a later segment skips the earlier ones
+    r = journal_reader_open(jn_dir, ngames - 1);
+    cr_assert_eq(journal_read(r, &g), 1);
+    cr_assert_eq(g.id, ngames - 1);
+    journal_reader_close(r);
+    free(name);
+}
+
+Test(journal_suite, write_failure_reported, .init = jn_setup, .fini = jn_teardown, .timeout = 5) {
+    JOURNAL *j = journal_open(jn_dir);
+    cr_assert_not_null(j);
+    journal_record(j, "alice", "bob", FIRST_PLAYER_ROLE, 0, jn_moves, 3);
+    cr_assert_eq(journal_flush(j), 0);
+
+    // no file may grow any more: the next game can't be written
+    struct rlimit old, lim;
+    getrlimit(RLIMIT_FSIZE, &old);
+    lim = old;
+    lim.rlim_cur = 64;
+    signal(SIGXFSZ, SIG_IGN);
+    cr_assert_eq(setrlimit(RLIMIT_FSIZE, &lim), 0);
+    journal_record(j, "alice", "carol", FIRST_PLAYER_ROLE, 0, jn_moves, 3);
+    cr_assert_eq(journal_flush(j), -1, "a lost game was reported as written");
+    cr_assert_eq(setrlimit(RLIMIT_FSIZE, &old), 0);
+
+    // the journal carries on, and what's lost isn't reported again
+    cr_assert_eq(journal_record(j, "alice", "dave", FIRST_PLAYER_ROLE, 0, jn_moves, 3), 3);
+    cr_assert_eq(journal_flush(j), 0);
+    journal_close(j);
+
+    JOURNAL_READER *r = journal_reader_open(jn_dir, 0);
+    JOURNAL_GAME g;
+    cr_assert_eq(journal_read(r, &g), 1);
+    cr_assert_eq(g.id, 1);
+    cr_assert_eq(journal_read(r, &g), 1);
+    cr_assert_eq(g.id, 3);
+    cr_assert_str_eq(g.second, "dave");
+    cr_assert_eq(journal_read(r, &g), 0);
+    journal_reader_close(r);
+}
+
+/*
+ * Tournaments, on the same footing as the matchmaking tests.  The players
+ * are p0, p1, ... rated in that order, strongest first.  Every game is
+ * won by the player who moves first (the other one resigns), and the
+ * tests keep their own score to check the pairings and standings against.
+ */
+
+#define TRN_TEST_PLAYERS 8
+
+static CLIENT *trn_clients[TRN_TEST_PLAYERS];
+static int trn_nplayers;
+static int trn_met[TRN_TEST_PLAYERS][TRN_TEST_PLAYERS];
+static int trn_points[TRN_TEST_PLAYERS], trn_byes[TRN_TEST_PLAYERS], trn_firsts[TRN_TEST_PLAYERS];
+static int trn_seen;
+
+static void trn_setup(void) {
+    mq_setup();
+    tournaments = treg_init();
+    cr_assert_not_null(tournaments);
+    trn_seen = 0;
+    memset(trn_met, 0, sizeof(trn_met));
+    memset(trn_points, 0, sizeof(trn_points));
+    memset(trn_byes, 0, sizeof(trn_byes));
+    memset(trn_firsts, 0, sizeof(trn_firsts));
+}
+
+static void trn_teardown(void) {
+    treg_fini(tournaments);
+    mq_teardown();
+}
+
+static int trn_start(TRN_FORMAT format, int rounds, int n) {
+    CLIENT *organizer = mq_player("organizer", 1500);
+    int id = treg_create(tournaments, organizer, format, rounds);
+    cr_assert_geq(id, 0);
+    char name[16];
+    for(int i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "p%d", i);
+        trn_clients[i] = mq_player(name, 2000 - 10 * i);
+        cr_assert_eq(treg_enter(tournaments, id, trn_clients[i]), 0);
+    }
+    trn_nplayers = n;
+    cr_assert_eq(treg_enter(tournaments, id, trn_clients[0]), -1, "entered twice");
+    cr_assert_eq(treg_start(tournaments, id, trn_clients[0]), -1, "started by a player");
+    cr_assert_eq(treg_start(tournaments, id, organizer), 0);
+    return id;
+}
+
+/*
+ * Play out the round that has been paired, and let the next one be
+ * paired.  Whoever has no game has a bye, worth bye_points.
+ *
+ * @return the number of games in the round.
+ */
+static int trn_play_round(int bye_points) {
+    int from = trn_seen, ngames = 0;
+    int playing[TRN_TEST_PLAYERS] = { 0 };
+    trn_seen = mq_ninvites;
+    for(int i = from; i < trn_seen; i++) {
+        if(mq_invites[i].role != SECOND_PLAYER_ROLE)
+            continue;
+        int first = atoi(mq_invites[i].opponent + 1), second = -1;
+        for(int k = 0; k < trn_nplayers; k++)
+            if(client_get_fd(trn_clients[k]) == mq_invites[i].fd)
+                second = k;
+        cr_assert(second >= 0 && first != second);
+        trn_met[first][second]++;
+        trn_met[second][first]++;
+        trn_points[first] += 2;
+        trn_firsts[first]++;
+        playing[first] = playing[second] = 1;
+        cr_assert_eq(client_resign_game(trn_clients[second], mq_invites[i].id), 0);
+        ngames++;
+    }
+    for(int k = 0; k < trn_nplayers; k++) {
+        if(!playing[k]) {
+            trn_byes[k]++;
+            trn_points[k] += bye_points;
+        }
+    }
+    // the round is over once the loop has been round
+    cr_assert_eq(ev_loop_poll(), 0);
+    return ngames;
+}
+
+/*
+ * The standings must be in order of points, then of the sum of the
+ * opponents' points, and agree with the score kept here.
+ */
+static void trn_check_standings(int id, char *format, int rounds) {
+    char *str = treg_standings(tournaments, id);
+    cr_assert_not_null(str);
+    char head[64];
+    snprintf(head, sizeof(head), "%s\t%d\t%d\n", format, rounds, rounds);
+    cr_assert_eq(strncmp(str, head, strlen(head)), 0, "standings begin %s", str);
+    char *line = str + strlen(head);
+    int last_points = 1 << 30, last_buchholz = 1 << 30;
+    for(int rank = 1; rank <= trn_nplayers; rank++) {
+        int r, p, pts, pts_half, bh, bh_half;
+        cr_assert_eq(sscanf(line, "%d\tp%d\t%d.%d\t%d.%d", &r, &p, &pts, &pts_half, &bh, &bh_half), 6,
+                     "bad line: %s", line);
+        cr_assert_eq(r, rank);
+        int points = 2 * pts + (pts_half != 0), buchholz = 2 * bh + (bh_half != 0);
+        cr_assert_eq(points, trn_points[p], "p%d has %d half-points, not %d", p, points, trn_points[p]);
+        int expect = 0;
+        for(int k = 0; k < trn_nplayers; k++)
+            expect += trn_met[p][k] * trn_points[k];
+        cr_assert_eq(buchholz, expect, "p%d has Buchholz %d, not %d", p, buchholz, expect);
+        cr_assert(points < last_points || (points == last_points && buchholz <= last_buchholz),
+                  "p%d out of order", p);
+        last_points = points;
+        last_buchholz = buchholz;
+        line = strchr(line, '\n') + 1;
+    }
+    cr_assert_eq(*line, '\0');
+    free(str);
+}
+
+Test(tournament_suite, round_robin_everyone_meets_once, .init = trn_setup, .fini = trn_teardown, .timeout = 5) {
+    // an odd number, so there's a bye each round (worth nothing)
+    int id = trn_start(TRN_ROUND_ROBIN, 0, 5);
+    for(int round = 0; round < 5; round++)
+        cr_assert_eq(trn_play_round(0), 2, "round %d", round + 1);
+    cr_assert_eq(mq_ninvites, trn_seen, "games after the last round");
+    for(int a = 0; a < 5; a++) {
+        cr_assert_eq(trn_byes[a], 1, "p%d had %d byes", a, trn_byes[a]);
+        for(int b = 0; b < 5; b++)
+            cr_assert_eq(trn_met[a][b], a != b, "p%d and p%d met %d times", a, b, trn_met[a][b]);
+        // four games each, as many first as second
+        cr_assert_eq(trn_firsts[a], 2, "p%d moved first %d times", a, trn_firsts[a]);
+    }
+    trn_check_standings(id, "roundrobin", 5);
+}
+
+Test(tournament_suite, round_robin_even, .init = trn_setup, .fini = trn_teardown, .timeout = 5) {
+    int id = trn_start(TRN_ROUND_ROBIN, 0, 6);
+    for(int round = 0; round < 5; round++)
+        cr_assert_eq(trn_play_round(0), 3, "round %d", round + 1);
+    cr_assert_eq(mq_ninvites, trn_seen, "games after the last round");
+    for(int a = 0; a < 6; a++) {
+        cr_assert_eq(trn_byes[a], 0);
+        for(int b = 0; b < 6; b++)
+            cr_assert_eq(trn_met[a][b], a != b, "p%d and p%d met %d times", a, b, trn_met[a][b]);
+    }
+    trn_check_standings(id, "roundrobin", 5);
+}
+
+Test(tournament_suite, swiss_byes_and_no_repeats, .init = trn_setup, .fini = trn_teardown, .timeout = 5) {
+    int id = trn_start(TRN_SWISS, 4, 7);
+    for(int round = 0; round < 4; round++)
+        cr_assert_eq(trn_play_round(2), 3, "round %d", round + 1);
+    cr_assert_eq(mq_ninvites, trn_seen, "games after the last round");
+    for(int a = 0; a < 7; a++) {
+        cr_assert_leq(trn_byes[a], 1, "p%d had %d byes", a, trn_byes[a]);
+        for(int b = 0; b < 7; b++)
+            cr_assert_leq(trn_met[a][b], 1, "p%d and p%d met %d times", a, b, trn_met[a][b]);
+    }
+    trn_check_standings(id, "swiss", 4);
+}
+
+Test(tournament_suite, swiss_pairs_by_score, .init = trn_setup, .fini = trn_teardown, .timeout = 5) {
+    // the first round by rating, neighbours together
+    trn_start(TRN_SWISS, 2, 8);
+    cr_assert_eq(trn_play_round(2), 4);
+    for(int a = 0; a < 8; a++)
+        cr_assert_eq(trn_met[a][a ^ 1], 1, "p%d paired out of order", a);
+    // then winners play winners, losers losers
+    int won[TRN_TEST_PLAYERS];
+    for(int a = 0; a < 8; a++)
+        won[a] = trn_points[a];
+    cr_assert_eq(trn_play_round(2), 4);
+    for(int a = 0; a < 8; a++)
+        for(int b = 0; b < 8; b++)
+            if(trn_met[a][b] && b != (a ^ 1))
+                cr_assert_eq(won[a], won[b], "p%d and p%d met on different scores", a, b);
+}
+
+/*
+ * The rate limiter, by the clock it's given.  Every request takes a token
+ * at 100/s with a burst of 200; listings take one at 4/s, burst 16, and
+ * offers one at 10/s, burst 40, as well.  32 refusals, refilling at 1/s,
+ * before a client is cut off.
+ */
+
+#define RL_T0 (5 * 1000000000ULL)
+#define RL_MS 1000000ULL
+
+static RATE_LIMITER rl_test;
+
+static void rl_setup(void) {
+    rl_set_scale(1);
+    rl_init(&rl_test);
+}
+
+// take n tokens for type at now, all of which must be granted
+static void rl_take(int type, int n, uint64_t now) {
+    for(int i = 0; i < n; i++)
+        cr_assert_eq(rl_check(&rl_test, type, now), RL_OK, "request %d of %d refused", i + 1, n);
+}
+
+Test(rate_limit_suite, requests_burst, .init = rl_setup, .timeout = 5) {
+    rl_take(JEUX_LOGIN_PKT, 200, RL_T0);
+    cr_assert_eq(rl_check(&rl_test, JEUX_LOGIN_PKT, RL_T0), RL_REFUSED);
+    // a token back every 10ms, and not before
+    cr_assert_eq(rl_check(&rl_test, JEUX_LOGIN_PKT, RL_T0 + 9 * RL_MS), RL_REFUSED);
+    rl_take(JEUX_LOGIN_PKT, 1, RL_T0 + 10 * RL_MS);
+    cr_assert_eq(rl_check(&rl_test, JEUX_LOGIN_PKT, RL_T0 + 10 * RL_MS), RL_REFUSED);
+}
+
+Test(rate_limit_suite, steady_rate_never_refused, .init = rl_setup, .timeout = 5) {
+    rl_take(JEUX_LOGIN_PKT, 200, RL_T0);
+    for(int i = 1; i <= 1000; i++)
+        rl_take(JEUX_LOGIN_PKT, 1, RL_T0 + i * 10 * RL_MS);
+}
+
+Test(rate_limit_suite, refills_to_the_burst_only, .init = rl_setup, .timeout = 5) {
+    rl_take(JEUX_LOGIN_PKT, 200, RL_T0);
+    // an hour idle is worth a burst, no more
+    uint64_t later = RL_T0 + 3600 * 1000 * RL_MS;
+    rl_take(JEUX_LOGIN_PKT, 200, later);
+    cr_assert_eq(rl_check(&rl_test, JEUX_LOGIN_PKT, later), RL_REFUSED);
+}
+
+Test(rate_limit_suite, listings_and_offers_bursts, .init = rl_setup, .timeout = 5) {
+    rl_take(JEUX_USERS_PKT, 10, RL_T0);
+    rl_take(JEUX_STATS_PKT, 6, RL_T0);
+    cr_assert_eq(rl_check(&rl_test, JEUX_STANDINGS_PKT, RL_T0), RL_REFUSED);
+    // a listing every 250ms
+    rl_take(JEUX_USERS_PKT, 1, RL_T0 + 250 * RL_MS);
+    cr_assert_eq(rl_check(&rl_test, JEUX_USERS_PKT, RL_T0 + 250 * RL_MS), RL_REFUSED);
+
+    // offers have a bucket of their own
+    rl_take(JEUX_INVITE_PKT, 20, RL_T0);
+    rl_take(JEUX_MATCH_PKT, 20, RL_T0);
+    cr_assert_eq(rl_check(&rl_test, JEUX_WATCH_PKT, RL_T0), RL_REFUSED);
+    cr_assert_eq(rl_check(&rl_test, JEUX_TOURNEY_PKT, RL_T0), RL_REFUSED);
+
+    // and neither stops anything else
+    rl_take(JEUX_MOVE_PKT, 10, RL_T0);
+}
+
+Test(rate_limit_suite, cut_off_when_patience_runs_out, .init = rl_setup, .timeout = 5) {
+    rl_take(JEUX_USERS_PKT, 16, RL_T0);
+    for(int i = 0; i < 32; i++)
+        cr_assert_eq(rl_check(&rl_test, JEUX_USERS_PKT, RL_T0), RL_REFUSED, "refusal %d", i + 1);
+    cr_assert_eq(rl_check(&rl_test, JEUX_USERS_PKT, RL_T0), RL_CUT_OFF);
+    // a second later there are four listings, and one refusal, to be had
+    cr_assert_eq(rl_check(&rl_test, JEUX_USERS_PKT, RL_T0 + 100 * RL_MS), RL_CUT_OFF);
+    rl_take(JEUX_USERS_PKT, 4, RL_T0 + 1000 * RL_MS);
+    cr_assert_eq(rl_check(&rl_test, JEUX_USERS_PKT, RL_T0 + 1000 * RL_MS), RL_REFUSED);
+    cr_assert_eq(rl_check(&rl_test, JEUX_USERS_PKT, RL_T0 + 1000 * RL_MS), RL_CUT_OFF);
+}
+
+Test(rate_limit_suite, scaled_limits, .init = rl_setup, .timeout = 5) {
+    rl_set_scale(2);
+    rl_init(&rl_test);
+    rl_take(JEUX_USERS_PKT, 32, RL_T0);
+    cr_assert_eq(rl_check(&rl_test, JEUX_USERS_PKT, RL_T0), RL_REFUSED);
+    rl_take(JEUX_USERS_PKT, 1, RL_T0 + 125 * RL_MS);
+
+    rl_set_scale(0);
+    rl_init(&rl_test);
+    rl_take(JEUX_USERS_PKT, 100000, RL_T0);
+}
+
+/*
+ * The wire codec: the header byte by byte, and back.
+ */
+
+static JEUX_PACKET_HEADER codec_header(int type, int id, int role, uint16_t size,
+                                       uint32_t sec, uint32_t nsec) {
+    JEUX_PACKET_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = type;
+    hdr.id = id;
+    hdr.role = role;
+    hdr.size = htons(size);
+    hdr.timestamp_sec = htonl(sec);
+    hdr.timestamp_nsec = htonl(nsec);
+    return hdr;
+}
+
+Test(proto_codec_suite, byte_layout, .timeout = 5) {
+    JEUX_PACKET_HEADER hdr = codec_header(JEUX_MOVE_PKT, 0x12, SECOND_PLAYER_ROLE, 0xa1b2,
+                                          0xc1c2c3c4, 0x3b9ac9ff);
+    unsigned char wire[JEUX_WIRE_HEADER_SIZE];
+    memset(wire, 0xee, sizeof(wire));
+    proto_encode_header(wire, &hdr);
+    unsigned char expect[JEUX_WIRE_HEADER_SIZE] = {
+        JEUX_MOVE_PKT, 0x12, SECOND_PLAYER_ROLE, 0,
+        0xa1, 0xb2, 0, 0,
+        0xc1, 0xc2, 0xc3, 0xc4,
+        0x3b, 0x9a, 0xc9, 0xff
+    };
+    for(int i = 0; i < JEUX_WIRE_HEADER_SIZE; i++)
+        cr_assert_eq(wire[i], expect[i], "byte %d is %#x, not %#x", i, wire[i], expect[i]);
+}
+
+Test(proto_codec_suite, same_bytes_as_the_struct, .timeout = 5) {
+    // on the usual ABIs the struct, padding zeroed, is what went out before
+    if(sizeof(JEUX_PACKET_HEADER) != JEUX_WIRE_HEADER_SIZE)
+        return;
+    JEUX_PACKET_HEADER hdr = codec_header(JEUX_ENDED_PKT, 7, 1, 300, 1700000000, 123456789);
+    unsigned char wire[JEUX_WIRE_HEADER_SIZE];
+    proto_encode_header(wire, &hdr);
+    cr_assert_eq(memcmp(wire, &hdr, JEUX_WIRE_HEADER_SIZE), 0);
+}
+
+Test(proto_codec_suite, round_trip, .timeout = 5) {
+    uint32_t values[] = { 0, 1, 0xff, 0x100, 0xffff, 0x10000, 0x7fffffff, 0xffffffff };
+    int n = sizeof(values) / sizeof(values[0]);
+    for(int i = 0; i < n; i++) {
+        JEUX_PACKET_HEADER hdr = codec_header(i, 255 - i, i % 3, values[n - 1 - i] & 0xffff,
+                                              values[i], values[n - 1 - i]), out;
+        unsigned char wire[JEUX_WIRE_HEADER_SIZE];
+        proto_encode_header(wire, &hdr);
+        memset(&out, 0, sizeof(out));
+        proto_decode_header(&out, wire);
+        cr_assert_eq(out.type, hdr.type);
+        cr_assert_eq(out.id, hdr.id);
+        cr_assert_eq(out.role, hdr.role);
+        cr_assert_eq(out.size, hdr.size);
+        cr_assert_eq(out.timestamp_sec, hdr.timestamp_sec);
+        cr_assert_eq(out.timestamp_nsec, hdr.timestamp_nsec);
+    }
+}
+
+Test(proto_codec_suite, decode_ignores_padding, .timeout = 5) {
+    unsigned char wire[JEUX_WIRE_HEADER_SIZE] = {
+        JEUX_ACK_PKT, 3, 0, 0x55,
+        0x00, 0x20, 0x66, 0x77,
+        0, 0, 0, 9,
+        0, 0, 1, 0
+    };
+    JEUX_PACKET_HEADER hdr;
+    proto_decode_header(&hdr, wire);
+    cr_assert_eq(hdr.type, JEUX_ACK_PKT);
+    cr_assert_eq(hdr.id, 3);
+    cr_assert_eq(ntohs(hdr.size), 0x20);
+    cr_assert_eq(ntohl(hdr.timestamp_sec), 9);
+    cr_assert_eq(ntohl(hdr.timestamp_nsec), 256);
+    // and encoding it again clears it
+    unsigned char again[JEUX_WIRE_HEADER_SIZE];
+    proto_encode_header(again, &hdr);
+    cr_assert(again[3] == 0 && again[6] == 0 && again[7] == 0);
+}
+
+Test(proto_codec_suite, encode_headers_batch, .timeout = 5) {
+    JEUX_PACKET_HEADER hdrs[5];
+    for(int i = 0; i < 5; i++)
+        hdrs[i] = codec_header(JEUX_MOVED_PKT, i, 0, 10 * i, 1000 + i, 2000 + i);
+    unsigned char buf[6 * JEUX_WIRE_HEADER_SIZE];
+    memset(buf, 0xee, sizeof(buf));
+    cr_assert_eq(proto_encode_headers(buf, hdrs, 5), 5 * JEUX_WIRE_HEADER_SIZE);
+    for(int i = 0; i < 5; i++) {
+        unsigned char one[JEUX_WIRE_HEADER_SIZE];
+        proto_encode_header(one, &hdrs[i]);
+        cr_assert_eq(memcmp(buf + i * JEUX_WIRE_HEADER_SIZE, one, JEUX_WIRE_HEADER_SIZE), 0,
+                     "header %d", i);
+    }
+    // nothing past the end
+    for(int i = 5 * JEUX_WIRE_HEADER_SIZE; i < (int)sizeof(buf); i++)
+        cr_assert_eq(buf[i], 0xee);
+    cr_assert_eq(proto_encode_headers(buf, hdrs, 0), 0);
+}
+
+/*
+ * proto_recv_packet, fed through a socketpair by a thread that writes a
+ * packet a few bytes at a time, pausing in between so that every piece
+ * arrives in a read of its own, and then hangs up.
+ */
+
+typedef struct recv_script {
+    int fd;
+    const unsigned char *bytes;
+    const int *chunks;               // lengths, ending with 0
+} RECV_SCRIPT;
+
+static void *recv_writer(void *arg) {
+    RECV_SCRIPT *sc = arg;
+    const unsigned char *p = sc->bytes;
+    for(const int *c = sc->chunks; *c > 0; c++) {
+        cr_assert_eq(write(sc->fd, p, *c), *c);
+        p += *c;
+        usleep(2000);
+    }
+    shutdown(sc->fd, SHUT_WR);
+    return NULL;
+}
+
+// a header and payload for the wire, returning the total length
+static size_t recv_packet_bytes(unsigned char *buf, int type, uint16_t size, const char *payload) {
+    JEUX_PACKET_HEADER hdr = codec_header(type, 42, FIRST_PLAYER_ROLE, size, 1234, 5678);
+    proto_encode_header(buf, &hdr);
+    memcpy(buf + JEUX_WIRE_HEADER_SIZE, payload, strlen(payload));
+    return JEUX_WIRE_HEADER_SIZE + strlen(payload);
+}
+
+// receive from the script, returning what proto_recv_packet did
+static int recv_scripted(const unsigned char *bytes, const int *chunks,
+                         JEUX_PACKET_HEADER *hdr, void **payloadp) {
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    RECV_SCRIPT sc = { sv[1], bytes, chunks };
+    pthread_t tid;
+    cr_assert_eq(pthread_create(&tid, NULL, recv_writer, &sc), 0);
+    *payloadp = (void *)1;
+    int ret = proto_recv_packet(sv[0], hdr, payloadp);
+    pthread_join(tid, NULL);
+    close(sv[0]);
+    close(sv[1]);
+    return ret;
+}
+
+Test(proto_recv_suite, split_header_and_payload, .timeout = 5) {
+    char text[101];
+    for(int i = 0; i < 100; i++)
+        text[i] = 'a' + i % 26;
+    text[100] = '\0';
+    unsigned char bytes[JEUX_WIRE_HEADER_SIZE + 100];
+    recv_packet_bytes(bytes, JEUX_MOVE_PKT, 100, text);
+    int chunks[] = { 3, 5, 8, 1, 49, 50, 0 };
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+    cr_assert_eq(recv_scripted(bytes, chunks, &hdr, &payload), 0);
+    cr_assert_eq(hdr.type, JEUX_MOVE_PKT);
+    cr_assert_eq(hdr.id, 42);
+    cr_assert_eq(hdr.role, FIRST_PLAYER_ROLE);
+    cr_assert_eq(hdr.size, 100, "size in host order");
+    cr_assert_eq(ntohl(hdr.timestamp_sec), 1234);
+    cr_assert_eq(ntohl(hdr.timestamp_nsec), 5678);
+    cr_assert_not_null(payload);
+    cr_assert_eq(memcmp(payload, text, 100), 0);
+    cr_assert_eq(((char *)payload)[100], '\0');
+    free(payload);
+}
+
+Test(proto_recv_suite, header_only, .timeout = 5) {
+    unsigned char bytes[JEUX_WIRE_HEADER_SIZE];
+    recv_packet_bytes(bytes, JEUX_ACK_PKT, 0, "");
+    int chunks[] = { 15, 1, 0 };
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+    cr_assert_eq(recv_scripted(bytes, chunks, &hdr, &payload), 0);
+    cr_assert_eq(hdr.type, JEUX_ACK_PKT);
+    cr_assert_eq(hdr.size, 0);
+    cr_assert_null(payload);
+}
+
+Test(proto_recv_suite, truncated_payload, .timeout = 5) {
+    // the header promises 100 bytes, and only 40 come before the end
+    unsigned char bytes[JEUX_WIRE_HEADER_SIZE + 40];
+    recv_packet_bytes(bytes, JEUX_MOVE_PKT, 100, "0123456789012345678901234567890123456789");
+    int chunks[] = { 16, 20, 20, 0 };
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+    cr_assert_eq(recv_scripted(bytes, chunks, &hdr, &payload), -1);
+    // and the partial payload is freed, not handed back (or leaked)
+    cr_assert_null(payload);
+}
+
+Test(proto_recv_suite, truncated_header, .timeout = 5) {
+    unsigned char bytes[JEUX_WIRE_HEADER_SIZE];
+    recv_packet_bytes(bytes, JEUX_ACK_PKT, 0, "");
+    int chunks[] = { 4, 6, 0 };
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+    cr_assert_eq(recv_scripted(bytes, chunks, &hdr, &payload), -1);
+    cr_assert_null(payload);
+}
+
+/*
+ * The event loop's output queues.  A spectator that never reads is sent
+ * a move after another, shared with everyone watching the game; once its
+ * socket buffer is full the moves queue up, until there is too much of
+ * them and it is cut off, and the payload it held references to is no
+ * longer held.
+ */
+
+static int evq_listen[2];
+
+static void evq_setup(void) {
+    // as in the server: a write to a connection that's been cut off fails
+    signal(SIGPIPE, SIG_IGN);
+    cr_assert_eq(pipe(evq_listen), 0);
+    client_registry = creg_init();
+    player_registry = preg_init();
+}
+
+static void evq_teardown(void) {
+    ev_loop_fini();
+}
+
+static void evq_spectator_cut_off(int want_uring) {
+    cr_assert_eq(ev_loop_init(evq_listen[0], want_uring), 0);
+    int sv[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    int small = 4096;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+    cr_assert_not_null(ev_loop_adopt(sv[0], NULL, 0, NULL, 0));
+
+    char move[4000];
+    memset(move, 'm', sizeof(move));
+    PROTO_BUF *buf = proto_buf_create(move, sizeof(move));
+    cr_assert_not_null(buf);
+    JEUX_PACKET_HEADER hdr = codec_header(JEUX_MOVED_PKT, 0, 0, sizeof(move), 0, 0);
+    int sent = 0;
+    while(proto_send_shared(sv[0], &hdr, buf) == 0) {
+        sent++;
+        cr_assert_lt(sent, 1000, "still queueing after %d moves", sent);
+        ev_loop_poll();
+    }
+    // more than the socket holds was queued first
+    cr_assert_gt(sent, 64);
+    cr_assert_eq(errno, EPIPE);
+    for(int i = 0; i < 100 && buf->refs > 1; i++)
+        ev_loop_poll();
+    cr_assert_eq(buf->refs, 1, "%d references left", buf->refs);
+    proto_buf_unref(buf);
+
+    // and the session goes as for any broken connection
+    for(int i = 0; i < 100 && ev_loop_session_count() > 0; i++)
+        ev_loop_poll();
+    cr_assert_eq(ev_loop_session_count(), 0);
+    close(sv[1]);
+}
+
+Test(event_loop_suite, spectator_cut_off_epoll, .init = evq_setup, .fini = evq_teardown, .timeout = 10) {
+    evq_spectator_cut_off(0);
+}
+
+Test(event_loop_suite, spectator_cut_off_uring, .init = evq_setup, .fini = evq_teardown, .timeout = 10) {
+    // falls back to epoll where io_uring isn't to be had
+    evq_spectator_cut_off(1);
+}
+
+/*
+ * Invitations left open too long, on the matchmaking fixture.  The loop's
+ * timers go by the clock, so the tests wait out a short time to live and
+ * then let the loop go round.
+ */
+
+#define INV_TEST_TTL_MS 50
+
+static void inv_setup(void) {
+    mq_setup();
+    client_set_invitation_ttl(INV_TEST_TTL_MS);
+}
+
+static void inv_wait_out(void) {
+    usleep((INV_TEST_TTL_MS + 5 * EV_TICK_MS) * 1000);
+    cr_assert_eq(ev_loop_poll(), 0);
+}
+
+// how many packets of a type have been sent to a client (with an id, if not -1)
+static int inv_sent(CLIENT *client, int type, int id) {
+    int n = 0;
+    for(int i = 0; i < mq_npackets; i++)
+        if(mq_packets[i].fd == client_get_fd(client) && mq_packets[i].type == type
+           && (id == -1 || mq_packets[i].id == id))
+            n++;
+    return n;
+}
+
+static long inv_stat(const char *name) {
+    size_t len;
+    char *report = stats_report(&len);
+    cr_assert_not_null(report);
+    long value = -1;
+    for(char *line = report; line != NULL && *line != '\0'; line = strchr(line, '\n')) {
+        if(*line == '\n')
+            line++;
+        size_t n = strlen(name);
+        if(strncmp(line, name, n) == 0 && line[n] == ' ')
+            value = atol(line + n + 1);
+    }
+    free(report);
+    return value;
+}
+
+// the id the target was given, from its INVITED
+static int inv_target_id(CLIENT *target) {
+    for(int i = mq_ninvites - 1; i >= 0; i--)
+        if(mq_invites[i].fd == client_get_fd(target))
+            return mq_invites[i].id;
+    cr_assert_fail("no INVITED for the target");
+    return -1;
+}
+
+Test(invitation_expiry_suite, withdrawn_from_both_sides, .init = inv_setup, .fini = mq_teardown, .timeout = 5) {
+    CLIENT *source = mq_player("source", 1500);
+    CLIENT *target = mq_player("target", 1500);
+    int sid = client_make_invitation(source, target, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE);
+    cr_assert_geq(sid, 0);
+    int tid = inv_target_id(target);
+    cr_assert_eq(inv_stat("invitations"), 1);
+
+    // not before its time
+    cr_assert_eq(ev_loop_poll(), 0);
+    cr_assert_eq(inv_sent(target, JEUX_REVOKED_PKT, -1), 0);
+    cr_assert_eq(inv_sent(source, JEUX_DECLINED_PKT, -1), 0);
+
+    inv_wait_out();
+    cr_assert_eq(inv_sent(target, JEUX_REVOKED_PKT, tid), 1, "target not told");
+    cr_assert_eq(inv_sent(source, JEUX_DECLINED_PKT, sid), 1, "source not told");
+    cr_assert_eq(inv_sent(target, JEUX_DECLINED_PKT, -1), 0);
+    cr_assert_eq(inv_sent(source, JEUX_REVOKED_PKT, -1), 0);
+    cr_assert_eq(inv_stat("invitations_expired"), 1);
+    cr_assert_eq(inv_stat("invitations"), 0);
+
+    // and it's gone from both
+    cr_assert_eq(client_revoke_invitation(source, sid), -1);
+    cr_assert_eq(client_accept_invitation(target, tid, NULL), -1);
+}
+
+Test(invitation_expiry_suite, closing_cancels_expiry, .init = inv_setup, .fini = mq_teardown, .timeout = 5) {
+    CLIENT *a = mq_player("a", 1500);
+    CLIENT *b = mq_player("b", 1500);
+    CLIENT *c = mq_player("c", 1500);
+    CLIENT *d = mq_player("d", 1500);
+
+    // revoked, declined and accepted before the time is up
+    int revoked = client_make_invitation(a, b, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE);
+    cr_assert_geq(revoked, 0);
+    cr_assert_eq(client_revoke_invitation(a, revoked), 0);
+    cr_assert_geq(client_make_invitation(a, c, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE), 0);
+    int declined = inv_target_id(c);
+    cr_assert_eq(client_decline_invitation(c, declined), 0);
+    int accepted = client_make_invitation(b, d, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE);
+    cr_assert_geq(accepted, 0);
+    int did = inv_target_id(d);
+    char *str = NULL;
+    cr_assert_eq(client_accept_invitation(d, did, &str), 0);
+    free(str);
+    int before = mq_npackets;
+
+    inv_wait_out();
+    cr_assert_eq(mq_npackets, before, "%d packets sent once the time was up", mq_npackets - before);
+    cr_assert_eq(inv_stat("invitations_expired"), 0);
+    // the game goes on
+    cr_assert_eq(inv_stat("games"), 1);
+    cr_assert_eq(client_resign_game(d, did), 0);
+}
+
+Test(invitation_expiry_suite, no_limit, .init = inv_setup, .fini = mq_teardown, .timeout = 5) {
+    client_set_invitation_ttl(0);
+    CLIENT *source = mq_player("source", 1500);
+    CLIENT *target = mq_player("target", 1500);
+    int sid = client_make_invitation(source, target, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE);
+    cr_assert_geq(sid, 0);
+    inv_wait_out();
+    cr_assert_eq(inv_stat("invitations_expired"), 0);
+    cr_assert_eq(client_revoke_invitation(source, sid), 0);
+}
+
+/*
+ * Game clocks, run by the loop's timer wheel: the increment, the flag
+ * falling when a side's time is up, and what becomes of the game then.
+ */
+
+static GAME_CLOCK *gc_fallen_clock;
+static GAME_ROLE gc_fallen_role;
+static int gc_falls;
+
+static void gc_flag(GAME_CLOCK *clock, GAME_ROLE role, void *arg) {
+    gc_fallen_clock = clock;
+    gc_fallen_role = role;
+    gc_falls++;
+}
+
+static void gc_setup(void) {
+    mq_setup();
+    gc_fallen_clock = NULL;
+    gc_fallen_role = NULL_ROLE;
+    gc_falls = 0;
+}
+
+// let the loop go round until a flag falls, for up to a second
+static void gc_wait_for_flag(void) {
+    for(int i = 0; i < 200 && gc_falls == 0; i++) {
+        usleep(5000);
+        cr_assert_eq(ev_loop_poll(), 0);
+    }
+}
+
+Test(game_clock_suite, press_adds_increment, .init = gc_setup, .fini = mq_teardown, .timeout = 5) {
+    GAME_CLOCK *clock = gclock_create(1000, 900, 200, gc_flag, NULL);
+    cr_assert_not_null(clock);
+    cr_assert_eq(gclock_running(clock), NULL_ROLE);
+    cr_assert_eq(gclock_press(clock, FIRST_PLAYER_ROLE), -1, "pressed while stopped");
+    cr_assert_eq(gclock_start(clock, FIRST_PLAYER_ROLE), 0);
+    cr_assert_eq(gclock_start(clock, SECOND_PLAYER_ROLE), -1, "started twice");
+
+    // no time goes by between loop passes
+    cr_assert_eq(gclock_press(clock, SECOND_PLAYER_ROLE), -1, "pressed out of turn");
+    cr_assert_eq(gclock_press(clock, FIRST_PLAYER_ROLE), 0);
+    cr_assert_eq(gclock_running(clock), SECOND_PLAYER_ROLE);
+    cr_assert_eq(gclock_remaining(clock, FIRST_PLAYER_ROLE), 1200);
+    cr_assert_eq(gclock_remaining(clock, SECOND_PLAYER_ROLE), 900);
+
+    // and here 50ms or so do
+    usleep(50000);
+    cr_assert_eq(ev_loop_poll(), 0);
+    uint64_t left = gclock_remaining(clock, SECOND_PLAYER_ROLE);
+    cr_assert(left <= 850 && left > 600, "%lu left", (unsigned long)left);
+    cr_assert_eq(gclock_press(clock, SECOND_PLAYER_ROLE), 0);
+    cr_assert_eq(gclock_remaining(clock, SECOND_PLAYER_ROLE), left + 200);
+    cr_assert_eq(gclock_running(clock), FIRST_PLAYER_ROLE);
+
+    // stopping keeps what's left, and the flag never falls
+    gclock_stop(clock);
+    cr_assert_eq(gclock_running(clock), NULL_ROLE);
+    cr_assert_eq(gclock_remaining(clock, FIRST_PLAYER_ROLE), 1200);
+    gclock_free(clock);
+    cr_assert_eq(gc_falls, 0);
+}
+
+Test(game_clock_suite, flag_falls_on_time, .init = gc_setup, .fini = mq_teardown, .timeout = 5) {
+    GAME_CLOCK *clock = gclock_create(500, 40, 0, gc_flag, NULL);
+    cr_assert_not_null(clock);
+    cr_assert_eq(gclock_start(clock, SECOND_PLAYER_ROLE), 0);
+    uint64_t started = ev_loop_now();
+    cr_assert_eq(ev_loop_poll(), 0);
+    cr_assert_eq(gc_falls, 0, "fell at once");
+
+    gc_wait_for_flag();
+    cr_assert_eq(gc_falls, 1);
+    cr_assert_eq(gc_fallen_clock, clock);
+    cr_assert_eq(gc_fallen_role, SECOND_PLAYER_ROLE);
+    cr_assert_geq(ev_loop_now() - started, 40, "fell early");
+    cr_assert_eq(gclock_running(clock), NULL_ROLE);
+    cr_assert_eq(gclock_remaining(clock, SECOND_PLAYER_ROLE), 0);
+    cr_assert_eq(gclock_remaining(clock, FIRST_PLAYER_ROLE), 500);
+    cr_assert_eq(gclock_press(clock, SECOND_PLAYER_ROLE), -1, "pressed after the flag fell");
+    gclock_free(clock);
+}
+
+Test(game_clock_suite, timed_game_lost_on_time, .init = gc_setup, .fini = mq_teardown, .timeout = 5) {
+    client_set_time_control(100, 0);
+    CLIENT *a = mq_player("a", 1500);
+    CLIENT *b = mq_player("b", 1500);
+    int aid = client_make_invitation(a, b, FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE);
+    cr_assert_geq(aid, 0);
+    int bid = inv_target_id(b);
+    char *str = NULL;
+    cr_assert_eq(client_accept_invitation(b, bid, &str), 0);
+    free(str);
+
+    // the first player's clock runs from the start, and it's theirs to press
+    cr_assert_eq(client_make_move(b, bid, "1"), -1, "moved out of turn");
+    cr_assert_eq(client_make_move(a, aid, "5"), 0);
+    // b lets their time run out
+    for(int i = 0; i < 300 && inv_sent(b, JEUX_ENDED_PKT, bid) == 0; i++) {
+        usleep(5000);
+        cr_assert_eq(ev_loop_poll(), 0);
+    }
+    cr_assert_eq(inv_sent(a, JEUX_ENDED_PKT, aid), 1);
+    cr_assert_eq(inv_sent(b, JEUX_ENDED_PKT, bid), 1);
+    for(int i = 0; i < mq_npackets; i++)
+        if(mq_packets[i].type == JEUX_ENDED_PKT)
+            cr_assert_eq(mq_packets[i].role, FIRST_PLAYER_ROLE, "won by %d", mq_packets[i].role);
+    cr_assert_gt(player_get_rating(client_get_player(a)), 1500);
+    cr_assert_eq(inv_stat("games"), 0);
+
+    // and there's no moving after that
+    cr_assert_eq(client_make_move(b, bid, "1"), -1);
+    cr_assert_eq(client_make_move(a, aid, "9"), -1);
+}
@@ -0,0 +1,412 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "protocol.h"
+#include "proto_codec.h"
+#include "game.h"
+#include "histogram.h"
+
+/*
+ * Closed-loop load generator for a Jeux server.
+ *
+ * Usage: jeux_bench -p <port> [-h <host>] [-c <clients>] [-t <threads>]
+ *                   [-d <seconds>] [-n <name_prefix>]
+ *
+ * Simulates clients (200 by default) in pairs, spread over threads (4 by
+ * default), each thread driving its clients from an epoll loop of its
+ * own.  Each client logs in as <name_prefix><number> and asks for USERS;
+ * then the first of each pair INVITEs the second, who ACCEPTs, and the two
+ * play a full game (always the same one, a draw), after which the next
+ * game starts, and so on until the time is up (10s by default).
+ *
+ * The load is closed-loop: a client sends a request only once the last
+ * one it sent has been answered, so the load a server gets is as much as
+ * it can take.  Each request is timed from sending it to getting its ACK
+ * or NACK, and each MOVE also to the opponent getting the MOVED.  At the
+ * end, the number of games and moves per second is reported, and for
+ * each request type the count, the rate and the p50/p99/p999/max
+ * latency, in microseconds.
+ *
+ * Each simulated client makes requests far faster than any person would,
+ * so the server being measured should be started with its rate limits
+ * lifted (jeux -r 0).
+ */
+
+#define BENCH_TYPES     32
+#define BENCH_MOVED     BENCH_TYPES        // histogram slot for MOVE to MOVED
+#define BENCH_BUF       8192
+#define BENCH_MAX_EVENTS 256
+
+// X and O take turns at these cells, and neither wins
+static const char game_moves[] = "123546879";
+#define BENCH_GAME_MOVES ((int)sizeof(game_moves) - 1)
+
+static const char *type_names[BENCH_TYPES + 1] = {
+    [JEUX_LOGIN_PKT] = "LOGIN",
+    [JEUX_USERS_PKT] = "USERS",
+    [JEUX_INVITE_PKT] = "INVITE",
+    [JEUX_ACCEPT_PKT] = "ACCEPT",
+    [JEUX_MOVE_PKT] = "MOVE",
+    [BENCH_MOVED] = "MOVE>MOVED"
+};
+
+typedef struct bench_pair BENCH_PAIR;
+
+typedef struct bench_client {
+    int fd;
+    int number;
+    char name[64];
+    BENCH_PAIR *pair;
+    int pending;                 // type of the request awaiting an answer, or 0
+    uint64_t sent_ns;            // when it was sent
+    int ready;                   // logged in and has had USERS
+    int game;                    // its ID for the current game
+    char in[BENCH_BUF];
+    size_t in_len;
+} BENCH_CLIENT;
+
+struct bench_pair {
+    BENCH_CLIENT *a, *b;         // a invites, and plays first
+    int playing;                 // a game is on, from the INVITE to the ENDEDs
+    int moves;                   // made in the current game
+    int ended;                   // ENDEDs received for it
+    uint64_t moved_ns;           // when the last MOVE was sent
+};
+
+typedef struct bench_thread {
+    pthread_t tid;
+    BENCH_PAIR *pairs;
+    int npairs;
+    HISTOGRAM *hists;            // BENCH_TYPES + 1 of them
+    long games, moves, nacks, errors;
+} BENCH_THREAD;
+
+static struct addrinfo *server;
+static const char *prefix = "bench";
+static uint64_t deadline_ns;
+static volatile int stopping;
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int send_request(BENCH_THREAD *t, BENCH_CLIENT *c, int type, int id, int role,
+                        const char *payload){
+    unsigned char buf[JEUX_WIRE_HEADER_SIZE + 128];
+    JEUX_PACKET_HEADER hdr;
+    size_t len = payload != NULL ? strlen(payload) : 0;
+    //stamped on the wall clock, for the server's delay estimates
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr.type = type;
+    hdr.id = id;
+    hdr.role = role;
+    hdr.size = htons(len);
+    hdr.timestamp_sec = htonl(ts.tv_sec);
+    hdr.timestamp_nsec = htonl(ts.tv_nsec);
+    proto_encode_header(buf, &hdr);
+    memcpy(buf + JEUX_WIRE_HEADER_SIZE, payload, len);
+    c->pending = type;
+    c->sent_ns = now_ns();
+    //requests are tiny and there is only ever one outstanding, so the
+    //socket buffer always has room
+    len += JEUX_WIRE_HEADER_SIZE;
+    if(send(c->fd, buf, len, MSG_NOSIGNAL) != (ssize_t)len){
+        t->errors++;
+        return -1;
+    }
+    return 0;
+}
+
+static void move(BENCH_THREAD *t, BENCH_CLIENT *c){
+    BENCH_PAIR *p = c->pair;
+    char cell[2] = { game_moves[p->moves], '\0' };
+    p->moves++;
+    send_request(t, c, JEUX_MOVE_PKT, c->game, 0, cell);
+    p->moved_ns = c->sent_ns;
+}
+
+// the first player invites the second once both are free
+static void next_game(BENCH_THREAD *t, BENCH_PAIR *p){
+    if(stopping || p->playing || !p->a->ready || !p->b->ready || p->a->pending || p->b->pending)
+        return;
+    p->playing = 1;
+    p->moves = p->ended = 0;
+    send_request(t, p->a, JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, p->b->name);
+}
+
+static void answered(BENCH_THREAD *t, BENCH_CLIENT *c, JEUX_PACKET_HEADER *hdr){
+    int type = c->pending;
+    c->pending = 0;
+    if(type > 0 && type < BENCH_TYPES)
+        hist_record(&t->hists[type], now_ns() - c->sent_ns);
+    if(hdr->type == JEUX_NACK_PKT){
+        t->nacks++;
+        return;
+    }
+    switch(type){
+        case JEUX_LOGIN_PKT:
+            send_request(t, c, JEUX_USERS_PKT, 0, 0, NULL);
+            return;
+        case JEUX_USERS_PKT:
+            c->ready = 1;
+            break;
+        case JEUX_INVITE_PKT:
+            c->game = hdr->id;
+            return;
+    }
+    next_game(t, c->pair);
+}
+
+static void received(BENCH_THREAD *t, BENCH_CLIENT *c, JEUX_PACKET_HEADER *hdr){
+    BENCH_PAIR *p = c->pair;
+    switch(hdr->type){
+        case JEUX_ACK_PKT:
+        case JEUX_NACK_PKT:
+            answered(t, c, hdr);
+            break;
+        case JEUX_INVITED_PKT:
+            c->game = hdr->id;
+            send_request(t, c, JEUX_ACCEPT_PKT, hdr->id, 0, NULL);
+            break;
+        case JEUX_ACCEPTED_PKT:
+            move(t, c);
+            break;
+        case JEUX_MOVED_PKT:
+            hist_record(&t->hists[BENCH_MOVED], now_ns() - p->moved_ns);
+            t->moves++;
+            if(p->moves < BENCH_GAME_MOVES)
+                move(t, c);
+            break;
+        case JEUX_ENDED_PKT:
+            if(++p->ended == 2){
+                p->playing = 0;
+                t->games++;
+                next_game(t, p);
+            }
+            break;
+    }
+}
+
+static int readable(BENCH_THREAD *t, BENCH_CLIENT *c){
+    ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, MSG_DONTWAIT);
+    if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        return -1;
+    if(n < 0)
+        return 0;
+    c->in_len += n;
+    size_t off = 0;
+    while(c->in_len - off >= JEUX_WIRE_HEADER_SIZE){
+        JEUX_PACKET_HEADER hdr;
+        proto_decode_header(&hdr, (unsigned char *)c->in + off);
+        size_t len = JEUX_WIRE_HEADER_SIZE + ntohs(hdr.size);
+        if(len > sizeof(c->in))
+            return -1;
+        if(c->in_len - off < len)
+            break;
+        received(t, c, &hdr);
+        off += len;
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    return 0;
+}
+
+static int connect_client(BENCH_CLIENT *c){
+    c->fd = socket(server->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(c->fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(connect(c->fd, server->ai_addr, server->ai_addrlen) == -1){
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void *run_thread(void *arg){
+    BENCH_THREAD *t = arg;
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if(ep < 0){
+        t->errors++;
+        return NULL;
+    }
+    for(int i = 0; i < t->npairs; i++){
+        BENCH_CLIENT *cs[2] = { t->pairs[i].a, t->pairs[i].b };
+        for(int j = 0; j < 2; j++){
+            BENCH_CLIENT *c = cs[j];
+            struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+            if(connect_client(c) == -1 || epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev) == -1){
+                t->errors++;
+                continue;
+            }
+            send_request(t, c, JEUX_LOGIN_PKT, 0, 0, c->name);
+        }
+    }
+    struct epoll_event events[BENCH_MAX_EVENTS];
+    while(!stopping){
+        int n = epoll_wait(ep, events, BENCH_MAX_EVENTS, 100);
+        if(now_ns() >= deadline_ns)
+            stopping = 1;
+        for(int i = 0; i < n && !stopping; i++){
+            BENCH_CLIENT *c = events[i].data.ptr;
+            if(readable(t, c) == -1){
+                t->errors++;
+                epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+                close(c->fd);
+                c->fd = -1;
+            }
+        }
+    }
+    for(int i = 0; i < t->npairs; i++){
+        if(t->pairs[i].a->fd >= 0)
+            close(t->pairs[i].a->fd);
+        if(t->pairs[i].b->fd >= 0)
+            close(t->pairs[i].b->fd);
+    }
+    close(ep);
+    return NULL;
+}
+
+static void report(BENCH_THREAD *threads, int nthreads, int nclients, double secs,
+                   const char *host, const char *port){
+    HISTOGRAM *merged = calloc(BENCH_TYPES + 1, sizeof(HISTOGRAM));
+    long games = 0, moves = 0, nacks = 0, errors = 0;
+    for(int i = 0; i < nthreads; i++){
+        for(int h = 0; h <= BENCH_TYPES && merged != NULL; h++)
+            hist_merge(&merged[h], &threads[i].hists[h]);
+        games += threads[i].games;
+        moves += threads[i].moves;
+        nacks += threads[i].nacks;
+        errors += threads[i].errors;
+    }
+    printf("jeux_bench: %d clients on %d threads, %.1fs against %s:%s\n",
+           nclients, nthreads, secs, host, port);
+    printf("games %ld (%.1f/s), moves %ld (%.1f/s), NACKs %ld, errors %ld\n",
+           games, games / secs, moves, moves / secs, nacks, errors);
+    if(merged == NULL)
+        return;
+    printf("%-12s %10s %10s %10s %10s %10s %10s\n",
+           "type", "count", "per sec", "p50 us", "p99 us", "p999 us", "max us");
+    for(int h = 0; h <= BENCH_TYPES; h++){
+        long n = hist_count(&merged[h]);
+        if(n == 0)
+            continue;
+        printf("%-12s %10ld %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               type_names[h] != NULL ? type_names[h] : "?", n, n / secs,
+               hist_percentile(&merged[h], 0.50) / 1e3, hist_percentile(&merged[h], 0.99) / 1e3,
+               hist_percentile(&merged[h], 0.999) / 1e3, hist_max(&merged[h]) / 1e3);
+    }
+    free(merged);
+}
+
+int main(int argc, char *argv[]){
+    const char *host = "localhost", *port = NULL;
+    int nclients = 200, nthreads = 4, opt;
+    double secs = 10;
+    while((opt = getopt(argc, argv, "p:h:c:t:d:n:")) != -1){
+        switch(opt){
+            case 'p':
+                port = optarg;
+                break;
+            case 'h':
+                host = optarg;
+                break;
+            case 'c':
+                nclients = atoi(optarg);
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'd':
+                secs = atof(optarg);
+                break;
+            case 'n':
+                prefix = optarg;
+                break;
+            default:
+                port = NULL;
+                optind = argc;
+                break;
+        }
+    }
+    int npairs = nclients / 2;
+    if(port == NULL || npairs < 1 || nthreads < 1 || secs <= 0){
+        fprintf(stderr, "Usage: %s -p <port> [-h <host>] [-c <clients>] [-t <threads>] "
+                "[-d <seconds>] [-n <name_prefix>]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if(nthreads > npairs)
+        nthreads = npairs;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, port, &hints, &server);
+    if(err != 0){
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    BENCH_PAIR *pairs = calloc(npairs, sizeof(BENCH_PAIR));
+    BENCH_CLIENT *clients = calloc(2 * npairs, sizeof(BENCH_CLIENT));
+    BENCH_THREAD *threads = calloc(nthreads, sizeof(BENCH_THREAD));
+    if(pairs == NULL || clients == NULL || threads == NULL){
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for(int i = 0; i < npairs; i++){
+        BENCH_PAIR *p = &pairs[i];
+        p->a = &clients[2 * i];
+        p->b = &clients[2 * i + 1];
+        for(int j = 0; j < 2; j++){
+            BENCH_CLIENT *c = &clients[2 * i + j];
+            c->fd = -1;
+            c->number = 2 * i + j;
+            c->pair = p;
+            snprintf(c->name, sizeof(c->name), "%s%d", prefix, c->number);
+        }
+    }
+
+    //pairs are dealt out evenly, partners always on the same thread
+    deadline_ns = now_ns() + (uint64_t)(secs * 1e9);
+    int next = 0;
+    for(int i = 0; i < nthreads; i++){
+        BENCH_THREAD *t = &threads[i];
+        t->pairs = &pairs[next];
+        t->npairs = npairs / nthreads + (i < npairs % nthreads);
+        next += t->npairs;
+        t->hists = calloc(BENCH_TYPES + 1, sizeof(HISTOGRAM));
+        if(t->hists == NULL || pthread_create(&t->tid, NULL, run_thread, t) != 0){
+            fprintf(stderr, "Unable to start thread %d\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    for(int i = 0; i < nthreads; i++)
+        pthread_join(threads[i].tid, NULL);
+
+    report(threads, nthreads, 2 * npairs, secs, host, port);
+    for(int i = 0; i < nthreads; i++)
+        free(threads[i].hists);
+    free(threads);
+    free(clients);
+    free(pairs);
+    freeaddrinfo(server);
+    return EXIT_SUCCESS;
+}
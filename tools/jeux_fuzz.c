@@ -0,0 +1,428 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include "protocol_ext.h"
+#include "proto_io.h"
+#include "proto_codec.h"
+#include "session.h"
+#include "event_loop.h"
+#include "client_ext.h"
+#include "rate_limit.h"
+#include "match_queue.h"
+#include "tournament.h"
+#include "jeux_globals.h"
+
+/*
+ * Fuzzing harness for the packet decoder and request dispatch.
+ *
+ * Usage: jeux_fuzz [-s] [-g <corpus_dir>] [<input_file> ...]
+ *
+ * Each input is run against a server with no network: its clients are
+ * SESSIONs fed from memory, exactly as the io_uring backend feeds them
+ * what it has received, and everything the server sends them is checked
+ * and thrown away instead of being written anywhere.  The bytes are also
+ * run through proto_recv_packet(), the decoder of the thread-per-connection
+ * service, by way of a pipe.
+ *
+ * An input is a byte of settings, then any number of records, each:
+ *   <op> <len> <len bytes>
+ * The low bits of op pick one of FUZZ_CLIENTS clients, which is connected
+ * if it is not already, and the bytes are what it sends (a packet may
+ * take several records); with FUZZ_CLOSE set in op, the client
+ * disconnects afterwards.  The settings say whether games are timed
+ * (FUZZ_TIMED) and whether the rate limits are on (FUZZ_LIMITED).
+ *
+ * With no arguments the input is read from stdin, and with files each is
+ * run in turn, which is what AFL wants (afl-fuzz ... -- jeux_fuzz @@).
+ * Built with JEUX_LIBFUZZER defined (make libfuzzer) there is no main(),
+ * and this is a libFuzzer target.  -g writes the seed corpus, a session
+ * for each kind of request done properly, to a directory; -s runs the
+ * seeds, as a quick check that nothing valid goes wrong.
+ */
+
+#define FUZZ_CLIENTS 4
+#define FUZZ_CLOSE   0x80
+#define FUZZ_TIMED   0x01
+#define FUZZ_LIMITED 0x02
+#define FUZZ_MAX_DECODE 65536        // what a pipe holds without a reader
+
+static SESSION *sessions[FUZZ_CLIENTS];
+static int listen_pipe[2] = { -1, -1 };
+
+/*
+ * The transport: every packet the server sends must be one a client
+ * could decode, with the size in its header matching its payload.
+ */
+static void check_sent(const void *hdr, size_t hdrlen, size_t datalen){
+    JEUX_PACKET_HEADER h;
+    if(hdrlen != JEUX_WIRE_HEADER_SIZE)
+        abort();
+    proto_decode_header(&h, hdr);
+    if(ntohs(h.size) != datalen)
+        abort();
+}
+
+static int fuzz_sender(int fd, const void *hdr, size_t hdrlen, const void *data, size_t datalen){
+    check_sent(hdr, hdrlen, datalen);
+    return 0;
+}
+
+static int fuzz_shared_sender(int fd, const void *hdr, size_t hdrlen, PROTO_BUF *buf){
+    check_sent(hdr, hdrlen, buf->len);
+    return 0;
+}
+
+static SESSION *connect_client(void){
+    int fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if(fd == -1)
+        return NULL;
+    SESSION *s = session_create(fd);
+    if(s == NULL){
+        close(fd);
+        return NULL;
+    }
+    s->buffered = 1;
+    return s;
+}
+
+static void disconnect_client(int slot){
+    SESSION *s = sessions[slot];
+    if(s == NULL)
+        return;
+    session_feed(s, NULL, 0);
+    while(session_run(s) != CO_DONE)
+        ;
+    session_fini(s);
+    sessions[slot] = NULL;
+}
+
+static void feed(int slot, const uint8_t *data, size_t len){
+    if(sessions[slot] == NULL && (sessions[slot] = connect_client()) == NULL)
+        return;
+    SESSION *s = sessions[slot];
+    if(session_feed(s, data, len) == -1){
+        disconnect_client(slot);
+        return;
+    }
+    do {
+        if(session_run(s) == CO_DONE){
+            //cut off, or out of memory
+            session_fini(s);
+            sessions[slot] = NULL;
+            break;
+        }
+    } while(session_has_input(s));
+    ev_loop_poll();
+}
+
+/*
+ * Run bytes through proto_recv_packet() until it fails, as it must once
+ * they run out.
+ */
+static void decode(const uint8_t *data, size_t len){
+    int p[2];
+    if(len > FUZZ_MAX_DECODE)
+        len = FUZZ_MAX_DECODE;
+    if(pipe(p) == -1)
+        return;
+    if(write(p[1], data, len) != (ssize_t)len){
+        close(p[0]);
+        close(p[1]);
+        return;
+    }
+    close(p[1]);
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+    while(proto_recv_packet(p[0], &hdr, &payload) == 0){
+        if(hdr.size > 0 && (payload == NULL || ((char *)payload)[hdr.size] != '\0'))
+            abort();
+        free(payload);
+    }
+    close(p[0]);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+    if(size == 0)
+        return 0;
+    if(listen_pipe[0] == -1 && pipe(listen_pipe) == -1)
+        abort();
+    decode(data + 1, size - 1);
+
+    //a pipe stands in for the listening socket: nothing ever connects
+    if(ev_loop_init(listen_pipe[0], 0) == -1)
+        abort();
+    proto_set_sender(fuzz_sender);
+    proto_set_shared_sender(fuzz_shared_sender);
+    client_set_time_control(data[0] & FUZZ_TIMED ? 60000 : 0, data[0] & FUZZ_TIMED ? 1000 : 0);
+    rl_set_scale(data[0] & FUZZ_LIMITED ? 1 : 0);
+    client_registry = creg_init();
+    player_registry = preg_init();
+    match_queue = mq_init();
+    tournaments = treg_init();
+
+    size_t off = 1;
+    while(off + 2 <= size){
+        int op = data[off];
+        size_t len = data[off + 1];
+        off += 2;
+        if(len > size - off)
+            len = size - off;
+        int slot = (op & ~FUZZ_CLOSE) % FUZZ_CLIENTS;
+        if(len > 0)
+            feed(slot, data + off, len);
+        if(op & FUZZ_CLOSE)
+            disconnect_client(slot);
+        off += len;
+    }
+
+    //everyone leaves, and the server is taken down as at shutdown
+    for(int i = 0; i < FUZZ_CLIENTS; i++)
+        disconnect_client(i);
+    ev_loop_poll();
+    ev_loop_fini();
+    mq_fini(match_queue);
+    treg_fini(tournaments);
+    creg_fini(client_registry);
+    preg_fini(player_registry);
+    match_queue = NULL;
+    tournaments = NULL;
+    return 0;
+}
+
+#ifndef JEUX_LIBFUZZER
+
+/*
+ * The seeds: sessions that do everything properly, for the fuzzer to
+ * start from.  A step with type 0 disconnects its client.
+ */
+typedef struct step {
+    int client;
+    int type;
+    int id;
+    int role;
+    const char *payload;
+} STEP;
+
+typedef struct seed {
+    const char *name;
+    int settings;
+    const STEP *steps;
+} SEED;
+
+#define LOGIN(c, name) { c, JEUX_LOGIN_PKT, 0, 0, name }
+#define END { -1, 0, 0, 0, NULL }
+
+// alice invites bob to play second; both know the invitation as 0
+#define INVITE_BOB LOGIN(0, "alice"), LOGIN(1, "bob"), { 0, JEUX_INVITE_PKT, 0, 2, "bob" }
+#define PLAY_BOB INVITE_BOB, { 1, JEUX_ACCEPT_PKT, 0, 0, NULL }
+
+// X and O take turns at these cells, and neither wins
+#define DRAW { 0, JEUX_MOVE_PKT, 0, 0, "1" }, { 1, JEUX_MOVE_PKT, 0, 0, "2" }, \
+             { 0, JEUX_MOVE_PKT, 0, 0, "3" }, { 1, JEUX_MOVE_PKT, 0, 0, "5" }, \
+             { 0, JEUX_MOVE_PKT, 0, 0, "4" }, { 1, JEUX_MOVE_PKT, 0, 0, "6" }, \
+             { 0, JEUX_MOVE_PKT, 0, 0, "8" }, { 1, JEUX_MOVE_PKT, 0, 0, "7" }, \
+             { 0, JEUX_MOVE_PKT, 0, 0, "9" }
+
+static const STEP seed_users[] = {
+    LOGIN(0, "alice"), LOGIN(1, "bob"), { 0, JEUX_USERS_PKT }, { 1, JEUX_STATS_PKT }, END
+};
+static const STEP seed_decline[] = { INVITE_BOB, { 1, JEUX_DECLINE_PKT, 0 }, END };
+static const STEP seed_revoke[] = { INVITE_BOB, { 0, JEUX_REVOKE_PKT, 0 }, END };
+static const STEP seed_game[] = { PLAY_BOB, DRAW, { 0, JEUX_USERS_PKT }, END };
+static const STEP seed_resign[] = {
+    PLAY_BOB, { 0, JEUX_MOVE_PKT, 0, 0, "5" }, { 1, JEUX_RESIGN_PKT, 0 }, END
+};
+static const STEP seed_walk_out[] = { PLAY_BOB, { 0, JEUX_MOVE_PKT, 0, 0, "5" }, { 1, 0 }, END };
+static const STEP seed_match[] = {
+    LOGIN(0, "alice"), LOGIN(1, "bob"), LOGIN(2, "carol"),
+    { 2, JEUX_MATCH_PKT }, { 2, JEUX_UNMATCH_PKT },
+    { 0, JEUX_MATCH_PKT }, { 1, JEUX_MATCH_PKT }, DRAW, END
+};
+static const STEP seed_watch[] = {
+    PLAY_BOB, LOGIN(2, "carol"), { 2, JEUX_WATCH_PKT, 0, 0, "alice" },
+    { 0, JEUX_MOVE_PKT, 0, 0, "5" }, { 2, JEUX_UNWATCH_PKT, 0 },
+    { 2, JEUX_WATCH_PKT, 0, 0, "bob" }, { 1, JEUX_RESIGN_PKT, 0 }, END
+};
+static const STEP seed_tourney[] = {
+    LOGIN(0, "alice"), LOGIN(1, "bob"), LOGIN(2, "carol"),
+    { 2, JEUX_TOURNEY_PKT, 0, 0, "roundrobin" },
+    { 0, JEUX_ENTER_PKT, 0 }, { 1, JEUX_ENTER_PKT, 0 }, { 2, JEUX_START_PKT, 0 },
+    DRAW, { 2, JEUX_STANDINGS_PKT, 0 }, END
+};
+
+static const SEED seeds[] = {
+    { "users", 0, seed_users },
+    { "decline", 0, seed_decline },
+    { "revoke", 0, seed_revoke },
+    { "game", 0, seed_game },
+    { "game_timed", FUZZ_TIMED, seed_game },
+    { "resign", 0, seed_resign },
+    { "walk_out", 0, seed_walk_out },
+    { "match", 0, seed_match },
+    { "watch", 0, seed_watch },
+    { "tourney", 0, seed_tourney },
+    { "users_limited", FUZZ_LIMITED, seed_users }
+};
+#define NSEEDS ((int)(sizeof(seeds) / sizeof(seeds[0])))
+
+/*
+ * Append what a client sends as records, as many as it takes: a record
+ * holds at most UINT8_MAX bytes, and the server reads the records for a
+ * client as one stream.
+ *
+ * @return the new length of the input.
+ */
+static size_t put_records(uint8_t *buf, size_t len, int client, const void *bytes, size_t n){
+    const uint8_t *p = bytes;
+    while(n > 0){
+        size_t chunk = n < UINT8_MAX ? n : UINT8_MAX;
+        buf[len++] = client;
+        buf[len++] = chunk;
+        memcpy(buf + len, p, chunk);
+        len += chunk;
+        p += chunk;
+        n -= chunk;
+    }
+    return len;
+}
+
+/*
+ * Turn a seed into an input, a header record per request, with the
+ * payload (if any) in records of its own.
+ *
+ * @return a malloc'ed input, with its length stored in *lenp.
+ */
+static uint8_t *build_seed(const SEED *seed, size_t *lenp){
+    size_t cap = 1, len = 0;
+    for(const STEP *st = seed->steps; st->client >= 0; st++){
+        size_t plen = st->payload != NULL ? strlen(st->payload) : 0;
+        cap += 2 + JEUX_WIRE_HEADER_SIZE + plen + 2 * ((plen + UINT8_MAX - 1) / UINT8_MAX);
+    }
+    uint8_t *buf = malloc(cap);
+    if(buf == NULL)
+        return NULL;
+    buf[len++] = seed->settings;
+    for(const STEP *st = seed->steps; st->client >= 0; st++){
+        if(st->type == 0){
+            buf[len++] = st->client | FUZZ_CLOSE;
+            buf[len++] = 0;
+            continue;
+        }
+        size_t plen = st->payload != NULL ? strlen(st->payload) : 0;
+        JEUX_PACKET_HEADER hdr;
+        unsigned char wire[JEUX_WIRE_HEADER_SIZE];
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.type = st->type;
+        hdr.id = st->id;
+        hdr.role = st->role;
+        hdr.size = htons(plen);
+        proto_encode_header(wire, &hdr);
+        len = put_records(buf, len, st->client, wire, sizeof(wire));
+        len = put_records(buf, len, st->client, st->payload, plen);
+    }
+    *lenp = len;
+    return buf;
+}
+
+static int write_seeds(const char *dir){
+    for(int i = 0; i < NSEEDS; i++){
+        size_t len;
+        uint8_t *buf = build_seed(&seeds[i], &len);
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, seeds[i].name);
+        FILE *f = fopen(path, "w");
+        if(buf == NULL || f == NULL || fwrite(buf, 1, len, f) != len){
+            perror(path);
+            free(buf);
+            if(f != NULL)
+                fclose(f);
+            return -1;
+        }
+        fclose(f);
+        free(buf);
+    }
+    return 0;
+}
+
+static void run_seeds(void){
+    for(int i = 0; i < NSEEDS; i++){
+        size_t len;
+        uint8_t *buf = build_seed(&seeds[i], &len);
+        if(buf == NULL)
+            continue;
+        LLVMFuzzerTestOneInput(buf, len);
+        free(buf);
+        fprintf(stderr, "seed %s ok\n", seeds[i].name);
+    }
+}
+
+// a whole file (or stdin), which is up to the fuzzer how big to make
+static uint8_t *read_input(FILE *f, size_t *lenp){
+    size_t cap = 4096, len = 0;
+    uint8_t *buf = malloc(cap);
+    size_t n;
+    while(buf != NULL && (n = fread(buf + len, 1, cap - len, f)) > 0){
+        len += n;
+        if(len == cap){
+            uint8_t *grown = realloc(buf, cap *= 2);
+            if(grown == NULL)
+                free(buf);
+            buf = grown;
+        }
+    }
+    *lenp = len;
+    return buf;
+}
+
+static void run_file(FILE *f){
+    size_t len;
+    uint8_t *buf = read_input(f, &len);
+    if(buf != NULL)
+        LLVMFuzzerTestOneInput(buf, len);
+    free(buf);
+}
+
+int main(int argc, char *argv[]){
+    int opt, seeds_run = 0;
+    char *corpus = NULL;
+    while((opt = getopt(argc, argv, "sg:")) != -1){
+        switch(opt){
+            case 's':
+                seeds_run = 1;
+                break;
+            case 'g':
+                corpus = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s] [-g <corpus_dir>] [<input_file> ...]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if(corpus != NULL || seeds_run){
+        if(corpus != NULL && write_seeds(corpus) == -1)
+            exit(EXIT_FAILURE);
+        if(seeds_run)
+            run_seeds();
+        exit(EXIT_SUCCESS);
+    }
+    if(optind == argc)
+        run_file(stdin);
+    for(int i = optind; i < argc; i++){
+        FILE *f = fopen(argv[i], "r");
+        if(f == NULL){
+            perror(argv[i]);
+            continue;
+        }
+        run_file(f);
+        fclose(f);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+#endif
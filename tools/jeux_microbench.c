@@ -0,0 +1,404 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+#include "proto_codec.h"
+#include "client_registry.h"
+#include "client.h"
+#include "player.h"
+#include "player_registry.h"
+#include "invitation.h"
+#include "game.h"
+#include "jeux_globals.h"
+#include "trace.h"
+
+/*
+ * Microbenchmarks for the server's hot paths.
+ *
+ * Usage: jeux_microbench [-t <threads>,...] [-n <population>,...]
+ *                        [-i <iterations>] [-c <case>,...]
+ *
+ * Each case (all of them by default) is run for every combination of
+ * thread count (1,2,4 by default) and population size (16,1024 by
+ * default): the population is set up, and then each thread does the
+ * case's operation the given number of times (200000 by default), all
+ * threads starting together.  What the population is depends on the case:
+ *   creg_register     CLIENTs already registered while each thread
+ *                     registers and unregisters one of its own
+ *   creg_lookup       logged-in CLIENTs, looked up by name at random
+ *   preg_register     PLAYERs already registered, registered again by name
+ *                     at random (which looks them up)
+ *   client_ref, player_ref, inv_ref
+ *                     objects shared by the threads, each taken at random
+ *                     and ref'd and unref'd; fewer objects, more contention
+ *   proto_packet      (none) a header-only packet sent with
+ *                     proto_send_packet() and received with
+ *                     proto_recv_packet() over a socketpair per thread
+ *   game_move         (none) game_parse_move() and game_apply_move() on
+ *                     a game played through to a draw, a new game being
+ *                     created every 9 moves
+ *   trace             (none) one event recorded in the thread's trace ring
+ *   header_codec      (none) MB_CODEC_BATCH headers encoded into one
+ *                     buffer with proto_encode_headers() and decoded
+ *                     again; the time is per batch
+ *
+ * Results go to stdout, one JSON object per line: the case, the number of
+ * threads, the population (0 where there is none), the total number of
+ * operations, the elapsed time, the operations per second over all
+ * threads, and the nanoseconds per operation as seen by one thread.
+ */
+
+#define MB_MAX_THREADS 256
+#define MB_MAX_LIST    16
+#define MB_CODEC_BATCH 64
+
+// X and O take turns at these cells, and neither wins
+static char *draw_moves[] = { "1", "2", "3", "5", "4", "6", "8", "7", "9" };
+
+typedef struct mb_thread {
+    pthread_t tid;
+    int index;
+    uint64_t rng;
+    uint64_t start_ns, end_ns;
+    int sock[2];                 // for proto_packet
+    GAME *game;                  // for game_move
+    int moves;
+} MB_THREAD;
+
+typedef struct mb_case {
+    const char *name;
+    int populated;
+    void (*setup)(int population, int nthreads);
+    void (*op)(MB_THREAD *t);
+    void (*teardown)(void);
+} MB_CASE;
+
+static int population;
+static long iterations = 200000;
+static CLIENT **clients;
+static int nclients;
+static PLAYER **players;
+static INVITATION **invitations;
+static char (*names)[16];
+static MB_THREAD threads[MB_MAX_THREADS];
+static pthread_barrier_t start_barrier;
+static const MB_CASE *current;
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift, so that picking a victim costs next to nothing
+static int pick(MB_THREAD *t){
+    t->rng ^= t->rng << 13;
+    t->rng ^= t->rng >> 7;
+    t->rng ^= t->rng << 17;
+    return t->rng % population;
+}
+
+/*
+ * Populations
+ */
+
+static void make_names(int n){
+    names = calloc(n, sizeof(*names));
+    for(int i = 0; i < n; i++)
+        snprintf(names[i], sizeof(names[i]), "mb%d", i);
+}
+
+static void make_clients(int n, int nthreads){
+    make_names(n);
+    nclients = n;
+    clients = calloc(n, sizeof(CLIENT *));
+    for(int i = 0; i < n; i++){
+        clients[i] = creg_register(client_registry, -1);
+        PLAYER *player = preg_register(player_registry, names[i]);
+        client_login(clients[i], player);
+        player_unref(player, "microbench login");
+    }
+}
+
+static void free_clients(void){
+    for(int i = 0; i < nclients; i++){
+        client_logout(clients[i]);
+        creg_unregister(client_registry, clients[i]);
+    }
+    free(clients);
+    free(names);
+    clients = NULL;
+    names = NULL;
+}
+
+static void make_players(int n, int nthreads){
+    make_names(n);
+    players = calloc(n, sizeof(PLAYER *));
+    for(int i = 0; i < n; i++)
+        players[i] = preg_register(player_registry, names[i]);
+}
+
+static void free_players(void){
+    for(int i = 0; i < population; i++)
+        player_unref(players[i], "microbench done");
+    free(players);
+    free(names);
+    players = NULL;
+    names = NULL;
+}
+
+static void make_invitations(int n, int nthreads){
+    //each from one client to the next
+    make_clients(n + 1, nthreads);
+    invitations = calloc(n, sizeof(INVITATION *));
+    for(int i = 0; i < n; i++)
+        invitations[i] = inv_create(clients[i], clients[i + 1],
+                                    FIRST_PLAYER_ROLE, SECOND_PLAYER_ROLE);
+}
+
+static void free_invitations(void){
+    for(int i = 0; i < population; i++)
+        inv_unref(invitations[i], "microbench done");
+    free(invitations);
+    invitations = NULL;
+    free_clients();
+}
+
+static void make_sockets(int n, int nthreads){
+    for(int i = 0; i < nthreads; i++)
+        socketpair(AF_UNIX, SOCK_STREAM, 0, threads[i].sock);
+}
+
+static void free_sockets(void){
+    for(int i = 0; i < MB_MAX_THREADS; i++){
+        if(threads[i].sock[0] > 0){
+            close(threads[i].sock[0]);
+            close(threads[i].sock[1]);
+        }
+        threads[i].sock[0] = threads[i].sock[1] = 0;
+    }
+}
+
+static void free_games(void){
+    for(int i = 0; i < MB_MAX_THREADS; i++){
+        if(threads[i].game != NULL)
+            game_unref(threads[i].game, "microbench done");
+        threads[i].game = NULL;
+        threads[i].moves = 0;
+    }
+}
+
+/*
+ * Operations
+ */
+
+static void op_creg_register(MB_THREAD *t){
+    CLIENT *client = creg_register(client_registry, -1);
+    if(client != NULL)
+        creg_unregister(client_registry, client);
+}
+
+static void op_creg_lookup(MB_THREAD *t){
+    CLIENT *client = creg_lookup(client_registry, names[pick(t)]);
+    if(client != NULL)
+        client_unref(client, "microbench lookup");
+}
+
+static void op_preg_register(MB_THREAD *t){
+    PLAYER *player = preg_register(player_registry, names[pick(t)]);
+    if(player != NULL)
+        player_unref(player, "microbench register");
+}
+
+static void op_client_ref(MB_THREAD *t){
+    CLIENT *client = clients[pick(t)];
+    client_unref(client_ref(client, "microbench"), "microbench");
+}
+
+static void op_player_ref(MB_THREAD *t){
+    PLAYER *player = players[pick(t)];
+    player_unref(player_ref(player, "microbench"), "microbench");
+}
+
+static void op_inv_ref(MB_THREAD *t){
+    INVITATION *inv = invitations[pick(t)];
+    inv_unref(inv_ref(inv, "microbench"), "microbench");
+}
+
+static void op_proto_packet(MB_THREAD *t){
+    JEUX_PACKET_HEADER hdr;
+    void *payload = NULL;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.type = JEUX_MOVED_PKT;
+    proto_send_packet(t->sock[0], &hdr, NULL);
+    proto_recv_packet(t->sock[1], &hdr, &payload);
+    free(payload);
+}
+
+static void op_game_move(MB_THREAD *t){
+    if(t->game == NULL || t->moves == 9){
+        if(t->game != NULL)
+            game_unref(t->game, "microbench game over");
+        t->game = game_create();
+        t->moves = 0;
+    }
+    GAME_ROLE role = t->moves % 2 == 0 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE;
+    GAME_MOVE *move = game_parse_move(t->game, role, draw_moves[t->moves++]);
+    if(move != NULL){
+        game_apply_move(t->game, move);
+        free(move);
+    }
+}
+
+static void op_trace(MB_THREAD *t){
+    trace(TRACE_CLIENT_REF, (uintptr_t)t, t->index, 0, "microbench");
+}
+
+static volatile int codec_sink;
+
+static void op_header_codec(MB_THREAD *t){
+    JEUX_PACKET_HEADER hdrs[MB_CODEC_BATCH];
+    unsigned char buf[MB_CODEC_BATCH * JEUX_WIRE_HEADER_SIZE];
+    for(int i = 0; i < MB_CODEC_BATCH; i++){
+        hdrs[i].type = JEUX_MOVED_PKT;
+        hdrs[i].id = i;
+        hdrs[i].role = 0;
+        hdrs[i].size = htons(1);
+        hdrs[i].timestamp_sec = htonl(t->index);
+        hdrs[i].timestamp_nsec = htonl(i);
+    }
+    size_t len = proto_encode_headers(buf, hdrs, MB_CODEC_BATCH);
+    for(size_t off = 0; off < len; off += JEUX_WIRE_HEADER_SIZE)
+        proto_decode_header(&hdrs[off / JEUX_WIRE_HEADER_SIZE], buf + off);
+    //so the decoding is not optimized away
+    codec_sink = hdrs[MB_CODEC_BATCH - 1].id;
+}
+
+static const MB_CASE cases[] = {
+    { "creg_register", 1, make_clients, op_creg_register, free_clients },
+    { "creg_lookup", 1, make_clients, op_creg_lookup, free_clients },
+    { "preg_register", 1, make_players, op_preg_register, free_players },
+    { "client_ref", 1, make_clients, op_client_ref, free_clients },
+    { "player_ref", 1, make_players, op_player_ref, free_players },
+    { "inv_ref", 1, make_invitations, op_inv_ref, free_invitations },
+    { "proto_packet", 0, make_sockets, op_proto_packet, free_sockets },
+    { "game_move", 0, NULL, op_game_move, free_games },
+    { "trace", 0, NULL, op_trace, NULL },
+    { "header_codec", 0, NULL, op_header_codec, NULL },
+};
+#define MB_NCASES ((int)(sizeof(cases) / sizeof(cases[0])))
+
+static void *run_thread(void *arg){
+    MB_THREAD *t = arg;
+    void (*op)(MB_THREAD *) = current->op;
+    pthread_barrier_wait(&start_barrier);
+    t->start_ns = now_ns();
+    for(long i = 0; i < iterations; i++)
+        op(t);
+    t->end_ns = now_ns();
+    return NULL;
+}
+
+static void run_case(const MB_CASE *c, int nthreads, int pop){
+    population = pop;
+    current = c;
+    if(c->setup != NULL)
+        c->setup(pop, nthreads);
+    pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+    for(int i = 0; i < nthreads; i++){
+        threads[i].index = i;
+        threads[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        pthread_create(&threads[i].tid, NULL, run_thread, &threads[i]);
+    }
+    pthread_barrier_wait(&start_barrier);
+    //from the first thread starting to the last one finishing
+    uint64_t start = UINT64_MAX, end = 0;
+    for(int i = 0; i < nthreads; i++){
+        pthread_join(threads[i].tid, NULL);
+        if(threads[i].start_ns < start)
+            start = threads[i].start_ns;
+        if(threads[i].end_ns > end)
+            end = threads[i].end_ns;
+    }
+    uint64_t elapsed = end - start;
+    pthread_barrier_destroy(&start_barrier);
+    if(c->teardown != NULL)
+        c->teardown();
+
+    long ops = iterations * nthreads;
+    printf("{\"case\":\"%s\",\"threads\":%d,\"population\":%d,\"ops\":%ld,"
+           "\"elapsed_ns\":%llu,\"ops_per_sec\":%.0f,\"ns_per_op\":%.1f}\n",
+           c->name, nthreads, c->populated ? pop : 0, ops, (unsigned long long)elapsed,
+           ops / (elapsed / 1e9), (double)elapsed * nthreads / ops);
+    fflush(stdout);
+}
+
+// a comma-separated list of positive numbers
+static int parse_list(char *s, int *list){
+    int n = 0;
+    for(char *tok = strtok(s, ","); tok != NULL && n < MB_MAX_LIST; tok = strtok(NULL, ",")){
+        if((list[n] = atoi(tok)) <= 0)
+            return -1;
+        n++;
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]){
+    int thread_counts[MB_MAX_LIST] = { 1, 2, 4 }, nthread_counts = 3;
+    int populations[MB_MAX_LIST] = { 16, 1024 }, npopulations = 2;
+    char *only[MB_NCASES + 1] = { NULL };
+    int opt, bad = 0;
+    while((opt = getopt(argc, argv, "t:n:i:c:")) != -1){
+        switch(opt){
+            case 't':
+                nthread_counts = parse_list(optarg, thread_counts);
+                break;
+            case 'n':
+                npopulations = parse_list(optarg, populations);
+                break;
+            case 'i':
+                iterations = atol(optarg);
+                break;
+            case 'c':
+                for(int n = 0; n < MB_NCASES; n++)
+                    only[n] = strtok(n == 0 ? optarg : NULL, ",");
+                break;
+            default:
+                bad = 1;
+                break;
+        }
+    }
+    for(int i = 0; i < nthread_counts; i++)
+        bad |= thread_counts[i] > MB_MAX_THREADS;
+    if(bad || nthread_counts <= 0 || npopulations <= 0 || iterations <= 0){
+        fprintf(stderr, "Usage: %s [-t <threads>,...] [-n <population>,...] "
+                "[-i <iterations>] [-c <case>,...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    client_registry = creg_init();
+    player_registry = preg_init();
+    for(int c = 0; c < MB_NCASES; c++){
+        int wanted = only[0] == NULL;
+        for(int n = 0; only[n] != NULL; n++)
+            wanted |= strcmp(only[n], cases[c].name) == 0;
+        if(!wanted)
+            continue;
+        for(int t = 0; t < nthread_counts; t++){
+            for(int p = 0; p < (cases[c].populated ? npopulations : 1); p++)
+                run_case(&cases[c], thread_counts[t], populations[p]);
+        }
+    }
+    creg_fini(client_registry);
+    preg_fini(player_registry);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "journal.h"
+
+/*
+ * Replay games from a Jeux game journal.
+ *
+ * Usage: jeux_replay -j <journal_dir> [-g <game_id>]
+ *                    [-f <from_id>] [-n <count>]
+ *
+ * With -g, the game is shown position by position, as it was played.
+ * Otherwise every game (from -f on, at most -n of them) is listed, one line
+ * each: ID, time finished, first player, second player, winner, number of
+ * moves.  Each listed game is also replayed, to check that its moves are
+ * legal; those that aren't are marked "BAD".
+ */
+
+static const char *result_name(JOURNAL_GAME *g){
+    if(g->aborted)
+        return "aborted";
+    switch(g->winner){
+        case FIRST_PLAYER_ROLE:
+            return "first";
+        case SECOND_PLAYER_ROLE:
+            return "second";
+        default:
+            return "draw";
+    }
+}
+
+static void format_time(uint64_t ms, char *buf, size_t len){
+    time_t t = ms / 1000;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(buf, len, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+static int show_game(JOURNAL_READER *r, uint64_t id){
+    JOURNAL_GAME g;
+    int ret = journal_find(r, id, &g);
+    if(ret != 1){
+        fprintf(stderr, ret == 0 ? "No game %" PRIu64 " in the journal\n"
+                                 : "Error reading the journal\n", id);
+        return -1;
+    }
+    char when[32];
+    format_time(g.time_ms, when, sizeof(when));
+    printf("Game %" PRIu64 ", finished %s: %s vs. %s, %s, %d moves\n",
+           g.id, when, g.first, g.second, result_name(&g), g.nmoves);
+    for(int i = 0; i <= g.nmoves; i++){
+        GAME *game = journal_replay(&g, i);
+        if(game == NULL){
+            printf("Move %d (%s) could not be replayed\n", i, g.moves[i - 1]);
+            return -1;
+        }
+        char *state = game_unparse_state(game);
+        if(i > 0)
+            printf("\n%d. %s\n", i, g.moves[i - 1]);
+        if(state != NULL)
+            fputs(state, stdout);
+        free(state);
+        game_unref(game, "replayed");
+    }
+    return 0;
+}
+
+static int list_games(JOURNAL_READER *r, long count){
+    JOURNAL_GAME g;
+    int ret;
+    while(count != 0 && (ret = journal_read(r, &g)) == 1){
+        char when[32];
+        format_time(g.time_ms, when, sizeof(when));
+        GAME *game = journal_replay(&g, -1);
+        printf("%" PRIu64 "\t%s\t%s\t%s\t%s\t%d%s\n", g.id, when, g.first, g.second,
+               result_name(&g), g.nmoves, game != NULL ? "" : "\tBAD");
+        if(game != NULL)
+            game_unref(game, "replayed");
+        if(count > 0)
+            count--;
+    }
+    return ret == -1 ? -1 : 0;
+}
+
+int main(int argc, char *argv[]){
+    char *dir = NULL;
+    uint64_t id = 0, from = 0;
+    long count = -1;
+    int opt;
+    while((opt = getopt(argc, argv, "j:g:f:n:")) != -1){
+        switch(opt){
+            case 'j':
+                dir = optarg;
+                break;
+            case 'g':
+                id = strtoull(optarg, NULL, 10);
+                break;
+            case 'f':
+                from = strtoull(optarg, NULL, 10);
+                break;
+            case 'n':
+                count = atol(optarg);
+                break;
+            default:
+                dir = NULL;
+                optind = argc;
+                break;
+        }
+    }
+    if(dir == NULL){
+        fprintf(stderr, "Usage: %s -j <journal_dir> [-g <game_id>] [-f <from_id>] [-n <count>]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    JOURNAL_READER *r = journal_reader_open(dir, id != 0 ? id : from);
+    if(r == NULL){
+        perror(dir);
+        exit(EXIT_FAILURE);
+    }
+    int ret = id != 0 ? show_game(r, id) : list_games(r, count);
+    journal_reader_close(r);
+    exit(ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "protocol_ext.h"
+#include "trace.h"
+
+/*
+ * Decode a trace dumped by the Jeux server (on SIGUSR1 or a crash; see
+ * trace.h).
+ *
+ * Usage: jeux_trace [-o <object>] [-p <thread>] <trace_file>
+ *
+ * The events of all the threads are merged into one list, oldest first,
+ * one line each: wall-clock time, thread, event, and what the event was
+ * about.  With -o, only the events about one object (a CLIENT, PLAYER or
+ * INVITATION, by the address shown for it, or a file descriptor) are
+ * listed; with -p, only those of one thread.
+ */
+
+typedef struct event {
+    TRACE_RECORD rec;
+    uint64_t thread;
+    char why[256];
+} EVENT;
+
+static const char *event_names[TRACE_TYPES] = {
+    [TRACE_PKT_IN] = "in",
+    [TRACE_PKT_OUT] = "out",
+    [TRACE_CLIENT_REF] = "client_ref",
+    [TRACE_CLIENT_UNREF] = "client_unref",
+    [TRACE_PLAYER_REF] = "player_ref",
+    [TRACE_PLAYER_UNREF] = "player_unref",
+    [TRACE_INV_REF] = "inv_ref",
+    [TRACE_INV_UNREF] = "inv_unref",
+    [TRACE_INV_STATE] = "inv_state"
+};
+
+static const char *type_names[] = {
+    [JEUX_LOGIN_PKT] = "LOGIN",
+    [JEUX_USERS_PKT] = "USERS",
+    [JEUX_INVITE_PKT] = "INVITE",
+    [JEUX_REVOKE_PKT] = "REVOKE",
+    [JEUX_ACCEPT_PKT] = "ACCEPT",
+    [JEUX_DECLINE_PKT] = "DECLINE",
+    [JEUX_MOVE_PKT] = "MOVE",
+    [JEUX_RESIGN_PKT] = "RESIGN",
+    [JEUX_ACK_PKT] = "ACK",
+    [JEUX_NACK_PKT] = "NACK",
+    [JEUX_INVITED_PKT] = "INVITED",
+    [JEUX_REVOKED_PKT] = "REVOKED",
+    [JEUX_ACCEPTED_PKT] = "ACCEPTED",
+    [JEUX_DECLINED_PKT] = "DECLINED",
+    [JEUX_MOVED_PKT] = "MOVED",
+    [JEUX_RESIGNED_PKT] = "RESIGNED",
+    [JEUX_ENDED_PKT] = "ENDED",
+    [JEUX_MATCH_PKT] = "MATCH",
+    [JEUX_UNMATCH_PKT] = "UNMATCH",
+    [JEUX_WATCH_PKT] = "WATCH",
+    [JEUX_UNWATCH_PKT] = "UNWATCH",
+    [JEUX_TOURNEY_PKT] = "TOURNEY",
+    [JEUX_ENTER_PKT] = "ENTER",
+    [JEUX_START_PKT] = "START",
+    [JEUX_STANDINGS_PKT] = "STANDINGS",
+    [JEUX_STATS_PKT] = "STATS"
+};
+
+// the states of an INVITATION, as in invitation.h
+static const char *state_names[] = { "OPEN", "ACCEPTED", "CLOSED" };
+
+static TRACE_FILE_HEADER fh;
+
+static const char *name_of(const char **names, size_t n, unsigned int i){
+    return i < n && names[i] != NULL ? names[i] : "?";
+}
+
+// a time stamp counter reading as nanoseconds since the epoch
+static uint64_t wall_ns(uint64_t tsc){
+    if(fh.tsc_dump == fh.tsc_start)
+        return fh.ns_start;
+    long double rate = (long double)(fh.ns_dump - fh.ns_start) / (fh.tsc_dump - fh.tsc_start);
+    return fh.ns_start + (int64_t)(((long double)tsc - fh.tsc_start) * rate);
+}
+
+static int by_time(const void *a, const void *b){
+    const EVENT *x = a, *y = b;
+    return x->rec.tsc < y->rec.tsc ? -1 : x->rec.tsc > y->rec.tsc;
+}
+
+static void print_event(EVENT *e){
+    uint64_t ns = wall_ns(e->rec.tsc);
+    time_t t = ns / 1000000000;
+    struct tm tm;
+    char when[32];
+    localtime_r(&t, &tm);
+    strftime(when, sizeof(when), "%H:%M:%S", &tm);
+    printf("%s.%06" PRIu64 " %6" PRIu64 " %-12s ", when, ns % 1000000000 / 1000, e->thread,
+           name_of(event_names, TRACE_TYPES, e->rec.type));
+    switch(e->rec.type){
+        case TRACE_PKT_IN:
+        case TRACE_PKT_OUT:
+            printf("fd %" PRIu64 " %s size %u\n", e->rec.obj,
+                   name_of(type_names, sizeof(type_names) / sizeof(type_names[0]), e->rec.arg2),
+                   e->rec.arg);
+            break;
+        case TRACE_INV_STATE:
+            printf("%#" PRIx64 " %s->%s %s\n", e->rec.obj, name_of(state_names, 3, e->rec.arg2),
+                   name_of(state_names, 3, e->rec.arg), e->why);
+            break;
+        default:
+            printf("%#" PRIx64 " count %u %s\n", e->rec.obj, e->rec.arg, e->why);
+            break;
+    }
+}
+
+/*
+ * Read the events of a dump.
+ *
+ * @return a malloc'ed array of them, in the order they are in the dump,
+ * with their number stored in *np, or NULL if the dump is unreadable.
+ */
+static EVENT *read_dump(FILE *f, size_t *np){
+    if(fread(&fh, sizeof(fh), 1, f) != 1 || memcmp(fh.magic, TRACE_MAGIC, sizeof(fh.magic)) != 0)
+        return NULL;
+    EVENT *events = NULL;
+    size_t n = 0, cap = 0;
+    for(uint32_t i = 0; i < fh.rings; i++){
+        TRACE_RING_HEADER rh;
+        if(fread(&rh, sizeof(rh), 1, f) != 1)
+            goto bad;
+        if(rh.dropped > 0)
+            fprintf(stderr, "thread %" PRIu64 ": %" PRIu64 " older events overwritten\n",
+                    rh.thread, rh.dropped);
+        for(uint32_t j = 0; j < rh.count; j++){
+            if(n == cap){
+                cap = cap ? 2 * cap : 4096;
+                EVENT *grown = realloc(events, cap * sizeof(EVENT));
+                if(grown == NULL)
+                    goto bad;
+                events = grown;
+            }
+            EVENT *e = &events[n];
+            if(fread(&e->rec, sizeof(e->rec), 1, f) != 1 || e->rec.why_len >= sizeof(e->why)
+               || fread(e->why, 1, e->rec.why_len, f) != e->rec.why_len)
+                goto bad;
+            e->why[e->rec.why_len] = '\0';
+            e->thread = rh.thread;
+            n++;
+        }
+    }
+    *np = n;
+    return events;
+bad:
+    free(events);
+    return NULL;
+}
+
+int main(int argc, char *argv[]){
+    uint64_t obj = 0, thread = 0;
+    int by_obj = 0, opt;
+    while((opt = getopt(argc, argv, "o:p:")) != -1){
+        switch(opt){
+            case 'o':
+                obj = strtoull(optarg, NULL, 0);
+                by_obj = 1;
+                break;
+            case 'p':
+                thread = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                optind = argc + 1;
+                break;
+        }
+    }
+    if(optind != argc - 1){
+        fprintf(stderr, "Usage: %s [-o <object>] [-p <thread>] <trace_file>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    FILE *f = fopen(argv[optind], "r");
+    if(f == NULL){
+        perror(argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    size_t n;
+    EVENT *events = read_dump(f, &n);
+    fclose(f);
+    if(events == NULL){
+        fprintf(stderr, "%s: not a Jeux trace, or cut short\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    qsort(events, n, sizeof(EVENT), by_time);
+    for(size_t i = 0; i < n; i++){
+        if((by_obj && events[i].rec.obj != obj) || (thread != 0 && events[i].thread != thread))
+            continue;
+        print_event(&events[i]);
+    }
+    free(events);
+    exit(EXIT_SUCCESS);
+}